@@ -0,0 +1,622 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cerrno>
+#include <random>
+
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "frame.h"
+#include "histogram.h"
+#include "line_parser.h"
+
+// Load generator for the chat server. It speaks the same line protocol as
+// client.cpp: every connection sends /nickname, /join and /connect, and the
+// senders then post chat lines carrying their send time. Receivers parse
+// the time back out of the broadcast to measure delivery latency.
+//
+// With --churn, random connections also switch channels, try /kick,
+// /mute, /unmute and /whois on each other, and hang up and reconnect while
+// the chat load runs. That is meant for shaking out races in the server
+// (make stress-tsan); delivery then no longer adds up to the expected count.
+//
+// --port takes a comma separated list to spread the connections over
+// several linked server processes (make bench-federation); every channel
+// then has members on every node.
+//
+// With --binary, connections speak the binary protocol (frame.h) instead:
+// the same commands, sent as frames, and chat lines addressed by channel ID.
+
+constexpr int MAX_MESSAGE_LENGTH = 4096;
+constexpr int READ_BUFFER_SIZE = 65536;
+constexpr int MAX_EVENTS = 256;
+constexpr int CONNECTIONS_PER_SOURCE_ADDRESS = 25000; // stays inside the ephemeral port range
+constexpr std::string_view TIMESTAMP_TAG = "BENCH ";
+
+using Clock = std::chrono::steady_clock;
+
+inline uint64_t nowNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+struct BenchConfig {
+    std::string host = "127.0.0.1";
+    std::vector<int> ports;   // connection i goes to ports[i % ports.size()]
+    int connections = 1000;
+    int channels = 10;
+    int sendersPerChannel = 1;
+    double rate = 1000;       // chat lines per second, all senders together
+    int messageSize = 64;     // bytes of chat text per line
+    double warmup = 2;        // seconds between joining and measuring
+    double duration = 10;     // seconds of measurement
+    int threads = 0;          // 0: one per core
+    int serverPid = 0;        // 0: look for a process named "server"
+    double churn = 0;         // churn operations per second, all connections together
+    bool binary = false;      // speak the binary protocol
+};
+
+enum class Phase {
+    Connecting,
+    Warmup,
+    Measuring,
+    Draining,
+    Done
+};
+
+struct BenchConnection {
+    int socket = -1;
+    int index = 0;
+    int channel = 0;
+    bool isSender = false;
+    std::string output;      // bytes the socket did not take yet
+    size_t outputOffset = 0;
+    LineParser input{ MAX_MESSAGE_LENGTH };
+    FrameParser frames{ MAX_MESSAGE_LENGTH * 16 }; // history replays come as one frame
+    uint64_t channelId = 0;  // binary protocol: 0 until the server sent it
+};
+
+// One load generator thread: owns a slice of the connections and drives
+// them from its own epoll loop.
+class Worker {
+public:
+    Worker(const BenchConfig& config, int first, int count, const std::atomic<Phase>& phase)
+        : config_(config), first_(first), count_(count), phase_(phase) {}
+
+    void start() {
+        thread_ = std::thread(&Worker::run, this);
+    }
+
+    void join() {
+        thread_.join();
+    }
+
+    int connected() const {
+        return connected_.load(std::memory_order_acquire);
+    }
+
+    bool ready() const {
+        return ready_.load(std::memory_order_acquire);
+    }
+
+    int senders() const {
+        return senderCount_;
+    }
+
+    // Only read after join().
+    uint64_t sent() const {
+        return sent_;
+    }
+
+    uint64_t received() const {
+        return received_;
+    }
+
+    uint64_t failedConnections() const {
+        return failedConnections_;
+    }
+
+    uint64_t churned() const {
+        return churned_;
+    }
+
+    const Histogram& latency() const {
+        return latency_;
+    }
+
+private:
+    void run() {
+        epollFd_ = epoll_create1(0);
+        if (epollFd_ == -1) {
+            std::cerr << "Failed to create epoll instance" << std::endl;
+            ready_.store(true, std::memory_order_release);
+            return;
+        }
+
+        connections_.reserve(count_);
+        for (int i = first_; i < first_ + count_; i++) {
+            openConnection(i);
+        }
+        ready_.store(true, std::memory_order_release);
+
+        std::string padding(std::max(0, config_.messageSize - static_cast<int>(TIMESTAMP_TAG.size()) - 20), 'x');
+        double workerRate = 0;
+        if (senderCount_ > 0) {
+            int totalSenders = config_.channels * config_.sendersPerChannel;
+            workerRate = config_.rate * senderCount_ / totalSenders;
+        }
+        double workerChurn = config_.churn * count_ / config_.connections;
+        uint64_t measureStart = 0;
+        size_t nextSender = 0;
+
+        epoll_event events[MAX_EVENTS];
+        while (phase_.load(std::memory_order_acquire) != Phase::Done) {
+            int count = epoll_wait(epollFd_, events, MAX_EVENTS, 1);
+            for (int i = 0; i < count; i++) {
+                BenchConnection& connection = connections_[events[i].data.u32];
+                if (events[i].events & EPOLLIN) {
+                    readFrom(connection);
+                }
+                // EPOLLOUT, or answers to PINGs.
+                if ((events[i].events & EPOLLOUT) || !connection.output.empty()) {
+                    flush(connection);
+                }
+            }
+
+            if (phase_.load(std::memory_order_acquire) != Phase::Measuring || (senderCount_ == 0 && workerChurn == 0)) {
+                continue;
+            }
+            uint64_t now = nowNanos();
+            if (measureStart == 0) {
+                measureStart = now;
+            }
+            uint64_t churnDue = static_cast<uint64_t>((now - measureStart) * 1e-9 * workerChurn);
+            while (churned_ < churnDue && !connections_.empty()) {
+                churn(connections_[random_() % connections_.size()]);
+                churned_++;
+            }
+            uint64_t due = static_cast<uint64_t>((now - measureStart) * 1e-9 * workerRate);
+            while (sent_ < due) {
+                while (!connections_[nextSender].isSender) {
+                    nextSender = (nextSender + 1) % connections_.size();
+                }
+                BenchConnection& sender = connections_[nextSender];
+                nextSender = (nextSender + 1) % connections_.size();
+
+                std::string text = std::string(TIMESTAMP_TAG) + std::to_string(nowNanos()) + " " + padding;
+                if (config_.binary && sender.channelId != 0) {
+                    char id[MAX_VARINT_LENGTH];
+                    std::string_view idBytes(id, encodeVarint(sender.channelId, id));
+                    sender.output.append(FrameHeader(Opcode::Chat, idBytes.size() + text.size()).view());
+                    sender.output.append(idBytes);
+                    sender.output.append(text);
+                } else {
+                    command(sender, text);
+                }
+                flush(sender);
+                sent_++;
+            }
+        }
+
+        for (BenchConnection& connection : connections_) {
+            close(connection.socket);
+        }
+        close(epollFd_);
+    }
+
+    void openConnection(int index) {
+        int clientSocket = dial(index);
+        if (clientSocket == -1) {
+            failedConnections_++;
+            return;
+        }
+
+        connections_.emplace_back();
+        BenchConnection& connection = connections_.back();
+        connection.index = index;
+        connection.channel = index % config_.channels;
+        connection.isSender = index < config_.channels * config_.sendersPerChannel;
+        if (connection.isSender) {
+            senderCount_++;
+        }
+        attach(connection, clientSocket);
+        connected_.fetch_add(1, std::memory_order_release);
+    }
+
+    // Registers a freshly dialed socket for the connection and sends the
+    // handshake for its channel.
+    void attach(BenchConnection& connection, int clientSocket) {
+        connection.socket = clientSocket;
+        connection.output.clear();
+        connection.outputOffset = 0;
+        connection.input.reset();
+        connection.frames.reset();
+        connection.channelId = 0;
+
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        event.data.u32 = static_cast<uint32_t>(&connection - connections_.data());
+        if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, clientSocket, &event) == -1) {
+            std::cerr << "Failed to register client socket with epoll" << std::endl;
+        }
+
+        std::string nickname = "bench" + std::to_string(connection.index);
+        std::string channelName = "bench" + std::to_string(connection.channel);
+        if (config_.binary) {
+            connection.output = "/binary\n";
+            appendFrame(connection, Opcode::Nickname, nickname);
+            appendFrame(connection, Opcode::Join, channelName);
+            appendFrame(connection, Opcode::Connect, "");
+        } else {
+            connection.output = "/nickname " + nickname + "\n/join " + channelName + "\n/connect\n";
+        }
+        flush(connection);
+    }
+
+    // One random operation on the connection: a hang-up and reconnect, a
+    // channel switch, or an admin command against a random nickname (which
+    // the server refuses unless the connection is its channel's admin).
+    void churn(BenchConnection& connection) {
+        std::string target = "bench" + std::to_string(random_() % config_.connections);
+        uint32_t operation = random_() % 6;
+        if (operation == 0 || connection.socket == -1) {
+            if (connection.socket != -1) {
+                epoll_ctl(epollFd_, EPOLL_CTL_DEL, connection.socket, nullptr);
+                close(connection.socket);
+            }
+            connection.socket = dial(connection.index);
+            if (connection.socket == -1) {
+                failedConnections_++;
+                return;
+            }
+            attach(connection, connection.socket);
+            return;
+        }
+        switch (operation) {
+        case 1:
+            connection.channel = static_cast<int>(random_() % config_.channels);
+            command(connection, "/join bench" + std::to_string(connection.channel));
+            break;
+        case 2:
+            command(connection, "/kick " + target);
+            break;
+        case 3:
+            command(connection, "/mute " + target);
+            break;
+        case 4:
+            command(connection, "/unmute " + target);
+            break;
+        default:
+            command(connection, "/whois " + target);
+            break;
+        }
+        flush(connection);
+    }
+
+    int dial(int index) {
+        int clientSocket = socket(AF_INET, SOCK_STREAM, 0);
+        if (clientSocket == -1) {
+            std::cerr << "Failed to create client socket" << std::endl;
+            return -1;
+        }
+
+        // Past ~28k connections one source address runs out of ephemeral
+        // ports, so loopback runs spread over 127.0.0.1, 127.0.0.2, ...
+        if (config_.host == "127.0.0.1") {
+            sockaddr_in sourceAddress{};
+            sourceAddress.sin_family = AF_INET;
+            sourceAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK + index / CONNECTIONS_PER_SOURCE_ADDRESS);
+            bind(clientSocket, reinterpret_cast<struct sockaddr*>(&sourceAddress), sizeof(sourceAddress));
+        }
+
+        sockaddr_in serverAddress{};
+        serverAddress.sin_family = AF_INET;
+        serverAddress.sin_port = htons(config_.ports[index % config_.ports.size()]);
+        serverAddress.sin_addr.s_addr = inet_addr(config_.host.c_str());
+        if (connect(clientSocket, reinterpret_cast<struct sockaddr*>(&serverAddress), sizeof(serverAddress)) == -1) {
+            std::cerr << "Failed to connect to server: " << std::strerror(errno) << std::endl;
+            close(clientSocket);
+            return -1;
+        }
+
+        int noDelay = 1;
+        setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+        fcntl(clientSocket, F_SETFL, fcntl(clientSocket, F_GETFL, 0) | O_NONBLOCK);
+        return clientSocket;
+    }
+
+    void readFrom(BenchConnection& connection) {
+        char buffer[READ_BUFFER_SIZE];
+        while (true) {
+            ssize_t bytesRead = recv(connection.socket, buffer, sizeof(buffer), 0);
+            if (bytesRead <= 0) {
+                if (bytesRead == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                    epoll_ctl(epollFd_, EPOLL_CTL_DEL, connection.socket, nullptr);
+                }
+                return;
+            }
+
+            if (!config_.binary) {
+                connection.input.feed(buffer, bytesRead, [&](std::string_view line) {
+                    if (line.compare(0, 5, "PING ") == 0) {
+                        command(connection, "/pong " + std::string(line.substr(5)));
+                    } else {
+                        recordLine(line);
+                    }
+                    return true;
+                });
+                continue;
+            }
+            std::string_view data(buffer, bytesRead);
+            std::string_view frame;
+            while (connection.frames.next(data, frame)) {
+                std::string_view body = frame.substr(1);
+                uint64_t channelId;
+                if (static_cast<Opcode>(frame[0]) == Opcode::Channel && decodeVarint(body, channelId) == VarintStatus::Complete) {
+                    connection.channelId = channelId;
+                } else if (static_cast<Opcode>(frame[0]) == Opcode::ChatMessage) {
+                    recordLine(body);
+                } else if (static_cast<Opcode>(frame[0]) == Opcode::Ping) {
+                    appendFrame(connection, Opcode::Pong, body);
+                }
+            }
+        }
+    }
+
+    // A text protocol line; a Command frame in binary mode.
+    void command(BenchConnection& connection, std::string_view line) {
+        if (config_.binary) {
+            appendFrame(connection, Opcode::Command, line);
+        } else {
+            connection.output.append(line);
+            connection.output.push_back('\n');
+        }
+    }
+
+    static void appendFrame(BenchConnection& connection, Opcode opcode, std::string_view body) {
+        connection.output.append(FrameHeader(opcode, body.size()).view());
+        connection.output.append(body);
+    }
+
+    // Broadcasts arrive as "<nickname>: BENCH <send time> <padding>", or as
+    // the text of a ChatMessage frame.
+    void recordLine(std::string_view line) {
+        size_t tag = line.find(TIMESTAMP_TAG);
+        if (tag == std::string_view::npos) {
+            return;
+        }
+        uint64_t sentAt = std::strtoull(line.data() + tag + TIMESTAMP_TAG.size(), nullptr, 10);
+        uint64_t now = nowNanos();
+        received_++;
+        latency_.record(now > sentAt ? (now - sentAt) / 1000 : 0);
+    }
+
+    void flush(BenchConnection& connection) {
+        while (connection.outputOffset < connection.output.size()) {
+            ssize_t bytesSent = send(connection.socket, connection.output.data() + connection.outputOffset,
+                                     connection.output.size() - connection.outputOffset, MSG_NOSIGNAL);
+            if (bytesSent == -1) {
+                return; // EAGAIN: EPOLLOUT resumes it; errors show up as EOF on read
+            }
+            connection.outputOffset += bytesSent;
+        }
+        connection.output.clear();
+        connection.outputOffset = 0;
+    }
+
+    const BenchConfig& config_;
+    int first_;
+    int count_;
+    const std::atomic<Phase>& phase_;
+    int epollFd_ = -1;
+    std::vector<BenchConnection> connections_;
+    int senderCount_ = 0;
+    std::atomic<int> connected_{0};
+    std::atomic<bool> ready_{false};
+    uint64_t sent_ = 0;
+    uint64_t received_ = 0;
+    uint64_t failedConnections_ = 0;
+    uint64_t churned_ = 0;
+    std::minstd_rand random_{ static_cast<uint32_t>(first_ + 1) };
+    Histogram latency_; // microseconds
+    std::thread thread_;
+};
+
+// Reads a "VmRSS:   1234 kB" style line from /proc/<pid>/status.
+uint64_t readProcessMemory(int pid, const std::string& field) {
+    std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, field.size(), field) == 0 && line.size() > field.size() && line[field.size()] == ':') {
+            return std::strtoull(line.c_str() + field.size() + 1, nullptr, 10);
+        }
+    }
+    return 0;
+}
+
+int findServerPid() {
+    DIR* proc = opendir("/proc");
+    if (proc == nullptr) {
+        return 0;
+    }
+    int pid = 0;
+    while (dirent* entry = readdir(proc)) {
+        int candidate = std::atoi(entry->d_name);
+        if (candidate <= 0) {
+            continue;
+        }
+        std::ifstream comm("/proc/" + std::to_string(candidate) + "/comm");
+        std::string name;
+        if (std::getline(comm, name) && name == "server") {
+            pid = candidate;
+            break;
+        }
+    }
+    closedir(proc);
+    return pid;
+}
+
+void sleepSeconds(double seconds) {
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+}
+
+int main(int argc, char* argv[]) {
+    BenchConfig config;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--host" && i + 1 < argc) {
+            config.host = argv[++i];
+        } else if (arg == "--port" && i + 1 < argc) {
+            std::string ports = argv[++i];
+            for (size_t start = 0; start <= ports.size();) {
+                size_t comma = std::min(ports.find(',', start), ports.size());
+                config.ports.push_back(std::atoi(ports.substr(start, comma - start).c_str()));
+                start = comma + 1;
+            }
+        } else if (arg == "--connections" && i + 1 < argc) {
+            config.connections = std::atoi(argv[++i]);
+        } else if (arg == "--channels" && i + 1 < argc) {
+            config.channels = std::atoi(argv[++i]);
+        } else if (arg == "--senders" && i + 1 < argc) {
+            config.sendersPerChannel = std::atoi(argv[++i]);
+        } else if (arg == "--rate" && i + 1 < argc) {
+            config.rate = std::atof(argv[++i]);
+        } else if (arg == "--message-size" && i + 1 < argc) {
+            config.messageSize = std::atoi(argv[++i]);
+        } else if (arg == "--warmup" && i + 1 < argc) {
+            config.warmup = std::atof(argv[++i]);
+        } else if (arg == "--duration" && i + 1 < argc) {
+            config.duration = std::atof(argv[++i]);
+        } else if (arg == "--threads" && i + 1 < argc) {
+            config.threads = std::atoi(argv[++i]);
+        } else if (arg == "--server-pid" && i + 1 < argc) {
+            config.serverPid = std::atoi(argv[++i]);
+        } else if (arg == "--churn" && i + 1 < argc) {
+            config.churn = std::atof(argv[++i]);
+        } else if (arg == "--binary") {
+            config.binary = true;
+        } else {
+            std::cerr << "Usage: " << argv[0] << " --port PORT[,PORT...] [--host ADDRESS] [--connections N] [--channels N]"
+                      << " [--senders PER_CHANNEL] [--rate LINES_PER_SECOND] [--message-size BYTES]"
+                      << " [--warmup SECONDS] [--duration SECONDS] [--threads N] [--server-pid PID] [--churn OPERATIONS_PER_SECOND]"
+                      << " [--binary]" << std::endl;
+            return 1;
+        }
+    }
+
+    if (config.ports.empty() || std::count(config.ports.begin(), config.ports.end(), 0) != 0) {
+        std::cerr << "Missing --port" << std::endl;
+        return 1;
+    }
+    config.channels = std::max(1, std::min(config.channels, config.connections));
+    config.sendersPerChannel = std::max(0, std::min(config.sendersPerChannel, config.connections / config.channels));
+    if (config.threads <= 0) {
+        config.threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    config.threads = std::min(config.threads, config.connections);
+
+    // Every connection is a descriptor; take whatever the hard limit allows.
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    if (config.serverPid == 0) {
+        config.serverPid = findServerPid();
+    }
+
+    std::atomic<Phase> phase{ Phase::Connecting };
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (int i = 0; i < config.threads; i++) {
+        int first = static_cast<int>(static_cast<int64_t>(config.connections) * i / config.threads);
+        int last = static_cast<int>(static_cast<int64_t>(config.connections) * (i + 1) / config.threads);
+        workers.emplace_back(new Worker(config, first, last - first, phase));
+    }
+
+    auto connectStart = Clock::now();
+    for (auto& worker : workers) {
+        worker->start();
+    }
+    for (auto& worker : workers) {
+        while (!worker->ready()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+    double connectSeconds = std::chrono::duration<double>(Clock::now() - connectStart).count();
+
+    int connected = 0;
+    int senders = 0;
+    for (auto& worker : workers) {
+        connected += worker->connected();
+        senders += worker->senders();
+    }
+    std::cout << "Connected " << connected << " of " << config.connections << " clients in "
+              << std::fixed << std::setprecision(2) << connectSeconds << " s ("
+              << config.channels << " channels, " << senders << " senders, "
+              << config.threads << " threads)" << std::endl;
+
+    phase.store(Phase::Warmup, std::memory_order_release);
+    sleepSeconds(config.warmup);
+
+    uint64_t rssBefore = config.serverPid != 0 ? readProcessMemory(config.serverPid, "VmRSS") : 0;
+    phase.store(Phase::Measuring, std::memory_order_release);
+    sleepSeconds(config.duration);
+    phase.store(Phase::Draining, std::memory_order_release);
+    sleepSeconds(1);
+    uint64_t rssAfter = config.serverPid != 0 ? readProcessMemory(config.serverPid, "VmRSS") : 0;
+    uint64_t rssPeak = config.serverPid != 0 ? readProcessMemory(config.serverPid, "VmHWM") : 0;
+    phase.store(Phase::Done, std::memory_order_release);
+
+    uint64_t sent = 0;
+    uint64_t received = 0;
+    uint64_t failed = 0;
+    uint64_t churned = 0;
+    Histogram latency;
+    for (auto& worker : workers) {
+        worker->join();
+        sent += worker->sent();
+        received += worker->received();
+        failed += worker->failedConnections();
+        churned += worker->churned();
+        latency.merge(worker->latency());
+    }
+
+    uint64_t expected = sent * static_cast<uint64_t>(config.connections / config.channels);
+    std::cout << "Sent:       " << sent << " lines (" << sent / config.duration << " lines/s)" << std::endl;
+    std::cout << "Delivered:  " << received << " messages (" << received / config.duration << " msgs/s, ~"
+              << (expected > 0 ? 100.0 * received / expected : 0.0) << "% of expected)" << std::endl;
+    std::cout << "Latency:    p50 " << latency.percentile(0.50) << " us, p99 " << latency.percentile(0.99)
+              << " us, p999 " << latency.percentile(0.999) << " us" << std::endl;
+    if (config.serverPid != 0) {
+        std::cout << "Server RSS: " << rssBefore << " kB before, " << rssAfter << " kB after, "
+                  << rssPeak << " kB peak (pid " << config.serverPid << ")" << std::endl;
+    } else {
+        std::cout << "Server RSS: unknown (no process named server, use --server-pid)" << std::endl;
+    }
+    if (churned > 0) {
+        std::cout << "Churn:      " << churned << " operations (" << churned / config.duration << " ops/s)" << std::endl;
+    }
+    if (failed > 0) {
+        std::cout << "Failed connections: " << failed << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,437 @@
+#ifndef CHANNEL_LOG_H
+#define CHANNEL_LOG_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+constexpr uint64_t LOG_SEGMENT_BYTES = 16 << 20; // a segment is sealed once it grows past this
+constexpr uint64_t LOG_INDEX_INTERVAL = 16;      // messages per sparse index entry
+
+// An open log segment. Shared with the shards that stream it to clients,
+// so the descriptor stays valid until the last transfer is done.
+class LogFile {
+public:
+    explicit LogFile(int fd) : fd_(fd) {}
+
+    LogFile(const LogFile&) = delete;
+    LogFile& operator=(const LogFile&) = delete;
+
+    ~LogFile() {
+        ::close(fd_);
+    }
+
+    int fd() const {
+        return fd_;
+    }
+
+private:
+    int fd_;
+};
+
+// A byte range of a segment: whole messages, ready for sendfile().
+struct LogRange {
+    std::shared_ptr<const LogFile> file;
+    uint64_t offset;
+    uint64_t length;
+};
+
+// Append-only message history of one channel, kept in a directory of
+// segments. Each segment is a "<first sequence>.log" file holding the
+// messages exactly as they went out on the wire, plus a "<first
+// sequence>.idx" file with one fixed-size entry (sequence, time, offset)
+// every LOG_INDEX_INTERVAL messages.
+//
+// With a segment limit, starting a new segment past it deletes the oldest
+// one; replays then start at the oldest message still kept.
+//
+// Opening a log maps the index files and copies them in as they are, and
+// only scans the few messages written after the last index entry, so
+// history of any size comes back quickly after a restart. A torn last
+// message is cut off.
+//
+// Not thread safe: the channel's home shard owns it.
+class ChannelLog {
+public:
+    // maxSegments 0 keeps every segment.
+    explicit ChannelLog(std::string directory, size_t maxSegments = 0, uint64_t segmentBytes = LOG_SEGMENT_BYTES)
+        : directory_(std::move(directory)), maxSegments_(maxSegments), segmentBytes_(segmentBytes) {}
+
+    ChannelLog(const ChannelLog&) = delete;
+    ChannelLog& operator=(const ChannelLog&) = delete;
+
+    ~ChannelLog() {
+        for (Segment& segment : segments_) {
+            if (segment.indexFd != -1) {
+                ::close(segment.indexFd);
+            }
+        }
+    }
+
+    // Creates the directory if needed and recovers existing segments.
+    bool open() {
+        if (mkdir(directory_.c_str(), 0755) == -1 && errno != EEXIST) {
+            return false;
+        }
+
+        std::vector<uint64_t> bases;
+        DIR* dir = opendir(directory_.c_str());
+        if (dir == nullptr) {
+            return false;
+        }
+        while (dirent* entry = readdir(dir)) {
+            std::string_view name(entry->d_name);
+            if (name.size() > 4 && name.substr(name.size() - 4) == ".log") {
+                bases.push_back(std::strtoull(entry->d_name, nullptr, 10));
+            }
+        }
+        closedir(dir);
+        std::sort(bases.begin(), bases.end());
+
+        for (uint64_t base : bases) {
+            if (!recoverSegment(base)) {
+                return false;
+            }
+        }
+        dropOldSegments();
+        return true;
+    }
+
+    uint64_t messageCount() const {
+        return nextSequence_;
+    }
+
+    // Sequence of the oldest message still kept.
+    uint64_t firstSequence() const {
+        return segments_.empty() ? nextSequence_ : segments_.front().baseSequence;
+    }
+
+    size_t segmentCount() const {
+        return segments_.size();
+    }
+
+    // Appends one encoded message (LF terminated). Returns false on a
+    // write error; the message is then not part of the history, and any
+    // part of it that reached the files is cut off again.
+    bool append(std::string_view message, int64_t timestamp) {
+        if (failed_) {
+            return false;
+        }
+        if (segments_.empty() || segments_.back().size >= segmentBytes_) {
+            if (!startSegment()) {
+                return false;
+            }
+            dropOldSegments();
+        }
+
+        Segment& segment = segments_.back();
+        if ((nextSequence_ - segment.baseSequence) % LOG_INDEX_INTERVAL == 0) {
+            IndexEntry entry{ nextSequence_, timestamp, segment.size };
+            segment.index.push_back(entry);
+            if (!writeAll(segment.indexFd, std::string_view(reinterpret_cast<const char*>(&entry), sizeof(entry)))) {
+                rollBack(segment);
+                return false;
+            }
+        }
+        if (!writeAll(segment.log->fd(), message)) {
+            rollBack(segment);
+            return false;
+        }
+        segment.size += message.size();
+        nextSequence_++;
+        return true;
+    }
+
+    // The byte ranges holding the newest messages, at most maxMessages of
+    // them and, when since is not 0, none older than the index entry
+    // before since (so up to LOG_INDEX_INTERVAL - 1 slightly older ones).
+    // If first is given, it is set to the sequence of the first message
+    // returned (messageCount() when there are none).
+    std::vector<LogRange> tail(uint64_t maxMessages, int64_t since, uint64_t* first = nullptr) {
+        std::vector<LogRange> ranges;
+        if (first != nullptr) {
+            *first = nextSequence_;
+        }
+        if (segments_.empty() || maxMessages == 0) {
+            return ranges;
+        }
+
+        uint64_t start = nextSequence_ - std::min(maxMessages, nextSequence_ - segments_.front().baseSequence);
+        if (since != 0) {
+            start = std::max(start, firstSequenceSince(since));
+        }
+        if (start >= nextSequence_) {
+            return ranges;
+        }
+
+        size_t index = segments_.size() - 1;
+        while (segments_[index].baseSequence > start) {
+            index--;
+        }
+        uint64_t offset;
+        if (!locate(segments_[index], start, offset)) {
+            return ranges;
+        }
+        if (first != nullptr) {
+            *first = start;
+        }
+        for (; index < segments_.size(); index++) {
+            const Segment& segment = segments_[index];
+            if (segment.size > offset) {
+                ranges.push_back({ segment.log, offset, segment.size - offset });
+            }
+            offset = 0;
+        }
+        return ranges;
+    }
+
+private:
+    struct IndexEntry {
+        uint64_t sequence;
+        int64_t timestamp;
+        uint64_t offset;
+    };
+
+    struct Segment {
+        uint64_t baseSequence = 0;
+        uint64_t size = 0;
+        std::shared_ptr<const LogFile> log;
+        int indexFd = -1;
+        std::vector<IndexEntry> index;
+    };
+
+    std::string path(uint64_t base, const char* extension) const {
+        return directory_ + "/" + std::to_string(base) + extension;
+    }
+
+    bool startSegment() {
+        Segment segment;
+        segment.baseSequence = nextSequence_;
+        int logFd = ::open(path(nextSequence_, ".log").c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (logFd == -1) {
+            return false;
+        }
+        segment.log = std::make_shared<LogFile>(logFd);
+        segment.indexFd = ::open(path(nextSequence_, ".idx").c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (segment.indexFd == -1) {
+            // Left behind, the log would pass for a segment on the next open().
+            ::unlink(path(nextSequence_, ".log").c_str());
+            return false;
+        }
+        segments_.push_back(std::move(segment));
+        return true;
+    }
+
+    // Deletes the oldest segments past the limit. Shards still streaming
+    // one hold its LogFile, so their transfers finish from the unlinked file.
+    void dropOldSegments() {
+        while (maxSegments_ != 0 && segments_.size() > maxSegments_) {
+            Segment& oldest = segments_.front();
+            ::unlink(path(oldest.baseSequence, ".log").c_str());
+            ::unlink(path(oldest.baseSequence, ".idx").c_str());
+            if (oldest.indexFd != -1) {
+                ::close(oldest.indexFd);
+            }
+            segments_.erase(segments_.begin());
+        }
+    }
+
+    bool recoverSegment(uint64_t base) {
+        Segment segment;
+        segment.baseSequence = base;
+        int logFd = ::open(path(base, ".log").c_str(), O_RDWR | O_APPEND | O_CLOEXEC);
+        if (logFd == -1) {
+            return false;
+        }
+        segment.log = std::make_shared<LogFile>(logFd);
+        segment.indexFd = ::open(path(base, ".idx").c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (segment.indexFd == -1) {
+            return false;
+        }
+
+        struct stat status{};
+        fstat(logFd, &status);
+        segment.size = static_cast<uint64_t>(status.st_size);
+
+        fstat(segment.indexFd, &status);
+        size_t entries = static_cast<size_t>(status.st_size) / sizeof(IndexEntry);
+        if (entries > 0) {
+            void* mapped = mmap(nullptr, entries * sizeof(IndexEntry), PROT_READ, MAP_PRIVATE, segment.indexFd, 0);
+            if (mapped == MAP_FAILED) {
+                return false;
+            }
+            segment.index.assign(static_cast<const IndexEntry*>(mapped), static_cast<const IndexEntry*>(mapped) + entries);
+            munmap(mapped, entries * sizeof(IndexEntry));
+        }
+
+        // Whatever came after the last complete message is a torn write.
+        uint64_t scanFrom = 0;
+        uint64_t sequence = base;
+        while (!segment.index.empty() && segment.index.back().offset >= segment.size) {
+            segment.index.pop_back();
+        }
+        if (!segment.index.empty()) {
+            scanFrom = segment.index.back().offset;
+            sequence = segment.index.back().sequence;
+        }
+        uint64_t complete = scanFrom;
+        if (segment.size > scanFrom) {
+            MappedRange range(logFd, scanFrom, segment.size - scanFrom);
+            if (!range.valid()) {
+                return false;
+            }
+            const char* cursor = range.data();
+            const char* end = cursor + range.size();
+            while (const char* newline = static_cast<const char*>(std::memchr(cursor, '\n', end - cursor))) {
+                sequence++;
+                cursor = newline + 1;
+            }
+            complete = scanFrom + (cursor - range.data());
+        }
+        if (complete < segment.size) {
+            if (ftruncate(logFd, complete) == -1) {
+                return false;
+            }
+            segment.size = complete;
+        }
+        if (ftruncate(segment.indexFd, segment.index.size() * sizeof(IndexEntry)) == -1) {
+            return false;
+        }
+
+        nextSequence_ = sequence;
+        segments_.push_back(std::move(segment));
+        return true;
+    }
+
+    uint64_t firstSequenceSince(int64_t since) const {
+        uint64_t sequence = segments_.front().baseSequence;
+        for (const Segment& segment : segments_) {
+            for (const IndexEntry& entry : segment.index) {
+                if (entry.timestamp >= since) {
+                    return sequence;
+                }
+                sequence = entry.sequence;
+            }
+        }
+        return sequence;
+    }
+
+    // Byte offset of a message in a segment: the nearest index entry at or
+    // before it, then a scan over the mapped messages in between.
+    bool locate(const Segment& segment, uint64_t sequence, uint64_t& offset) const {
+        auto entry = std::upper_bound(segment.index.begin(), segment.index.end(), sequence,
+                                      [](uint64_t value, const IndexEntry& candidate) { return value < candidate.sequence; });
+        uint64_t current = segment.baseSequence;
+        offset = 0;
+        if (entry != segment.index.begin()) {
+            --entry;
+            current = entry->sequence;
+            offset = entry->offset;
+        }
+        if (current == sequence) {
+            return true;
+        }
+
+        MappedRange range(segment.log->fd(), offset, segment.size - offset);
+        if (!range.valid()) {
+            return false;
+        }
+        const char* cursor = range.data();
+        const char* end = cursor + range.size();
+        while (current < sequence) {
+            const char* newline = static_cast<const char*>(std::memchr(cursor, '\n', end - cursor));
+            if (newline == nullptr) {
+                return false;
+            }
+            cursor = newline + 1;
+            current++;
+        }
+        offset += cursor - range.data();
+        return true;
+    }
+
+    // Read-only mapping of part of a file; mmap offsets must be page aligned.
+    class MappedRange {
+    public:
+        MappedRange(int fd, uint64_t offset, uint64_t length) {
+            uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+            uint64_t aligned = offset - offset % page;
+            skip_ = offset - aligned;
+            mappedLength_ = skip_ + length;
+            mapped_ = mmap(nullptr, mappedLength_, PROT_READ, MAP_SHARED, fd, aligned);
+            size_ = length;
+        }
+
+        ~MappedRange() {
+            if (mapped_ != MAP_FAILED) {
+                munmap(mapped_, mappedLength_);
+            }
+        }
+
+        bool valid() const {
+            return mapped_ != MAP_FAILED;
+        }
+
+        const char* data() const {
+            return static_cast<const char*>(mapped_) + skip_;
+        }
+
+        size_t size() const {
+            return size_;
+        }
+
+    private:
+        void* mapped_;
+        size_t mappedLength_;
+        size_t skip_;
+        size_t size_;
+    };
+
+    // Undoes a failed append: drops its index entry and truncates both
+    // files back to the last whole message, so the next append lands where
+    // the index says it does. If even that fails the log takes no more
+    // messages; recovery at the next start cuts the torn line off.
+    void rollBack(Segment& segment) {
+        if (!segment.index.empty() && segment.index.back().sequence == nextSequence_) {
+            segment.index.pop_back();
+        }
+        if (ftruncate(segment.log->fd(), segment.size) == -1 ||
+            ftruncate(segment.indexFd, segment.index.size() * sizeof(IndexEntry)) == -1) {
+            failed_ = true;
+        }
+    }
+
+    static bool writeAll(int fd, std::string_view data) {
+        while (!data.empty()) {
+            ssize_t written = ::write(fd, data.data(), data.size());
+            if (written == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            data.remove_prefix(written);
+        }
+        return true;
+    }
+
+    std::string directory_;
+    size_t maxSegments_;
+    uint64_t segmentBytes_;
+    std::vector<Segment> segments_;
+    uint64_t nextSequence_ = 0;
+    bool failed_ = false; // a failed append could not be undone
+};
+
+#endif
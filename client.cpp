@@ -1,144 +1,466 @@
-#include <iostream>
-#include <cstring>
-#include <thread>
-
-#ifdef _WIN32
-#include <winsock2.h>
-#pragma comment(lib, "ws2_32.lib")
-#else
-#include <unistd.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#endif
-
-constexpr int MAX_MESSAGE_LENGTH = 4096;
-constexpr int MAX_NICKNAME_LENGTH = 50;
-
-#ifdef _WIN32
-BOOL CtrlHandler(DWORD fdwCtrlType) {
-    if (fdwCtrlType == CTRL_C_EVENT) {
-        return TRUE;
-    }
-    return FALSE;
-}
-#else
-void CtrlHandler(int) {}
-#endif
-
-void receiveMessages(int socket) {
-    char buffer[MAX_MESSAGE_LENGTH] = { 0 };
-    while (true) {
-        int bytesRead = recv(socket, buffer, sizeof(buffer) - 1, 0);
-        if (bytesRead == 0) {
-            std::cout << "Server disconnected" << std::endl;
-            break;
-        } else if (bytesRead == -1) {
-            std::cerr << "Failed to receive message from server" << std::endl;
-            break;
-        }
-        buffer[bytesRead] = '\0';
-
-        std::string receivedMessage(buffer);
-        std::cout << receivedMessage << std::endl;
-    }
-}
-
-int main() {
-#ifdef _WIN32
-    WSADATA wsData;
-    if (WSAStartup(MAKEWORD(2, 2), &wsData) != 0) {
-        std::cerr << "Failed to initialize winsock" << std::endl;
-        return 1;
-    }
-#endif
-
-    int serverPort;
-    std::cout << "Enter server port: ";
-    std::cin >> serverPort;
-
-    int clientSocket = socket(AF_INET, SOCK_STREAM, 0);
-    if (clientSocket == -1) {
-        std::cerr << "Failed to create client socket" << std::endl;
-        return 1;
-    }
-
-    sockaddr_in serverAddress{};
-    serverAddress.sin_family = AF_INET;
-    serverAddress.sin_port = htons(serverPort);
-    serverAddress.sin_addr.s_addr = inet_addr("127.0.0.1");
-
-    if (connect(clientSocket, reinterpret_cast<struct sockaddr*>(&serverAddress), sizeof(serverAddress)) == -1) {
-        std::cerr << "Failed to connect to server" << std::endl;
-#ifdef _WIN32
-        closesocket(clientSocket);
-#else
-        close(clientSocket);
-#endif
-        return 1;
-    }
-
-    std::cout << "Connected to server" << std::endl;
-
-    std::thread receiveThread(receiveMessages, clientSocket);
-
-    std::string nickname;
-    std::cout << "Enter your nickname (up to 50 characters): ";
-    std::cin.ignore(); // Ignore newline character from previous input
-    std::getline(std::cin, nickname);
-    nickname = nickname.substr(0, MAX_NICKNAME_LENGTH);
-    std::string nicknameCommand = "/nickname " + nickname;
-
-    if (send(clientSocket, nicknameCommand.c_str(), nicknameCommand.length(), 0) == -1) {
-        std::cerr << "Failed to send nickname to server" << std::endl;
-        receiveThread.join();
-#ifdef _WIN32
-        closesocket(clientSocket);
-#else
-        close(clientSocket);
-#endif
-        return 1;
-    }
-
-    std::string channelName;
-    std::cout << "Enter channel name: ";
-    std::getline(std::cin, channelName);
-    std::string joinCommand = "/join " + channelName;
-
-    if (send(clientSocket, joinCommand.c_str(), joinCommand.length(), 0) == -1) {
-        std::cerr << "Failed to send join command to server" << std::endl;
-        receiveThread.join();
-#ifdef _WIN32
-        closesocket(clientSocket);
-#else
-        close(clientSocket);
-#endif
-        return 1;
-    }
-
-    std::string message;
-    while (true) {
-        std::getline(std::cin, message);
-        if (message.find("/quit") == 0) {
-            std::cout << "Disconnected." << std::endl;
-            close(clientSocket);
-            break;
-        }
-
-        if (send(clientSocket, message.c_str(), message.length(), 0) == -1) {
-            std::cerr << "Failed to send message to server" << std::endl;
-            break;
-        }
-    }
-
-    receiveThread.join();
-
-#ifdef _WIN32
-    closesocket(clientSocket);
-    WSACleanup();
-#else
-    close(clientSocket);
-#endif
-
-    return 0;
-}
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#endif
+
+constexpr int MAX_MESSAGE_LENGTH = 4096;
+constexpr int MAX_NICKNAME_LENGTH = 50;
+constexpr size_t BATCH_READ_SIZE = 65536;
+constexpr size_t BATCH_MAX_PENDING_FACTOR = 4; // input is paused while this many batches wait for the socket
+
+using Clock = std::chrono::steady_clock;
+
+#ifdef _WIN32
+BOOL CtrlHandler(DWORD fdwCtrlType) {
+    if (fdwCtrlType == CTRL_C_EVENT) {
+        return TRUE;
+    }
+    return FALSE;
+}
+#else
+void CtrlHandler(int) {}
+#endif
+
+// The server pings a client that has been quiet for a while with
+// "PING <token>" and drops it if nothing comes back. Builds the answer,
+// "/pong <token>", for such a line; false for any other line.
+bool pingReply(std::string_view line, std::string& reply) {
+    if (line.compare(0, 5, "PING ") != 0) {
+        return false;
+    }
+    reply = "/pong ";
+    reply.append(line.substr(5));
+    if (reply.back() != '\n') {
+        reply.push_back('\n');
+    }
+    return true;
+}
+
+// The server frames every message with a newline, so received lines are
+// printed as they are, except for PINGs, which are answered instead.
+void receiveMessages(int socket) {
+    char buffer[MAX_MESSAGE_LENGTH];
+    std::string pending; // a line the last read cut short
+    while (true) {
+        int bytesRead = recv(socket, buffer, sizeof(buffer), 0);
+        if (bytesRead == 0) {
+            std::cout << "Server disconnected" << std::endl;
+            break;
+        } else if (bytesRead == -1) {
+            std::cerr << "Failed to receive message from server" << std::endl;
+            break;
+        }
+
+        pending.append(buffer, bytesRead);
+        size_t start = 0;
+        size_t newline;
+        while ((newline = pending.find('\n', start)) != std::string::npos) {
+            std::string_view line(pending.data() + start, newline + 1 - start);
+            std::string reply;
+            if (pingReply(line, reply)) {
+                send(socket, reply.data(), reply.size(), MSG_NOSIGNAL);
+            } else {
+                std::cout.write(line.data(), line.size());
+            }
+            start = newline + 1;
+        }
+        pending.erase(0, start);
+        std::cout.flush();
+    }
+}
+
+struct BatchOptions {
+    size_t flushBytes = 65536;                   // a batch goes out once this much is pending
+    std::chrono::milliseconds flushDelay{ 5 };  // or once its oldest line has waited this long
+};
+
+// Non-interactive mode for bots and bridges. Protocol lines (/nickname,
+// /join, /connect, chat) are read from a file or stdin and sent in large
+// writes; whatever the server sends is copied to stdout through a buffer,
+// whole lines at a time, with PINGs answered rather than copied.
+//
+// Complete lines are coalesced until flushBytes are pending or the oldest
+// has waited flushDelay, so a steady stream costs one send() per batch
+// rather than one per line, and a lone line still goes out within
+// flushDelay. Nagle's algorithm is off: batching already happens here, and
+// Nagle would only hold back the short tail of a burst until the previous
+// batch is acknowledged. Output is flushed by the same two thresholds.
+//
+// The input ends at EOF or at a line starting with /quit. The client then
+// sends what is left, half-closes the connection and exits when the server
+// closes its side.
+class BatchClient {
+public:
+    BatchClient(int socket, int input, const BatchOptions& options)
+        : socket_(socket), input_(input), options_(options) {}
+
+    bool run() {
+        int noDelay = 1;
+        setsockopt(socket_, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+        fcntl(socket_, F_SETFL, fcntl(socket_, F_GETFL, 0) | O_NONBLOCK);
+
+        while (true) {
+            Clock::time_point now = Clock::now();
+            if (!flushOutgoing(now) || !flushIncoming(now, false)) {
+                return false;
+            }
+            if (inputDone_ && complete_ == 0 && !halfClosed_) {
+                shutdown(socket_, SHUT_WR);
+                halfClosed_ = true;
+            }
+
+            pollfd fds[2] = { { socket_, static_cast<short>(POLLIN | (sendBlocked_ ? POLLOUT : 0)), 0 }, { input_, POLLIN, 0 } };
+            bool wantInput = !inputDone_ && complete_ < options_.flushBytes * BATCH_MAX_PENDING_FACTOR;
+            if (poll(fds, wantInput ? 2 : 1, timeoutMillis(now)) == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                std::cerr << "Failed to poll" << std::endl;
+                return false;
+            }
+
+            if (fds[0].revents & POLLOUT) {
+                sendBlocked_ = false;
+            }
+            if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+                ssize_t bytesRead = readServer();
+                if (bytesRead <= 0) {
+                    flushIncoming(Clock::now(), true);
+                    if (bytesRead == 0) {
+                        std::cerr << "Server disconnected" << std::endl;
+                        return true;
+                    }
+                    std::cerr << "Failed to receive message from server" << std::endl;
+                    return false;
+                }
+            }
+            if (wantInput && (fds[1].revents & (POLLIN | POLLHUP | POLLERR))) {
+                readInput();
+            }
+        }
+    }
+
+private:
+    void readInput() {
+        char buffer[BATCH_READ_SIZE];
+        ssize_t bytesRead = read(input_, buffer, sizeof(buffer));
+        if (bytesRead == -1 && (errno == EINTR || errno == EAGAIN)) {
+            return;
+        }
+        if (bytesRead <= 0) {
+            // A last line without a newline is still sent.
+            if (outgoing_.size() > complete_) {
+                outgoing_.push_back('\n');
+                markComplete(outgoing_.size());
+            }
+            inputDone_ = true;
+            return;
+        }
+
+        size_t scanFrom = outgoing_.size();
+        outgoing_.append(buffer, bytesRead);
+        size_t newline;
+        while ((newline = outgoing_.find('\n', scanFrom)) != std::string::npos) {
+            if (outgoing_.compare(complete_, 5, "/quit") == 0) {
+                outgoing_.resize(complete_);
+                inputDone_ = true;
+                return;
+            }
+            markComplete(newline + 1);
+            scanFrom = newline + 1;
+        }
+    }
+
+    void markComplete(size_t end) {
+        if (complete_ == sent_) {
+            pendingSince_ = Clock::now();
+        }
+        complete_ = end;
+    }
+
+    // Sends the complete lines once a threshold is reached. A batch that
+    // the socket only partly took is finished as soon as it has room.
+    bool flushOutgoing(Clock::time_point now) {
+        if (complete_ == sent_ || sendBlocked_) {
+            return true;
+        }
+        if (sent_ == 0 && !inputDone_ && complete_ < options_.flushBytes && now < pendingSince_ + options_.flushDelay) {
+            return true;
+        }
+        while (sent_ < complete_) {
+            ssize_t bytesSent = send(socket_, outgoing_.data() + sent_, complete_ - sent_, MSG_NOSIGNAL);
+            if (bytesSent == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    sendBlocked_ = true;
+                    return true;
+                }
+                std::cerr << "Failed to send message to server" << std::endl;
+                return false;
+            }
+            sent_ += bytesSent;
+        }
+        outgoing_.erase(0, sent_);
+        complete_ -= sent_;
+        sent_ = 0;
+        return true;
+    }
+
+    ssize_t readServer() {
+        char buffer[BATCH_READ_SIZE];
+        ssize_t bytesRead;
+        do {
+            bytesRead = recv(socket_, buffer, sizeof(buffer), 0);
+        } while (bytesRead == -1 && errno == EINTR);
+        if (bytesRead == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 1;
+        }
+        if (bytesRead > 0) {
+            if (scanned_ == 0) {
+                incomingSince_ = Clock::now();
+            }
+            incoming_.append(buffer, bytesRead);
+            answerPings();
+        }
+        return bytesRead;
+    }
+
+    // Takes PINGs out of the newly completed server lines and queues their
+    // answers ahead of any unfinished input line.
+    void answerPings() {
+        size_t newline;
+        while ((newline = incoming_.find('\n', scanned_)) != std::string::npos) {
+            std::string reply;
+            if (!pingReply(std::string_view(incoming_).substr(scanned_, newline + 1 - scanned_), reply)) {
+                scanned_ = newline + 1;
+                continue;
+            }
+            incoming_.erase(scanned_, newline + 1 - scanned_);
+            if (!halfClosed_) {
+                outgoing_.insert(complete_, reply);
+                markComplete(complete_ + reply.size());
+            }
+        }
+    }
+
+    // Only complete lines are written, unless forced at the end.
+    bool flushIncoming(Clock::time_point now, bool force) {
+        size_t end = force ? incoming_.size() : scanned_;
+        if (end == 0 || (!force && end < options_.flushBytes && now < incomingSince_ + options_.flushDelay)) {
+            return true;
+        }
+        size_t offset = 0;
+        while (offset < end) {
+            ssize_t written = write(STDOUT_FILENO, incoming_.data() + offset, end - offset);
+            if (written == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                std::cerr << "Failed to write server output" << std::endl;
+                return false;
+            }
+            offset += written;
+        }
+        incoming_.erase(0, end);
+        scanned_ = 0;
+        return true;
+    }
+
+    // Until the nearer of the two flush deadlines, or forever.
+    int timeoutMillis(Clock::time_point now) const {
+        Clock::time_point deadline = Clock::time_point::max();
+        if (complete_ > sent_ && !sendBlocked_) {
+            deadline = pendingSince_ + options_.flushDelay;
+        }
+        if (scanned_ != 0) {
+            deadline = std::min(deadline, incomingSince_ + options_.flushDelay);
+        }
+        if (deadline == Clock::time_point::max()) {
+            return -1;
+        }
+        if (deadline <= now) {
+            return 0;
+        }
+        return static_cast<int>(std::chrono::ceil<std::chrono::milliseconds>(deadline - now).count());
+    }
+
+    int socket_;
+    int input_;
+    BatchOptions options_;
+    std::string outgoing_;     // read from the input, not yet sent
+    size_t sent_ = 0;          // bytes of outgoing_ already sent
+    size_t complete_ = 0;      // outgoing_ up to here holds complete lines
+    Clock::time_point pendingSince_;
+    bool sendBlocked_ = false; // the socket took less than offered; wait for POLLOUT
+    bool inputDone_ = false;
+    bool halfClosed_ = false;
+    std::string incoming_;     // server output not yet written to stdout
+    size_t scanned_ = 0;       // incoming_ up to here holds complete lines, PINGs taken out
+    Clock::time_point incomingSince_;
+};
+
+int main(int argc, char* argv[]) {
+#ifdef _WIN32
+    WSADATA wsData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsData) != 0) {
+        std::cerr << "Failed to initialize winsock" << std::endl;
+        return 1;
+    }
+#endif
+
+    int serverPort = 0;
+    std::string serverHost = "127.0.0.1";
+    std::string batchInput; // empty: interactive
+    BatchOptions batchOptions;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--port" && i + 1 < argc) {
+            serverPort = std::atoi(argv[++i]);
+        } else if (arg == "--host" && i + 1 < argc) {
+            serverHost = argv[++i];
+        } else if (arg == "--batch" && i + 1 < argc) {
+            batchInput = argv[++i];
+        } else if (arg == "--flush-bytes" && i + 1 < argc) {
+            batchOptions.flushBytes = std::max<size_t>(1, std::strtoull(argv[++i], nullptr, 10));
+        } else if (arg == "--flush-ms" && i + 1 < argc) {
+            batchOptions.flushDelay = std::chrono::milliseconds(std::atoi(argv[++i]));
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--port PORT] [--host ADDRESS] [--batch FILE|-] [--flush-bytes N] [--flush-ms MS]"
+                      << std::endl;
+            return 1;
+        }
+    }
+
+    bool portFromTerminal = serverPort == 0;
+    if (portFromTerminal) {
+        if (!batchInput.empty()) {
+            std::cerr << "Batch mode needs --port" << std::endl;
+            return 1;
+        }
+        std::cout << "Enter server port: ";
+        std::cin >> serverPort;
+    }
+
+    int input = STDIN_FILENO;
+    if (!batchInput.empty() && batchInput != "-") {
+        input = open(batchInput.c_str(), O_RDONLY | O_CLOEXEC);
+        if (input == -1) {
+            std::cerr << "Failed to open " << batchInput << std::endl;
+            return 1;
+        }
+    }
+
+    int clientSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (clientSocket == -1) {
+        std::cerr << "Failed to create client socket" << std::endl;
+        return 1;
+    }
+
+    sockaddr_in serverAddress{};
+    serverAddress.sin_family = AF_INET;
+    serverAddress.sin_port = htons(serverPort);
+    serverAddress.sin_addr.s_addr = inet_addr(serverHost.c_str());
+
+    if (connect(clientSocket, reinterpret_cast<struct sockaddr*>(&serverAddress), sizeof(serverAddress)) == -1) {
+        std::cerr << "Failed to connect to server" << std::endl;
+#ifdef _WIN32
+        closesocket(clientSocket);
+#else
+        close(clientSocket);
+#endif
+        return 1;
+    }
+
+    if (!batchInput.empty()) {
+        bool ok = BatchClient(clientSocket, input, batchOptions).run();
+        close(clientSocket);
+        return ok ? 0 : 1;
+    }
+
+    std::cout << "Connected to server" << std::endl;
+
+    std::thread receiveThread(receiveMessages, clientSocket);
+
+    std::string nickname;
+    std::cout << "Enter your nickname (up to 50 characters): ";
+    if (portFromTerminal) {
+        std::cin.ignore(); // Ignore newline character from previous input
+    }
+    std::getline(std::cin, nickname);
+    nickname = nickname.substr(0, MAX_NICKNAME_LENGTH);
+    std::string nicknameCommand = "/nickname " + nickname + "\n";
+
+    if (send(clientSocket, nicknameCommand.c_str(), nicknameCommand.length(), 0) == -1) {
+        std::cerr << "Failed to send nickname to server" << std::endl;
+        receiveThread.join();
+#ifdef _WIN32
+        closesocket(clientSocket);
+#else
+        close(clientSocket);
+#endif
+        return 1;
+    }
+
+    std::string channelName;
+    std::cout << "Enter channel name: ";
+    std::getline(std::cin, channelName);
+    std::string joinCommand = "/join " + channelName + "\n";
+
+    if (send(clientSocket, joinCommand.c_str(), joinCommand.length(), 0) == -1) {
+        std::cerr << "Failed to send join command to server" << std::endl;
+        receiveThread.join();
+#ifdef _WIN32
+        closesocket(clientSocket);
+#else
+        close(clientSocket);
+#endif
+        return 1;
+    }
+
+    std::string message;
+    while (true) {
+        std::getline(std::cin, message);
+        if (message.find("/quit") == 0) {
+            std::cout << "Disconnected." << std::endl;
+            close(clientSocket);
+            break;
+        }
+
+        message += "\n";
+        if (send(clientSocket, message.c_str(), message.length(), 0) == -1) {
+            std::cerr << "Failed to send message to server" << std::endl;
+            break;
+        }
+    }
+
+    receiveThread.join();
+
+#ifdef _WIN32
+    closesocket(clientSocket);
+    WSACleanup();
+#else
+    close(clientSocket);
+#endif
+
+    return 0;
+}
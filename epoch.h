@@ -0,0 +1,60 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+// Quiescent-state based reclamation for data that threads read without
+// locks. Each participating thread is "online" while it may hold pointers
+// into shared data and "offline" while it blocks; it only reads shared
+// pointers between enter() and exit(). A writer that unpublishes an object
+// calls retire() and may free the object once safe() says every
+// participant has been offline or re-entered since.
+//
+// Participants are numbered by their owner (here: the shard index).
+// Threads that never call enter() never hold anything up.
+class EpochReclaimer {
+public:
+    explicit EpochReclaimer(int participants)
+        : count_(participants), participants_(new Participant[participants]) {}
+
+    // Marks the participant online and lets it read shared pointers.
+    void enter(int participant) {
+        participants_[participant].epoch.store(globalEpoch_.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+    }
+
+    // Marks the participant offline: it holds no shared pointers any more.
+    void exit(int participant) {
+        participants_[participant].epoch.store(OFFLINE, std::memory_order_release);
+    }
+
+    // Call after unpublishing an object; the result is its retirement epoch.
+    uint64_t retire() {
+        return globalEpoch_.fetch_add(1, std::memory_order_seq_cst);
+    }
+
+    // True once no reader can still see objects retired in the given epoch.
+    bool safe(uint64_t retiredEpoch) const {
+        for (int i = 0; i < count_; i++) {
+            uint64_t epoch = participants_[i].epoch.load(std::memory_order_seq_cst);
+            if (epoch != OFFLINE && epoch <= retiredEpoch) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    static constexpr uint64_t OFFLINE = 0;
+
+    struct alignas(64) Participant {
+        std::atomic<uint64_t> epoch{OFFLINE};
+    };
+
+    std::atomic<uint64_t> globalEpoch_{1};
+    int count_;
+    std::unique_ptr<Participant[]> participants_;
+};
+
+#endif
@@ -0,0 +1,184 @@
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <random>
+
+#include "message_filter.h"
+#include "text_scan.h"
+
+// Microbenchmark for the chat filter's kernels: UTF-8 validation and the
+// control character scan, scalar against each vector width the CPU has,
+// and the blocklist automaton against searching for each pattern in turn.
+// Every kernel runs over the same corpus of chat lines, which are valid
+// UTF-8 and hold no control characters or blocked words, so each one reads
+// every byte. The results of the kernels are checked against each other.
+
+struct FilterBenchConfig {
+    size_t lines = 10000;
+    size_t lineLength = 200;
+    double nonAscii = 0.1;   // share of characters outside ASCII
+    size_t patterns = 200;
+    double seconds = 0.5;    // per kernel
+};
+
+// Lines mixing ASCII with 2, 3 and 4 byte characters, in nonAscii of the
+// characters.
+static std::vector<std::string> makeCorpus(const FilterBenchConfig& config, std::mt19937_64& random) {
+    static const char* const wide[] = { "\xC3\xA7", "\xC3\xA3", "\xE2\x82\xAC", "\xE3\x81\x82", "\xF0\x9F\x98\x80" };
+    std::uniform_real_distribution<double> chance(0, 1);
+    std::vector<std::string> corpus(config.lines);
+    for (std::string& line : corpus) {
+        while (line.size() < config.lineLength) {
+            if (chance(random) < config.nonAscii) {
+                line += wide[random() % 5];
+            } else {
+                line += static_cast<char>('a' + random() % 26);
+                if (random() % 6 == 0) {
+                    line += ' ';
+                }
+            }
+        }
+    }
+    return corpus;
+}
+
+// Patterns of 5 to 10 letters with a digit in them, which the corpus never
+// contains, so the search never stops early.
+static std::vector<std::string> makePatterns(const FilterBenchConfig& config, std::mt19937_64& random) {
+    std::vector<std::string> patterns(config.patterns);
+    for (std::string& pattern : patterns) {
+        size_t length = 5 + random() % 6;
+        for (size_t i = 0; i < length; i++) {
+            pattern += static_cast<char>('a' + random() % 26);
+        }
+        pattern[random() % length] = static_cast<char>('0' + random() % 10);
+    }
+    return patterns;
+}
+
+// Runs kernel over the corpus until config.seconds have passed, and prints
+// the throughput. Returns what kernel returned for the corpus, summed.
+template <typename Kernel>
+static uint64_t measure(const std::string& name, const std::vector<std::string>& corpus, const FilterBenchConfig& config,
+                        Kernel kernel) {
+    using Clock = std::chrono::steady_clock;
+    size_t corpusBytes = 0;
+    for (const std::string& line : corpus) {
+        corpusBytes += line.size();
+    }
+    uint64_t result = 0;
+    uint64_t bytes = 0;
+    Clock::time_point start = Clock::now();
+    Clock::time_point end;
+    do {
+        result = 0;
+        for (const std::string& line : corpus) {
+            result += kernel(line);
+        }
+        bytes += corpusBytes;
+        end = Clock::now();
+    } while (end - start < std::chrono::duration<double>(config.seconds));
+    double seconds = std::chrono::duration<double>(end - start).count();
+    std::cout << "  " << std::left << std::setw(24) << name << std::right << std::fixed << std::setprecision(2)
+              << std::setw(10) << bytes / seconds / 1e9 << " GB/s" << std::setw(10)
+              << seconds * 1e9 / (bytes / corpusBytes * corpus.size()) << " ns/line" << std::endl;
+    return result;
+}
+
+static bool agree(const std::vector<uint64_t>& results) {
+    if (std::adjacent_find(results.begin(), results.end(), std::not_equal_to<uint64_t>()) != results.end()) {
+        std::cerr << "Kernels disagree" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    FilterBenchConfig config;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--lines" && i + 1 < argc) {
+            config.lines = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--line-length" && i + 1 < argc) {
+            config.lineLength = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--non-ascii" && i + 1 < argc) {
+            config.nonAscii = std::atof(argv[++i]);
+        } else if (arg == "--patterns" && i + 1 < argc) {
+            config.patterns = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--seconds" && i + 1 < argc) {
+            config.seconds = std::atof(argv[++i]);
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--lines N] [--line-length N] [--non-ascii FRACTION] [--patterns N] [--seconds S]"
+                      << std::endl;
+            return 1;
+        }
+    }
+
+    std::mt19937_64 random(1);
+    std::vector<std::string> corpus = makeCorpus(config, random);
+    std::vector<std::string> patterns = makePatterns(config, random);
+    std::cout << config.lines << " lines of " << config.lineLength << " bytes, " << config.nonAscii * 100
+              << "% of characters outside ASCII" << std::endl;
+
+    std::vector<uint64_t> results;
+    std::cout << "UTF-8 validation" << std::endl;
+    results.push_back(measure("scalar", corpus, config, [](std::string_view line) {
+        return validUtf8Scalar(line.data(), line.size());
+    }));
+#if TEXT_SCAN_X86
+    if (__builtin_cpu_supports("ssse3")) {
+        results.push_back(measure("ssse3", corpus, config, [](std::string_view line) {
+            return validUtf8Sse(line.data(), line.size());
+        }));
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        results.push_back(measure("avx2", corpus, config, [](std::string_view line) {
+            return validUtf8Avx2(line.data(), line.size());
+        }));
+    }
+#endif
+    if (!agree(results)) {
+        return 1;
+    }
+
+    results.clear();
+    std::cout << "Control character scan" << std::endl;
+    results.push_back(measure("scalar", corpus, config, [](std::string_view line) {
+        return findControlScalar(line.data(), line.size());
+    }));
+#if TEXT_SCAN_X86
+    results.push_back(measure("sse2", corpus, config, [](std::string_view line) {
+        return findControlSse2(line.data(), line.size());
+    }));
+    if (__builtin_cpu_supports("avx2")) {
+        results.push_back(measure("avx2", corpus, config, [](std::string_view line) {
+            return findControlAvx2(line.data(), line.size());
+        }));
+    }
+#endif
+    if (!agree(results)) {
+        return 1;
+    }
+
+    results.clear();
+    Blocklist blocklist(patterns);
+    std::cout << "Blocklist of " << patterns.size() << " patterns (" << blocklist.stateCount() << " states)" << std::endl;
+    results.push_back(measure("search each pattern", corpus, config, [&](std::string_view line) {
+        for (const std::string& pattern : patterns) {
+            if (line.find(pattern) != std::string_view::npos) {
+                return true;
+            }
+        }
+        return false;
+    }));
+    results.push_back(measure("aho-corasick", corpus, config, [&](std::string_view line) {
+        return blocklist.matches(line);
+    }));
+    return agree(results) ? 0 : 1;
+}
@@ -0,0 +1,250 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// Binary protocol, the opt-in alternative to text lines. A client asks for
+// it by sending "/binary" as its very first line; everything after that
+// line, in both directions, is frames:
+//
+//   <varint length> <opcode> <body>
+//
+// where length counts the opcode and the body. Integers inside bodies are
+// unsigned LEB128 varints. Channels and users are referred to by number:
+// the server tells a client its own user ID in Welcome and a channel's ID
+// in Channel, right after the client joins it, and routes Chat frames by
+// that ID without parsing or looking anything up by name.
+enum class Opcode : uint8_t {
+    // Client to server.
+    Nickname = 0x01, // <nickname>
+    Join = 0x02,     // <channel name>
+    Connect = 0x03,  // (empty)
+    Chat = 0x04,     // <varint channel ID> <text>
+    Command = 0x05,  // <text command line>, e.g. "/kick bob"; anything the text protocol accepts
+    Pong = 0x06,     // <body of the Ping being answered>
+
+    // Server to client.
+    Welcome = 0x81,     // <varint protocol version> <varint user ID>
+    Text = 0x82,        // <line>: a notice or reply, the text protocol's line without its LF
+    Channel = 0x83,     // <varint channel ID> <channel name>
+    ChatMessage = 0x84, // <varint channel ID> <varint user ID> <varint nickname length> <nickname> <text>
+    History = 0x85,     // <LF terminated text lines>: replayed channel history
+    Ping = 0x86         // <varint token>: keepalive; any frame back counts as the answer, Pong by convention
+};
+
+constexpr uint64_t BINARY_PROTOCOL_VERSION = 1;
+constexpr size_t MAX_VARINT_LENGTH = 10;
+
+inline size_t encodeVarint(uint64_t value, char* out) {
+    size_t length = 0;
+    while (value >= 0x80) {
+        out[length++] = static_cast<char>((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    out[length++] = static_cast<char>(value);
+    return length;
+}
+
+inline void appendVarint(std::string& out, uint64_t value) {
+    char bytes[MAX_VARINT_LENGTH];
+    out.append(bytes, encodeVarint(value, bytes));
+}
+
+enum class VarintStatus {
+    Complete,
+    Incomplete, // data ended in the middle of the varint
+    Malformed   // longer than any 64-bit value
+};
+
+// Takes a varint off the front of data; data is left alone unless it is
+// complete.
+inline VarintStatus decodeVarint(std::string_view& data, uint64_t& value) {
+    value = 0;
+    for (size_t i = 0; i < data.size(); i++) {
+        if (i == MAX_VARINT_LENGTH) {
+            return VarintStatus::Malformed;
+        }
+        uint8_t byte = static_cast<uint8_t>(data[i]);
+        // The tenth byte holds bit 63 only.
+        if (i == MAX_VARINT_LENGTH - 1 && byte > 1) {
+            return VarintStatus::Malformed;
+        }
+        value |= static_cast<uint64_t>(byte & 0x7F) << (7 * i);
+        if (!(byte & 0x80)) {
+            data.remove_prefix(i + 1);
+            return VarintStatus::Complete;
+        }
+    }
+    return data.size() >= MAX_VARINT_LENGTH ? VarintStatus::Malformed : VarintStatus::Incomplete;
+}
+
+// The length prefix and opcode of a frame whose body is bodyLength bytes,
+// to be sent in front of the body.
+class FrameHeader {
+public:
+    FrameHeader(Opcode opcode, size_t bodyLength) {
+        size_ = encodeVarint(bodyLength + 1, bytes_);
+        bytes_[size_++] = static_cast<char>(opcode);
+    }
+
+    std::string_view view() const {
+        return std::string_view(bytes_, size_);
+    }
+
+private:
+    char bytes_[MAX_VARINT_LENGTH + 1];
+    size_t size_;
+};
+
+// Splits a byte stream into frames, the binary counterpart of LineParser
+// and used the same way: complete frames are handed out straight from the
+// caller's buffer, and only a frame that straddles two reads is carried in
+// the parser's own buffer, allocated the first time that happens. Frames
+// longer than the limit are skipped whole and counted. A length prefix that
+// is not a valid varint leaves the stream unreadable: the parser then
+// reports malformed() and stops handing out frames.
+class FrameParser {
+public:
+    explicit FrameParser(size_t maxFrameLength = 4096) : maxFrameLength_(maxFrameLength) {}
+
+    // Takes the next complete frame (opcode and body) off the front of
+    // data. Returns false once data is used up, with any unfinished frame
+    // carried over to the next call. Empty frames are skipped.
+    bool next(std::string_view& data, std::string_view& frame) {
+        while (!data.empty() && !malformed_) {
+            if (skipping_ > 0) {
+                size_t skipped = std::min<uint64_t>(skipping_, data.size());
+                data.remove_prefix(skipped);
+                skipping_ -= skipped;
+                continue;
+            }
+
+            if (carriedLength_ == 0) {
+                std::string_view body = data;
+                uint64_t length;
+                VarintStatus status = decodeVarint(body, length);
+                if (status == VarintStatus::Malformed) {
+                    malformed_ = true;
+                    return false;
+                }
+                if (status == VarintStatus::Complete) {
+                    if (length > maxFrameLength_) {
+                        droppedFrames_++;
+                        skipping_ = length;
+                        data = body;
+                        continue;
+                    }
+                    if (body.size() >= length) {
+                        frame = body.substr(0, length);
+                        data = body.substr(length);
+                        if (length == 0) {
+                            continue;
+                        }
+                        return true;
+                    }
+                }
+            }
+
+            if (!carry(data)) {
+                continue;
+            }
+            frame = std::string_view(carried_.get() + headerLength_, carriedLength_ - headerLength_);
+            carriedLength_ = 0;
+            headerLength_ = 0;
+            if (!frame.empty()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool malformed() const {
+        return malformed_;
+    }
+
+    size_t droppedFrames() const {
+        return droppedFrames_;
+    }
+
+    // The unfinished frame as received so far, length prefix included, and
+    // what is left to skip of an oversized one: all another parser needs to
+    // pick the stream up where this one is (see restore()).
+    std::string_view carried() const {
+        return std::string_view(carried_.get(), carriedLength_);
+    }
+
+    uint64_t skipping() const {
+        return skipping_;
+    }
+
+    void restore(std::string_view carried, uint64_t skipping) {
+        reset();
+        skipping_ = skipping;
+        if (!carried.empty()) {
+            carry(carried);
+        }
+    }
+
+    void reset() {
+        carriedLength_ = 0;
+        headerLength_ = 0;
+        frameLength_ = 0;
+        skipping_ = 0;
+        malformed_ = false;
+        droppedFrames_ = 0;
+    }
+
+private:
+    // Moves bytes of the current frame from data into the carry buffer.
+    // Returns true once the frame is complete.
+    bool carry(std::string_view& data) {
+        if (!carried_) {
+            carried_.reset(new char[maxFrameLength_ + MAX_VARINT_LENGTH]);
+        }
+        while (headerLength_ == 0 && !data.empty()) {
+            carried_[carriedLength_++] = data.front();
+            data.remove_prefix(1);
+            std::string_view header(carried_.get(), carriedLength_);
+            uint64_t length;
+            VarintStatus status = decodeVarint(header, length);
+            if (status == VarintStatus::Malformed) {
+                malformed_ = true;
+                return false;
+            }
+            if (status == VarintStatus::Complete) {
+                if (length > maxFrameLength_) {
+                    droppedFrames_++;
+                    skipping_ = length;
+                    carriedLength_ = 0;
+                    return false;
+                }
+                headerLength_ = carriedLength_;
+                frameLength_ = length;
+            }
+        }
+        if (headerLength_ == 0) {
+            return false;
+        }
+        size_t wanted = std::min<size_t>(headerLength_ + frameLength_ - carriedLength_, data.size());
+        std::memcpy(carried_.get() + carriedLength_, data.data(), wanted);
+        carriedLength_ += wanted;
+        data.remove_prefix(wanted);
+        return carriedLength_ == headerLength_ + frameLength_;
+    }
+
+    size_t maxFrameLength_;
+    std::unique_ptr<char[]> carried_;
+    size_t carriedLength_ = 0; // bytes of the current frame carried so far, header included
+    size_t headerLength_ = 0;  // 0 until the length prefix is complete
+    size_t frameLength_ = 0;
+    uint64_t skipping_ = 0;    // bytes of an oversized frame still to skip
+    bool malformed_ = false;
+    size_t droppedFrames_ = 0;
+};
+
+#endif
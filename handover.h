@@ -0,0 +1,261 @@
+#ifndef HANDOVER_H
+#define HANDOVER_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "frame.h"
+
+// Hot upgrade: a server started with --upgrade-socket PATH listens on that
+// Unix socket, and a new server process started with --take-over PATH
+// connects to it, gets the old process's state as a snapshot and its
+// sockets as descriptors, and carries on serving the same connections.
+// Over the Unix socket:
+//
+//   old -> new   <8 byte snapshot length> <snapshot>
+//   old -> new   the descriptors (SCM_RIGHTS), HANDOVER_FDS_PER_MESSAGE at
+//                most per message, each message with one byte of data
+//   new -> old   HANDOVER_READY, once it has rebuilt the state
+//   old -> new   HANDOVER_GO; the old process then exits without touching
+//                a socket
+//
+// Either side gives up by closing the connection. Until it has sent
+// HANDOVER_GO the old process can take everything back, and the new one
+// serves nothing before it has received it, so the sockets never have two
+// owners at once.
+constexpr std::string_view HANDOVER_MAGIC = "IRC-redes handover"; // a snapshot starts with it and HANDOVER_VERSION
+constexpr uint64_t HANDOVER_VERSION = 1;
+constexpr size_t HANDOVER_FDS_PER_MESSAGE = 250; // the kernel takes 253 at most
+constexpr char HANDOVER_READY = 'R';
+constexpr char HANDOVER_GO = 'G';
+constexpr int HANDOVER_TIMEOUT_MILLIS = 30000; // for the other side's next step
+
+// Flags of a client, and of a channel member, in a hot upgrade snapshot.
+constexpr uint64_t HANDOVER_CONNECTED = 1;
+constexpr uint64_t HANDOVER_ADMIN = 2;
+constexpr uint64_t HANDOVER_BINARY = 4;
+constexpr uint64_t HANDOVER_MUTED = 8;
+constexpr uint64_t HANDOVER_KICKED = 16;
+
+// The snapshot is a flat sequence of varints and length-prefixed byte
+// strings, in an order both sides know.
+class SnapshotWriter {
+public:
+    void number(uint64_t value) {
+        appendVarint(data_, value);
+    }
+
+    void bytes(std::string_view value) {
+        number(value.size());
+        data_.append(value.data(), value.size());
+    }
+
+    const std::string& data() const {
+        return data_;
+    }
+
+private:
+    std::string data_;
+};
+
+// Reads what SnapshotWriter wrote. A truncated or malformed snapshot makes
+// every later read return 0 or an empty string and failed() true, so a
+// reader only has to check once at the end (and bound its loops by it).
+class SnapshotReader {
+public:
+    explicit SnapshotReader(std::string_view data) : rest_(data) {}
+
+    uint64_t number() {
+        uint64_t value = 0;
+        if (failed_ || decodeVarint(rest_, value) != VarintStatus::Complete) {
+            failed_ = true;
+            return 0;
+        }
+        return value;
+    }
+
+    std::string_view bytes() {
+        uint64_t length = number();
+        if (failed_ || length > rest_.size()) {
+            failed_ = true;
+            return std::string_view();
+        }
+        std::string_view value = rest_.substr(0, length);
+        rest_.remove_prefix(length);
+        return value;
+    }
+
+    bool failed() const {
+        return failed_;
+    }
+
+    bool done() const {
+        return rest_.empty();
+    }
+
+private:
+    std::string_view rest_;
+    bool failed_ = false;
+};
+
+inline bool makeUnixAddress(const std::string& path, sockaddr_un& address) {
+    address = sockaddr_un{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        return false;
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+// Waits up to HANDOVER_TIMEOUT_MILLIS for the socket to become readable.
+inline bool waitReadable(int socket) {
+    pollfd readable = { socket, POLLIN, 0 };
+    int ready;
+    do {
+        ready = poll(&readable, 1, HANDOVER_TIMEOUT_MILLIS);
+    } while (ready == -1 && errno == EINTR);
+    return ready == 1;
+}
+
+inline bool writeFully(int socket, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = send(socket, data, length, MSG_NOSIGNAL);
+        if (sent == -1 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        length -= static_cast<size_t>(sent);
+    }
+    return true;
+}
+
+inline bool readFully(int socket, char* data, size_t length) {
+    while (length > 0) {
+        if (!waitReadable(socket)) {
+            return false;
+        }
+        ssize_t received = recv(socket, data, length, 0);
+        if (received == -1 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return false;
+        }
+        data += received;
+        length -= static_cast<size_t>(received);
+    }
+    return true;
+}
+
+inline bool sendSnapshot(int socket, const std::string& snapshot) {
+    uint64_t length = snapshot.size();
+    return writeFully(socket, reinterpret_cast<const char*>(&length), sizeof(length)) &&
+           writeFully(socket, snapshot.data(), snapshot.size());
+}
+
+inline bool receiveSnapshot(int socket, std::string& snapshot) {
+    uint64_t length;
+    if (!readFully(socket, reinterpret_cast<char*>(&length), sizeof(length))) {
+        return false;
+    }
+    snapshot.resize(length);
+    return readFully(socket, snapshot.data(), length);
+}
+
+inline bool sendDescriptors(int socket, const std::vector<int>& fds) {
+    union {
+        char bytes[CMSG_SPACE(sizeof(int) * HANDOVER_FDS_PER_MESSAGE)];
+        cmsghdr align;
+    } control;
+    for (size_t first = 0; first < fds.size(); first += HANDOVER_FDS_PER_MESSAGE) {
+        size_t count = std::min(fds.size() - first, HANDOVER_FDS_PER_MESSAGE);
+        char byte = static_cast<char>(count);
+        iovec data = { &byte, 1 };
+        msghdr message{};
+        message.msg_iov = &data;
+        message.msg_iovlen = 1;
+        message.msg_control = control.bytes;
+        message.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+        cmsghdr* header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int) * count);
+        std::memcpy(CMSG_DATA(header), fds.data() + first, sizeof(int) * count);
+        ssize_t sent;
+        do {
+            sent = sendmsg(socket, &message, MSG_NOSIGNAL);
+        } while (sent == -1 && errno == EINTR);
+        if (sent != 1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Appends count descriptors to fds. The ones already received are kept
+// even on failure, for the caller to close.
+inline bool receiveDescriptors(int socket, size_t count, std::vector<int>& fds) {
+    union {
+        char bytes[CMSG_SPACE(sizeof(int) * HANDOVER_FDS_PER_MESSAGE)];
+        cmsghdr align;
+    } control;
+    while (count > 0) {
+        if (!waitReadable(socket)) {
+            return false;
+        }
+        char byte;
+        iovec data = { &byte, 1 };
+        msghdr message{};
+        message.msg_iov = &data;
+        message.msg_iovlen = 1;
+        message.msg_control = control.bytes;
+        message.msg_controllen = sizeof(control.bytes);
+        ssize_t received;
+        do {
+            received = recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+        } while (received == -1 && errno == EINTR);
+        if (received != 1) {
+            return false;
+        }
+        size_t batch = 0;
+        for (cmsghdr* header = CMSG_FIRSTHDR(&message); header != nullptr; header = CMSG_NXTHDR(&message, header)) {
+            if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+            size_t n = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (size_t i = 0; i < n; i++) {
+                int fd;
+                std::memcpy(&fd, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+                fds.push_back(fd);
+            }
+            batch += n;
+        }
+        if ((message.msg_flags & MSG_CTRUNC) || batch != static_cast<unsigned char>(byte) || batch > count) {
+            return false;
+        }
+        count -= batch;
+    }
+    return true;
+}
+
+// Reads the other side's next step, one byte.
+inline bool expectByte(int socket, char expected) {
+    char byte = 0;
+    return readFully(socket, &byte, 1) && byte == expected;
+}
+
+#endif
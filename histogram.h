@@ -0,0 +1,98 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+// Log-linear histogram in the style of HDR histograms: values below 64 get
+// a bucket each, above that every power of two is split into 32 buckets, so
+// any recorded value is known to within about 3% over the full 64-bit range.
+//
+// Buckets are relaxed atomics. A histogram has one writer on the hot path
+// (the shard that owns it) and any number of readers, which may see a
+// sample in the sum before it shows up in the buckets but never block it.
+class Histogram {
+public:
+    Histogram() : counts_(new std::atomic<uint64_t>[BUCKET_COUNT]) {
+        for (size_t i = 0; i < BUCKET_COUNT; i++) {
+            counts_[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void record(uint64_t value) {
+        counts_[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    // Adds another histogram's samples to this one.
+    void merge(const Histogram& other) {
+        for (size_t i = 0; i < BUCKET_COUNT; i++) {
+            uint64_t count = other.counts_[i].load(std::memory_order_relaxed);
+            if (count != 0) {
+                counts_[i].fetch_add(count, std::memory_order_relaxed);
+            }
+        }
+        sum_.fetch_add(other.sum_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+
+    uint64_t count() const {
+        uint64_t total = 0;
+        for (size_t i = 0; i < BUCKET_COUNT; i++) {
+            total += counts_[i].load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    uint64_t sum() const {
+        return sum_.load(std::memory_order_relaxed);
+    }
+
+    // Smallest bucket value with at least quantile of the samples at or
+    // below it; 0 when nothing was recorded.
+    uint64_t percentile(double quantile) const {
+        uint64_t total = count();
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(quantile * total + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKET_COUNT; i++) {
+            seen += counts_[i].load(std::memory_order_relaxed);
+            if (seen >= rank) {
+                return bucketValue(i);
+            }
+        }
+        return bucketValue(BUCKET_COUNT - 1);
+    }
+
+private:
+    static constexpr int SUB_BUCKET_BITS = 5;
+    static constexpr uint64_t LINEAR_LIMIT = 2ull << SUB_BUCKET_BITS;
+    static constexpr size_t BUCKET_COUNT = LINEAR_LIMIT + (64 - SUB_BUCKET_BITS - 1) * (1 << SUB_BUCKET_BITS);
+
+    static size_t bucketOf(uint64_t value) {
+        if (value < LINEAR_LIMIT) {
+            return static_cast<size_t>(value);
+        }
+        int shift = 63 - __builtin_clzll(value) - SUB_BUCKET_BITS;
+        return LINEAR_LIMIT + (shift - 1) * (1 << SUB_BUCKET_BITS) + ((value >> shift) - (1 << SUB_BUCKET_BITS));
+    }
+
+    // Lowest value that falls into the bucket.
+    static uint64_t bucketValue(size_t bucket) {
+        if (bucket < LINEAR_LIMIT) {
+            return bucket;
+        }
+        size_t offset = bucket - LINEAR_LIMIT;
+        int shift = static_cast<int>(offset >> SUB_BUCKET_BITS) + 1;
+        uint64_t subBucket = (offset & ((1 << SUB_BUCKET_BITS) - 1)) + (1 << SUB_BUCKET_BITS);
+        return subBucket << shift;
+    }
+
+    std::unique_ptr<std::atomic<uint64_t>[]> counts_;
+    std::atomic<uint64_t> sum_{0};
+};
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef LINE_PARSER_H
+#define LINE_PARSER_H
+
+#include <cstring>
+#include <memory>
+#include <string_view>
+
+// Splits a TCP byte stream into LF or CRLF terminated lines. A single read
+// may hold any number of lines plus the start of the next one, and a line
+// may arrive split across several reads.
+//
+// Complete lines are handed out straight from the caller's read buffer. Only
+// a line that straddles two reads is carried in the parser's own buffer,
+// which is allocated the first time that happens, so idle connections cost
+// nothing. Lines longer than the limit are dropped whole and counted.
+class LineParser {
+public:
+    explicit LineParser(size_t maxLineLength = 4096) : maxLineLength_(maxLineLength) {}
+
+    // Calls onLine(std::string_view) for every complete line in data, in
+    // order, without the line terminator. onLine returns false to stop
+    // parsing (e.g. because the connection is closing); feed() then returns
+    // false and the rest of data is ignored.
+    template <typename Callback>
+    bool feed(const char* data, size_t length, Callback&& onLine) {
+        std::string_view rest(data, length);
+        std::string_view line;
+        while (next(rest, line)) {
+            if (!onLine(line)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Pull form of feed(): takes the next complete line off the front of
+    // data. Returns false once data is used up, with any unfinished line
+    // carried over to the next call.
+    bool next(std::string_view& data, std::string_view& line) {
+        while (!data.empty()) {
+            const char* newline = static_cast<const char*>(std::memchr(data.data(), '\n', data.size()));
+            if (newline == nullptr) {
+                carry(data.data(), data.size());
+                data = std::string_view();
+                return false;
+            }
+
+            size_t length = newline - data.data();
+            bool complete;
+            if (carriedLength_ == 0 && !discarding_) {
+                line = data.substr(0, length);
+                complete = true;
+            } else {
+                carry(data.data(), length);
+                line = std::string_view(carried_.get(), carriedLength_);
+                complete = !discarding_;
+            }
+            carriedLength_ = 0;
+            discarding_ = false;
+            data.remove_prefix(length + 1);
+
+            if (complete) {
+                // The limit is on the line itself; a CR is part of the terminator.
+                if (!line.empty() && line.back() == '\r') {
+                    line.remove_suffix(1);
+                }
+                if (line.size() <= maxLineLength_) {
+                    return true;
+                }
+                droppedLines_++;
+            }
+        }
+        return false;
+    }
+
+    // Bytes of an unfinished line waiting for the rest of it.
+    size_t pending() const {
+        return carriedLength_;
+    }
+
+    size_t droppedLines() const {
+        return droppedLines_;
+    }
+
+    // The unfinished line, and whether it is one being dropped for its
+    // length: all another parser needs to pick the stream up where this one
+    // is (see restore()).
+    std::string_view carried() const {
+        return std::string_view(carried_.get(), carriedLength_);
+    }
+
+    bool discarding() const {
+        return discarding_;
+    }
+
+    void restore(std::string_view carried, bool discarding) {
+        reset();
+        if (!carried.empty()) {
+            carry(carried.data(), carried.size());
+        }
+        discarding_ = discarding;
+    }
+
+    // Forgets any partial line so the parser can serve a new connection; the
+    // carry buffer is kept.
+    void reset() {
+        carriedLength_ = 0;
+        discarding_ = false;
+        droppedLines_ = 0;
+    }
+
+private:
+    void carry(const char* data, size_t length) {
+        if (discarding_) {
+            return;
+        }
+        // Room for the line and the CR of a CRLF; anything longer is over the
+        // limit whatever comes next.
+        if (carriedLength_ + length > maxLineLength_ + 1) {
+            discarding_ = true;
+            carriedLength_ = 0;
+            droppedLines_++;
+            return;
+        }
+        if (!carried_) {
+            carried_.reset(new char[maxLineLength_ + 1]);
+        }
+        std::memcpy(carried_.get() + carriedLength_, data, length);
+        carriedLength_ += length;
+    }
+
+    size_t maxLineLength_;
+    std::unique_ptr<char[]> carried_;
+    size_t carriedLength_ = 0;
+    bool discarding_ = false; // inside a line that is already too long
+    size_t droppedLines_ = 0;
+};
+
+#endif
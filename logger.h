@@ -0,0 +1,299 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "spsc_queue.h"
+
+// Severities below LOG_LEVEL compile to nothing, arguments included:
+// 0 debug, 1 info, 2 warning, 3 error, 4 silent.
+#ifndef LOG_LEVEL
+#define LOG_LEVEL 1
+#endif
+
+enum class LogLevel : uint8_t {
+    Debug,
+    Info,
+    Warning,
+    Error
+};
+
+constexpr size_t LOG_RECORD_SIZE = 256;
+constexpr size_t LOG_RING_CAPACITY = 256; // records per thread
+constexpr int LOG_FLUSH_INTERVAL_MS = 10;
+
+// One log line, formatted by the caller but not yet timestamped as text.
+// Text past the record's capacity is cut off.
+struct LogRecord {
+    int64_t timestamp; // nanoseconds since the epoch
+    LogLevel level;
+    uint16_t length;
+    char text[LOG_RECORD_SIZE - sizeof(int64_t) - sizeof(uint32_t)];
+
+    void append(std::string_view part) {
+        size_t count = std::min(part.size(), sizeof(text) - length);
+        std::memcpy(text + length, part.data(), count);
+        length += static_cast<uint16_t>(count);
+    }
+};
+
+// Asynchronous logger. A thread that logs gets its own lock-free record
+// ring the first time it does; a background writer drains every ring,
+// orders the records by time and writes them in one batch per pass. The
+// logging thread never blocks and never touches the terminal: when its
+// ring is full the record is dropped and counted instead.
+class Logger {
+public:
+    static Logger& instance() {
+        // Never destroyed, so threads still running at exit can log safely.
+        static Logger* logger = new Logger();
+        return *logger;
+    }
+
+    // Starts the writer. Records go to path, or to stdout (stderr from
+    // Warning up) when path is empty. Returns false if the file can't be
+    // opened.
+    bool start(const std::string& path) {
+        if (!path.empty()) {
+            fileFd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (fileFd_ == -1) {
+                return false;
+            }
+        }
+        stopping_ = false;
+        writer_ = std::thread(&Logger::run, this);
+        return true;
+    }
+
+    // Writes out everything logged so far and stops the writer.
+    void stop() {
+        if (!writer_.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(wakeMutex_);
+            stopping_ = true;
+        }
+        wake_.notify_one();
+        writer_.join();
+        if (fileFd_ != -1) {
+            ::close(fileFd_);
+            fileFd_ = -1;
+        }
+    }
+
+    template <typename... Parts>
+    void log(LogLevel level, const Parts&... parts) {
+        LogRecord record;
+        record.timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        record.level = level;
+        record.length = 0;
+        (appendPart(record, parts), ...);
+
+        LogRing& ring = threadRing();
+        if (!ring.records.push(record)) {
+            ring.dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    struct LogRing {
+        SpscQueue<LogRecord, LOG_RING_CAPACITY> records;
+        std::atomic<uint64_t> dropped{0};
+        std::atomic<bool> retired{false}; // its thread exited
+    };
+
+    // Hands the thread's ring back to the writer, which frees it once empty.
+    struct ThreadRing {
+        std::shared_ptr<LogRing> ring;
+
+        ~ThreadRing() {
+            if (ring) {
+                ring->retired.store(true, std::memory_order_release);
+            }
+        }
+    };
+
+    Logger() = default;
+
+    LogRing& threadRing() {
+        thread_local ThreadRing local;
+        if (!local.ring) {
+            local.ring = std::make_shared<LogRing>();
+            std::lock_guard<std::mutex> lock(ringsMutex_);
+            rings_.push_back(local.ring);
+        }
+        return *local.ring;
+    }
+
+    static void appendPart(LogRecord& record, std::string_view part) {
+        record.append(part);
+    }
+
+    static void appendPart(LogRecord& record, char part) {
+        record.append(std::string_view(&part, 1));
+    }
+
+    template <typename T, typename = std::enable_if_t<std::is_integral_v<T>>>
+    static void appendPart(LogRecord& record, T part) {
+        char digits[24];
+        auto result = std::to_chars(digits, digits + sizeof(digits), part);
+        record.append(std::string_view(digits, result.ptr - digits));
+    }
+
+    void run() {
+        std::vector<LogRecord> batch;
+        std::string output;
+        std::string errors;
+        std::vector<std::shared_ptr<LogRing>> rings;
+        while (true) {
+            bool stopping;
+            {
+                std::lock_guard<std::mutex> lock(wakeMutex_);
+                stopping = stopping_;
+            }
+            {
+                std::lock_guard<std::mutex> lock(ringsMutex_);
+                rings = rings_;
+            }
+
+            uint64_t dropped = 0;
+            for (auto& ring : rings) {
+                // Checked first: a ring retired before the drain has no more
+                // records coming.
+                bool retired = ring->retired.load(std::memory_order_acquire);
+                LogRecord record;
+                while (ring->records.pop(record)) {
+                    batch.push_back(record);
+                }
+                dropped += ring->dropped.exchange(0, std::memory_order_relaxed);
+                if (retired) {
+                    std::lock_guard<std::mutex> lock(ringsMutex_);
+                    rings_.erase(std::find(rings_.begin(), rings_.end(), ring));
+                }
+            }
+            rings.clear();
+
+            if (batch.empty() && dropped == 0) {
+                if (stopping) {
+                    return;
+                }
+                std::unique_lock<std::mutex> lock(wakeMutex_);
+                wake_.wait_for(lock, std::chrono::milliseconds(LOG_FLUSH_INTERVAL_MS), [&]() { return stopping_; });
+                continue;
+            }
+
+            std::stable_sort(batch.begin(), batch.end(), [](const LogRecord& a, const LogRecord& b) {
+                return a.timestamp < b.timestamp;
+            });
+            for (const LogRecord& record : batch) {
+                std::string& target = fileFd_ == -1 && record.level >= LogLevel::Warning ? errors : output;
+                format(target, record.timestamp, record.level, std::string_view(record.text, record.length));
+            }
+            if (dropped > 0) {
+                LogRecord note;
+                note.length = 0;
+                appendPart(note, dropped);
+                note.append(" log records dropped: logging threads outran the writer");
+                int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::system_clock::now().time_since_epoch()).count();
+                format(fileFd_ == -1 ? errors : output, now, LogLevel::Warning, std::string_view(note.text, note.length));
+            }
+            batch.clear();
+
+            writeAll(fileFd_ == -1 ? STDOUT_FILENO : fileFd_, output);
+            writeAll(STDERR_FILENO, errors);
+        }
+    }
+
+    // "2024-05-01 12:34:56.789 INFO  text"
+    void format(std::string& out, int64_t timestamp, LogLevel level, std::string_view text) {
+        static const char* const LEVEL_NAMES[] = { "DEBUG ", "INFO  ", "WARN  ", "ERROR " };
+        time_t seconds = static_cast<time_t>(timestamp / 1000000000);
+        if (seconds != cachedSecond_) {
+            tm local{};
+            localtime_r(&seconds, &local);
+            strftime(cachedTime_, sizeof(cachedTime_), "%Y-%m-%d %H:%M:%S", &local);
+            cachedSecond_ = seconds;
+        }
+        char millis[8];
+        std::snprintf(millis, sizeof(millis), ".%03d ", static_cast<int>(timestamp / 1000000 % 1000));
+
+        out.append(cachedTime_);
+        out.append(millis);
+        out.append(LEVEL_NAMES[static_cast<int>(level)]);
+        out.append(text);
+        out.push_back('\n');
+    }
+
+    static void writeAll(int fd, std::string& data) {
+        size_t offset = 0;
+        while (offset < data.size()) {
+            ssize_t written = ::write(fd, data.data() + offset, data.size() - offset);
+            if (written == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            offset += written;
+        }
+        data.clear();
+    }
+
+    std::mutex ringsMutex_; // guards rings_; taken once per logging thread and once per writer pass
+    std::vector<std::shared_ptr<LogRing>> rings_;
+    std::mutex wakeMutex_;
+    std::condition_variable wake_;
+    bool stopping_ = false;
+    int fileFd_ = -1;
+    std::thread writer_;
+    time_t cachedSecond_ = -1;
+    char cachedTime_[32] = {};
+};
+
+#if LOG_LEVEL <= 0
+#define LOG_DEBUG(...) Logger::instance().log(LogLevel::Debug, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) ((void)0)
+#endif
+
+#if LOG_LEVEL <= 1
+#define LOG_INFO(...) Logger::instance().log(LogLevel::Info, __VA_ARGS__)
+#else
+#define LOG_INFO(...) ((void)0)
+#endif
+
+#if LOG_LEVEL <= 2
+#define LOG_WARNING(...) Logger::instance().log(LogLevel::Warning, __VA_ARGS__)
+#else
+#define LOG_WARNING(...) ((void)0)
+#endif
+
+#if LOG_LEVEL <= 3
+#define LOG_ERROR(...) Logger::instance().log(LogLevel::Error, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,231 @@
+#ifndef MESSAGE_BUFFER_H
+#define MESSAGE_BUFFER_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <mutex>
+#include <new>
+#include <string_view>
+#include <utility>
+
+// Size-classed free lists for message storage: blocks of 64 B up to 8 KiB,
+// anything bigger goes straight to the heap. Each thread keeps a small cache
+// per class and trades whole batches with a shared depot, so a buffer built
+// on one shard and released on another is recycled without taking a lock on
+// every allocation.
+class BufferPool {
+public:
+    static constexpr size_t MIN_BLOCK_SIZE = 64;
+    static constexpr int CLASS_COUNT = 8;
+    static constexpr int UNPOOLED = CLASS_COUNT;
+    static constexpr size_t MAX_BLOCK_SIZE = MIN_BLOCK_SIZE << (CLASS_COUNT - 1);
+
+    static int sizeClass(size_t size) {
+        if (size > MAX_BLOCK_SIZE) {
+            return UNPOOLED;
+        }
+        int sizeClass = 0;
+        while ((MIN_BLOCK_SIZE << sizeClass) < size) {
+            sizeClass++;
+        }
+        return sizeClass;
+    }
+
+    static void* allocate(size_t size) {
+        int blockClass = sizeClass(size);
+        if (blockClass == UNPOOLED) {
+            return ::operator new(size);
+        }
+
+        FreeList& list = threadCache().lists[blockClass];
+        if (list.head == nullptr) {
+            depot().take(blockClass, list);
+        }
+        if (list.head == nullptr) {
+            return ::operator new(MIN_BLOCK_SIZE << blockClass);
+        }
+        FreeBlock* block = list.head;
+        list.head = block->next;
+        list.count--;
+        return block;
+    }
+
+    static void release(void* pointer, size_t size) {
+        int blockClass = sizeClass(size);
+        if (blockClass == UNPOOLED) {
+            ::operator delete(pointer);
+            return;
+        }
+
+        FreeList& list = threadCache().lists[blockClass];
+        FreeBlock* block = static_cast<FreeBlock*>(pointer);
+        block->next = list.head;
+        list.head = block;
+        list.count++;
+        if (list.count > THREAD_CACHE_LIMIT) {
+            depot().give(blockClass, list, TRANSFER_BATCH);
+        }
+    }
+
+private:
+    static constexpr size_t THREAD_CACHE_LIMIT = 256;
+    static constexpr size_t TRANSFER_BATCH = 128;
+
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    struct FreeList {
+        FreeBlock* head = nullptr;
+        size_t count = 0;
+    };
+
+    class Depot {
+    public:
+        // Moves up to TRANSFER_BATCH blocks of a class into an empty list.
+        void take(int blockClass, FreeList& list) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            FreeList& shared = lists_[blockClass];
+            while (shared.head != nullptr && list.count < TRANSFER_BATCH) {
+                FreeBlock* block = shared.head;
+                shared.head = block->next;
+                shared.count--;
+                block->next = list.head;
+                list.head = block;
+                list.count++;
+            }
+        }
+
+        void give(int blockClass, FreeList& list, size_t count) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            FreeList& shared = lists_[blockClass];
+            while (list.head != nullptr && count-- > 0) {
+                FreeBlock* block = list.head;
+                list.head = block->next;
+                list.count--;
+                block->next = shared.head;
+                shared.head = block;
+                shared.count++;
+            }
+        }
+
+    private:
+        std::mutex mutex_;
+        FreeList lists_[CLASS_COUNT];
+    };
+
+    struct ThreadCache {
+        FreeList lists[CLASS_COUNT];
+
+        // Short-lived threads (threads mode) hand their blocks back on exit.
+        ~ThreadCache() {
+            for (int blockClass = 0; blockClass < CLASS_COUNT; blockClass++) {
+                depot().give(blockClass, lists[blockClass], lists[blockClass].count);
+            }
+        }
+    };
+
+    static ThreadCache& threadCache() {
+        thread_local ThreadCache cache;
+        return cache;
+    }
+
+    // Never destroyed, so thread caches can still return blocks at exit.
+    static Depot& depot() {
+        static Depot* instance = new Depot();
+        return *instance;
+    }
+};
+
+// An encoded outgoing message: an immutable, reference-counted byte block
+// from BufferPool. It is built once and shared by the output queue of every
+// recipient, whichever shard they live on.
+class MessageBuffer {
+public:
+    MessageBuffer() = default;
+
+    MessageBuffer(const MessageBuffer& other) : block_(other.block_) {
+        if (block_ != nullptr) {
+            block_->references.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    MessageBuffer(MessageBuffer&& other) noexcept : block_(other.block_) {
+        other.block_ = nullptr;
+    }
+
+    MessageBuffer& operator=(MessageBuffer other) noexcept {
+        std::swap(block_, other.block_);
+        return *this;
+    }
+
+    ~MessageBuffer() {
+        if (block_ != nullptr && block_->references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            size_t capacity = block_->capacity;
+            block_->~Block();
+            BufferPool::release(block_, capacity);
+        }
+    }
+
+    // Concatenates parts into one new buffer, e.g. { nickname, ": ", text }.
+    static MessageBuffer compose(std::initializer_list<std::string_view> parts, char terminator) {
+        size_t length = terminator != '\0' ? 1 : 0;
+        for (std::string_view part : parts) {
+            length += part.size();
+        }
+
+        size_t capacity = sizeof(Block) + length;
+        MessageBuffer buffer;
+        buffer.block_ = new (BufferPool::allocate(capacity)) Block();
+        buffer.block_->capacity = capacity;
+        buffer.block_->length = length;
+
+        char* out = buffer.block_->bytes();
+        for (std::string_view part : parts) {
+            std::memcpy(out, part.data(), part.size());
+            out += part.size();
+        }
+        if (terminator != '\0') {
+            *out = terminator;
+        }
+        return buffer;
+    }
+
+    const char* data() const {
+        return block_ != nullptr ? block_->bytes() : nullptr;
+    }
+
+    size_t size() const {
+        return block_ != nullptr ? block_->length : 0;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    std::string_view view() const {
+        return std::string_view(data(), size());
+    }
+
+private:
+    struct Block {
+        std::atomic<uint32_t> references{1};
+        uint32_t length = 0;
+        size_t capacity = 0;
+
+        char* bytes() {
+            return reinterpret_cast<char*>(this + 1);
+        }
+    };
+
+    Block* block_ = nullptr;
+};
+
+// Encodes one outgoing line; every message the server sends is LF framed.
+inline MessageBuffer makeMessageBuffer(std::initializer_list<std::string_view> parts) {
+    return MessageBuffer::compose(parts, '\n');
+}
+
+#endif
@@ -0,0 +1,180 @@
+#ifndef MESSAGE_FILTER_H
+#define MESSAGE_FILTER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "text_scan.h"
+
+// A set of banned patterns, found anywhere in a line with one pass over its
+// bytes (Aho-Corasick), however many patterns there are. Matching ignores
+// ASCII case.
+//
+// The automaton is compiled to a flat DFA. Bytes that appear in no pattern
+// all share one input class, so a row of the table has one entry per
+// distinct pattern byte plus one, not 256: a blocklist of a few hundred
+// words fits in a few tens of kilobytes. Each entry is the target state's
+// row offset, with the top bit set when reaching it completes a pattern,
+// so a step is two loads and no multiplication.
+class Blocklist {
+public:
+    Blocklist() = default;
+
+    // Empty patterns are ignored.
+    explicit Blocklist(const std::vector<std::string>& patterns) {
+        // Case folding leaves at most 230 distinct bytes, so classes fit a byte.
+        uint32_t classCount = 1;
+        for (const std::string& pattern : patterns) {
+            for (char c : pattern) {
+                uint8_t& byteClass = classes_[fold(c)];
+                if (byteClass == 0) {
+                    byteClass = static_cast<uint8_t>(classCount++);
+                }
+            }
+        }
+        for (int c = 'A'; c <= 'Z'; c++) {
+            classes_[c] = classes_[c - 'A' + 'a'];
+        }
+        if (classCount > 1) {
+            build(patterns, classCount);
+        }
+    }
+
+    bool empty() const {
+        return table_.empty();
+    }
+
+    size_t stateCount() const {
+        return stride_ == 0 ? 0 : table_.size() / stride_;
+    }
+
+    bool matches(std::string_view text) const {
+        if (table_.empty()) {
+            return false;
+        }
+        const uint32_t* table = table_.data();
+        uint32_t state = 0;
+        for (char c : text) {
+            state = table[state + classes_[static_cast<unsigned char>(c)]];
+            if (state & MATCH) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    static constexpr uint32_t MATCH = 1u << 31;
+
+    static unsigned char fold(char c) {
+        unsigned char byte = static_cast<unsigned char>(c);
+        return byte >= 'A' && byte <= 'Z' ? static_cast<unsigned char>(byte - 'A' + 'a') : byte;
+    }
+
+    // Builds the trie, then fills in every missing transition breadth first
+    // from the state's failure link (the longest proper suffix that is also
+    // a trie state), which turns it into the DFA. A state whose suffix
+    // completes a pattern completes one too.
+    void build(const std::vector<std::string>& patterns, uint32_t classCount) {
+        stride_ = classCount;
+        std::vector<uint32_t> next(stride_, 0); // trie edges, by state and class; 0: none yet
+        std::vector<bool> accepting(1, false);
+        for (const std::string& pattern : patterns) {
+            if (pattern.empty()) {
+                continue;
+            }
+            uint32_t state = 0;
+            for (char c : pattern) {
+                size_t edge = state * stride_ + classes_[fold(c)];
+                if (next[edge] == 0) {
+                    next[edge] = static_cast<uint32_t>(accepting.size());
+                    accepting.push_back(false);
+                    next.resize(next.size() + stride_, 0);
+                }
+                state = next[edge];
+            }
+            accepting[state] = true;
+        }
+
+        std::vector<uint32_t> failure(accepting.size(), 0);
+        std::deque<uint32_t> queue;
+        for (uint32_t byteClass = 0; byteClass < stride_; byteClass++) {
+            if (next[byteClass] != 0) {
+                queue.push_back(next[byteClass]);
+            }
+        }
+        while (!queue.empty()) {
+            uint32_t state = queue.front();
+            queue.pop_front();
+            if (accepting[failure[state]]) {
+                accepting[state] = true;
+            }
+            for (uint32_t byteClass = 0; byteClass < stride_; byteClass++) {
+                uint32_t& edge = next[state * stride_ + byteClass];
+                uint32_t fallback = next[failure[state] * stride_ + byteClass];
+                if (edge == 0) {
+                    edge = fallback;
+                } else {
+                    failure[edge] = fallback;
+                    queue.push_back(edge);
+                }
+            }
+        }
+
+        table_.resize(next.size());
+        for (size_t i = 0; i < next.size(); i++) {
+            table_[i] = next[i] * stride_ | (accepting[next[i]] ? MATCH : 0);
+        }
+    }
+
+    uint8_t classes_[256] = {}; // byte -> input class; 0: in no pattern
+    uint32_t stride_ = 0;       // entries per row, one per class
+    std::vector<uint32_t> table_;
+};
+
+// The checks a chat line goes through before it is fanned out, in order:
+// valid UTF-8, control characters removed, a length limit and the
+// blocklist. Every check is off by default. Fixed once the server has
+// started, so shards share one filter without locking it.
+struct MessageFilter {
+    enum class Verdict {
+        Pass,
+        InvalidUtf8,
+        TooLong,
+        Blocked
+    };
+
+    bool requireUtf8 = false;
+    bool removeControls = false;
+    size_t maxLength = 0; // bytes; 0: no limit
+    Blocklist blocklist;
+
+    bool enabled() const {
+        return requireUtf8 || removeControls || maxLength != 0 || !blocklist.empty();
+    }
+
+    // On Pass, text is the line to send: the same bytes, or scratch holding
+    // them without their control characters.
+    Verdict apply(std::string_view& text, std::string& scratch) const {
+        if (requireUtf8 && !validUtf8(text)) {
+            return Verdict::InvalidUtf8;
+        }
+        if (removeControls && findControl(text) != text.size()) {
+            stripControls(text, scratch);
+            text = scratch;
+        }
+        if (maxLength != 0 && text.size() > maxLength) {
+            return Verdict::TooLong;
+        }
+        if (blocklist.matches(text)) {
+            return Verdict::Blocked;
+        }
+        return Verdict::Pass;
+    }
+};
+
+#endif
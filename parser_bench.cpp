@@ -0,0 +1,92 @@
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <chrono>
+#include <random>
+
+#include "line_parser.h"
+#include "protocol.h"
+
+// Throughput of the server's input path: LineParser splitting reads into
+// lines and parseCommand classifying each one, as a shard does for every
+// read. The stream is mostly chat lines with some commands, LF and CRLF
+// terminated, cut into reads of --read-size bytes; small reads make more
+// lines straddle two reads and go through the carry buffer.
+
+struct ParserBenchConfig {
+    size_t lines = 100000;
+    size_t lineLength = 80;  // average
+    size_t readSize = 16384; // the server's READ_BUFFER_SIZE
+    double seconds = 1;
+};
+
+static std::string makeStream(const ParserBenchConfig& config) {
+    static const char* const commands[] = { "/join #room", "/nickname someone", "/whois someone", "/pong 1", "/mute someone" };
+    std::mt19937_64 random(1);
+    std::string stream;
+    for (size_t i = 0; i < config.lines; i++) {
+        if (random() % 10 == 0) {
+            stream += commands[random() % 5];
+        } else {
+            size_t length = 1 + random() % (2 * config.lineLength);
+            for (size_t k = 0; k < length; k++) {
+                stream += static_cast<char>('a' + random() % 26);
+            }
+        }
+        stream += random() % 2 == 0 ? "\n" : "\r\n";
+    }
+    return stream;
+}
+
+int main(int argc, char* argv[]) {
+    ParserBenchConfig config;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--lines" && i + 1 < argc) {
+            config.lines = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--line-length" && i + 1 < argc) {
+            config.lineLength = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--read-size" && i + 1 < argc) {
+            config.readSize = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--seconds" && i + 1 < argc) {
+            config.seconds = std::atof(argv[++i]);
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--lines N] [--line-length N] [--read-size N] [--seconds S]" << std::endl;
+            return 1;
+        }
+    }
+    if (config.readSize == 0) {
+        config.readSize = 1;
+    }
+
+    using Clock = std::chrono::steady_clock;
+    const std::string stream = makeStream(config);
+    LineParser parser(MAX_MESSAGE_LENGTH);
+    uint64_t lines = 0;
+    uint64_t commands = 0;
+    uint64_t bytes = 0;
+    Clock::time_point start = Clock::now();
+    Clock::time_point end;
+    do {
+        for (size_t offset = 0; offset < stream.size(); offset += config.readSize) {
+            size_t length = std::min(config.readSize, stream.size() - offset);
+            parser.feed(stream.data() + offset, length, [&](std::string_view line) {
+                std::string_view argument;
+                commands += parseCommand(line, argument) != Command::Chat;
+                lines++;
+                return true;
+            });
+        }
+        bytes += stream.size();
+        end = Clock::now();
+    } while (end - start < std::chrono::duration<double>(config.seconds));
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+    std::cout << "Reads of " << config.readSize << " bytes, lines of " << config.lineLength << " bytes on average" << std::endl;
+    std::cout << std::fixed << std::setprecision(2) << lines / seconds / 1e6 << " M lines/s, " << bytes / seconds / 1e9
+              << " GB/s (" << lines << " lines, " << commands << " commands)" << std::endl;
+    return 0;
+}
@@ -0,0 +1,89 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <string_view>
+
+// The text protocol: lines of at most MAX_MESSAGE_LENGTH bytes (longer
+// ones are dropped whole, see LineParser), each a chat line or a command.
+constexpr int MAX_MESSAGE_LENGTH = 4096;
+
+enum class Command {
+    None,     // empty line
+    Chat,     // anything not starting with '/'
+    Nickname,
+    Connect,
+    Join,
+    Ping,
+    Pong,     // answer to a server PING; like any input it just shows the client is alive
+    Kick,
+    Mute,
+    Unmute,
+    Whois,
+    Binary,   // switches the connection to frames (frame.h)
+    Unknown
+};
+
+// Classifies a line with one switch on the command word's length and a
+// single comparison per candidate, instead of trying every prefix in turn.
+// argument receives whatever follows the first space.
+inline Command parseCommand(std::string_view line, std::string_view& argument) {
+    argument = std::string_view();
+    if (line.empty()) {
+        return Command::None;
+    }
+    if (line[0] != '/') {
+        return Command::Chat;
+    }
+
+    size_t space = line.find(' ');
+    std::string_view word = line.substr(1, space == std::string_view::npos ? std::string_view::npos : space - 1);
+    if (space != std::string_view::npos) {
+        argument = line.substr(space + 1);
+    }
+
+    switch (word.size()) {
+    case 4:
+        if (word == "join") {
+            return Command::Join;
+        }
+        if (word == "ping") {
+            return Command::Ping;
+        }
+        if (word == "pong") {
+            return Command::Pong;
+        }
+        if (word == "kick") {
+            return Command::Kick;
+        }
+        if (word == "mute") {
+            return Command::Mute;
+        }
+        break;
+    case 5:
+        if (word == "whois") {
+            return Command::Whois;
+        }
+        break;
+    case 6:
+        if (word == "unmute") {
+            return Command::Unmute;
+        }
+        if (word == "binary") {
+            return Command::Binary;
+        }
+        break;
+    case 7:
+        if (word == "connect") {
+            return Command::Connect;
+        }
+        break;
+    case 8:
+        if (word == "nickname") {
+            return Command::Nickname;
+        }
+        break;
+    }
+    return Command::Unknown;
+}
+
+#endif
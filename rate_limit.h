@@ -0,0 +1,149 @@
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+// A token bucket refilled at a fixed rate, kept as a single timestamp: the
+// time at which the bucket would be full again (the "generic cell rate
+// algorithm"). Taking tokens pushes that time forward; the take fails when
+// it would land more than a full bucket ahead of now. One word per bucket
+// means a bucket shared between threads is updated with a single CAS.
+//
+// Times are steady-clock nanoseconds. A default constructed limit lets
+// everything through.
+class RateLimit {
+public:
+    RateLimit() = default;
+
+    // rate tokens per second, up to burst of them at once (at least one).
+    RateLimit(uint64_t rate, uint64_t burst) {
+        if (rate != 0) {
+            interval_ = std::max<uint64_t>(1, 1000000000 / rate);
+            tolerance_ = std::max<uint64_t>(1, burst) * interval_;
+        }
+    }
+
+    bool enabled() const {
+        return interval_ != 0;
+    }
+
+    // Bucket state owned by one thread.
+    bool take(uint64_t& full, uint64_t now, uint64_t cost) const {
+        uint64_t next;
+        if (!advance(full, now, cost, next)) {
+            return false;
+        }
+        full = next;
+        return true;
+    }
+
+    bool take(std::atomic<uint64_t>& full, uint64_t now, uint64_t cost) const {
+        uint64_t current = full.load(std::memory_order_relaxed);
+        uint64_t next;
+        do {
+            if (!advance(current, now, cost, next)) {
+                return false;
+            }
+        } while (!full.compare_exchange_weak(current, next, std::memory_order_relaxed));
+        return true;
+    }
+
+private:
+    bool advance(uint64_t full, uint64_t now, uint64_t cost, uint64_t& next) const {
+        if (interval_ == 0) {
+            next = full;
+            return true;
+        }
+        next = std::max(full, now) + cost * interval_;
+        return next <= now + tolerance_;
+    }
+
+    uint64_t interval_ = 0;  // nanoseconds per token; 0: unlimited
+    uint64_t tolerance_ = 0; // a full bucket, in nanoseconds
+};
+
+// Per source address admission state, shared by every shard: a connection
+// rate bucket and a count of open connections. IPv6 sources are grouped by
+// /64, the smallest block a single host is usually given.
+//
+// The table is a fixed array of slots addressed by a hash of the source,
+// with no keys and no locks: admitting a connection is an atomic add and a
+// CAS on one cache line. Sources that hash to the same slot share their
+// limits, which with the default 65536 slots only matters once that many
+// hosts are connecting at once.
+class AdmissionTable {
+public:
+    AdmissionTable(RateLimit connectLimit, uint32_t maxConnections, size_t slotCount)
+        : connectLimit_(connectLimit), maxConnections_(maxConnections),
+          mask_(slotCount - 1) {
+        if (enabled()) {
+            slots_.reset(new Slot[slotCount]);
+        }
+    }
+
+    bool enabled() const {
+        return connectLimit_.enabled() || maxConnections_ != 0;
+    }
+
+    static uint32_t slotKey(const sockaddr_storage& address) {
+        uint64_t key = 0;
+        if (address.ss_family == AF_INET) {
+            key = reinterpret_cast<const sockaddr_in&>(address).sin_addr.s_addr;
+        } else if (address.ss_family == AF_INET6) {
+            std::memcpy(&key, &reinterpret_cast<const sockaddr_in6&>(address).sin6_addr, sizeof(key));
+        }
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdull;
+        key ^= key >> 33;
+        return static_cast<uint32_t>(key);
+    }
+
+    // Counts a new connection from the source against its limits. On
+    // success the caller holds the connection until release().
+    bool admit(uint32_t key, uint64_t now) {
+        Slot& slot = slots_[key & mask_];
+        if (maxConnections_ != 0 && slot.connections.fetch_add(1, std::memory_order_relaxed) >= maxConnections_) {
+            slot.connections.fetch_sub(1, std::memory_order_relaxed);
+            return false;
+        }
+        if (!connectLimit_.take(slot.connectFull, now, 1)) {
+            release(key);
+            return false;
+        }
+        return true;
+    }
+
+    // Counts a connection that was admitted before, by the process this one
+    // took over from, without charging the connect rate again.
+    void hold(uint32_t key) {
+        if (maxConnections_ != 0) {
+            slots_[key & mask_].connections.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    void release(uint32_t key) {
+        if (maxConnections_ != 0) {
+            slots_[key & mask_].connections.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    struct alignas(16) Slot {
+        std::atomic<uint64_t> connectFull{0};
+        std::atomic<uint32_t> connections{0};
+    };
+
+    RateLimit connectLimit_;
+    uint32_t maxConnections_;
+    size_t mask_;
+    std::unique_ptr<Slot[]> slots_;
+};
+
+#endif
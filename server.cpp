@@ -1,435 +1,5089 @@
-#include <iostream>
-#include <cstring>
-#include <unordered_map>
-#include <vector>
-#include <thread>
-#include <mutex>
-#include <chrono>
-#include <algorithm>
-
-#ifdef _WIN32
-#include <winsock2.h>
-#pragma comment(lib, "ws2_32.lib")
-#else
-#include <unistd.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <signal.h>
-#endif
-
-constexpr int MAX_MESSAGE_LENGTH = 4096;
-
-#ifdef _WIN32
-BOOL CtrlHandler(DWORD fdwCtrlType) {
-    if (fdwCtrlType == CTRL_C_EVENT) {
-        return TRUE;
-    }
-    return FALSE;
-}
-#else
-void CtrlHandler(int) {}
-#endif
-
-struct Client {
-    int socket;
-    std::string nickname;
-    std::string channelName;
-    bool isConnected;
-    bool isAdmin;
-    int failedAttempts;
-};
-
-struct Channel {
-    std::vector<std::string> users;
-    std::vector<std::string> mutedUsers;
-    std::vector<std::string> kickedUsers;
-    std::string adminNickname;
-};
-
-class Server {
-public:
-    Server(int port) : serverSocket_(0), port_(port), nextClientId_(1), running_(false) {}
-
-    ~Server() {
-        stop();
-    }
-
-    bool start() {
-        if (running_) {
-            std::cerr << "Server is already running" << std::endl;
-            return false;
-        }
-
-        if (!createServerSocket()) {
-            return false;
-        }
-
-        if (!bindServerSocket()) {
-            return false;
-        }
-
-        if (!listenForClients()) {
-            return false;
-        }
-
-        running_ = true;
-
-        std::cout << "Server started on port " << port_ << std::endl;
-
-        acceptClients();
-
-        return true;
-    }
-
-    void stop() {
-        if (!running_) {
-            return;
-        }
-
-        running_ = false;
-
-        for (auto& client : clients_) {
-#ifdef _WIN32
-            closesocket(client.second.socket);
-#else
-            close(client.second.socket);
-#endif
-        }
-
-#ifdef _WIN32
-        closesocket(serverSocket_);
-        WSACleanup();
-#else
-        close(serverSocket_);
-#endif
-    }
-
-private:
-    bool isMuted(const std::string& username, const std::string& channelName) {
-        if (channels_.count(channelName) > 0) {
-            const auto& channel = channels_[channelName];
-            return std::find(channel.mutedUsers.begin(), channel.mutedUsers.end(), username) != channel.mutedUsers.end();
-        }
-        return false;
-    }
-
-    bool isKicked(const std::string& username, const std::string& channelName) {
-        if (channels_.count(channelName) > 0) {
-            const auto& channel = channels_[channelName];
-            return std::find(channel.kickedUsers.begin(), channel.kickedUsers.end(), username) != channel.kickedUsers.end();
-        }
-        return false;
-    }
-
-    bool createServerSocket() {
-        serverSocket_ = socket(AF_INET, SOCK_STREAM, 0);
-        if (serverSocket_ == -1) {
-            std::cerr << "Failed to create server socket" << std::endl;
-            return false;
-        }
-        return true;
-    }
-
-    bool bindServerSocket() {
-        sockaddr_in serverAddress{};
-        serverAddress.sin_family = AF_INET;
-        serverAddress.sin_port = htons(port_);
-        serverAddress.sin_addr.s_addr = htonl(INADDR_ANY);
-
-        if (bind(serverSocket_, reinterpret_cast<struct sockaddr*>(&serverAddress), sizeof(serverAddress)) == -1) {
-            std::cerr << "Failed to bind server socket" << std::endl;
-#ifdef _WIN32
-            closesocket(serverSocket_);
-#else
-            close(serverSocket_);
-#endif
-            return false;
-        }
-
-        return true;
-    }
-
-    bool listenForClients() {
-        if (listen(serverSocket_, SOMAXCONN) == -1) {
-            std::cerr << "Failed to listen for clients" << std::endl;
-#ifdef _WIN32
-            closesocket(serverSocket_);
-#else
-            close(serverSocket_);
-#endif
-            return false;
-        }
-
-        return true;
-    }
-
-    void acceptClients() {
-        while (running_) {
-            int clientSocket = accept(serverSocket_, nullptr, nullptr);
-            if (clientSocket == -1) {
-                std::cerr << "Failed to accept client connection" << std::endl;
-                continue;
-            }
-
-            std::string clientId = "client_" + std::to_string(nextClientId_++);
-            clients_[clientId] = { clientSocket, "", "", false, false, 0 };
-
-            std::thread clientThread(&Server::handleClient, this, clientSocket, clientId);
-            clientThread.detach();
-        }
-    }
-
-    void handleClient(int clientSocket, const std::string& clientId) {
-        char buffer[MAX_MESSAGE_LENGTH] = { 0 };
-
-        while (running_) {
-            int bytesRead = recv(clientSocket, buffer, sizeof(buffer) - 1, 0);
-            if (bytesRead == 0) {
-                std::cout << "Client " << clients_[clientId].nickname << " disconnected" << std::endl;
-                removeUserFromChannel(clients_[clientId].channelName, clientId);
-                break;
-            } else if (bytesRead == -1) {
-                std::cerr << "Failed to receive message from client " << clients_[clientId].nickname << std::endl;
-                break;
-            }
-            buffer[bytesRead] = '\0';
-
-            std::string message(buffer);
-            if (message.find("/nickname") == 0) {
-                clients_[clientId].nickname = message.substr(10);
-            } else if (message.find("/connect") == 0) {
-                clients_[clientId].isConnected = true;
-                std::cout << clients_[clientId].nickname << " connected." << std::endl;
-                broadcastMessage(clients_[clientId].nickname + " connected.\n", clients_[clientId].channelName);
-            } else if (message.find("/join") == 0) {
-                std::string channelName = message.substr(6);
-                if (!channelName.empty()) {
-                    joinChannel(channelName, clientId);
-                }
-            } else if (!message.empty() && message[0] != '/' && clients_[clientId].isConnected && !isMuted(clients_[clientId].nickname, clients_[clientId].channelName) && !isKicked(clients_[clientId].nickname, clients_[clientId].channelName)) {
-                std::cout << clients_[clientId].nickname << ": " << message << std::endl;
-                broadcastMessage(clients_[clientId].nickname + ": " + message, clients_[clientId].channelName);
-            } else if (message.find("/ping") == 0) {
-                std::cout << "Server: pong" << std::endl;
-                broadcastMessage("Server: pong", clients_[clientId].channelName);
-            } else if (!message.empty() && !clients_[clientId].isConnected && !clients_[clientId].channelName.empty()) {
-                // Check if the client is muted or kicked
-                if (clients_[clientId].failedAttempts < 5) {
-                    if (!sendMessage(clientSocket, "Please use the /connect command to establish a connection.")) {
-                        std::cerr << "Failed to send message to client " << clientId << std::endl;
-                    }
-                    clients_[clientId].failedAttempts++;
-                } else {
-                    std::cout << "Connection closed with client " << clients_[clientId].nickname << " due to multiple failed attempts." << std::endl;
-                    removeUserFromChannel(clients_[clientId].channelName, clientId);
-                    break;
-                }
-            } else if (message.find("/kick") == 0) {
-                std::string username = message.substr(6);
-                if (clients_[clientId].isAdmin) {
-                    kickUser(username, clients_[clientId].channelName, clientId);
-                } else {
-                    if (!sendMessage(clientSocket, "You don't have permission to use the /kick command.")) {
-                        std::cerr << "Failed to send message to client " << clientId << std::endl;
-                    }
-                }
-            } else if (message.find("/mute") == 0) {
-                std::string username = message.substr(6);
-                if (clients_[clientId].isAdmin) {
-                    muteUser(username, clients_[clientId].channelName);
-                } else {
-                    if (!sendMessage(clientSocket, "You don't have permission to use the /mute command.")) {
-                        std::cerr << "Failed to send message to client " << clientId << std::endl;
-                    }
-                }
-            } else if (message.find("/unmute") == 0) {
-                std::string username = message.substr(8);
-                if (clients_[clientId].isAdmin) {
-                    unmuteUser(username, clients_[clientId].channelName);
-                } else {
-                    if (!sendMessage(clientSocket, "You don't have permission to use the /unmute command.")) {
-                        std::cerr << "Failed to send message to client " << clientId << std::endl;
-                    }
-                }
-            } else if (message.find("/whois") == 0) {
-                std::string username = message.substr(7);
-                if (clients_[clientId].isAdmin) {
-                    sendUserIP(username, clientSocket);
-                } else {
-                    if (!sendMessage(clientSocket, "You don't have permission to use the /whois command.")) {
-                        std::cerr << "Failed to send message to client " << clientId << std::endl;
-                    }
-                }
-            }
-        }
-
-        clients_.erase(clientId);
-
-#ifdef _WIN32
-        closesocket(clientSocket);
-#else
-        close(clientSocket);
-#endif
-    }
-
-    void joinChannel(const std::string& channelName, const std::string& clientId) {
-        std::lock_guard<std::mutex> lock(clientsMutex_);
-        if (channelNameToAdmin_.count(channelName) == 0) {
-            channelNameToAdmin_[channelName] = clientId;
-            clients_[clientId].isAdmin = true;
-        }
-        clients_[clientId].channelName = channelName;
-        channels_[channelName].users.push_back(clients_[clientId].nickname);
-        if (channels_[channelName].adminNickname.empty()) {
-            channels_[channelName].adminNickname = clients_[clientId].nickname;
-        }
-        std::cout << clients_[clientId].nickname << " joined channel " << channelName << std::endl;
-    }
-
-    void removeUserFromChannel(const std::string& channelName, const std::string& clientId) {
-        std::lock_guard<std::mutex> lock(clientsMutex_);
-        if (channels_.count(channelName) > 0) {
-            auto& channel = channels_[channelName];
-            auto it = std::find(channel.users.begin(), channel.users.end(), clients_[clientId].nickname);
-            if (it != channel.users.end()) {
-                channel.users.erase(it);
-                if (channel.adminNickname == clients_[clientId].nickname) {
-                    if (!channel.users.empty()) {
-                        channel.adminNickname = channel.users.front();
-                    } else {
-                        channel.adminNickname.clear();
-                    }
-                }
-            }
-        }
-    }
-
-    void kickUser(const std::string& username, const std::string& channelName, const std::string& kickedClientId) {
-        if (channels_.count(channelName) > 0) {
-            auto& channel = channels_[channelName];
-            if (std::find(channel.kickedUsers.begin(), channel.kickedUsers.end(), username) == channel.kickedUsers.end()) {
-                channel.kickedUsers.push_back(username);
-                std::cout << "User " << username << " has been kicked from the channel." << std::endl;
-                removeUserFromChannel(channelName, kickedClientId);
-                broadcastMessage("User " + username + " has been kicked from the channel.", channelName);
-            }
-        }
-    }
-            
-    
-
-    void muteUser(const std::string& username, const std::string& channelName) {
-        std::lock_guard<std::mutex> lock(clientsMutex_);
-        if (channels_.count(channelName) > 0) {
-            auto& channel = channels_[channelName];
-            if (std::find(channel.mutedUsers.begin(), channel.mutedUsers.end(), username) == channel.mutedUsers.end()) {
-                channel.mutedUsers.push_back(username);
-                std::cout << "User " << username << " has been muted in channel " << channelName << std::endl;
-            }
-        }
-    }
-
-    void unmuteUser(const std::string& username, const std::string& channelName) {
-        std::lock_guard<std::mutex> lock(clientsMutex_);
-        if (channels_.count(channelName) > 0) {
-            auto& channel = channels_[channelName];
-            auto it = std::find(channel.mutedUsers.begin(), channel.mutedUsers.end(), username);
-            if (it != channel.mutedUsers.end()) {
-                channel.mutedUsers.erase(it);
-                std::cout << "User " << username << " has been unmuted in channel " << channelName << std::endl;
-            }
-        }
-    }
-
-    void sendUserIP(const std::string& username, int clientSocket) {
-        std::lock_guard<std::mutex> lock(clientsMutex_);
-        for (const auto& client : clients_) {
-            if (client.second.nickname == username) {
-                std::string ip = getClientIP(client.second.socket);
-                if (!sendMessage(clientSocket, "User " + username + " IP: " + ip)) {
-                    std::cerr << "Failed to send IP information to the administrator" << std::endl;
-                }
-                break;
-            }
-        }
-    }
-
-    std::string getClientIP(int socket) {
-        sockaddr_in addr{};
-        socklen_t len = sizeof(addr);
-        getpeername(socket, reinterpret_cast<struct sockaddr*>(&addr), &len);
-        char ip[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &(addr.sin_addr), ip, INET_ADDRSTRLEN);
-        return std::string(ip);
-    }
-
-    void broadcastMessage(const std::string& message, const std::string& channelName) {
-        std::lock_guard<std::mutex> lock(clientsMutex_);
-        if (channels_.count(channelName) > 0) {
-            auto& channel = channels_[channelName];
-            for (const auto& client : clients_) {
-                if (client.second.isConnected && client.second.channelName == channelName &&
-                    //!isMuted(client.second.nickname, channelName) &&
-                    !isKicked(client.second.nickname, channelName)) {
-                    if (!sendMessage(client.second.socket, message)) {
-                        std::cerr << "Failed to send message to client " << client.first << std::endl;
-                    }
-                }
-            }
-        }
-    }
-
-    bool sendMessage(int socket, const std::string& message) {
-        if (send(socket, message.c_str(), message.length(), 0) == -1) {
-            return false;
-        }
-        return true;
-    }
-
-private:
-    int serverSocket_;
-    int port_;
-    int nextClientId_;
-    std::unordered_map<std::string, Client> clients_;
-    std::unordered_map<std::string, std::string> channelNameToAdmin_;
-    std::unordered_map<std::string, Channel> channels_;
-    std::mutex clientsMutex_;
-    bool running_;
-};
-
-int main() {
-#ifdef _WIN32
-    WSADATA wsData;
-    if (WSAStartup(MAKEWORD(2, 2), &wsData) != 0) {
-        std::cerr << "Failed to initialize winsock" << std::endl;
-        return 1;
-    }
-#endif
-
-#ifdef _WIN32
-    SetConsoleCtrlHandler((PHANDLER_ROUTINE)CtrlHandler, TRUE);
-#else
-    signal(SIGINT, CtrlHandler);
-#endif
-
-    int serverPort;
-    std::cout << "Enter server port: ";
-    std::cin >> serverPort;
-
-    Server server(serverPort);
-    server.start();
-
-    std::string input;
-    std::cout << "Type '/quit' to stop the server" << std::endl;
-    while (true) {
-        std::getline(std::cin, input);
-        if (input.find("/quit") != std::string::npos) {
-            break;
-        }
-    }
-
-    server.stop();
-
-    return 0;
-}
+#include <iostream>
+#include <cctype>
+#include <cstring>
+#include <cstdlib>
+#include <unordered_map>
+#include <unordered_set>
+#include <set>
+#include <map>
+#include <random>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <new>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <cerrno>
+#include <string_view>
+#include <tuple>
+#include <optional>
+#include <sstream>
+#include <iomanip>
+#include <fstream>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#endif
+
+#include "channel_log.h"
+#include "epoch.h"
+#include "frame.h"
+#include "handover.h"
+#include "histogram.h"
+#include "line_parser.h"
+#include "logger.h"
+#include "message_buffer.h"
+#include "message_filter.h"
+#include "protocol.h"
+#include "rate_limit.h"
+#include "timing_wheel.h"
+#include "uring.h"
+
+// Coroutines mode needs a C++20 build (make server20).
+#if defined(__cpp_impl_coroutine)
+#define SERVER_COROUTINES 1
+#include "task.h"
+#endif
+
+constexpr int READ_BUFFER_SIZE = 16384;
+constexpr int MAX_EPOLL_EVENTS = 256;
+constexpr size_t SHARD_MAILBOX_CAPACITY = 1024;
+constexpr int CLIENT_HANDLE_SHARD_SHIFT = 48;
+constexpr int CLIENT_HANDLE_GENERATION_SHIFT = 32;
+constexpr int MAX_WRITE_BATCH = 64;     // iovecs handed to one sendmsg()
+constexpr size_t CLIENT_SLAB_SIZE = 1024; // client slots allocated at a time
+constexpr size_t CACHE_LINE_SIZE = 64;
+constexpr int ADMIN_REQUEST_SIZE = 4096;
+constexpr size_t ADMISSION_TABLE_SLOTS = 65536; // per source address limits, shared by every shard
+constexpr unsigned URING_ENTRIES = 1024;       // submission queue slots per shard
+constexpr unsigned URING_BUFFER_COUNT = 512;   // provided receive buffers per shard
+constexpr unsigned URING_BUFFER_SIZE = 4096;
+constexpr uint16_t URING_BUFFER_GROUP = 0;
+constexpr int URING_TAG_SHIFT = 56;            // io_uring user_data: tag << 56 | handle or pointer
+constexpr int TIMER_TICK_MILLIS = 100;          // resolution of the client timeouts
+constexpr size_t LINK_MAX_LINE_LENGTH = MAX_MESSAGE_LENGTH * 2; // a relayed line plus its header
+constexpr size_t LINK_MAX_QUEUED_BYTES = 64 << 20; // a peer further behind than this is dropped
+constexpr size_t LINK_SEEN_MESSAGES = 65536;     // message IDs remembered for duplicate suppression
+constexpr int LINK_SUMMARY_SECONDS = 5;          // channel summaries are flooded at least this often
+constexpr int LINK_SUMMARY_EXPIRY_SECONDS = 15;  // a node whose summary is older is forgotten
+constexpr int LINK_REDIAL_SECONDS = 1;
+
+// What an io_uring completion belongs to.
+enum UringTag : uint64_t {
+    URING_ACCEPT = 1,
+    URING_WAKE,
+    URING_RECV,
+    URING_SEND,
+    URING_CANCEL
+};
+
+#ifdef _WIN32
+BOOL CtrlHandler(DWORD fdwCtrlType) {
+    if (fdwCtrlType == CTRL_C_EVENT) {
+        return TRUE;
+    }
+    return FALSE;
+}
+#else
+void CtrlHandler(int) {}
+#endif
+
+// Counts every global heap allocation, so /stats can show that the message
+// path stays allocation-free once the pools are warm.
+std::atomic<uint64_t> heapAllocations{0};
+
+void* operator new(size_t size) {
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    void* pointer = std::malloc(size == 0 ? 1 : size);
+    if (pointer == nullptr) {
+        throw std::bad_alloc();
+    }
+    return pointer;
+}
+
+void operator delete(void* pointer) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept {
+    std::free(pointer);
+}
+
+// Identifies a client across the whole server: the owning shard, the
+// generation of its client slot and the slot itself. Generations start at 1,
+// so no valid handle is ever 0.
+using ClientHandle = uint64_t;
+
+inline ClientHandle makeClientHandle(int shard, uint16_t generation, uint32_t slot) {
+    return (static_cast<uint64_t>(shard) << CLIENT_HANDLE_SHARD_SHIFT) |
+           (static_cast<uint64_t>(generation) << CLIENT_HANDLE_GENERATION_SHIFT) | slot;
+}
+
+inline int clientHandleShard(ClientHandle handle) {
+    return static_cast<int>(handle >> CLIENT_HANDLE_SHARD_SHIFT);
+}
+
+inline uint32_t clientHandleSlot(ClientHandle handle) {
+    return static_cast<uint32_t>(handle);
+}
+
+// Wall-clock time, for timestamps that have to survive a restart.
+inline int64_t wallClockNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+inline uint64_t monotonicNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline uint64_t elapsedNanos(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Monotonic time in TIMER_TICK_MILLIS ticks, the clock of the shards'
+// timing wheels.
+inline uint64_t timerTick() {
+    return monotonicNanos() / (TIMER_TICK_MILLIS * 1000000ull);
+}
+
+inline uint64_t secondsToTicks(int seconds) {
+    return static_cast<uint64_t>(seconds) * 1000 / TIMER_TICK_MILLIS;
+}
+
+// epoll tokens for a shard's own descriptors; clients use their handle.
+constexpr uint64_t LISTENER_TOKEN = ~0ull;
+constexpr uint64_t WAKE_TOKEN = ~0ull - 1;
+
+struct ChannelSlot;
+struct Waiter;
+
+// Either an encoded message or, for history replay, a range of a channel
+// log segment that is sent straight from the page cache with sendfile().
+struct OutputChunk {
+    MessageBuffer data;
+    size_t offset = 0; // bytes already written
+    std::shared_ptr<const LogFile> file;
+    uint64_t fileOffset = 0;
+    size_t fileLength = 0;
+
+    size_t size() const {
+        return file ? fileLength : data.size();
+    }
+};
+
+// Ring of pending output chunks. Its storage only ever grows, so a client
+// slot that has been used once queues messages without allocating.
+class OutputQueue {
+public:
+    bool empty() const {
+        return count_ == 0;
+    }
+
+    size_t size() const {
+        return count_;
+    }
+
+    OutputChunk& front() {
+        return slots_[head_];
+    }
+
+    OutputChunk& operator[](size_t index) {
+        return slots_[(head_ + index) & (slots_.size() - 1)];
+    }
+
+    void push_back(OutputChunk chunk) {
+        if (count_ == slots_.size()) {
+            grow();
+        }
+        (*this)[count_] = std::move(chunk);
+        count_++;
+    }
+
+    void pop_front() {
+        slots_[head_] = OutputChunk();
+        head_ = (head_ + 1) & (slots_.size() - 1);
+        count_--;
+    }
+
+    // Removes the chunk at index by moving the ones before it up by one.
+    void erase(size_t index) {
+        for (size_t i = index; i > 0; i--) {
+            (*this)[i] = std::move((*this)[i - 1]);
+        }
+        pop_front();
+    }
+
+    void clear() {
+        while (!empty()) {
+            pop_front();
+        }
+        head_ = 0;
+    }
+
+private:
+    void grow() {
+        std::vector<OutputChunk> larger(std::max<size_t>(8, slots_.size() * 2));
+        for (size_t i = 0; i < count_; i++) {
+            larger[i] = std::move((*this)[i]);
+        }
+        slots_.swap(larger);
+        head_ = 0;
+    }
+
+    std::vector<OutputChunk> slots_; // power-of-two sized
+    size_t head_ = 0;
+    size_t count_ = 0;
+};
+
+// A client's entry in its shard's TimingWheel, which hands back the node.
+struct ClientTimer : TimerNode {
+    ClientHandle client = 0;
+};
+
+struct Client {
+    ClientHandle handle = 0;
+    uint16_t generation = 0;
+    bool inUse = false;
+    int socket = -1;
+    std::string nickname;
+    std::string channelName;
+    bool isConnected = false;
+    bool isAdmin = false;
+    int failedAttempts = 0;
+    OutputQueue outputQueue;
+    size_t queuedBytes = 0;  // unwritten bytes in outputQueue
+    bool flushScheduled = false;
+    bool isEvicted = false;  // went over its output limits under the Disconnect policy
+    int wakeFd = -1;         // threads mode: makes the client's thread poll for POLLOUT
+    LineParser input{ MAX_MESSAGE_LENGTH };
+    bool binary = false;            // speaks frames instead of lines, both ways
+    FrameParser frames{ MAX_MESSAGE_LENGTH + MAX_VARINT_LENGTH + 1 };
+    std::string chatHeader;         // ChatMessage frame body up to the text; empty until needed
+    ChannelSlot* channel = nullptr; // slot of channelName
+    Waiter* waiter = nullptr;       // coroutines mode: the client's session while it is parked
+    size_t sendingChunks = 0;       // uring mode: chunks at the front of outputQueue in a send in flight
+    uint32_t sourceKey = 0;         // AdmissionTable key of the peer address
+    sockaddr_storage peerAddress{}; // as accept() returned it
+    uint64_t commandBucket = 0;     // RateLimit state of the client's line budget
+    uint64_t byteBucket = 0;        // and of its byte budget
+    bool isThrottled = false;       // lines are being dropped; the client has been told
+    ClientTimer timer;              // due at the client's nearest timeout; see checkTimeouts()
+    uint64_t acceptedTick = 0;      // timer ticks, as in Shard::currentTick_
+    uint64_t lastInputTick = 0;     // when the client last sent anything
+    uint64_t lastOutputTick = 0;    // when its socket last took output, or its queue last filled up from empty
+    bool pingSent = false;          // pinged since lastInputTick
+    int pendingReplays = 0;         // history replays asked of channel home shards and not yet here
+    std::vector<std::pair<uint64_t, MessageBuffer>> heldLines; // channel output that came meanwhile, by chat sequence
+    uint64_t replayedFrom = 0;      // chat lines of the channel in [replayedFrom, replayedTo) came in the replay
+    uint64_t replayedTo = 0;
+
+    // Readies the slot for its next connection. Strings, queue and parser
+    // keep the memory they already have.
+    void reset() {
+        socket = -1;
+        nickname.clear();
+        channelName.clear();
+        channel = nullptr;
+        isConnected = false;
+        isAdmin = false;
+        failedAttempts = 0;
+        outputQueue.clear();
+        queuedBytes = 0;
+        flushScheduled = false;
+        isEvicted = false;
+        wakeFd = -1;
+        waiter = nullptr;
+        sendingChunks = 0;
+        sourceKey = 0;
+        peerAddress = sockaddr_storage{};
+        commandBucket = 0;
+        byteBucket = 0;
+        isThrottled = false;
+        timer.client = 0;
+        pingSent = false;
+        pendingReplays = 0;
+        heldLines.clear();
+        replayedFrom = 0;
+        replayedTo = 0;
+        input.reset();
+        binary = false;
+        frames.reset();
+        chatHeader.clear();
+    }
+};
+
+// A shard's clients, in fixed slots allocated CLIENT_SLAB_SIZE at a time.
+// Slabs never move, freed slots are reused last-in first-out, and a slot's
+// generation changes on every reuse so stale handles stop resolving.
+class ClientTable {
+public:
+    explicit ClientTable(int shard) : shard_(shard) {}
+
+    Client* find(ClientHandle handle) {
+        uint32_t slot = clientHandleSlot(handle);
+        if (clientHandleShard(handle) != shard_ || slot >= slotCount_) {
+            return nullptr;
+        }
+        Client& client = at(slot);
+        return client.inUse && client.handle == handle ? &client : nullptr;
+    }
+
+    Client& add(int socket) {
+        uint32_t slot;
+        if (!freeSlots_.empty()) {
+            slot = freeSlots_.back();
+            freeSlots_.pop_back();
+        } else {
+            if (slotCount_ % CLIENT_SLAB_SIZE == 0) {
+                slabs_.emplace_back(new Client[CLIENT_SLAB_SIZE]);
+            }
+            slot = slotCount_++;
+        }
+
+        Client& client = at(slot);
+        client.generation = client.generation == UINT16_MAX ? 1 : client.generation + 1;
+        client.handle = makeClientHandle(shard_, client.generation, slot);
+        client.inUse = true;
+        client.socket = socket;
+        size_++;
+        return client;
+    }
+
+    void remove(Client& client) {
+        client.reset();
+        client.inUse = false;
+        freeSlots_.push_back(clientHandleSlot(client.handle));
+        size_--;
+    }
+
+    template <typename Callback>
+    void forEach(Callback&& callback) {
+        for (uint32_t slot = 0; slot < slotCount_; slot++) {
+            Client& client = at(slot);
+            if (client.inUse) {
+                callback(client);
+            }
+        }
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+private:
+    Client& at(uint32_t slot) {
+        return slabs_[slot / CLIENT_SLAB_SIZE][slot % CLIENT_SLAB_SIZE];
+    }
+
+    int shard_;
+    std::vector<std::unique_ptr<Client[]>> slabs_;
+    std::vector<uint32_t> freeSlots_;
+    uint32_t slotCount_ = 0;
+    size_t size_ = 0;
+};
+
+// Open-addressing map from ClientHandle to a member slot. Unlike
+// std::unordered_map it allocates no node per entry; handle 0 marks an empty
+// bucket.
+class HandleIndex {
+public:
+    const uint32_t* find(ClientHandle key) const {
+        if (count_ == 0) {
+            return nullptr;
+        }
+        for (size_t bucket = bucketOf(key);; bucket = (bucket + 1) & (entries_.size() - 1)) {
+            if (entries_[bucket].key == key) {
+                return &entries_[bucket].value;
+            }
+            if (entries_[bucket].key == 0) {
+                return nullptr;
+            }
+        }
+    }
+
+    void assign(ClientHandle key, uint32_t value) {
+        if ((count_ + 1) * 4 > entries_.size() * 3) {
+            grow();
+        }
+        size_t bucket = bucketOf(key);
+        while (entries_[bucket].key != 0 && entries_[bucket].key != key) {
+            bucket = (bucket + 1) & (entries_.size() - 1);
+        }
+        if (entries_[bucket].key == 0) {
+            count_++;
+        }
+        entries_[bucket] = { key, value };
+    }
+
+    // Backward-shift deletion: later entries of the same probe run move up,
+    // so lookups never need tombstones.
+    void erase(ClientHandle key) {
+        if (count_ == 0) {
+            return;
+        }
+        size_t mask = entries_.size() - 1;
+        size_t hole = bucketOf(key);
+        while (entries_[hole].key != key) {
+            if (entries_[hole].key == 0) {
+                return;
+            }
+            hole = (hole + 1) & mask;
+        }
+
+        for (size_t next = (hole + 1) & mask; entries_[next].key != 0; next = (next + 1) & mask) {
+            size_t home = bucketOf(entries_[next].key);
+            bool stays = hole <= next ? (hole < home && home <= next) : (hole < home || home <= next);
+            if (!stays) {
+                entries_[hole] = entries_[next];
+                hole = next;
+            }
+        }
+        entries_[hole] = Entry();
+        count_--;
+    }
+
+private:
+    struct Entry {
+        ClientHandle key = 0;
+        uint32_t value = 0;
+    };
+
+    size_t bucketOf(ClientHandle key) const {
+        return static_cast<size_t>((key * 0x9E3779B97F4A7C15ull) >> 32) & (entries_.size() - 1);
+    }
+
+    void grow() {
+        std::vector<Entry> old(std::max<size_t>(16, entries_.size() * 2));
+        old.swap(entries_);
+        count_ = 0;
+        for (const Entry& entry : old) {
+            if (entry.key != 0) {
+                assign(entry.key, entry.value);
+            }
+        }
+    }
+
+    std::vector<Entry> entries_; // power-of-two sized
+    size_t count_ = 0;
+};
+
+// A channel member as seen by the channel's home shard. The mute and kick
+// flags mirror the channel's name sets so the message path never has to
+// look a nickname up.
+struct ChannelMember {
+    ClientHandle client;
+    std::string nickname;
+    bool isConnected;
+    bool isMuted;
+    bool isKicked;
+    bool isBinary;
+};
+
+// Per-channel figures for the metrics endpoint. The home shard sets the
+// member count, whichever shard fans a message out counts it.
+struct ChannelGauges {
+    std::atomic<uint64_t> members{0};
+    std::atomic<uint64_t> messages{0}; // broadcasts so far
+};
+
+// Flags of a member in ChannelSnapshot::members.
+constexpr uint32_t MEMBER_MUTED = 1;
+constexpr uint32_t MEMBER_KICKED = 2;
+
+// Immutable, versioned view of a channel, republished by its home shard
+// after every change. Any shard reads the current one without a lock to
+// check a sender and fan its message out. The channel's slot holds one
+// reference until the snapshot is replaced and no reader can still see it;
+// cross-shard deliveries hold one each while in flight.
+struct ChannelSnapshot {
+    mutable std::atomic<uint32_t> references{1};
+    uint64_t version = 0;
+    HandleIndex members;                               // member -> MEMBER_* flags
+    std::vector<std::vector<ClientHandle>> recipients; // connected, not kicked members, by shard
+    bool hasBinaryRecipients = false;                  // messages need a frame encoding too
+    std::string adminNickname;
+
+    void acquire() const {
+        references.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void release() const {
+        if (references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            delete this;
+        }
+    }
+};
+
+// Owning reference to a snapshot, for messages that outlive the epoch in
+// which the snapshot was read.
+class SnapshotRef {
+public:
+    SnapshotRef() = default;
+
+    explicit SnapshotRef(const ChannelSnapshot* snapshot) : snapshot_(snapshot) {
+        if (snapshot_ != nullptr) {
+            snapshot_->acquire();
+        }
+    }
+
+    SnapshotRef(SnapshotRef&& other) noexcept : snapshot_(other.snapshot_) {
+        other.snapshot_ = nullptr;
+    }
+
+    SnapshotRef& operator=(SnapshotRef&& other) noexcept {
+        std::swap(snapshot_, other.snapshot_);
+        return *this;
+    }
+
+    ~SnapshotRef() {
+        if (snapshot_ != nullptr) {
+            snapshot_->release();
+        }
+    }
+
+    const ChannelSnapshot* get() const {
+        return snapshot_;
+    }
+
+private:
+    const ChannelSnapshot* snapshot_ = nullptr;
+};
+
+// Where a channel's current snapshot is published.
+struct ChannelSlot {
+    uint32_t id = 0; // binary protocol channel ID, unique while the server runs
+    std::atomic<ChannelSnapshot*> current{nullptr};
+    ChannelGauges gauges;
+    std::atomic<uint32_t> remoteNodes{0}; // federation: other nodes with recipients, set by the link thread
+    std::atomic<uint64_t> chatSequence{1}; // with history: the next chat line's place in the channel's log order
+
+    ~ChannelSlot() {
+        ChannelSnapshot* snapshot = current.load(std::memory_order_relaxed);
+        if (snapshot != nullptr) {
+            snapshot->release();
+        }
+    }
+};
+
+// Every channel's slot, by name. Slots are created on first use and live as
+// long as the server, so clients and channels keep plain pointers to them.
+// The lock is only taken on /join and by metrics scrapes.
+class ChannelDirectory {
+public:
+    ChannelSlot& find(const std::string& channelName) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& slot = slots_[channelName];
+        if (!slot) {
+            slot.reset(new ChannelSlot());
+            slot->id = static_cast<uint32_t>(slots_.size());
+        }
+        return *slot;
+    }
+
+    template <typename Callback>
+    void forEach(Callback&& callback) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& entry : slots_) {
+            callback(entry.first, *entry.second);
+        }
+    }
+
+    // Channel names in the order their slots were created, i.e. by ID.
+    std::vector<std::string> namesById() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<std::string> names(slots_.size());
+        for (const auto& entry : slots_) {
+            names[entry.second->id - 1] = entry.first;
+        }
+        return names;
+    }
+
+private:
+    std::mutex mutex_;
+    std::unordered_map<std::string, std::unique_ptr<ChannelSlot>> slots_;
+};
+
+// Every nickname in use, with the client holding it and that client's
+// address, shared by all shards. Names are interned: each is stored once,
+// in its entry, and looked up from a string_view without allocating. The
+// map is split by hash into stripes with a lock each, so shards setting
+// nicknames rarely contend, and a lookup is one hash probe however many
+// users are online.
+class NicknameRegistry {
+public:
+    // Gives the name to the client, unless another client holds it.
+    bool claim(std::string_view name, ClientHandle client, const std::string& address) {
+        Stripe& stripe = stripeOf(name);
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+        auto found = stripe.names.find(name);
+        if (found != stripe.names.end()) {
+            return found->second->client == client;
+        }
+        std::unique_ptr<Entry> entry(new Entry{ std::string(name), client, address });
+        std::string_view key = entry->name;
+        stripe.names.emplace(key, std::move(entry));
+        return true;
+    }
+
+    void release(std::string_view name, ClientHandle client) {
+        Stripe& stripe = stripeOf(name);
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+        auto found = stripe.names.find(name);
+        if (found != stripe.names.end() && found->second->client == client) {
+            stripe.names.erase(found);
+        }
+    }
+
+    // The client holding the name; 0 if nobody does.
+    ClientHandle owner(std::string_view name) {
+        Stripe& stripe = stripeOf(name);
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+        auto found = stripe.names.find(name);
+        return found == stripe.names.end() ? 0 : found->second->client;
+    }
+
+    bool address(std::string_view name, std::string& address) {
+        Stripe& stripe = stripeOf(name);
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+        auto found = stripe.names.find(name);
+        if (found == stripe.names.end()) {
+            return false;
+        }
+        address = found->second->address;
+        return true;
+    }
+
+private:
+    static constexpr size_t STRIPES = 64;
+
+    struct Entry {
+        std::string name; // the interned name; its stripe's key points into it
+        ClientHandle client;
+        std::string address;
+    };
+
+    struct alignas(CACHE_LINE_SIZE) Stripe {
+        std::mutex mutex;
+        std::unordered_map<std::string_view, std::unique_ptr<Entry>> names;
+    };
+
+    Stripe& stripeOf(std::string_view name) {
+        return stripes_[(std::hash<std::string_view>{}(name) >> 7) % STRIPES];
+    }
+
+    Stripe stripes_[STRIPES];
+};
+
+// The text form of a peer address, IPv4 or IPv6.
+inline std::string formatAddress(const sockaddr_storage& address) {
+    char text[INET6_ADDRSTRLEN] = "";
+    if (address.ss_family == AF_INET) {
+        inet_ntop(AF_INET, &reinterpret_cast<const sockaddr_in&>(address).sin_addr, text, sizeof(text));
+    } else if (address.ss_family == AF_INET6) {
+        inet_ntop(AF_INET6, &reinterpret_cast<const sockaddr_in6&>(address).sin6_addr, text, sizeof(text));
+    }
+    return text;
+}
+
+// The authoritative state of a channel, owned by its home shard.
+struct Channel {
+    std::string name;
+    ChannelSlot* slot = nullptr;
+    uint64_t version = 0;               // of the last published snapshot
+    std::vector<ChannelMember> members; // dense, walked by broadcasts
+    HandleIndex memberSlots;            // position of each member in members
+    std::unordered_set<std::string> mutedUsers;
+    std::unordered_set<std::string> kickedUsers;
+    std::string adminNickname;
+    std::unique_ptr<ChannelLog> history; // set when the server keeps history
+    bool announced = false;              // the link thread was told the channel has recipients here
+    uint64_t nextLogged = 1;                       // chat sequence of the next line to log
+    std::map<uint64_t, MessageBuffer> earlyLines;  // lines that reached the home shard before ones ahead of them
+    std::deque<std::pair<ClientHandle, uint64_t>> waitingReplays; // members and the chat sequence their replay ends at
+    std::deque<uint64_t> loggedSequences;          // chat sequences of the newest logged lines, as many as a replay sends
+
+    ChannelMember* findMember(ClientHandle client) {
+        const uint32_t* slot = memberSlots.find(client);
+        return slot == nullptr ? nullptr : &members[*slot];
+    }
+
+    void addMember(ChannelMember member) {
+        memberSlots.assign(member.client, static_cast<uint32_t>(members.size()));
+        members.push_back(std::move(member));
+    }
+
+    // Swap-with-last removal, so leaving costs the same in any channel size.
+    void removeMember(ClientHandle client) {
+        const uint32_t* found = memberSlots.find(client);
+        if (found == nullptr) {
+            return;
+        }
+        uint32_t slot = *found;
+        memberSlots.erase(client);
+        if (slot != members.size() - 1) {
+            members[slot] = std::move(members.back());
+            memberSlots.assign(members[slot].client, slot);
+        }
+        members.pop_back();
+    }
+};
+
+// How the server multiplexes client sockets. Threads is the original
+// thread-per-client model; Epoll runs one edge-triggered event loop per
+// shard, each with its own SO_REUSEPORT listener. Coroutines runs on the
+// same event loops but serves each connection with a straight-line session
+// task, as threads mode does, suspended instead of blocking a thread.
+// Uring replaces the epoll loop with io_uring: multishot accept and recv
+// into provided buffers, and every send of a loop iteration submitted in a
+// single system call.
+enum class IoMode {
+    Threads,
+    Epoll,
+    Coroutines,
+    Uring
+};
+
+// What happens to a client whose output queue is full.
+enum class OverflowPolicy {
+    DropOldest,
+    DropNewest,
+    Disconnect
+};
+
+struct ServerConfig {
+    int port = 0;
+    int adminPort = 0; // 0: no metrics endpoint
+    std::string logFile;  // empty: log to the terminal
+    bool chatEcho = true; // log every chat line
+    std::string historyDir;     // empty: no channel history
+    size_t historySegments = 0; // segments kept per channel; 0: all
+    uint64_t replayMessages = 50; // history sent to a member as it starts receiving a channel
+    int64_t replaySeconds = 0;    // 0: no age limit on the replay
+    IoMode ioMode = IoMode::Epoll;
+    int shardCount = 1;
+    size_t maxQueuedBytes = 1 << 20;
+    size_t maxQueuedMessages = 4096;
+    OverflowPolicy overflowPolicy = OverflowPolicy::DropOldest;
+    RateLimit connectLimit;         // new connections per source address
+    uint32_t maxConnectionsPerIp = 0; // 0: no limit
+    RateLimit commandLimit;         // lines per client
+    RateLimit byteLimit;            // line bytes per client
+    int linkPort = 0;               // 0: accept no peer links
+    std::vector<std::string> peers; // HOST:PORT of nodes to link to
+    uint32_t nodeId = 0;            // unique among linked nodes
+    int pingInterval = 60;          // seconds of silence before a client is pinged; 0: never
+    int idleTimeout = 120;          // seconds of silence before a client is dropped; 0: never
+    int handshakeTimeout = 120;     // seconds a client gets to /connect; 0: no limit
+    int writeTimeout = 60;          // seconds output may wait without the socket taking any; 0: no limit
+    std::string upgradeSocket;      // Unix socket a new server process can take over from; empty: none
+    std::string takeOver;           // Unix socket of the server process to take over from; empty: start afresh
+    MessageFilter chatFilter;       // checks on chat lines; all off by default
+};
+
+// How often each overflow policy fired. Written by the owning shard only,
+// read by whoever prints the stats.
+struct OverflowStats {
+    std::atomic<uint64_t> droppedOldest{0};
+    std::atomic<uint64_t> droppedNewest{0};
+    std::atomic<uint64_t> disconnects{0};
+};
+
+// Hot-path counters of one shard. Only the shard's own thread (in threads
+// mode, its client threads) updates them, on cache lines no other shard
+// writes, and readers sum them with relaxed loads, so neither side waits.
+struct alignas(CACHE_LINE_SIZE) ShardMetrics {
+    std::atomic<uint64_t> accepts{0};
+    std::atomic<uint64_t> disconnects{0};
+    std::atomic<uint64_t> bytesIn{0};
+    std::atomic<uint64_t> bytesOut{0};
+    std::atomic<uint64_t> messagesBroadcast{0};
+    std::atomic<uint64_t> messagesQueued{0}; // one per recipient
+    std::atomic<uint64_t> sendFailures{0};
+    std::atomic<uint64_t> connectionsRejected{0}; // over their source's limits
+    std::atomic<uint64_t> linesThrottled{0};      // dropped for a client over its budget
+    std::atomic<uint64_t> chatInvalidUtf8{0};     // chat lines refused by the filter, by reason
+    std::atomic<uint64_t> chatTooLong{0};
+    std::atomic<uint64_t> chatBlocked{0};
+    std::atomic<uint64_t> pingsSent{0};
+    std::atomic<uint64_t> clientsTimedOut{0};     // reaped by checkTimeouts()
+    Histogram commandNanos;                  // time to run one input line
+    Histogram fanoutNanos;                   // time for one broadcast on the home shard
+};
+
+// Counters of the link thread, read by whoever prints the stats.
+struct LinkMetrics {
+    std::atomic<uint64_t> links{0};
+    std::atomic<uint64_t> messagesOut{0}; // one per link a message went out on
+    std::atomic<uint64_t> messagesIn{0};  // relayed messages delivered on this node
+    std::atomic<uint64_t> duplicates{0};  // relayed messages seen before and dropped
+};
+
+// A request passed between shards. Channel operations travel to the
+// channel's home shard; Deliver carries fan-out output back to the shards
+// that own the recipients' sockets. Federate and Membership go from a shard
+// to the link thread, Relay from the link thread to a channel's home.
+struct ShardMessage {
+    enum class Type {
+        Join,
+        Leave,
+        Connect,
+        Chat,
+        Ping,
+        Kick,
+        Mute,
+        Unmute,
+        GrantAdmin,
+        Deliver,
+        Append,
+        Replay,
+        Federate,
+        Relay,
+        Membership
+    };
+
+    Type type;
+    ClientHandle client = 0;             // client that caused it
+    std::string nickname;
+    std::string channelName;
+    std::string text;                    // target username
+    bool isConnected = false;
+    bool isBinary = false;
+    std::vector<ClientHandle> clients;   // Deliver: recipients on the target shard
+    SnapshotRef snapshot;                // Deliver: take the recipients from here instead
+    MessageBuffer payload;               // Chat, Deliver and Append: the encoded message
+    MessageBuffer frame;                 // Chat and Deliver: the same message as a frame, if anyone needs it
+    std::vector<LogRange> history;       // Replay: log ranges to stream to the client
+    uint64_t sequence = 0;               // Chat, Deliver and Append: the chat line's ChannelSlot::chatSequence
+                                         // (0 for other lines); Replay: the first chat sequence not replayed
+    uint64_t replayedFrom = 0;           // Replay: the chat sequence of the first line replayed
+    bool active = false;                 // Membership: the channel has recipients on this node
+
+    // Messages that cross shards come from the message buffer pool too.
+    static void* operator new(size_t size) {
+        return BufferPool::allocate(size);
+    }
+
+    static void operator delete(void* pointer, size_t size) {
+        BufferPool::release(pointer, size);
+    }
+};
+
+using ShardMailbox = SpscQueue<ShardMessage*, SHARD_MAILBOX_CAPACITY>;
+
+// The link thread's end of the shard mailboxes: a queue from each shard and
+// the eventfd that wakes it. Shards treat it as one more post() target,
+// numbered after the last shard.
+struct LinkMailboxes {
+    std::vector<std::unique_ptr<ShardMailbox>> inboxes; // indexed by the sending shard
+    int wakeFd = -1;
+
+    void wake() {
+        uint64_t one = 1;
+        if (write(wakeFd, &one, sizeof(one)) == -1) {
+            LOG_ERROR("Failed to wake the link thread");
+        }
+    }
+};
+
+inline int homeShardOf(std::string_view channelName, size_t shardCount) {
+    return static_cast<int>(std::hash<std::string_view>{}(channelName) % shardCount);
+}
+
+// One reactor thread's share of the server. A shard owns the clients it
+// accepted and the channels whose name hashes to it (their "home"). Only the
+// shard's own thread touches that state; other shards reach it through the
+// shard's mailboxes. In threads mode there is a single shard and the client
+// threads serialize on clientsMutex_ instead.
+class Shard {
+public:
+    Shard(int index, const ServerConfig& config, std::vector<std::unique_ptr<Shard>>& shards, const std::atomic<bool>& running,
+          ChannelDirectory& directory, NicknameRegistry& nicknames, EpochReclaimer& epochs, AdmissionTable& admission,
+          LinkMailboxes* links)
+        : index_(index), config_(config), shards_(shards), running_(running), directory_(directory), nicknames_(nicknames),
+          epochs_(epochs), admission_(admission), links_(links), serverSocket_(-1), pingTicks_(secondsToTicks(config.pingInterval)),
+          idleTicks_(secondsToTicks(config.idleTimeout)), handshakeTicks_(secondsToTicks(config.handshakeTimeout)),
+          writeTicks_(secondsToTicks(config.writeTimeout)), clients_(index), currentTick_(timerTick()), timers_(currentTick_) {}
+
+    ~Shard() {
+        for (auto& inbox : inboxes_) {
+            ShardMessage* message;
+            while (inbox->pop(message)) {
+                delete message;
+            }
+        }
+        for (auto& backlog : outboxes_) {
+            for (ShardMessage* message : backlog) {
+                delete message;
+            }
+        }
+        for (auto& retired : retired_) {
+            retired.first->release();
+        }
+    }
+
+    bool open() {
+        if (!createServerSocket()) {
+            return false;
+        }
+
+        if (!bindServerSocket()) {
+            return false;
+        }
+
+        if (!listenForClients()) {
+            return false;
+        }
+
+        if (config_.ioMode != IoMode::Threads) {
+            return createEventLoop();
+        }
+        return true;
+    }
+
+    void run() {
+        if (config_.ioMode == IoMode::Uring) {
+            thread_ = std::thread(&Shard::runUringLoop, this);
+        } else if (config_.ioMode != IoMode::Threads) {
+            thread_ = std::thread(&Shard::runEventLoop, this);
+        } else {
+            thread_ = std::thread(&Shard::acceptClients, this);
+        }
+    }
+
+    void wake() {
+        if (config_.ioMode != IoMode::Threads) {
+            uint64_t one = 1;
+            if (write(wakeFd_, &one, sizeof(one)) == -1) {
+                LOG_ERROR("Failed to wake shard ", index_);
+            }
+        } else {
+            shutdown(serverSocket_, SHUT_RDWR);
+            std::lock_guard<std::mutex> lock(clientsMutex_);
+            clients_.forEach([](Client& client) {
+                uint64_t one = 1;
+                if (write(client.wakeFd, &one, sizeof(one)) == -1) {
+                    LOG_ERROR("Failed to wake client thread");
+                }
+            });
+        }
+    }
+
+    // Waits for the shard's threads. Client threads are detached, so in
+    // threads mode this waits until the last one has closed its client.
+    void join() {
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+        std::unique_lock<std::mutex> lock(clientsMutex_);
+        clientThreadsDone_.wait(lock, [&] { return clientThreads_ == 0; });
+    }
+
+    const OverflowStats& overflowStats() const {
+        return overflowStats_;
+    }
+
+    const ShardMetrics& metrics() const {
+        return metrics_;
+    }
+
+    // The queue the link thread pushes Relay messages into.
+    ShardMailbox& linkInbox() {
+        return *inboxes_.back();
+    }
+
+    void close() {
+        clients_.forEach([&](Client& client) {
+#ifdef _WIN32
+            closesocket(client.socket);
+#else
+            ::close(client.socket);
+#endif
+            if (client.wakeFd != -1) {
+                ::close(client.wakeFd);
+            }
+#if SERVER_COROUTINES
+            dropSession(client);
+#endif
+            timers_.cancel(client.timer);
+            if (!client.nickname.empty()) {
+                nicknames_.release(client.nickname, client.handle);
+            }
+            clients_.remove(client);
+        });
+
+#ifdef _WIN32
+        closesocket(serverSocket_);
+#else
+        ::close(serverSocket_);
+#endif
+        if (config_.ioMode != IoMode::Threads) {
+            if (epollFd_ != -1) {
+                ::close(epollFd_);
+            }
+            ::close(wakeFd_);
+        }
+    }
+
+    // Hot upgrade, new side: serves the listener the old process handed
+    // over instead of opening one.
+    bool adopt(int listener) {
+        serverSocket_ = listener;
+        return createEventLoop();
+    }
+
+    int listener() const {
+        return serverSocket_;
+    }
+
+    // Hot upgrade, old side (epoll mode): parks the shard's thread between
+    // two loop iterations, so that the upgrade thread can work on the
+    // shard's state, until resume().
+    void pause() {
+        pauseRequested_.store(true, std::memory_order_relaxed);
+        wake();
+        std::unique_lock<std::mutex> lock(pauseMutex_);
+        pauseChanged_.wait(lock, [&] { return paused_; });
+    }
+
+    void resume() {
+        std::unique_lock<std::mutex> lock(pauseMutex_);
+        pauseRequested_.store(false, std::memory_order_relaxed);
+        pauseChanged_.notify_all();
+        pauseChanged_.wait(lock, [&] { return !paused_; });
+    }
+
+    // With the shard paused: runs the requests other shards left for it
+    // and writes out what is queued. Returns false once it found nothing
+    // to do.
+    bool settle() {
+        bool busy = drainInboxes();
+        busy |= !scheduledFlushes_.empty() || hasBacklog();
+        flushScheduledClients();
+        flushOutboxes();
+        return busy;
+    }
+
+    // The new process reopens the channel logs, so they are closed around
+    // a handover, and reopened if it falls through.
+    void closeHistories() {
+        for (auto& entry : channels_) {
+            entry.second.history.reset();
+        }
+    }
+
+    void reopenHistories() {
+        for (auto& entry : channels_) {
+            openHistory(entry.second, entry.first);
+        }
+    }
+
+    // Hot upgrade, old side, with the shard paused: writes its clients to
+    // the snapshot and their sockets to sockets, numbering every client in
+    // refs from 1. Unsent output goes over as plain bytes, log ranges
+    // included, one chunk per chunk.
+    void exportClients(SnapshotWriter& out, std::unordered_map<ClientHandle, uint64_t>& refs, std::vector<int>& sockets) {
+        out.number(clients_.size());
+        clients_.forEach([&](Client& client) {
+            refs.emplace(client.handle, refs.size() + 1);
+            sockets.push_back(client.socket);
+            out.number((client.isConnected ? HANDOVER_CONNECTED : 0) | (client.isAdmin ? HANDOVER_ADMIN : 0) |
+                       (client.binary ? HANDOVER_BINARY : 0));
+            out.number(static_cast<uint64_t>(client.failedAttempts));
+            out.bytes(client.nickname);
+            out.bytes(client.channelName);
+            out.bytes(std::string_view(reinterpret_cast<const char*>(&client.peerAddress), sizeof(client.peerAddress)));
+            if (client.binary) {
+                out.bytes(client.frames.carried());
+                out.number(client.frames.skipping());
+            } else {
+                out.bytes(client.input.carried());
+                out.number(client.input.discarding() ? 1 : 0);
+            }
+            out.number(client.outputQueue.size());
+            for (size_t i = 0; i < client.outputQueue.size(); i++) {
+                OutputChunk& chunk = client.outputQueue[i];
+                if (!chunk.file) {
+                    out.bytes(chunk.data.view().substr(chunk.offset));
+                    continue;
+                }
+                std::string text(chunk.fileLength - chunk.offset, '\0');
+                ssize_t bytesRead = pread(chunk.file->fd(), text.data(), text.size(), static_cast<off_t>(chunk.fileOffset + chunk.offset));
+                text.resize(bytesRead > 0 ? static_cast<size_t>(bytesRead) : 0);
+                out.bytes(text);
+            }
+        });
+    }
+
+    // The channels the shard is home to, and who got to be their admins.
+    void exportChannels(SnapshotWriter& out, const std::unordered_map<ClientHandle, uint64_t>& refs) {
+        auto refOf = [&](ClientHandle client) {
+            auto found = refs.find(client);
+            return found == refs.end() ? 0 : found->second;
+        };
+        out.number(channels_.size());
+        for (const auto& entry : channels_) {
+            const Channel& channel = entry.second;
+            out.bytes(entry.first);
+            out.bytes(channel.adminNickname);
+            out.number(channel.members.size());
+            for (const ChannelMember& member : channel.members) {
+                out.number(refOf(member.client));
+                out.bytes(member.nickname);
+                out.number((member.isConnected ? HANDOVER_CONNECTED : 0) | (member.isBinary ? HANDOVER_BINARY : 0) |
+                           (member.isMuted ? HANDOVER_MUTED : 0) | (member.isKicked ? HANDOVER_KICKED : 0));
+            }
+            writeNames(out, channel.mutedUsers);
+            writeNames(out, channel.kickedUsers);
+        }
+        out.number(channelNameToAdmin_.size());
+        for (const auto& entry : channelNameToAdmin_) {
+            out.bytes(entry.first);
+            out.number(refOf(entry.second));
+        }
+    }
+
+    // Hot upgrade, new side, before the shard's thread starts: serves a
+    // client the old process handed over, as it was there. Its timeouts
+    // start afresh. Returns its handle here, 0 if it could not be set up.
+    ClientHandle importClient(SnapshotReader& in, int socket) {
+        uint64_t flags = in.number();
+        int failedAttempts = static_cast<int>(in.number());
+        std::string_view nickname = in.bytes();
+        std::string_view channelName = in.bytes();
+        std::string_view address = in.bytes();
+        std::string_view carried = in.bytes();
+        uint64_t parserState = in.number();
+        std::vector<std::string_view> output;
+        uint64_t chunks = in.number();
+        for (uint64_t i = 0; i < chunks && !in.failed(); i++) {
+            output.push_back(in.bytes());
+        }
+        if (in.failed() || !setNonBlocking(socket)) {
+            ::close(socket);
+            return 0;
+        }
+
+        Client& client = clients_.add(socket);
+        if (config_.ioMode == IoMode::Uring) {
+            armRecv(client);
+        } else {
+            epoll_event event{};
+            event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            event.data.u64 = client.handle;
+            if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, socket, &event) == -1) {
+                LOG_ERROR("Failed to register client socket with epoll");
+                clients_.remove(client);
+                ::close(socket);
+                return 0;
+            }
+        }
+
+        client.isConnected = (flags & HANDOVER_CONNECTED) != 0;
+        client.isAdmin = (flags & HANDOVER_ADMIN) != 0;
+        client.binary = (flags & HANDOVER_BINARY) != 0;
+        client.failedAttempts = failedAttempts;
+        client.nickname.assign(nickname.data(), nickname.size());
+        client.channelName.assign(channelName.data(), channelName.size());
+        if (address.size() == sizeof(client.peerAddress)) {
+            std::memcpy(&client.peerAddress, address.data(), address.size());
+        }
+        if (admission_.enabled()) {
+            client.sourceKey = AdmissionTable::slotKey(client.peerAddress);
+            admission_.hold(client.sourceKey);
+        }
+        if (!client.nickname.empty()) {
+            nicknames_.claim(client.nickname, client.handle, formatAddress(client.peerAddress));
+        }
+        if (!client.channelName.empty()) {
+            client.channel = &directory_.find(client.channelName);
+        }
+        if (client.binary) {
+            client.frames.restore(carried, parserState);
+        } else {
+            client.input.restore(carried, parserState != 0);
+        }
+        startTimeouts(client);
+        for (std::string_view bytes : output) {
+            queueMessage(client, MessageBuffer::compose({ bytes }, '\0'));
+        }
+        return client.handle;
+    }
+
+    // Rebuilds a channel on its home shard here, which need not be its home
+    // in the old process. handles maps the old process's client numbers to
+    // clients here.
+    void importChannel(const std::string& channelName, SnapshotReader& in, const std::vector<ClientHandle>& handles) {
+        Channel& channel = channels_[channelName];
+        channel.name = channelName;
+        channel.slot = &directory_.find(channelName);
+        channel.adminNickname = in.bytes();
+        uint64_t members = in.number();
+        for (uint64_t i = 0; i < members && !in.failed(); i++) {
+            uint64_t ref = in.number();
+            std::string_view nickname = in.bytes();
+            uint64_t flags = in.number();
+            if (ref != 0 && ref <= handles.size() && handles[ref - 1] != 0 && channel.findMember(handles[ref - 1]) == nullptr) {
+                channel.addMember({ handles[ref - 1], std::string(nickname), (flags & HANDOVER_CONNECTED) != 0,
+                                    (flags & HANDOVER_MUTED) != 0, (flags & HANDOVER_KICKED) != 0, (flags & HANDOVER_BINARY) != 0 });
+            }
+        }
+        readNames(in, channel.mutedUsers);
+        readNames(in, channel.kickedUsers);
+        openHistory(channel, channelName);
+        publishSnapshot(channel);
+    }
+
+    void importAdmin(const std::string& channelName, ClientHandle client) {
+        channelNameToAdmin_[channelName] = client;
+    }
+
+    // Coroutines mode: the handed over clients' sessions start once every
+    // client and channel is in place.
+    void startSessions() {
+#if SERVER_COROUTINES
+        if (config_.ioMode == IoMode::Coroutines) {
+            clients_.forEach([&](Client& client) {
+                runSession(client.handle);
+            });
+        }
+#endif
+    }
+
+private:
+    // Uring mode: one sendmsg() in flight for a client. It holds references
+    // to the buffers it sends, so they outlive a client closed meanwhile.
+    struct SendOp {
+        ClientHandle client = 0;
+        msghdr header{};
+        iovec iov[MAX_WRITE_BATCH];
+        MessageBuffer buffers[MAX_WRITE_BATCH];
+        size_t count = 0;
+    };
+
+    int homeShard(std::string_view channelName) const {
+        return homeShardOf(channelName, shards_.size());
+    }
+
+    // post() target of the link thread, when the server is federated.
+    int linkTarget() const {
+        return static_cast<int>(shards_.size());
+    }
+
+    ShardMailbox& mailbox(int target) {
+        return target == linkTarget() ? *links_->inboxes[index_] : *shards_[target]->inboxes_[index_];
+    }
+
+    // Hands a message to the shard that has to act on it. Messages for this
+    // shard are handled right away, without touching the heap; the rest go
+    // through the target's mailbox and are flushed, with a single wake-up per
+    // target, at the end of the current event loop iteration.
+    void post(int shard, ShardMessage&& message) {
+        if (shard == index_) {
+            handleShardMessage(message);
+            return;
+        }
+
+        ShardMessage* remote = new ShardMessage(std::move(message));
+        std::deque<ShardMessage*>& backlog = outboxes_[shard];
+        if (!backlog.empty() || !mailbox(shard).push(remote)) {
+            backlog.push_back(remote);
+        }
+        wakePending_[shard] = true;
+    }
+
+    ShardMessage makeMessage(ShardMessage::Type type, ClientHandle clientId, const std::string& channelName) {
+        ShardMessage message;
+        message.type = type;
+        message.client = clientId;
+        message.channelName = channelName;
+        Client* client = clients_.find(clientId);
+        if (client != nullptr) {
+            message.nickname = client->nickname;
+            message.isConnected = client->isConnected;
+            message.isBinary = client->binary;
+        }
+        return message;
+    }
+
+    void flushOutboxes() {
+        for (size_t shard = 0; shard < outboxes_.size(); shard++) {
+            std::deque<ShardMessage*>& backlog = outboxes_[shard];
+            while (!backlog.empty() && mailbox(static_cast<int>(shard)).push(backlog.front())) {
+                backlog.pop_front();
+            }
+            if (wakePending_[shard]) {
+                wakePending_[shard] = false;
+                if (static_cast<int>(shard) == linkTarget()) {
+                    links_->wake();
+                } else {
+                    shards_[shard]->wake();
+                }
+            }
+        }
+    }
+
+    bool hasBacklog() const {
+        for (const auto& backlog : outboxes_) {
+            if (!backlog.empty()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Returns whether there was anything to handle.
+    bool drainInboxes() {
+        bool drained = false;
+        for (auto& inbox : inboxes_) {
+            ShardMessage* raw;
+            while (inbox->pop(raw)) {
+                std::unique_ptr<ShardMessage> message(raw);
+                handleShardMessage(*message);
+                drained = true;
+            }
+        }
+        return drained;
+    }
+
+    void handleShardMessage(const ShardMessage& message) {
+        switch (message.type) {
+        case ShardMessage::Type::Join:
+            joinChannel(message);
+            break;
+        case ShardMessage::Type::Leave:
+            removeUserFromChannel(message);
+            break;
+        case ShardMessage::Type::Connect:
+            connectMember(message);
+            break;
+        case ShardMessage::Type::Chat:
+            if (!isMuted(message.client, message.channelName) && !isKicked(message.client, message.channelName)) {
+                if (config_.chatEcho) {
+                    LOG_INFO(message.payload.view().substr(0, message.payload.size() - 1));
+                }
+                broadcastMessage(message.payload, message.channelName, message.frame, message.sequence);
+                appendHistory(message.channelName, message.payload, message.sequence);
+                auto it = channels_.find(message.channelName);
+                if (it != channels_.end()) {
+                    federate(*it->second.slot, message.channelName, message.payload);
+                }
+            } else {
+                appendHistory(message.channelName, MessageBuffer(), message.sequence);
+            }
+            break;
+        case ShardMessage::Type::Ping:
+            broadcastMessage(makeMessageBuffer({ "Server: pong" }), message.channelName);
+            break;
+        case ShardMessage::Type::Kick:
+            kickUser(message.text, message.channelName);
+            break;
+        case ShardMessage::Type::Mute:
+            muteUser(message.text, message.channelName);
+            break;
+        case ShardMessage::Type::Unmute:
+            unmuteUser(message.text, message.channelName);
+            break;
+        case ShardMessage::Type::GrantAdmin: {
+            Client* client = clients_.find(message.client);
+            if (client != nullptr) {
+                client->isAdmin = true;
+            }
+            break;
+        }
+        case ShardMessage::Type::Deliver:
+            if (message.snapshot.get() != nullptr) {
+                deliverMessage(message.snapshot.get()->recipients[index_], message.payload, message.frame,
+                               message.channelName, message.sequence);
+            } else {
+                deliverMessage(message.clients, message.payload, message.frame, message.channelName, message.sequence);
+            }
+            break;
+        case ShardMessage::Type::Append:
+            appendHistory(message.channelName, message.payload, message.sequence);
+            break;
+        case ShardMessage::Type::Replay: {
+            Client* client = clients_.find(message.client);
+            if (client != nullptr) {
+                receiveReplay(*client, message);
+            }
+            break;
+        }
+        case ShardMessage::Type::Relay: {
+            if (config_.chatEcho) {
+                LOG_INFO(message.payload.view().substr(0, message.payload.size() - 1));
+            }
+            auto it = channels_.find(message.channelName);
+            uint64_t sequence = it != channels_.end() ? takeChatSequence(*it->second.slot) : 0;
+            broadcastMessage(message.payload, message.channelName, MessageBuffer(), sequence);
+            appendHistory(message.channelName, message.payload, sequence);
+            break;
+        }
+        case ShardMessage::Type::Federate:
+        case ShardMessage::Type::Membership:
+            break; // link thread only
+        }
+    }
+
+    bool isMuted(ClientHandle client, const std::string& channelName) {
+        auto it = channels_.find(channelName);
+        if (it != channels_.end()) {
+            const ChannelMember* member = it->second.findMember(client);
+            return member != nullptr && member->isMuted;
+        }
+        return false;
+    }
+
+    bool isKicked(ClientHandle client, const std::string& channelName) {
+        auto it = channels_.find(channelName);
+        if (it != channels_.end()) {
+            const ChannelMember* member = it->second.findMember(client);
+            return member != nullptr && member->isKicked;
+        }
+        return false;
+    }
+
+    bool createServerSocket() {
+        serverSocket_ = socket(AF_INET, SOCK_STREAM, 0);
+        if (serverSocket_ == -1) {
+            LOG_ERROR("Failed to create server socket");
+            return false;
+        }
+
+        // Every epoll shard binds its own listener to the same port and lets
+        // the kernel spread incoming connections across them.
+        if (config_.ioMode != IoMode::Threads) {
+            int enable = 1;
+            if (setsockopt(serverSocket_, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) == -1) {
+                LOG_ERROR("Failed to enable SO_REUSEPORT on server socket");
+                ::close(serverSocket_);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool bindServerSocket() {
+        sockaddr_in serverAddress{};
+        serverAddress.sin_family = AF_INET;
+        serverAddress.sin_port = htons(config_.port);
+        serverAddress.sin_addr.s_addr = htonl(INADDR_ANY);
+
+        if (bind(serverSocket_, reinterpret_cast<struct sockaddr*>(&serverAddress), sizeof(serverAddress)) == -1) {
+            LOG_ERROR("Failed to bind server socket");
+#ifdef _WIN32
+            closesocket(serverSocket_);
+#else
+            ::close(serverSocket_);
+#endif
+            return false;
+        }
+
+        return true;
+    }
+
+    bool listenForClients() {
+        if (listen(serverSocket_, SOMAXCONN) == -1) {
+            LOG_ERROR("Failed to listen for clients");
+#ifdef _WIN32
+            closesocket(serverSocket_);
+#else
+            ::close(serverSocket_);
+#endif
+            return false;
+        }
+
+        return true;
+    }
+
+    // Threads mode: the accept thread also keeps the shard's clock, waking
+    // at least once a tick to run the client timers.
+    void acceptClients() {
+        while (running_) {
+            pollfd listener = { serverSocket_, POLLIN, 0 };
+            int ready = poll(&listener, 1, TIMER_TICK_MILLIS);
+            {
+                std::lock_guard<std::mutex> lock(clientsMutex_);
+                currentTick_ = timerTick();
+                expireTimers();
+            }
+            if (ready <= 0) {
+                if (ready == -1 && errno != EINTR) {
+                    LOG_ERROR("Failed to poll server socket");
+                }
+                continue;
+            }
+
+            sockaddr_storage address{};
+            socklen_t addressLength = sizeof(address);
+            int clientSocket = accept(serverSocket_, reinterpret_cast<sockaddr*>(&address), &addressLength);
+            if (clientSocket == -1) {
+                if (running_) {
+                    LOG_ERROR("Failed to accept client connection");
+                }
+                continue;
+            }
+            uint32_t sourceKey;
+            if (!admitConnection(clientSocket, address, sourceKey)) {
+                continue;
+            }
+
+            int wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (wakeFd == -1) {
+                LOG_ERROR("Failed to create wake-up eventfd for client");
+                admission_.release(sourceKey);
+                ::close(clientSocket);
+                continue;
+            }
+
+            metrics_.accepts.fetch_add(1, std::memory_order_relaxed);
+            ClientHandle clientId;
+            {
+                std::lock_guard<std::mutex> lock(clientsMutex_);
+                Client& client = clients_.add(clientSocket);
+                client.wakeFd = wakeFd;
+                client.sourceKey = sourceKey;
+                client.peerAddress = address;
+                clientId = client.handle;
+                clientThreads_++;
+                startTimeouts(client);
+            }
+
+            std::thread clientThread(&Shard::handleClient, this, clientSocket, clientId);
+            clientThread.detach();
+        }
+    }
+
+    // Checks a new connection against its source's limits before anything is
+    // set up for it. A rejected socket is reset instead of closed gracefully,
+    // so a flood leaves no TIME_WAIT sockets behind either.
+    bool admitConnection(int clientSocket, const sockaddr_storage& address, uint32_t& sourceKey) {
+        sourceKey = 0;
+        if (!admission_.enabled()) {
+            return true;
+        }
+        sourceKey = AdmissionTable::slotKey(address);
+        if (admission_.admit(sourceKey, monotonicNanos())) {
+            return true;
+        }
+        metrics_.connectionsRejected.fetch_add(1, std::memory_order_relaxed);
+        linger reset{ 1, 0 };
+        setsockopt(clientSocket, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+        ::close(clientSocket);
+        return false;
+    }
+
+    // Threads mode: the client's own thread reads from it and, when other
+    // threads left output the socket would not take right away, writes it.
+    void handleClient(int clientSocket, ClientHandle clientId) {
+        char buffer[READ_BUFFER_SIZE];
+        int wakeFd;
+        bool hasOutput;
+        {
+            std::lock_guard<std::mutex> lock(clientsMutex_);
+            wakeFd = clients_.find(clientId)->wakeFd;
+            hasOutput = false;
+        }
+
+        while (running_) {
+            pollfd fds[2] = { { clientSocket, static_cast<short>(POLLIN | (hasOutput ? POLLOUT : 0)), 0 }, { wakeFd, POLLIN, 0 } };
+            if (poll(fds, 2, -1) == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                LOG_ERROR("Failed to poll client ", clientId);
+                break;
+            }
+
+            std::lock_guard<std::mutex> lock(clientsMutex_);
+            Client& client = *clients_.find(clientId);
+            if (fds[1].revents & POLLIN) {
+                uint64_t value;
+                if (read(wakeFd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+                    LOG_ERROR("Failed to read wake-up eventfd");
+                }
+            }
+            if ((fds[0].revents & POLLOUT) && !flushOutput(client)) {
+                LOG_WARNING("Failed to send message to client ", clientId);
+                break;
+            }
+            hasOutput = !client.outputQueue.empty();
+            if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+
+            int bytesRead = recv(clientSocket, buffer, sizeof(buffer), MSG_DONTWAIT);
+            if (bytesRead == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                continue;
+            }
+            if (bytesRead == 0) {
+                LOG_INFO("Client ", client.nickname, " disconnected");
+                break;
+            } else if (bytesRead == -1) {
+                LOG_WARNING("Failed to receive message from client ", client.nickname);
+                break;
+            }
+
+            metrics_.bytesIn.fetch_add(bytesRead, std::memory_order_relaxed);
+            if (!receiveLines(clientId, client, buffer, bytesRead)) {
+                break;
+            }
+            hasOutput = !client.outputQueue.empty();
+        }
+
+        std::lock_guard<std::mutex> lock(clientsMutex_);
+        closeClient(clientId);
+        if (--clientThreads_ == 0) {
+            clientThreadsDone_.notify_all();
+        }
+    }
+
+    // Feeds freshly read bytes through the client's line or frame parser
+    // and runs every complete line or frame. Returns false when the
+    // connection has to be closed.
+    bool receiveLines(ClientHandle clientId, Client& client, const char* data, size_t length) {
+        client.lastInputTick = currentTick_;
+        client.pingSent = false;
+        std::string_view rest(data, length);
+        std::string_view input;
+        while (nextInput(client, rest, input)) {
+            auto start = std::chrono::steady_clock::now();
+            bool keepOpen = handleInput(clientId, client, input);
+            metrics_.commandNanos.record(elapsedNanos(start));
+            if (!keepOpen) {
+                return false;
+            }
+        }
+        if (client.frames.malformed()) {
+            LOG_WARNING("Closing client ", client.nickname, ": malformed frame");
+            return false;
+        }
+        return true;
+    }
+
+    // The next complete line, or frame once the client switched to the
+    // binary protocol. The switch can happen between two lines of the same
+    // read, so the parser is picked anew for every one.
+    static bool nextInput(Client& client, std::string_view& data, std::string_view& input) {
+        return client.binary ? client.frames.next(data, input) : client.input.next(data, input);
+    }
+
+    bool handleInput(ClientHandle clientId, Client& client, std::string_view input) {
+        return client.binary ? handleFrame(clientId, client, input) : handleMessage(clientId, input);
+    }
+
+    // Runs one frame from a binary client. The frames that have a text
+    // command counterpart share its code; Chat goes straight to the
+    // client's channel by ID. Unknown opcodes are ignored.
+    bool handleFrame(ClientHandle clientId, Client& client, std::string_view frame) {
+        Opcode opcode = static_cast<Opcode>(frame[0]);
+        std::string_view body = frame.substr(1);
+        if (opcode == Opcode::Command && !hasLineBreak(body)) {
+            return handleMessage(clientId, body);
+        }
+        if (!admitLine(client, frame)) {
+            return true;
+        }
+        switch (opcode) {
+        case Opcode::Nickname:
+            if (acceptFrameText(client, body)) {
+                setNickname(client, body);
+            }
+            break;
+        case Opcode::Join:
+            if (acceptFrameText(client, body)) {
+                switchChannel(clientId, client, body);
+            }
+            break;
+        case Opcode::Command:
+            acceptFrameText(client, body); // only gets here with a line break
+            break;
+        case Opcode::Connect:
+            connectClient(clientId, client);
+            break;
+        case Opcode::Chat: {
+            uint64_t channelId;
+            if (decodeVarint(body, channelId) == VarintStatus::Complete && client.isConnected && client.channel != nullptr &&
+                channelId == client.channel->id && acceptFrameText(client, body)) {
+                sendChat(clientId, client, body);
+            }
+            break;
+        }
+        default:
+            break;
+        }
+        return true;
+    }
+
+    static bool hasLineBreak(std::string_view text) {
+        return text.find_first_of("\r\n") != std::string_view::npos;
+    }
+
+    // A text line cannot hold a line break, but a frame can, and the code
+    // shared with the text protocol splices frame text into LF terminated
+    // lines: to text clients, into the channel log and onto peer links. A
+    // frame whose text has CR or LF goes nowhere, and only its sender
+    // hears why.
+    bool acceptFrameText(Client& client, std::string_view text) {
+        if (!hasLineBreak(text)) {
+            return true;
+        }
+        LOG_WARNING("Ignoring a frame from client ", client.nickname, ": its text contains a line break");
+        if (!sendMessage(client, { "Your frame was ignored: its text contains a line break." })) {
+            LOG_WARNING("Failed to send message to client ", client.handle);
+        }
+        return false;
+    }
+
+    // Runs one command or chat line from a client. Anything that reads or
+    // changes channel state is forwarded to the channel's home shard.
+    // Returns false when the connection has to be closed.
+    bool handleMessage(ClientHandle clientId, std::string_view message) {
+        Client& client = *clients_.find(clientId);
+        if (!admitLine(client, message)) {
+            return true;
+        }
+        std::string_view argument;
+        Command command = parseCommand(message, argument);
+        if (command == Command::Nickname) {
+            setNickname(client, argument);
+        } else if (command == Command::Connect) {
+            connectClient(clientId, client);
+        } else if (command == Command::Join) {
+            switchChannel(clientId, client, argument);
+        } else if (command == Command::Binary) {
+            switchToFrames(client);
+        } else if (command == Command::Chat && client.isConnected) {
+            if (!client.channelName.empty()) {
+                sendChat(clientId, client, message);
+            }
+        } else if (command == Command::Pong) {
+            // Its arrival was all that mattered.
+        } else if (command == Command::Ping) {
+            LOG_INFO("Server: pong");
+            if (!client.channelName.empty()) {
+                post(homeShard(client.channelName), makeMessage(ShardMessage::Type::Ping, clientId, client.channelName));
+            }
+        } else if (command != Command::None && !client.isConnected && !client.channelName.empty()) {
+            // Check if the client is muted or kicked
+            if (client.failedAttempts < 5) {
+                if (!sendMessage(client, { "Please use the /connect command to establish a connection." })) {
+                    LOG_WARNING("Failed to send message to client ", clientId);
+                }
+                client.failedAttempts++;
+            } else {
+                LOG_INFO("Connection closed with client ", client.nickname, " due to multiple failed attempts.");
+                return false;
+            }
+        } else if (command == Command::Kick) {
+            forwardAdminCommand(clientId, ShardMessage::Type::Kick, argument, "/kick");
+        } else if (command == Command::Mute) {
+            forwardAdminCommand(clientId, ShardMessage::Type::Mute, argument, "/mute");
+        } else if (command == Command::Unmute) {
+            forwardAdminCommand(clientId, ShardMessage::Type::Unmute, argument, "/unmute");
+        } else if (command == Command::Whois) {
+            if (client.isAdmin) {
+                // The registry has the address, whichever shard owns the user.
+                std::string address;
+                if (nicknames_.address(argument, address) && !sendMessage(client, { "User ", argument, " IP: ", address })) {
+                    LOG_WARNING("Failed to send message to client ", clientId);
+                }
+            } else {
+                if (!sendMessage(client, { "You don't have permission to use the /whois command." })) {
+                    LOG_WARNING("Failed to send message to client ", clientId);
+                }
+            }
+        }
+        return true;
+    }
+
+    // Nicknames are unique: the new one is claimed before the old one is
+    // given up, and a taken one leaves the client as it was.
+    void setNickname(Client& client, std::string_view nickname) {
+        if (nickname == client.nickname) {
+            return;
+        }
+        if (!nickname.empty() && !nicknames_.claim(nickname, client.handle, formatAddress(client.peerAddress))) {
+            if (!sendMessage(client, { "Nickname ", nickname, " is already in use." })) {
+                LOG_WARNING("Failed to send message to client ", client.handle);
+            }
+            return;
+        }
+        if (!client.nickname.empty()) {
+            nicknames_.release(client.nickname, client.handle);
+        }
+        client.nickname.assign(nickname.data(), nickname.size());
+        client.chatHeader.clear();
+    }
+
+    void connectClient(ClientHandle clientId, Client& client) {
+        client.isConnected = true;
+        LOG_INFO(client.nickname, " connected.");
+        if (!client.channelName.empty()) {
+            expectReplay(client);
+            post(homeShard(client.channelName), makeMessage(ShardMessage::Type::Connect, clientId, client.channelName));
+        }
+    }
+
+    // Binary clients learn the channel's ID here, before any of its
+    // messages can reach them.
+    void switchChannel(ClientHandle clientId, Client& client, std::string_view channelName) {
+        if (channelName.empty()) {
+            return;
+        }
+        if (!client.channelName.empty()) {
+            post(homeShard(client.channelName), makeMessage(ShardMessage::Type::Leave, clientId, client.channelName));
+        }
+        releaseHeldLines(client);
+        client.replayedFrom = 0;
+        client.replayedTo = 0;
+        client.channelName.assign(channelName.data(), channelName.size());
+        client.channel = &directory_.find(client.channelName);
+        client.chatHeader.clear();
+        if (client.binary) {
+            char id[MAX_VARINT_LENGTH];
+            std::string_view idBytes(id, encodeVarint(client.channel->id, id));
+            FrameHeader header(Opcode::Channel, idBytes.size() + channelName.size());
+            queueMessage(client, MessageBuffer::compose({ header.view(), idBytes, channelName }, '\0'));
+        }
+        if (client.isConnected) {
+            expectReplay(client);
+        }
+        post(homeShard(client.channelName), makeMessage(ShardMessage::Type::Join, clientId, client.channelName));
+    }
+
+    // The home shard answers every Connect, and every Join of a connected
+    // client, with a Replay when the server keeps history. Until it is
+    // here, the client's channel output waits in heldLines.
+    void expectReplay(Client& client) {
+        if (!config_.historyDir.empty()) {
+            client.pendingReplays++;
+        }
+    }
+
+    // "/binary" is only honored as a connection's first line, so nothing
+    // has been said about the client to a channel in the other protocol.
+    void switchToFrames(Client& client) {
+        if (client.binary || !client.nickname.empty() || !client.channelName.empty() || client.isConnected) {
+            if (!sendMessage(client, { "The binary protocol can only be chosen right after connecting." })) {
+                LOG_WARNING("Failed to send message to client ", client.handle);
+            }
+            return;
+        }
+        client.binary = true;
+        char body[2 * MAX_VARINT_LENGTH];
+        size_t length = encodeVarint(BINARY_PROTOCOL_VERSION, body);
+        length += encodeVarint(client.handle, body + length);
+        FrameHeader header(Opcode::Welcome, length);
+        queueMessage(client, MessageBuffer::compose({ header.view(), std::string_view(body, length) }, '\0'));
+    }
+
+    // A chat line as a ChatMessage frame. The part of the frame that only
+    // depends on the sender is encoded once and kept until its nickname or
+    // channel changes.
+    MessageBuffer encodeChatFrame(Client& client, std::string_view text) {
+        if (client.chatHeader.empty()) {
+            appendVarint(client.chatHeader, client.channel->id);
+            appendVarint(client.chatHeader, client.handle);
+            appendVarint(client.chatHeader, client.nickname.size());
+            client.chatHeader += client.nickname;
+        }
+        FrameHeader header(Opcode::ChatMessage, client.chatHeader.size() + text.size());
+        return MessageBuffer::compose({ header.view(), client.chatHeader, text }, '\0');
+    }
+
+    // Charges a line to the client's line and byte budgets. A line over
+    // either budget is dropped before it is parsed, let alone fanned out,
+    // and the client is told once each time it starts going over.
+    bool admitLine(Client& client, std::string_view line) {
+        if (!config_.commandLimit.enabled() && !config_.byteLimit.enabled()) {
+            return true;
+        }
+        uint64_t now = monotonicNanos();
+        uint64_t commandBucket = client.commandBucket;
+        uint64_t byteBucket = client.byteBucket;
+        if (config_.commandLimit.take(commandBucket, now, 1) && config_.byteLimit.take(byteBucket, now, line.size() + 1)) {
+            client.commandBucket = commandBucket;
+            client.byteBucket = byteBucket;
+            client.isThrottled = false;
+            return true;
+        }
+
+        metrics_.linesThrottled.fetch_add(1, std::memory_order_relaxed);
+        if (!client.isThrottled) {
+            client.isThrottled = true;
+            if (!sendMessage(client, { "You are sending too fast; messages are being dropped." })) {
+                LOG_WARNING("Failed to send message to client ", client.handle);
+            }
+        }
+        return false;
+    }
+
+    // Checks the sender against the channel's current snapshot and fans the
+    // line out from this shard, without a lock and without a hop to the
+    // channel's home. Until the home shard has published a snapshot that
+    // lists the sender (right after /join) the line takes the old route
+    // through the home shard, which holds the authoritative state.
+    //
+    // With history, the line takes its chat sequence before it reads the
+    // snapshot, and the home shard reads the counter right after it
+    // publishes a snapshot with a new recipient (see replayHistory()). Both
+    // sides are sequentially consistent, so a line either comes before the
+    // recipient's replay cut-off or is fanned out to the recipient live.
+    // Every sequence taken reaches the home shard, in a Chat or an Append,
+    // so the log never waits for one that will not come.
+    void sendChat(ClientHandle clientId, Client& client, std::string_view message) {
+        if (config_.chatFilter.enabled() && !filterChat(client, message)) {
+            return;
+        }
+        MessageBuffer payload = makeMessageBuffer({ client.nickname, ": ", message });
+        uint64_t sequence = takeChatSequence(*client.channel);
+        const ChannelSnapshot* snapshot = client.channel->current.load(std::memory_order_seq_cst);
+        const uint32_t* flags = snapshot != nullptr ? snapshot->members.find(clientId) : nullptr;
+        if (flags == nullptr) {
+            auto chat = makeMessage(ShardMessage::Type::Chat, clientId, client.channelName);
+            chat.payload = std::move(payload);
+            chat.frame = encodeChatFrame(client, message);
+            chat.sequence = sequence;
+            post(homeShard(client.channelName), std::move(chat));
+            return;
+        }
+        if (*flags & (MEMBER_MUTED | MEMBER_KICKED)) {
+            if (sequence != 0) {
+                auto skip = makeMessage(ShardMessage::Type::Append, clientId, client.channelName);
+                skip.sequence = sequence;
+                post(homeShard(client.channelName), std::move(skip));
+            }
+            return;
+        }
+        if (config_.chatEcho) {
+            LOG_INFO(payload.view().substr(0, payload.size() - 1));
+        }
+        MessageBuffer frame = snapshot->hasBinaryRecipients ? encodeChatFrame(client, message) : MessageBuffer();
+        fanOut(*snapshot, *client.channel, payload, frame, client.channelName, sequence);
+        federate(*client.channel, client.channelName, payload);
+        if (sequence != 0) {
+            auto append = makeMessage(ShardMessage::Type::Append, clientId, client.channelName);
+            append.payload = std::move(payload);
+            append.sequence = sequence;
+            post(homeShard(client.channelName), std::move(append));
+        }
+    }
+
+    // 0 when the server keeps no history: nothing is ordered then.
+    uint64_t takeChatSequence(ChannelSlot& slot) {
+        return config_.historyDir.empty() ? 0 : slot.chatSequence.fetch_add(1, std::memory_order_seq_cst);
+    }
+
+    // Runs a chat line through the configured filter before anything else
+    // sees it. A refused line goes nowhere, not even to the home shard or
+    // the history, and only its sender hears why. On success message may
+    // point into filterScratch_, valid until the next chat line.
+    bool filterChat(Client& client, std::string_view& message) {
+        const char* reason;
+        switch (config_.chatFilter.apply(message, filterScratch_)) {
+        case MessageFilter::Verdict::Pass:
+            return true;
+        case MessageFilter::Verdict::InvalidUtf8:
+            metrics_.chatInvalidUtf8.fetch_add(1, std::memory_order_relaxed);
+            reason = "it is not valid UTF-8.";
+            break;
+        case MessageFilter::Verdict::TooLong:
+            metrics_.chatTooLong.fetch_add(1, std::memory_order_relaxed);
+            reason = "it is too long.";
+            break;
+        default:
+            metrics_.chatBlocked.fetch_add(1, std::memory_order_relaxed);
+            reason = "it contains a blocked word.";
+            break;
+        }
+        if (!sendMessage(client, { "Your message was not sent: ", reason })) {
+            LOG_WARNING("Failed to send message to client ", client.handle);
+        }
+        return false;
+    }
+
+    // Hands a chat line from a local client to the link thread, which sends
+    // it to the other nodes, but only while some other node has recipients.
+    void federate(ChannelSlot& slot, const std::string& channelName, const MessageBuffer& payload) {
+        if (links_ == nullptr || slot.remoteNodes.load(std::memory_order_relaxed) == 0) {
+            return;
+        }
+        auto message = makeMessage(ShardMessage::Type::Federate, 0, channelName);
+        message.payload = payload;
+        post(linkTarget(), std::move(message));
+    }
+
+    void forwardAdminCommand(ClientHandle clientId, ShardMessage::Type type, std::string_view username, std::string_view command) {
+        Client& client = *clients_.find(clientId);
+        if (client.isAdmin) {
+            auto request = makeMessage(type, clientId, client.channelName);
+            request.text = std::string(username);
+            post(homeShard(client.channelName), std::move(request));
+        } else {
+            if (!sendMessage(client, { "You don't have permission to use the ", command, " command." })) {
+                LOG_WARNING("Failed to send message to client ", clientId);
+            }
+        }
+    }
+
+    bool createEventLoop() {
+        if (!setNonBlocking(serverSocket_)) {
+            LOG_ERROR("Failed to make server socket non-blocking");
+            return false;
+        }
+
+        wakeFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wakeFd_ == -1) {
+            LOG_ERROR("Failed to create wake-up eventfd");
+            return false;
+        }
+
+        // The link thread, if any, gets the mailbox after the shards'.
+        size_t senders = shards_.size() + (links_ != nullptr ? 1 : 0);
+        for (size_t sender = 0; sender < senders; sender++) {
+            inboxes_.emplace_back(new ShardMailbox());
+        }
+        outboxes_.resize(senders);
+        wakePending_.resize(senders, false);
+
+        if (config_.ioMode == IoMode::Uring) {
+            return createRing();
+        }
+
+        epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+        if (epollFd_ == -1) {
+            LOG_ERROR("Failed to create epoll instance");
+            return false;
+        }
+
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLET;
+        event.data.u64 = LISTENER_TOKEN;
+        if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, serverSocket_, &event) == -1) {
+            LOG_ERROR("Failed to register server socket with epoll");
+            return false;
+        }
+
+        event.events = EPOLLIN;
+        event.data.u64 = WAKE_TOKEN;
+        if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, wakeFd_, &event) == -1) {
+            LOG_ERROR("Failed to register wake-up eventfd with epoll");
+            return false;
+        }
+
+        return true;
+    }
+
+    bool setNonBlocking(int socket) {
+        int flags = fcntl(socket, F_GETFL, 0);
+        return flags != -1 && fcntl(socket, F_SETFL, flags | O_NONBLOCK) != -1;
+    }
+
+    // The shard's reactor: accepts, reads, dispatches and writes for every
+    // client it owns and serves the requests other shards send it. All
+    // sockets are non-blocking and edge-triggered, so each readiness event
+    // is drained until EAGAIN.
+    void runEventLoop() {
+        epoll_event events[MAX_EPOLL_EVENTS];
+
+        while (running_) {
+            // Offline while blocked, so snapshot reclamation never waits on
+            // an idle shard.
+            epochs_.exit(index_);
+            if (pauseRequested_.load(std::memory_order_relaxed)) {
+                park();
+            }
+            // Sessions resumed by the last flush may have queued more output,
+            // and pending timers need the clock to keep ticking.
+            int timeout = !scheduledFlushes_.empty() ? 0 : hasBacklog() ? 1 : timers_.size() != 0 ? TIMER_TICK_MILLIS : -1;
+            int count = epoll_wait(epollFd_, events, MAX_EPOLL_EVENTS, timeout);
+            epochs_.enter(index_);
+            currentTick_ = timerTick();
+            if (count == -1) {
+                if (errno != EINTR) {
+                    LOG_ERROR("epoll_wait failed");
+                    break;
+                }
+                continue;
+            }
+
+            for (int i = 0; i < count; i++) {
+                uint64_t token = events[i].data.u64;
+                if (token == WAKE_TOKEN) {
+                    uint64_t value;
+                    if (read(wakeFd_, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+                        LOG_ERROR("Failed to read wake-up eventfd");
+                    }
+                    continue;
+                }
+                if (token == LISTENER_TOKEN) {
+                    acceptReadyClients();
+                    continue;
+                }
+
+                ClientHandle clientId = token;
+                Client* client = clients_.find(clientId);
+                if (client == nullptr) {
+                    continue;
+                }
+
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    LOG_WARNING("Failed to receive message from client ", client->nickname);
+                    closeClient(clientId);
+                    continue;
+                }
+                if ((events[i].events & EPOLLOUT) && !flushOutput(*client)) {
+                    LOG_WARNING("Failed to send message to client ", clientId);
+                    closeClient(clientId);
+                    continue;
+                }
+#if SERVER_COROUTINES
+                if (config_.ioMode == IoMode::Coroutines) {
+                    wakeSession(*client, events[i].events);
+                    continue;
+                }
+#endif
+                if (events[i].events & EPOLLIN) {
+                    readFromClient(clientId);
+                }
+            }
+
+            expireTimers();
+            drainInboxes();
+            flushScheduledClients();
+            flushOutboxes();
+            reclaimSnapshots();
+        }
+        epochs_.exit(index_);
+    }
+
+    // See pause().
+    void park() {
+        std::unique_lock<std::mutex> lock(pauseMutex_);
+        paused_ = true;
+        pauseChanged_.notify_all();
+        pauseChanged_.wait(lock, [&] { return !pauseRequested_.load(std::memory_order_relaxed); });
+        paused_ = false;
+        pauseChanged_.notify_all();
+    }
+
+    static void writeNames(SnapshotWriter& out, const std::unordered_set<std::string>& names) {
+        out.number(names.size());
+        for (const std::string& name : names) {
+            out.bytes(name);
+        }
+    }
+
+    static void readNames(SnapshotReader& in, std::unordered_set<std::string>& names) {
+        uint64_t count = in.number();
+        for (uint64_t i = 0; i < count && !in.failed(); i++) {
+            names.emplace(in.bytes());
+        }
+    }
+
+    // Writes out everything queued for clients during this loop iteration,
+    // so messages that arrived together leave in one sendmsg() batch.
+    void flushScheduledClients() {
+        flushing_.swap(scheduledFlushes_);
+        for (ClientHandle clientId : flushing_) {
+            Client* client = clients_.find(clientId);
+            if (client == nullptr) {
+                continue;
+            }
+            client->flushScheduled = false;
+            if (client->isEvicted) {
+                closeClient(clientId);
+                continue;
+            }
+            if (!flushOutput(*client)) {
+                LOG_WARNING("Failed to send message to client ", clientId);
+                closeClient(clientId);
+                continue;
+            }
+#if SERVER_COROUTINES
+            wakeSession(*client, EPOLLOUT);
+#endif
+        }
+        flushing_.clear();
+    }
+
+    void acceptReadyClients() {
+        while (true) {
+            sockaddr_storage address{};
+            socklen_t addressLength = sizeof(address);
+            int clientSocket = accept4(serverSocket_, reinterpret_cast<sockaddr*>(&address), &addressLength, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (clientSocket == -1) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    LOG_ERROR("Failed to accept client connection");
+                }
+                return;
+            }
+            uint32_t sourceKey;
+            if (!admitConnection(clientSocket, address, sourceKey)) {
+                continue;
+            }
+
+            metrics_.accepts.fetch_add(1, std::memory_order_relaxed);
+            Client& client = clients_.add(clientSocket);
+            client.sourceKey = sourceKey;
+            client.peerAddress = address;
+            epoll_event event{};
+            event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            event.data.u64 = client.handle;
+            if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, clientSocket, &event) == -1) {
+                LOG_ERROR("Failed to register client socket with epoll");
+                admission_.release(sourceKey);
+                clients_.remove(client);
+                ::close(clientSocket);
+                continue;
+            }
+            startTimeouts(client);
+#if SERVER_COROUTINES
+            if (config_.ioMode == IoMode::Coroutines) {
+                runSession(client.handle);
+            }
+#endif
+        }
+    }
+
+    void readFromClient(ClientHandle clientId) {
+        char buffer[READ_BUFFER_SIZE];
+        Client& client = *clients_.find(clientId);
+
+        while (true) {
+            ssize_t bytesRead = recv(client.socket, buffer, sizeof(buffer), 0);
+            if (bytesRead == 0) {
+                LOG_INFO("Client ", client.nickname, " disconnected");
+                closeClient(clientId);
+                return;
+            } else if (bytesRead == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return;
+                }
+                LOG_WARNING("Failed to receive message from client ", client.nickname);
+                closeClient(clientId);
+                return;
+            }
+
+            metrics_.bytesIn.fetch_add(bytesRead, std::memory_order_relaxed);
+            if (!receiveLines(clientId, client, buffer, bytesRead)) {
+                closeClient(clientId);
+                return;
+            }
+        }
+    }
+
+#if SERVER_COROUTINES
+    // Coroutines mode: bytes a session has read but not parsed yet. They
+    // normally sit in the shard's read buffer, which the next session to
+    // read overwrites, so a session that suspends with input left over
+    // moves it to its own storage first.
+    struct SessionInput {
+        std::string_view pending;
+        std::string saved;
+
+        void save() {
+            bool inSaved = pending.data() >= saved.data() && pending.data() < saved.data() + saved.size();
+            if (!pending.empty() && !inSaved) {
+                saved.assign(pending.data(), pending.size());
+                pending = saved;
+            }
+        }
+    };
+
+    // Awaitable: the client's next line, or nothing once the connection is
+    // over. The session parks until the socket has a whole line for it.
+    struct AsyncReadLine : Waiter {
+        Shard& shard;
+        ClientHandle clientId;
+        SessionInput& input;
+        std::optional<std::string_view> line;
+
+        AsyncReadLine(Shard& owner, ClientHandle client, SessionInput& sessionInput)
+            : shard(owner), clientId(client), input(sessionInput) {
+            events = EPOLLIN;
+            ready = [](Waiter& waiter) {
+                auto& self = static_cast<AsyncReadLine&>(waiter);
+                return self.shard.pollLine(self.clientId, self.input, self.line);
+            };
+        }
+
+        bool await_ready() {
+            return ready(*this);
+        }
+
+        void await_suspend(std::coroutine_handle<> session) {
+            coroutine = session;
+            shard.clients_.find(clientId)->waiter = this;
+        }
+
+        std::optional<std::string_view> await_resume() {
+            return line;
+        }
+    };
+
+    // Awaitable: lets the event loop write the client's output and parks the
+    // session while that output is over half the queue limits. A client that
+    // stops reading is then no longer read from either, long before its
+    // overflow policy has to drop anything. False once the client is gone.
+    struct AsyncSend : Waiter {
+        Shard& shard;
+        ClientHandle clientId;
+        SessionInput& input;
+
+        AsyncSend(Shard& owner, ClientHandle client, SessionInput& sessionInput)
+            : shard(owner), clientId(client), input(sessionInput) {
+            events = EPOLLOUT;
+            ready = [](Waiter& waiter) {
+                auto& self = static_cast<AsyncSend&>(waiter);
+                return self.shard.outputDrained(self.clientId);
+            };
+        }
+
+        bool await_ready() {
+            return ready(*this);
+        }
+
+        void await_suspend(std::coroutine_handle<> session) {
+            input.save();
+            coroutine = session;
+            shard.clients_.find(clientId)->waiter = this;
+        }
+
+        bool await_resume() {
+            return shard.clients_.find(clientId) != nullptr;
+        }
+    };
+
+    // One connection, start to finish, in the style of handleClient. The
+    // task only runs while its client has input or room for output and
+    // costs a pooled frame the rest of the time.
+    Task runSession(ClientHandle clientId) {
+        SessionInput input;
+        while (std::optional<std::string_view> line = co_await AsyncReadLine(*this, clientId, input)) {
+            auto start = std::chrono::steady_clock::now();
+            bool keepOpen = handleInput(clientId, *clients_.find(clientId), *line);
+            metrics_.commandNanos.record(elapsedNanos(start));
+            if (!keepOpen || !co_await AsyncSend(*this, clientId, input)) {
+                break;
+            }
+        }
+        closeClient(clientId);
+    }
+
+    // Takes the next line (or frame) off the session's input, reading from
+    // the socket until one is complete. Returns false when the socket has
+    // nothing more for now; line is left empty when the connection is over.
+    bool pollLine(ClientHandle clientId, SessionInput& input, std::optional<std::string_view>& line) {
+        line.reset();
+        Client* client = clients_.find(clientId);
+        if (client == nullptr) {
+            return true;
+        }
+
+        std::string_view next;
+        while (!nextInput(*client, input.pending, next)) {
+            if (client->frames.malformed()) {
+                LOG_WARNING("Closing client ", client->nickname, ": malformed frame");
+                return true;
+            }
+            ssize_t bytesRead = recv(client->socket, sessionBuffer_, sizeof(sessionBuffer_), 0);
+            if (bytesRead == 0) {
+                LOG_INFO("Client ", client->nickname, " disconnected");
+                return true;
+            } else if (bytesRead == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return false;
+                }
+                LOG_WARNING("Failed to receive message from client ", client->nickname);
+                return true;
+            }
+            metrics_.bytesIn.fetch_add(bytesRead, std::memory_order_relaxed);
+            client->lastInputTick = currentTick_;
+            client->pingSent = false;
+            input.pending = std::string_view(sessionBuffer_, bytesRead);
+        }
+        line = next;
+        return true;
+    }
+
+    bool outputDrained(ClientHandle clientId) {
+        Client* client = clients_.find(clientId);
+        return client == nullptr ||
+               (client->queuedBytes <= config_.maxQueuedBytes / 2 && client->outputQueue.size() <= config_.maxQueuedMessages / 2);
+    }
+
+    // Resumes the client's parked session if the events are what it waits
+    // for and it can now make progress.
+    void wakeSession(Client& client, uint32_t events) {
+        Waiter* waiter = client.waiter;
+        if (waiter != nullptr && (waiter->events & events) && waiter->ready(*waiter)) {
+            client.waiter = nullptr;
+            waiter->coroutine.resume();
+        }
+    }
+
+    // A parked session ends with its connection.
+    void dropSession(Client& client) {
+        if (client.waiter != nullptr) {
+            std::coroutine_handle<> session = client.waiter->coroutine;
+            client.waiter = nullptr;
+            session.destroy();
+        }
+    }
+#endif
+
+    // Drops the client from its channel and releases its socket.
+    void closeClient(ClientHandle clientId) {
+        Client* client = clients_.find(clientId);
+        if (client == nullptr) {
+            return;
+        }
+        if (!client->channelName.empty()) {
+            post(homeShard(client->channelName), makeMessage(ShardMessage::Type::Leave, clientId, client->channelName));
+        }
+#if SERVER_COROUTINES
+        dropSession(*client);
+#endif
+
+        int clientSocket = client->socket;
+        if (config_.ioMode == IoMode::Uring) {
+            cancelRequests(clientSocket);
+        } else if (config_.ioMode != IoMode::Threads) {
+            epoll_ctl(epollFd_, EPOLL_CTL_DEL, clientSocket, nullptr);
+        } else {
+            ::close(client->wakeFd);
+        }
+        admission_.release(client->sourceKey);
+        if (!client->nickname.empty()) {
+            nicknames_.release(client->nickname, clientId);
+        }
+        timers_.cancel(client->timer);
+        clients_.remove(*client);
+        metrics_.disconnects.fetch_add(1, std::memory_order_relaxed);
+#ifdef _WIN32
+        closesocket(clientSocket);
+#else
+        ::close(clientSocket);
+#endif
+    }
+
+    void joinChannel(const ShardMessage& request) {
+        if (channelNameToAdmin_.count(request.channelName) == 0) {
+            channelNameToAdmin_[request.channelName] = request.client;
+            auto grant = makeMessage(ShardMessage::Type::GrantAdmin, request.client, request.channelName);
+            post(clientHandleShard(request.client), std::move(grant));
+        }
+        auto created = channels_.try_emplace(request.channelName);
+        auto& channel = created.first->second;
+        if (created.second) {
+            channel.name = request.channelName;
+            channel.slot = &directory_.find(request.channelName);
+            openHistory(channel, request.channelName);
+        }
+        channel.addMember({ request.client, request.nickname, request.isConnected,
+                            channel.mutedUsers.count(request.nickname) > 0,
+                            channel.kickedUsers.count(request.nickname) > 0, request.isBinary });
+        if (channel.adminNickname.empty()) {
+            channel.adminNickname = request.nickname;
+        }
+        publishSnapshot(channel);
+        if (request.isConnected) {
+            replayHistory(channel, request.client);
+        }
+        LOG_INFO(request.nickname, " joined channel ", request.channelName);
+    }
+
+    void removeUserFromChannel(const ShardMessage& request) {
+        auto channelIt = channels_.find(request.channelName);
+        if (channelIt == channels_.end()) {
+            return;
+        }
+        auto& channel = channelIt->second;
+        channel.removeMember(request.client);
+        if (channel.adminNickname == request.nickname) {
+            reassignAdminNickname(channel);
+        }
+        publishSnapshot(channel);
+    }
+
+    // Only runs when the named admin leaves or is kicked.
+    void reassignAdminNickname(Channel& channel) {
+        channel.adminNickname.clear();
+        for (const auto& member : channel.members) {
+            if (!member.isKicked) {
+                channel.adminNickname = member.nickname;
+                break;
+            }
+        }
+    }
+
+    void connectMember(const ShardMessage& request) {
+        auto channelIt = channels_.find(request.channelName);
+        if (channelIt == channels_.end()) {
+            skipReplay(request.client, request.channelName);
+            return;
+        }
+        ChannelMember* member = channelIt->second.findMember(request.client);
+        if (member != nullptr && !member->isConnected) {
+            member->isConnected = true;
+            publishSnapshot(channelIt->second);
+            replayHistory(channelIt->second, request.client);
+        } else {
+            skipReplay(request.client, request.channelName);
+        }
+        broadcastMessage(makeMessageBuffer({ request.nickname, " connected." }), request.channelName);
+    }
+
+    void kickUser(const std::string& username, const std::string& channelName) {
+        auto it = channels_.find(channelName);
+        if (it != channels_.end()) {
+            auto& channel = it->second;
+            if (channel.kickedUsers.insert(username).second) {
+                ChannelMember* member = findMemberNamed(channel, username);
+                if (member != nullptr) {
+                    member->isKicked = true;
+                }
+                LOG_INFO("User ", username, " has been kicked from the channel.");
+                if (channel.adminNickname == username) {
+                    reassignAdminNickname(channel);
+                }
+                publishSnapshot(channel);
+                broadcastMessage(makeMessageBuffer({ "User ", username, " has been kicked from the channel." }), channelName);
+            }
+        }
+    }
+
+    void muteUser(const std::string& username, const std::string& channelName) {
+        auto it = channels_.find(channelName);
+        if (it != channels_.end()) {
+            auto& channel = it->second;
+            if (channel.mutedUsers.insert(username).second) {
+                setMuted(channel, username, true);
+                LOG_INFO("User ", username, " has been muted in channel ", channelName);
+            }
+        }
+    }
+
+    void unmuteUser(const std::string& username, const std::string& channelName) {
+        auto it = channels_.find(channelName);
+        if (it != channels_.end()) {
+            auto& channel = it->second;
+            if (channel.mutedUsers.erase(username) > 0) {
+                setMuted(channel, username, false);
+                LOG_INFO("User ", username, " has been unmuted in channel ", channelName);
+            }
+        }
+    }
+
+    void setMuted(Channel& channel, const std::string& username, bool muted) {
+        ChannelMember* member = findMemberNamed(channel, username);
+        if (member != nullptr) {
+            member->isMuted = muted;
+        }
+        publishSnapshot(channel);
+    }
+
+    // Nicknames are unique, so the registry names the one member an admin
+    // command is about, with no walk over the channel.
+    ChannelMember* findMemberNamed(Channel& channel, const std::string& nickname) {
+        ClientHandle owner = nicknames_.owner(nickname);
+        return owner == 0 ? nullptr : channel.findMember(owner);
+    }
+
+    // Copy-on-write: builds the channel's next snapshot, swaps it into the
+    // slot and retires the old one until no shard can still be reading it.
+    void publishSnapshot(Channel& channel) {
+        ChannelSnapshot* next = new ChannelSnapshot();
+        next->version = ++channel.version;
+        next->recipients.resize(shards_.size());
+        for (const auto& member : channel.members) {
+            next->members.assign(member.client, (member.isMuted ? MEMBER_MUTED : 0) | (member.isKicked ? MEMBER_KICKED : 0));
+            if (member.isConnected && !member.isKicked) {
+                next->recipients[clientHandleShard(member.client)].push_back(member.client);
+                next->hasBinaryRecipients |= member.isBinary;
+            }
+        }
+        next->adminNickname = channel.adminNickname;
+        channel.slot->gauges.members.store(channel.members.size(), std::memory_order_relaxed);
+
+        // Other nodes only send a channel's messages here while it has
+        // recipients here, so the link thread hears about every change.
+        bool active = std::any_of(next->recipients.begin(), next->recipients.end(),
+                                  [](const std::vector<ClientHandle>& recipients) { return !recipients.empty(); });
+        if (links_ != nullptr && active != channel.announced) {
+            channel.announced = active;
+            auto membership = makeMessage(ShardMessage::Type::Membership, 0, channel.name);
+            membership.active = active;
+            post(linkTarget(), std::move(membership));
+        }
+
+        // Sequentially consistent, as is the read of chatSequence that may
+        // follow (see sendChat()).
+        ChannelSnapshot* previous = channel.slot->current.exchange(next, std::memory_order_seq_cst);
+        if (previous != nullptr) {
+            retired_.emplace_back(previous, epochs_.retire());
+            reclaimSnapshots();
+        }
+    }
+
+    // Opens (and after a restart recovers) the channel's log under the
+    // history directory. A channel whose log can't be opened keeps none.
+    void openHistory(Channel& channel, const std::string& channelName) {
+        if (config_.historyDir.empty()) {
+            return;
+        }
+        auto history = std::make_unique<ChannelLog>(config_.historyDir + "/" + historyDirectoryName(channelName), config_.historySegments);
+        if (!history->open()) {
+            LOG_ERROR("Failed to open the history of channel ", channelName, ": ", std::strerror(errno));
+            return;
+        }
+        LOG_INFO("Recovered ", history->messageCount(), " messages of channel ", channelName);
+        channel.history = std::move(history);
+    }
+
+    // Channel names are user input; anything but letters, digits, '-' and
+    // '_' is escaped as %XX so every name maps to one plain directory.
+    static std::string historyDirectoryName(const std::string& channelName) {
+        static const char HEX[] = "0123456789ABCDEF";
+        std::string name;
+        for (unsigned char c : channelName) {
+            if (std::isalnum(c) || c == '-' || c == '_') {
+                name.push_back(static_cast<char>(c));
+            } else {
+                name.push_back('%');
+                name.push_back(HEX[c >> 4]);
+                name.push_back(HEX[c & 0xF]);
+            }
+        }
+        return name;
+    }
+
+    // Chat lines are logged by the home shard, whichever shard fanned them
+    // out, so a channel's log has a single writer. They are logged in chat
+    // sequence order: a line that arrives ahead of one still on its way
+    // from another shard waits in earlyLines. An empty payload stands for a
+    // line that was never sent, and only moves the order on. The order is
+    // kept even for a channel whose log could not be opened, so a log
+    // reopened later picks it up where it is.
+    void appendHistory(const std::string& channelName, const MessageBuffer& payload, uint64_t sequence) {
+        auto it = channels_.find(channelName);
+        if (it == channels_.end() || sequence == 0) {
+            return;
+        }
+        Channel& channel = it->second;
+        if (sequence != channel.nextLogged) {
+            channel.earlyLines.emplace(sequence, payload);
+            return;
+        }
+        logLine(channel, payload);
+        for (auto early = channel.earlyLines.begin(); early != channel.earlyLines.end() && early->first == channel.nextLogged;
+             early = channel.earlyLines.erase(early)) {
+            logLine(channel, early->second);
+        }
+        serveReplays(channel);
+    }
+
+    void logLine(Channel& channel, const MessageBuffer& payload) {
+        serveReplays(channel);
+        uint64_t sequence = channel.nextLogged++;
+        if (payload.empty() || !channel.history) {
+            return;
+        }
+        if (!channel.history->append(payload.view(), wallClockNanos())) {
+            LOG_ERROR("Failed to append to the history of channel ", channel.name);
+            return;
+        }
+        channel.loggedSequences.push_back(sequence);
+        if (channel.loggedSequences.size() > config_.replayMessages) {
+            channel.loggedSequences.pop_front();
+        }
+    }
+
+    // Sends a member that just started receiving the channel its recent
+    // history. Called right after the snapshot that lists the member as a
+    // recipient is published: chat lines with a sequence from here on are
+    // fanned out to it live, and the replay holds the ones before, as soon
+    // as they are all logged. Only the log ranges travel; the client's
+    // shard streams them.
+    void replayHistory(Channel& channel, ClientHandle clientId) {
+        if (!channel.history) {
+            skipReplay(clientId, channel.name);
+            return;
+        }
+        uint64_t cutOff = channel.slot->chatSequence.load(std::memory_order_seq_cst);
+        channel.waitingReplays.emplace_back(clientId, cutOff);
+        serveReplays(channel);
+    }
+
+    void serveReplays(Channel& channel) {
+        while (!channel.waitingReplays.empty() && channel.waitingReplays.front().second <= channel.nextLogged) {
+            auto replay = makeMessage(ShardMessage::Type::Replay, channel.waitingReplays.front().first, channel.name);
+            replay.sequence = channel.waitingReplays.front().second;
+            channel.waitingReplays.pop_front();
+            if (!channel.history) {
+                post(clientHandleShard(replay.client), std::move(replay));
+                continue;
+            }
+            int64_t since = config_.replaySeconds > 0 ? wallClockNanos() - config_.replaySeconds * 1000000000LL : 0;
+            uint64_t first;
+            replay.history = channel.history->tail(config_.replayMessages, since, &first);
+
+            // The log counts logged lines only; map the first one replayed
+            // back to its chat sequence. Lines logged before this process
+            // started were never sent live by it.
+            uint64_t oldestKept = channel.history->messageCount() - channel.loggedSequences.size();
+            if (first < oldestKept) {
+                replay.replayedFrom = 1;
+            } else if (first - oldestKept < channel.loggedSequences.size()) {
+                replay.replayedFrom = channel.loggedSequences[first - oldestKept];
+            } else {
+                replay.replayedFrom = replay.sequence; // nothing replayed
+            }
+            post(clientHandleShard(replay.client), std::move(replay));
+        }
+    }
+
+    // Answers a replay request that has no history to send.
+    void skipReplay(ClientHandle clientId, const std::string& channelName) {
+        if (!config_.historyDir.empty()) {
+            post(clientHandleShard(clientId), makeMessage(ShardMessage::Type::Replay, clientId, channelName));
+        }
+    }
+
+    void reclaimSnapshots() {
+        while (!retired_.empty() && epochs_.safe(retired_.front().second)) {
+            retired_.front().first->release();
+            retired_.pop_front();
+        }
+    }
+
+    // Server messages about a channel, sent from its home shard. Without a
+    // frame, binary members get the line as a Text frame.
+    void broadcastMessage(const MessageBuffer& payload, const std::string& channelName, const MessageBuffer& frame = MessageBuffer(),
+                          uint64_t sequence = 0) {
+        auto it = channels_.find(channelName);
+        if (it == channels_.end()) {
+            return;
+        }
+        Channel& channel = it->second;
+        const ChannelSnapshot* snapshot = channel.slot->current.load(std::memory_order_relaxed);
+        if (snapshot != nullptr) {
+            fanOut(*snapshot, *channel.slot, payload, frame, channelName, sequence);
+        }
+    }
+
+    // Queues the message for the snapshot's recipients on this shard and
+    // hands every other shard with recipients a single batch, which points
+    // at the snapshot's list for that shard instead of copying it. Every
+    // recipient queues a reference to the same encoded buffer, or to the
+    // same frame if it speaks the binary protocol.
+    void fanOut(const ChannelSnapshot& snapshot, ChannelSlot& slot, const MessageBuffer& payload, const MessageBuffer& frame,
+                const std::string& channelName, uint64_t sequence) {
+        auto start = std::chrono::steady_clock::now();
+        metrics_.messagesBroadcast.fetch_add(1, std::memory_order_relaxed);
+        slot.gauges.messages.fetch_add(1, std::memory_order_relaxed);
+
+        for (size_t shard = 0; shard < snapshot.recipients.size(); shard++) {
+            if (snapshot.recipients[shard].empty()) {
+                continue;
+            }
+            if (static_cast<int>(shard) == index_) {
+                deliverMessage(snapshot.recipients[shard], payload, frame, channelName, sequence);
+                continue;
+            }
+            auto batch = makeMessage(ShardMessage::Type::Deliver, 0, channelName);
+            batch.snapshot = SnapshotRef(&snapshot);
+            batch.payload = payload;
+            batch.frame = frame;
+            batch.sequence = sequence;
+            post(static_cast<int>(shard), std::move(batch));
+        }
+        metrics_.fanoutNanos.record(elapsedNanos(start));
+    }
+
+    // A client waiting for a replay of the channel gets its output after
+    // the history, and none of the chat lines the replay already carried.
+    void deliverMessage(const std::vector<ClientHandle>& clientIds, const MessageBuffer& payload, MessageBuffer frame,
+                        const std::string& channelName, uint64_t sequence) {
+        for (ClientHandle clientId : clientIds) {
+            Client* client = clients_.find(clientId);
+            if (client == nullptr) {
+                continue;
+            }
+            if (client->binary && frame.empty()) {
+                frame = encodeTextFrame(payload);
+            }
+            const MessageBuffer& message = client->binary ? frame : payload;
+            if ((client->pendingReplays > 0 || sequence < client->replayedTo) && client->channelName == channelName) {
+                if (client->pendingReplays > 0) {
+                    client->heldLines.emplace_back(sequence, message);
+                    continue;
+                }
+                if (sequence >= client->replayedFrom) {
+                    continue;
+                }
+            }
+            if (!queueMessage(*client, message)) {
+                LOG_WARNING("Failed to send message to client ", clientId);
+            }
+        }
+    }
+
+    void receiveReplay(Client& client, const ShardMessage& replay) {
+        if (client.pendingReplays > 0) {
+            client.pendingReplays--;
+        }
+        // A replay for a channel the client has left since is of no use.
+        if (replay.channelName == client.channelName) {
+            queueHistory(client, replay.history);
+            client.replayedFrom = replay.replayedFrom;
+            client.replayedTo = replay.sequence;
+        }
+        if (client.pendingReplays == 0) {
+            releaseHeldLines(client);
+        }
+    }
+
+    void releaseHeldLines(Client& client) {
+        for (const auto& held : client.heldLines) {
+            if (held.first != 0 && held.first >= client.replayedFrom && held.first < client.replayedTo) {
+                continue;
+            }
+            if (!queueMessage(client, held.second)) {
+                LOG_WARNING("Failed to send message to client ", client.handle);
+            }
+        }
+        client.heldLines.clear();
+    }
+
+    // Queues history ranges behind whatever the client already has pending.
+    // Epoll shards send them with sendfile(); threads mode sockets block and
+    // uring mode only submits buffers, so there the ranges are read into
+    // ordinary buffers instead. So are they for binary clients, which get
+    // each range as one History frame that the overflow policy can only
+    // drop whole.
+    void queueHistory(Client& client, const std::vector<LogRange>& ranges) {
+        for (const LogRange& range : ranges) {
+            if (config_.ioMode == IoMode::Threads || config_.ioMode == IoMode::Uring || client.binary) {
+                std::string text(range.length, '\0');
+                ssize_t bytesRead = pread(range.file->fd(), text.data(), text.size(), static_cast<off_t>(range.offset));
+                FrameHeader header(Opcode::History, text.size());
+                MessageBuffer buffer = client.binary ? MessageBuffer::compose({ header.view(), text }, '\0')
+                                                     : MessageBuffer::compose({ text }, '\0');
+                if (bytesRead != static_cast<ssize_t>(text.size()) || !queueMessage(client, buffer)) {
+                    LOG_WARNING("Failed to replay history to client ", client.handle);
+                }
+                continue;
+            }
+            if (client.isEvicted || !reserveOutputSpace(client, range.length)) {
+                continue;
+            }
+            OutputChunk chunk;
+            chunk.file = range.file;
+            chunk.fileOffset = range.offset;
+            chunk.fileLength = range.length;
+            if (client.outputQueue.empty()) {
+                startWriteClock(client);
+            }
+            client.outputQueue.push_back(std::move(chunk));
+            client.queuedBytes += range.length;
+            if (!client.flushScheduled) {
+                client.flushScheduled = true;
+                scheduledFlushes_.push_back(client.handle);
+            }
+        }
+    }
+
+    bool sendMessage(Client& client, std::initializer_list<std::string_view> message) {
+        MessageBuffer payload = makeMessageBuffer(message);
+        return queueMessage(client, client.binary ? encodeTextFrame(payload) : payload);
+    }
+
+    // A server line (LF terminated) as a Text frame.
+    static MessageBuffer encodeTextFrame(const MessageBuffer& payload) {
+        std::string_view line = payload.view().substr(0, payload.size() - 1);
+        FrameHeader header(Opcode::Text, line.size());
+        return MessageBuffer::compose({ header.view(), line }, '\0');
+    }
+
+    // Appends a message to the client's output queue, subject to the
+    // queue limits. The queue is then written without ever blocking: in
+    // epoll mode once per loop iteration (or on EPOLLOUT), in threads mode
+    // right away, with the client's own thread polling for the rest.
+    bool queueMessage(Client& client, const MessageBuffer& payload) {
+        if (payload.empty() || client.isEvicted) {
+            return true;
+        }
+        if (!reserveOutputSpace(client, payload.size())) {
+            return true;
+        }
+        OutputChunk chunk;
+        chunk.data = payload;
+        if (client.outputQueue.empty()) {
+            startWriteClock(client);
+        }
+        client.outputQueue.push_back(std::move(chunk));
+        client.queuedBytes += payload.size();
+        metrics_.messagesQueued.fetch_add(1, std::memory_order_relaxed);
+
+        if (config_.ioMode == IoMode::Threads) {
+            if (!flushOutput(client)) {
+                return false;
+            }
+            if (!client.outputQueue.empty()) {
+                uint64_t one = 1;
+                if (write(client.wakeFd, &one, sizeof(one)) == -1) {
+                    LOG_ERROR("Failed to wake client thread");
+                }
+            }
+            return true;
+        }
+        if (!client.flushScheduled) {
+            client.flushScheduled = true;
+            scheduledFlushes_.push_back(client.handle);
+        }
+        return true;
+    }
+
+    // Makes room for a message of the given size under the client's queue
+    // limits by applying the overflow policy. Returns false when the new
+    // message has to be dropped instead.
+    bool reserveOutputSpace(Client& client, size_t size) {
+        auto overLimit = [&]() {
+            return client.queuedBytes + size > config_.maxQueuedBytes || client.outputQueue.size() + 1 > config_.maxQueuedMessages;
+        };
+        if (!overLimit()) {
+            return true;
+        }
+
+        switch (config_.overflowPolicy) {
+        case OverflowPolicy::DropOldest:
+            // The front message may be partly written already; dropping it
+            // would corrupt the stream, so the oldest droppable one is second
+            // (or the first one past a send in flight).
+            while (overLimit() && client.outputQueue.size() > std::max<size_t>(1, client.sendingChunks)) {
+                size_t oldest = std::max<size_t>(1, client.sendingChunks);
+                client.queuedBytes -= client.outputQueue[oldest].size();
+                client.outputQueue.erase(oldest);
+                overflowStats_.droppedOldest.fetch_add(1, std::memory_order_relaxed);
+            }
+            if (!overLimit()) {
+                return true;
+            }
+            overflowStats_.droppedNewest.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        case OverflowPolicy::DropNewest:
+            overflowStats_.droppedNewest.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        case OverflowPolicy::Disconnect:
+            evictClient(client);
+            return false;
+        }
+        return false;
+    }
+
+    // Disconnects a client that stopped reading. Its queue is released right
+    // away; the socket is closed by the thread that owns it.
+    void evictClient(Client& client) {
+        overflowStats_.disconnects.fetch_add(1, std::memory_order_relaxed);
+        LOG_WARNING("Disconnecting client ", client.nickname, ": output queue is full");
+        client.isEvicted = true;
+        client.outputQueue.clear();
+        client.queuedBytes = 0;
+        if (config_.ioMode == IoMode::Threads) {
+            shutdown(client.socket, SHUT_RDWR);
+        } else if (!client.flushScheduled) {
+            client.flushScheduled = true;
+            scheduledFlushes_.push_back(client.handle);
+        }
+    }
+
+    // A client's timeouts are checked lazily: reads and writes only note the
+    // tick they happened in, and the client's timer, set for the nearest
+    // deadline those ticks give, checks again when it fires and moves itself
+    // on if nothing is due yet. A client that has gone quiet is pinged, and
+    // dropped if it stays quiet; one that never connects, or whose socket
+    // stops taking its output, is dropped.
+    void startTimeouts(Client& client) {
+        client.timer.client = client.handle;
+        client.acceptedTick = currentTick_;
+        client.lastInputTick = currentTick_;
+        client.lastOutputTick = currentTick_;
+        checkTimeouts(client);
+    }
+
+    // Runs the timers that came due by currentTick_.
+    void expireTimers() {
+        timers_.advance(currentTick_, [&](TimerNode& timer) {
+            Client* client = clients_.find(static_cast<ClientTimer&>(timer).client);
+            if (client != nullptr) {
+                checkTimeouts(*client);
+            }
+        });
+    }
+
+    void checkTimeouts(Client& client) {
+        if (client.isEvicted) {
+            return;
+        }
+        uint64_t now = currentTick_;
+        const char* reason = nullptr;
+        if (handshakeTicks_ != 0 && !client.isConnected && now - client.acceptedTick >= handshakeTicks_) {
+            reason = "no /connect in time";
+        } else if (idleTicks_ != 0 && now - client.lastInputTick >= idleTicks_) {
+            reason = client.pingSent ? "no answer to PING" : "idle";
+        } else if (writeTicks_ != 0 && !client.outputQueue.empty() && now - client.lastOutputTick >= writeTicks_) {
+            reason = "not reading its output";
+        }
+        if (reason != nullptr) {
+            reapClient(client, reason);
+            return;
+        }
+        if (pingTicks_ != 0 && !client.pingSent && now - client.lastInputTick >= pingTicks_) {
+            sendPing(client);
+        }
+
+        uint64_t next = UINT64_MAX;
+        if (handshakeTicks_ != 0 && !client.isConnected) {
+            next = client.acceptedTick + handshakeTicks_;
+        }
+        if (idleTicks_ != 0) {
+            next = std::min(next, client.lastInputTick + idleTicks_);
+        }
+        if (pingTicks_ != 0 && !client.pingSent) {
+            next = std::min(next, client.lastInputTick + pingTicks_);
+        }
+        if (writeTicks_ != 0 && !client.outputQueue.empty()) {
+            next = std::min(next, client.lastOutputTick + writeTicks_);
+        }
+        if (next != UINT64_MAX) {
+            timers_.schedule(client.timer, next);
+        }
+    }
+
+    // Starts the write stall clock of a client whose queue was empty, and
+    // brings its timer forward if that makes the nearest deadline.
+    void startWriteClock(Client& client) {
+        client.lastOutputTick = currentTick_;
+        uint64_t deadline = currentTick_ + writeTicks_;
+        if (writeTicks_ != 0 && client.timer.scheduled() && client.timer.expires > deadline) {
+            timers_.schedule(client.timer, deadline);
+        }
+    }
+
+    // "PING <token>", or a Ping frame. Clients answer with "/pong <token>"
+    // (a Pong frame), though any input will do.
+    void sendPing(Client& client) {
+        client.pingSent = true;
+        metrics_.pingsSent.fetch_add(1, std::memory_order_relaxed);
+        if (client.binary) {
+            std::string token;
+            appendVarint(token, currentTick_);
+            FrameHeader header(Opcode::Ping, token.size());
+            queueMessage(client, MessageBuffer::compose({ header.view(), token }, '\0'));
+        } else {
+            sendMessage(client, { "PING ", std::to_string(currentTick_) });
+        }
+    }
+
+    // Drops a client that timed out. Like evictClient(), it leaves a
+    // threads mode socket to be closed by the client's own thread.
+    void reapClient(Client& client, const char* reason) {
+        metrics_.clientsTimedOut.fetch_add(1, std::memory_order_relaxed);
+        LOG_INFO("Disconnecting client ", client.nickname, ": ", reason);
+        if (config_.ioMode == IoMode::Threads) {
+            shutdown(client.socket, SHUT_RDWR);
+        } else {
+            closeClient(client.handle);
+        }
+    }
+
+    // Writes as much of the output queue as the socket takes, up to
+    // MAX_WRITE_BATCH buffers per sendmsg() and log ranges with sendfile().
+    // In uring mode the sendmsg() is only submitted. Returns false on a
+    // socket error.
+    bool flushOutput(Client& client) {
+        if (config_.ioMode == IoMode::Uring) {
+            return submitSend(client);
+        }
+        while (!client.outputQueue.empty()) {
+            if (client.outputQueue.front().file) {
+                OutputChunk& front = client.outputQueue.front();
+                off_t position = static_cast<off_t>(front.fileOffset + front.offset);
+                ssize_t sent = sendfile(client.socket, front.file->fd(), &position, front.fileLength - front.offset);
+                if (sent == -1) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        return true;
+                    }
+                    metrics_.sendFailures.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+                if (sent == 0) {
+                    // The range ends past the file; nothing more to send.
+                    client.queuedBytes -= front.fileLength - front.offset;
+                    client.outputQueue.pop_front();
+                    continue;
+                }
+                metrics_.bytesOut.fetch_add(sent, std::memory_order_relaxed);
+                client.lastOutputTick = currentTick_;
+                client.queuedBytes -= static_cast<size_t>(sent);
+                front.offset += static_cast<size_t>(sent);
+                if (front.offset == front.fileLength) {
+                    client.outputQueue.pop_front();
+                }
+                continue;
+            }
+
+            iovec iov[MAX_WRITE_BATCH];
+            size_t count = 0;
+            size_t limit = std::min<size_t>(client.outputQueue.size(), MAX_WRITE_BATCH);
+            for (; count < limit && !client.outputQueue[count].file; count++) {
+                OutputChunk& chunk = client.outputQueue[count];
+                iov[count].iov_base = const_cast<char*>(chunk.data.data() + chunk.offset);
+                iov[count].iov_len = chunk.data.size() - chunk.offset;
+            }
+
+            msghdr header{};
+            header.msg_iov = iov;
+            header.msg_iovlen = count;
+            ssize_t sent = sendmsg(client.socket, &header, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (sent == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return true;
+                }
+                metrics_.sendFailures.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+
+            metrics_.bytesOut.fetch_add(sent, std::memory_order_relaxed);
+            consumeOutput(client, static_cast<size_t>(sent));
+        }
+        return true;
+    }
+
+    // Drops what the socket took from the front of the output queue.
+    void consumeOutput(Client& client, size_t sent) {
+        client.lastOutputTick = currentTick_;
+        client.queuedBytes -= sent;
+        while (sent > 0) {
+            OutputChunk& front = client.outputQueue.front();
+            size_t left = front.data.size() - front.offset;
+            if (sent < left) {
+                front.offset += sent;
+                break;
+            }
+            sent -= left;
+            client.outputQueue.pop_front();
+        }
+    }
+
+    bool createRing() {
+        if (!ring_.init(URING_ENTRIES) || !ring_.registerBuffers(URING_BUFFER_COUNT, URING_BUFFER_SIZE, URING_BUFFER_GROUP)) {
+            LOG_ERROR("Failed to set up io_uring");
+            return false;
+        }
+        armAccept();
+        armWake();
+        return true;
+    }
+
+    // Uring mode's reactor. Requests queued while handling one batch of
+    // completions go to the kernel together with the wait for the next.
+    void runUringLoop() {
+        while (running_) {
+            int64_t timeout = !scheduledFlushes_.empty() ? 0 : hasBacklog() ? 1000000
+                                                            : timers_.size() != 0 ? TIMER_TICK_MILLIS * 1000000ll : -1;
+            epochs_.exit(index_);
+            int result = ring_.submit(timeout == 0 ? 0 : 1, timeout);
+            epochs_.enter(index_);
+            currentTick_ = timerTick();
+            if (result < 0 && result != -EINTR && result != -ETIME && result != -EBUSY) {
+                LOG_ERROR("io_uring_enter failed: ", std::strerror(-result));
+                break;
+            }
+
+            ring_.forEachCompletion([&](const io_uring_cqe& completion) {
+                handleCompletion(completion);
+            });
+
+            expireTimers();
+            drainInboxes();
+            flushScheduledClients();
+            flushOutboxes();
+            reclaimSnapshots();
+        }
+        epochs_.exit(index_);
+    }
+
+    void handleCompletion(const io_uring_cqe& completion) {
+        uint64_t tag = completion.user_data >> URING_TAG_SHIFT;
+        uint64_t value = completion.user_data & ((uint64_t(1) << URING_TAG_SHIFT) - 1);
+        bool more = (completion.flags & IORING_CQE_F_MORE) != 0;
+        switch (tag) {
+        case URING_ACCEPT:
+            if (completion.res >= 0) {
+                adoptClient(completion.res);
+            } else if (completion.res != -ECONNABORTED && completion.res != -EINTR) {
+                LOG_ERROR("Failed to accept client connection: ", std::strerror(-completion.res));
+            }
+            if (!more && running_) {
+                armAccept();
+            }
+            break;
+        case URING_WAKE:
+            armWake();
+            break;
+        case URING_RECV:
+            completeRecv(value, completion);
+            break;
+        case URING_SEND:
+            completeSend(reinterpret_cast<SendOp*>(value), completion.res);
+            break;
+        default:
+            break;
+        }
+    }
+
+    io_uring_sqe* prepare(uint8_t opcode, int fd, uint64_t tag, uint64_t value) {
+        io_uring_sqe* sqe = ring_.nextSqe();
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->user_data = tag << URING_TAG_SHIFT | value;
+        return sqe;
+    }
+
+    // One multishot accept serves every connection until it fails.
+    void armAccept() {
+        io_uring_sqe* sqe = prepare(IORING_OP_ACCEPT, serverSocket_, URING_ACCEPT, 0);
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    }
+
+    void armWake() {
+        io_uring_sqe* sqe = prepare(IORING_OP_READ, wakeFd_, URING_WAKE, 0);
+        sqe->addr = reinterpret_cast<uint64_t>(&wakeValue_);
+        sqe->len = sizeof(wakeValue_);
+    }
+
+    // Multishot recv: every chunk the client sends completes into one of the
+    // shard's provided buffers, with no request per read.
+    void armRecv(const Client& client) {
+        io_uring_sqe* sqe = prepare(IORING_OP_RECV, client.socket, URING_RECV, client.handle);
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUFFER_GROUP;
+    }
+
+    // In-flight requests hold a reference to the socket, so they are
+    // cancelled (and the cancellation submitted) before it is closed.
+    void cancelRequests(int socket) {
+        io_uring_sqe* sqe = prepare(IORING_OP_ASYNC_CANCEL, socket, URING_CANCEL, 0);
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        ring_.submit(0);
+    }
+
+    // The multishot accept has no address buffer of its own, so the peer
+    // address is looked up here, once per connection.
+    void adoptClient(int clientSocket) {
+        sockaddr_storage address{};
+        socklen_t addressLength = sizeof(address);
+        getpeername(clientSocket, reinterpret_cast<sockaddr*>(&address), &addressLength);
+        uint32_t sourceKey;
+        if (!admitConnection(clientSocket, address, sourceKey)) {
+            return;
+        }
+        metrics_.accepts.fetch_add(1, std::memory_order_relaxed);
+        Client& client = clients_.add(clientSocket);
+        client.sourceKey = sourceKey;
+        client.peerAddress = address;
+        startTimeouts(client);
+        armRecv(client);
+    }
+
+    void completeRecv(ClientHandle clientId, const io_uring_cqe& completion) {
+        if (completion.flags & IORING_CQE_F_BUFFER) {
+            uint16_t id = static_cast<uint16_t>(completion.flags >> IORING_CQE_BUFFER_SHIFT);
+            Client* client = clients_.find(clientId);
+            bool keepOpen = true;
+            if (client != nullptr && completion.res > 0) {
+                metrics_.bytesIn.fetch_add(completion.res, std::memory_order_relaxed);
+                keepOpen = receiveLines(clientId, *client, ring_.buffer(id), completion.res);
+            }
+            ring_.recycleBuffer(id);
+            if (!keepOpen) {
+                closeClient(clientId);
+                return;
+            }
+        }
+
+        Client* client = clients_.find(clientId);
+        if (client == nullptr) {
+            return;
+        }
+        if (completion.res == 0) {
+            LOG_INFO("Client ", client->nickname, " disconnected");
+            closeClient(clientId);
+            return;
+        }
+        if (completion.res < 0 && completion.res != -ENOBUFS) {
+            LOG_WARNING("Failed to receive message from client ", client->nickname, ": ", std::strerror(-completion.res));
+            closeClient(clientId);
+            return;
+        }
+        if (!(completion.flags & IORING_CQE_F_MORE)) {
+            armRecv(*client);
+        }
+    }
+
+    // Submits one sendmsg() over the front of the client's output queue,
+    // unless one is in flight already.
+    bool submitSend(Client& client) {
+        if (client.sendingChunks != 0 || client.outputQueue.empty()) {
+            return true;
+        }
+        SendOp* op;
+        if (freeSendOps_.empty()) {
+            sendOps_.emplace_back(new SendOp());
+            op = sendOps_.back().get();
+        } else {
+            op = freeSendOps_.back();
+            freeSendOps_.pop_back();
+        }
+
+        op->client = client.handle;
+        op->count = std::min<size_t>(client.outputQueue.size(), MAX_WRITE_BATCH);
+        for (size_t i = 0; i < op->count; i++) {
+            OutputChunk& chunk = client.outputQueue[i];
+            op->buffers[i] = chunk.data;
+            op->iov[i].iov_base = const_cast<char*>(chunk.data.data() + chunk.offset);
+            op->iov[i].iov_len = chunk.data.size() - chunk.offset;
+        }
+        op->header = msghdr{};
+        op->header.msg_iov = op->iov;
+        op->header.msg_iovlen = op->count;
+
+        io_uring_sqe* sqe = prepare(IORING_OP_SENDMSG, client.socket, URING_SEND, reinterpret_cast<uint64_t>(op));
+        sqe->addr = reinterpret_cast<uint64_t>(&op->header);
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        client.sendingChunks = op->count;
+        return true;
+    }
+
+    void completeSend(SendOp* op, int result) {
+        ClientHandle clientId = op->client;
+        for (size_t i = 0; i < op->count; i++) {
+            op->buffers[i] = MessageBuffer();
+        }
+        freeSendOps_.push_back(op);
+
+        Client* client = clients_.find(clientId);
+        if (client == nullptr) {
+            return;
+        }
+        client->sendingChunks = 0;
+        if (client->isEvicted) {
+            return;
+        }
+        if (result < 0) {
+            metrics_.sendFailures.fetch_add(1, std::memory_order_relaxed);
+            LOG_WARNING("Failed to send message to client ", clientId);
+            closeClient(clientId);
+            return;
+        }
+        metrics_.bytesOut.fetch_add(result, std::memory_order_relaxed);
+        consumeOutput(*client, static_cast<size_t>(result));
+        submitSend(*client);
+    }
+
+private:
+    // Fixed once the server has started; read by any thread. The objects
+    // behind the references are shared by every shard and synchronize
+    // themselves.
+    int index_;
+    const ServerConfig& config_;
+    std::vector<std::unique_ptr<Shard>>& shards_;
+    const std::atomic<bool>& running_;
+    ChannelDirectory& directory_;   // locked
+    NicknameRegistry& nicknames_;   // locked
+    EpochReclaimer& epochs_;        // each shard only enters and exits its own participant
+    AdmissionTable& admission_;     // atomics
+    LinkMailboxes* links_;          // nullptr unless federated; inboxes[index_] is this shard's queue to the link thread
+    int serverSocket_;
+    int epollFd_ = -1;
+    int wakeFd_ = -1;               // written by any shard to wake this one
+    const uint64_t pingTicks_;      // the config's timeouts in timer ticks; 0: off
+    const uint64_t idleTicks_;
+    const uint64_t handshakeTicks_;
+    const uint64_t writeTicks_;
+
+    // Owned by the shard's thread. In threads mode, by whichever thread
+    // holds clientsMutex_ (the accept thread or a client thread). No other
+    // thread may touch them; other shards send a ShardMessage instead.
+    ClientTable clients_;
+    uint64_t currentTick_;          // timerTick() as of the last wake-up
+    TimingWheel timers_;            // one ClientTimer per client
+    std::unordered_map<std::string, ClientHandle> channelNameToAdmin_;
+    std::unordered_map<std::string, Channel> channels_;
+    std::vector<std::deque<ShardMessage*>> outboxes_;      // overflow while a target's mailbox is full
+    std::vector<bool> wakePending_;
+    std::vector<ClientHandle> scheduledFlushes_;
+    std::vector<ClientHandle> flushing_;
+    std::string filterScratch_;     // a chat line without its control characters
+#if SERVER_COROUTINES
+    char sessionBuffer_[READ_BUFFER_SIZE]; // coroutines mode: shared by the shard's sessions
+#endif
+    Uring ring_;
+    uint64_t wakeValue_ = 0;
+    std::vector<std::unique_ptr<SendOp>> sendOps_;
+    std::vector<SendOp*> freeSendOps_;
+    std::deque<std::pair<ChannelSnapshot*, uint64_t>> retired_; // replaced snapshots and their retirement epochs
+    size_t clientThreads_ = 0;                                   // threads mode: handleClient threads still running
+
+    // Single producer, single consumer: inboxes_[i] is only pushed to by
+    // shard i and only popped by this shard.
+    std::vector<std::unique_ptr<ShardMailbox>> inboxes_;
+
+    // Written by the owner as above, read by anyone with relaxed loads.
+    OverflowStats overflowStats_;
+    ShardMetrics metrics_;
+
+    std::mutex clientsMutex_;
+    std::condition_variable clientThreadsDone_; // threads mode: clientThreads_ reached 0
+    std::thread thread_;
+
+    // Hot upgrade: the upgrade thread asks, the shard's thread parks.
+    std::atomic<bool> pauseRequested_{false};
+    std::mutex pauseMutex_;
+    std::condition_variable pauseChanged_;
+    bool paused_ = false; // under pauseMutex_
+};
+
+// Federation: TCP links to other server processes ("nodes"), all served by
+// one link thread with its own epoll loop. Each node floods a summary of the
+// channels that have recipients on it, under a version that only grows, and
+// floods it again every LINK_SUMMARY_SECONDS. Every node keeps the newest
+// summary of every other node along with the links it came in on (the
+// first one first) and forgets a node whose summary stops being refreshed.
+//
+// A chat line sent on this node gets an ID (origin node, sequence) and goes
+// out once on each link that leads to a node with recipients in its
+// channel: the link that node's summary arrived on first, and never the
+// link the message came from. Nodes pass messages on by the same rule and
+// drop IDs they have already seen, so redundant links and loops cost a
+// duplicate at most. Inside a node the line goes to the channel's home
+// shard, which fans it out like a local one: links never carry a copy per
+// user.
+//
+// Wire format, one line each, channel names %XX-escaped:
+//   HELLO <node>
+//   SUMMARY <origin> <version> [<channel> ...]
+//   MSG <origin> <sequence> <channel> <line>
+//
+// Links are not authenticated; they are meant for a trusted network.
+class PeerLinks {
+public:
+    PeerLinks(const ServerConfig& config, std::vector<std::unique_ptr<Shard>>& shards, const std::atomic<bool>& running,
+              ChannelDirectory& directory)
+        : config_(config), shards_(shards), running_(running), directory_(directory), nodeId_(config.nodeId) {}
+
+    ~PeerLinks() {
+        for (auto& inbox : mailboxes_.inboxes) {
+            ShardMessage* message;
+            while (inbox->pop(message)) {
+                delete message;
+            }
+        }
+        for (auto& backlog : backlogs_) {
+            for (ShardMessage* message : backlog) {
+                delete message;
+            }
+        }
+    }
+
+    LinkMailboxes& mailboxes() {
+        return mailboxes_;
+    }
+
+    uint32_t nodeId() const {
+        return nodeId_;
+    }
+
+    const LinkMetrics& metrics() const {
+        return metrics_;
+    }
+
+    bool open() {
+        for (int shard = 0; shard < config_.shardCount; shard++) {
+            mailboxes_.inboxes.emplace_back(new ShardMailbox());
+        }
+        backlogs_.resize(config_.shardCount);
+        wakePending_.resize(config_.shardCount, false);
+
+        mailboxes_.wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+        if (mailboxes_.wakeFd == -1 || epollFd_ == -1) {
+            std::cerr << "Failed to set up the link thread" << std::endl;
+            return false;
+        }
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.u64 = WAKE_TOKEN;
+        epoll_ctl(epollFd_, EPOLL_CTL_ADD, mailboxes_.wakeFd, &event);
+
+        if (config_.linkPort != 0 && !openListener()) {
+            return false;
+        }
+        for (const std::string& address : config_.peers) {
+            size_t colon = address.rfind(':');
+            if (colon == std::string::npos) {
+                std::cerr << "Peer address must be HOST:PORT: " << address << std::endl;
+                return false;
+            }
+            peers_.push_back({ address.substr(0, colon), address.substr(colon + 1), nullptr, {} });
+        }
+        refreshOwnSummary();
+        return true;
+    }
+
+    void run() {
+        thread_ = std::thread(&PeerLinks::loop, this);
+    }
+
+    void wake() {
+        mailboxes_.wake();
+    }
+
+    void join() {
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    void close() {
+        for (auto& link : links_) {
+            if (!link->closed) {
+                ::close(link->socket);
+            }
+        }
+        links_.clear();
+        if (listener_ != -1) {
+            ::close(listener_);
+        }
+        if (epollFd_ != -1) {
+            ::close(epollFd_);
+        }
+        if (mailboxes_.wakeFd != -1) {
+            ::close(mailboxes_.wakeFd);
+        }
+    }
+
+private:
+    struct Peer;
+
+    struct Link {
+        int socket = -1;
+        uint32_t node = 0;        // the peer's node ID, once its HELLO arrived
+        Peer* peer = nullptr;     // set on links this node dialed
+        bool connecting = false;  // non-blocking connect() still in progress
+        bool closed = false;      // freed at the end of the loop iteration
+        bool flushScheduled = false;
+        std::string output;
+        size_t outputOffset = 0;
+        LineParser input{ LINK_MAX_LINE_LENGTH };
+    };
+
+    // A --peer address; redialed while it has no link.
+    struct Peer {
+        std::string host;
+        std::string port;
+        Link* link;
+        std::chrono::steady_clock::time_point nextDial;
+    };
+
+    struct NodeSummary {
+        uint64_t version = 0;
+        std::vector<std::string> channels; // sorted
+        std::vector<Link*> via;            // links this version arrived on, first one first
+        std::string line;                  // as received, to pass on to new links
+        std::chrono::steady_clock::time_point refreshed;
+    };
+
+    struct MessageId {
+        uint32_t origin;
+        uint64_t sequence;
+
+        bool operator==(const MessageId& other) const {
+            return origin == other.origin && sequence == other.sequence;
+        }
+    };
+
+    struct MessageIdHash {
+        size_t operator()(const MessageId& id) const {
+            return std::hash<uint64_t>{}(id.sequence * 0x9E3779B97F4A7C15ull ^ id.origin);
+        }
+    };
+
+    bool openListener() {
+        listener_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int enable = 1;
+        setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(config_.linkPort);
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        if (bind(listener_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1 || listen(listener_, SOMAXCONN) == -1) {
+            std::cerr << "Failed to bind link port " << config_.linkPort << std::endl;
+            return false;
+        }
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.u64 = LISTENER_TOKEN;
+        epoll_ctl(epollFd_, EPOLL_CTL_ADD, listener_, &event);
+        return true;
+    }
+
+    void loop() {
+        epoll_event events[MAX_EPOLL_EVENTS];
+        while (running_) {
+            int count = epoll_wait(epollFd_, events, MAX_EPOLL_EVENTS, hasBacklog() ? 1 : 1000);
+            if (count == -1 && errno != EINTR) {
+                LOG_ERROR("Link thread epoll_wait failed");
+                break;
+            }
+            for (int i = 0; i < count; i++) {
+                uint64_t token = events[i].data.u64;
+                if (token == WAKE_TOKEN) {
+                    uint64_t value;
+                    if (read(mailboxes_.wakeFd, &value, sizeof(value)) == -1 && errno != EAGAIN) {
+                        LOG_ERROR("Failed to read link thread eventfd");
+                    }
+                } else if (token == LISTENER_TOKEN) {
+                    acceptLinks();
+                } else {
+                    handleLinkEvent(*reinterpret_cast<Link*>(token), events[i].events);
+                }
+            }
+
+            drainMailboxes();
+            tick(std::chrono::steady_clock::now());
+            flushLinks();
+            flushBacklogs();
+            reapLinks();
+        }
+    }
+
+    void acceptLinks() {
+        while (true) {
+            int linkSocket = accept4(listener_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (linkSocket == -1) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    LOG_ERROR("Failed to accept peer link");
+                }
+                return;
+            }
+            Link* link = addLink(linkSocket);
+            if (link == nullptr) {
+                continue;
+            }
+            queueLine(*link, "HELLO " + std::to_string(nodeId_));
+        }
+    }
+
+    // Takes ownership of the socket. Returns nullptr, with the socket
+    // closed, if the link could not be set up; nothing refers to it then.
+    Link* addLink(int linkSocket) {
+        int noDelay = 1;
+        setsockopt(linkSocket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+        std::unique_ptr<Link> link(new Link());
+        link->socket = linkSocket;
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.u64 = reinterpret_cast<uint64_t>(link.get());
+        if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, linkSocket, &event) == -1) {
+            LOG_ERROR("Failed to register peer link with epoll");
+            ::close(linkSocket);
+            return nullptr;
+        }
+        metrics_.links.fetch_add(1, std::memory_order_relaxed);
+        links_.push_back(std::move(link));
+        return links_.back().get();
+    }
+
+    void dial(Peer& peer, std::chrono::steady_clock::time_point now) {
+        peer.nextDial = now + std::chrono::seconds(LINK_REDIAL_SECONDS);
+        addrinfo hints{};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* result = nullptr;
+        if (getaddrinfo(peer.host.c_str(), peer.port.c_str(), &hints, &result) != 0 || result == nullptr) {
+            LOG_WARNING("Failed to resolve peer ", peer.host);
+            return;
+        }
+        int linkSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int connected = linkSocket == -1 ? -1 : connect(linkSocket, result->ai_addr, result->ai_addrlen);
+        freeaddrinfo(result);
+        if (connected == -1 && errno != EINPROGRESS) {
+            if (linkSocket != -1) {
+                ::close(linkSocket);
+            }
+            return;
+        }
+        // On failure peer.link stays null, so the peer is dialed again.
+        Link* link = addLink(linkSocket);
+        if (link == nullptr) {
+            return;
+        }
+        link->peer = &peer;
+        link->connecting = true;
+        peer.link = link;
+    }
+
+    void handleLinkEvent(Link& link, uint32_t events) {
+        if (link.closed) {
+            return;
+        }
+        if (link.connecting) {
+            int error = 0;
+            socklen_t length = sizeof(error);
+            if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                return;
+            }
+            getsockopt(link.socket, SOL_SOCKET, SO_ERROR, &error, &length);
+            if (error != 0) {
+                closeLink(link);
+                return;
+            }
+            link.connecting = false;
+            queueLine(link, "HELLO " + std::to_string(nodeId_));
+        }
+        if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            readLink(link);
+        }
+        if (!link.closed && (events & EPOLLOUT)) {
+            flushLink(link);
+        }
+    }
+
+    void readLink(Link& link) {
+        char buffer[READ_BUFFER_SIZE];
+        while (!link.closed) {
+            ssize_t bytesRead = recv(link.socket, buffer, sizeof(buffer), 0);
+            if (bytesRead == -1 && errno == EINTR) {
+                continue;
+            }
+            if (bytesRead == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return;
+            }
+            if (bytesRead <= 0) {
+                closeLink(link);
+                return;
+            }
+            link.input.feed(buffer, bytesRead, [&](std::string_view line) {
+                handleLine(link, line);
+                return !link.closed;
+            });
+        }
+    }
+
+    void handleLine(Link& link, std::string_view line) {
+        std::string_view rest = line;
+        std::string_view kind = nextToken(rest);
+        if (kind == "HELLO") {
+            uint32_t node = static_cast<uint32_t>(parseNumber(nextToken(rest)));
+            if (node == nodeId_ || node == 0) {
+                LOG_WARNING("Closing link from node ", node, ": same node ID as this one");
+                closeLink(link);
+                return;
+            }
+            link.node = node;
+            LOG_INFO("Linked to node ", node);
+            queueLine(link, ownSummary_);
+            for (const auto& entry : nodes_) {
+                queueLine(link, entry.second.line);
+            }
+        } else if (link.node == 0) {
+            LOG_WARNING("Closing peer link that did not start with HELLO");
+            closeLink(link);
+        } else if (kind == "SUMMARY") {
+            handleSummary(link, line, rest);
+        } else if (kind == "MSG") {
+            handleRelay(link, line, rest);
+        }
+    }
+
+    void handleSummary(Link& link, std::string_view line, std::string_view rest) {
+        uint32_t origin = static_cast<uint32_t>(parseNumber(nextToken(rest)));
+        uint64_t version = parseNumber(nextToken(rest));
+        if (origin == nodeId_ || origin == 0) {
+            return;
+        }
+        NodeSummary& summary = nodes_[origin];
+        if (version > summary.version) {
+            std::vector<std::string> channels;
+            for (std::string_view token = nextToken(rest); !token.empty(); token = nextToken(rest)) {
+                channels.push_back(unescapeToken(token));
+            }
+            std::sort(channels.begin(), channels.end());
+            setChannels(summary, std::move(channels));
+            summary.version = version;
+            summary.via.assign(1, &link);
+            summary.line.assign(line.data(), line.size());
+            summary.refreshed = std::chrono::steady_clock::now();
+            for (auto& other : links_) {
+                if (other.get() != &link && other->node != 0 && !other->closed) {
+                    queueLine(*other, summary.line);
+                }
+            }
+        } else if (version == summary.version && std::find(summary.via.begin(), summary.via.end(), &link) == summary.via.end()) {
+            summary.via.push_back(&link);
+        }
+    }
+
+    void handleRelay(Link& link, std::string_view line, std::string_view rest) {
+        MessageId id;
+        id.origin = static_cast<uint32_t>(parseNumber(nextToken(rest)));
+        id.sequence = parseNumber(nextToken(rest));
+        std::string channelName = unescapeToken(nextToken(rest));
+        if (!remember(id)) {
+            metrics_.duplicates.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        forward(line, id.origin, channelName, &link);
+        if (localChannels_.count(channelName) == 0) {
+            return;
+        }
+        metrics_.messagesIn.fetch_add(1, std::memory_order_relaxed);
+        auto relay = std::make_unique<ShardMessage>();
+        relay->type = ShardMessage::Type::Relay;
+        relay->channelName = std::move(channelName);
+        relay->payload = makeMessageBuffer({ rest });
+        int home = homeShardOf(relay->channelName, shards_.size());
+        postToShard(home, relay.release());
+    }
+
+    // Sends a message on every link that leads to a node, other than its
+    // origin, with recipients in the channel; at most once per link.
+    void forward(std::string_view line, uint32_t origin, const std::string& channelName, const Link* from) {
+        hops_.clear();
+        for (const auto& entry : nodes_) {
+            const NodeSummary& summary = entry.second;
+            if (entry.first == origin || summary.via.empty() ||
+                !std::binary_search(summary.channels.begin(), summary.channels.end(), channelName)) {
+                continue;
+            }
+            Link* hop = summary.via.front();
+            if (hop != from && std::find(hops_.begin(), hops_.end(), hop) == hops_.end()) {
+                hops_.push_back(hop);
+            }
+        }
+        for (Link* hop : hops_) {
+            queueLine(*hop, line);
+        }
+        metrics_.messagesOut.fetch_add(hops_.size(), std::memory_order_relaxed);
+    }
+
+    // False if the ID was seen before. The last LINK_SEEN_MESSAGES IDs are kept.
+    bool remember(const MessageId& id) {
+        if (!seen_.insert(id).second) {
+            return false;
+        }
+        seenOrder_.push_back(id);
+        if (seenOrder_.size() > LINK_SEEN_MESSAGES) {
+            seen_.erase(seenOrder_.front());
+            seenOrder_.pop_front();
+        }
+        return true;
+    }
+
+    void drainMailboxes() {
+        for (auto& inbox : mailboxes_.inboxes) {
+            ShardMessage* raw;
+            while (inbox->pop(raw)) {
+                std::unique_ptr<ShardMessage> message(raw);
+                if (message->type == ShardMessage::Type::Federate) {
+                    originate(message->channelName, message->payload);
+                } else if (message->type == ShardMessage::Type::Membership) {
+                    if (message->active) {
+                        localChannels_.insert(message->channelName);
+                    } else {
+                        localChannels_.erase(message->channelName);
+                    }
+                    summaryChanged_ = true;
+                }
+            }
+        }
+    }
+
+    void originate(const std::string& channelName, const MessageBuffer& payload) {
+        MessageId id{ nodeId_, nextSequence_++ };
+        remember(id);
+        std::string line = "MSG " + std::to_string(id.origin) + " " + std::to_string(id.sequence) + " " + escapeToken(channelName) + " ";
+        line.append(payload.view().substr(0, payload.size() - 1));
+        forward(line, nodeId_, channelName, nullptr);
+    }
+
+    // Once a second or so: floods this node's summary when it changed or is
+    // due, forgets nodes that stopped refreshing theirs and redials peers.
+    void tick(std::chrono::steady_clock::time_point now) {
+        if (summaryChanged_ || now >= ownSummarySent_ + std::chrono::seconds(LINK_SUMMARY_SECONDS)) {
+            summaryChanged_ = false;
+            ownSummarySent_ = now;
+            refreshOwnSummary();
+            for (auto& link : links_) {
+                if (link->node != 0 && !link->closed) {
+                    queueLine(*link, ownSummary_);
+                }
+            }
+        }
+        if (now < nextExpiry_) {
+            return;
+        }
+        nextExpiry_ = now + std::chrono::seconds(1);
+        for (auto it = nodes_.begin(); it != nodes_.end();) {
+            if (now - it->second.refreshed > std::chrono::seconds(LINK_SUMMARY_EXPIRY_SECONDS)) {
+                LOG_INFO("Node ", it->first, " expired");
+                setChannels(it->second, {});
+                it = nodes_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        for (Peer& peer : peers_) {
+            if (peer.link == nullptr && now >= peer.nextDial) {
+                dial(peer, now);
+            }
+        }
+    }
+
+    void refreshOwnSummary() {
+        ownVersion_ = std::max(ownVersion_ + 1, static_cast<uint64_t>(wallClockNanos()));
+        ownSummary_ = "SUMMARY " + std::to_string(nodeId_) + " " + std::to_string(ownVersion_);
+        for (const std::string& channelName : localChannels_) {
+            ownSummary_ += " " + escapeToken(channelName);
+        }
+    }
+
+    // Replaces a node's channel list and keeps each channel's count of
+    // remote nodes, which shards read to decide whether to federate.
+    void setChannels(NodeSummary& summary, std::vector<std::string> channels) {
+        for (const std::string& channelName : summary.channels) {
+            if (!std::binary_search(channels.begin(), channels.end(), channelName)) {
+                directory_.find(channelName).remoteNodes.fetch_sub(1, std::memory_order_relaxed);
+            }
+        }
+        for (const std::string& channelName : channels) {
+            if (!std::binary_search(summary.channels.begin(), summary.channels.end(), channelName)) {
+                directory_.find(channelName).remoteNodes.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        summary.channels = std::move(channels);
+    }
+
+    void queueLine(Link& link, std::string_view line) {
+        if (link.closed) {
+            return;
+        }
+        if (link.output.size() - link.outputOffset > LINK_MAX_QUEUED_BYTES) {
+            LOG_WARNING("Dropping link to node ", link.node, ": too far behind");
+            closeLink(link);
+            return;
+        }
+        link.output.append(line.data(), line.size());
+        link.output.push_back('\n');
+        if (!link.flushScheduled && !link.connecting) {
+            link.flushScheduled = true;
+            flushing_.push_back(&link);
+        }
+    }
+
+    // Everything queued on a link in one loop iteration goes out in one write.
+    void flushLinks() {
+        for (Link* link : flushing_) {
+            link->flushScheduled = false;
+            flushLink(*link);
+        }
+        flushing_.clear();
+    }
+
+    void flushLink(Link& link) {
+        while (!link.closed && link.outputOffset < link.output.size()) {
+            ssize_t sent = send(link.socket, link.output.data() + link.outputOffset, link.output.size() - link.outputOffset, MSG_NOSIGNAL);
+            if (sent == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    closeLink(link);
+                }
+                return;
+            }
+            link.outputOffset += sent;
+        }
+        link.output.clear();
+        link.outputOffset = 0;
+    }
+
+    void closeLink(Link& link) {
+        if (link.closed) {
+            return;
+        }
+        link.closed = true;
+        epoll_ctl(epollFd_, EPOLL_CTL_DEL, link.socket, nullptr);
+        ::close(link.socket);
+        metrics_.links.fetch_sub(1, std::memory_order_relaxed);
+        if (link.node != 0) {
+            LOG_INFO("Link to node ", link.node, " closed");
+        }
+        if (link.peer != nullptr) {
+            link.peer->link = nullptr;
+        }
+        for (auto it = nodes_.begin(); it != nodes_.end();) {
+            auto& via = it->second.via;
+            via.erase(std::remove(via.begin(), via.end(), &link), via.end());
+            if (via.empty()) {
+                setChannels(it->second, {});
+                it = nodes_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    void reapLinks() {
+        links_.erase(std::remove_if(links_.begin(), links_.end(), [](const std::unique_ptr<Link>& link) { return link->closed; }),
+                     links_.end());
+    }
+
+    void postToShard(int shard, ShardMessage* message) {
+        std::deque<ShardMessage*>& backlog = backlogs_[shard];
+        if (!backlog.empty() || !shards_[shard]->linkInbox().push(message)) {
+            backlog.push_back(message);
+        }
+        wakePending_[shard] = true;
+    }
+
+    void flushBacklogs() {
+        for (size_t shard = 0; shard < backlogs_.size(); shard++) {
+            std::deque<ShardMessage*>& backlog = backlogs_[shard];
+            while (!backlog.empty() && shards_[shard]->linkInbox().push(backlog.front())) {
+                backlog.pop_front();
+            }
+            if (wakePending_[shard]) {
+                wakePending_[shard] = false;
+                shards_[shard]->wake();
+            }
+        }
+    }
+
+    bool hasBacklog() const {
+        for (const auto& backlog : backlogs_) {
+            if (!backlog.empty()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static std::string_view nextToken(std::string_view& rest) {
+        size_t space = rest.find(' ');
+        std::string_view token = rest.substr(0, space);
+        rest.remove_prefix(space == std::string_view::npos ? rest.size() : space + 1);
+        return token;
+    }
+
+    static uint64_t parseNumber(std::string_view token) {
+        uint64_t value = 0;
+        for (char c : token) {
+            if (c < '0' || c > '9') {
+                return 0;
+            }
+            value = value * 10 + (c - '0');
+        }
+        return value;
+    }
+
+    static std::string escapeToken(std::string_view value) {
+        static const char HEX[] = "0123456789ABCDEF";
+        std::string escaped;
+        for (unsigned char c : value) {
+            if (c <= ' ' || c == '%' || c == 0x7F) {
+                escaped.push_back('%');
+                escaped.push_back(HEX[c >> 4]);
+                escaped.push_back(HEX[c & 0xF]);
+            } else {
+                escaped.push_back(static_cast<char>(c));
+            }
+        }
+        return escaped;
+    }
+
+    static std::string unescapeToken(std::string_view token) {
+        std::string value;
+        for (size_t i = 0; i < token.size(); i++) {
+            if (token[i] == '%' && i + 2 < token.size() && std::isxdigit(static_cast<unsigned char>(token[i + 1])) &&
+                std::isxdigit(static_cast<unsigned char>(token[i + 2]))) {
+                value.push_back(static_cast<char>(std::stoi(std::string(token.substr(i + 1, 2)), nullptr, 16)));
+                i += 2;
+            } else {
+                value.push_back(token[i]);
+            }
+        }
+        return value;
+    }
+
+    // Fixed after start.
+    const ServerConfig& config_;
+    std::vector<std::unique_ptr<Shard>>& shards_;
+    const std::atomic<bool>& running_;
+    ChannelDirectory& directory_;
+    uint32_t nodeId_;
+
+    // Link thread only.
+    int epollFd_ = -1;
+    int listener_ = -1;
+    std::vector<std::unique_ptr<Link>> links_;
+    std::vector<Peer> peers_;
+    std::unordered_map<uint32_t, NodeSummary> nodes_;
+    std::set<std::string> localChannels_; // channels with recipients on this node
+    bool summaryChanged_ = false;
+    uint64_t ownVersion_ = 0;
+    std::string ownSummary_;
+    std::chrono::steady_clock::time_point ownSummarySent_;
+    std::chrono::steady_clock::time_point nextExpiry_;
+    uint64_t nextSequence_ = static_cast<uint64_t>(wallClockNanos()); // IDs stay unique across restarts
+    std::unordered_set<MessageId, MessageIdHash> seen_;
+    std::deque<MessageId> seenOrder_;
+    std::vector<Link*> hops_;
+    std::vector<Link*> flushing_;
+    std::vector<std::deque<ShardMessage*>> backlogs_; // per shard, while its mailbox is full
+    std::vector<bool> wakePending_;
+
+    // Queues from the shards; the link thread is their only consumer.
+    LinkMailboxes mailboxes_;
+
+    LinkMetrics metrics_;
+    std::thread thread_;
+};
+
+// What a new server process gets from the one it takes over from.
+struct Handover {
+    int connection = -1;
+    std::string snapshot;
+    SnapshotReader state{ std::string_view() }; // the snapshot past its header
+    int port = 0;
+    int shardCount = 0;
+    int adminPort = 0;    // 0: the old process had no admin listener
+    std::vector<int> fds; // the shards' listeners, the admin listener, then the clients
+};
+
+class Server {
+public:
+    Server(const ServerConfig& config)
+        : config_(normalize(config)), running_(false), epochs_(config_.shardCount),
+          admission_(config_.connectLimit, config_.maxConnectionsPerIp, ADMISSION_TABLE_SLOTS) {}
+
+    ~Server() {
+        stop();
+    }
+
+    // With a handover, the shards serve the sockets of the process it came
+    // from, and its clients and channels, instead of starting afresh.
+    bool start(Handover* handover = nullptr) {
+        if (running_) {
+            std::cerr << "Server is already running" << std::endl;
+            return false;
+        }
+
+        if (config_.linkPort != 0 || !config_.peers.empty()) {
+            links_.reset(new PeerLinks(config_, shards_, running_, directory_));
+            if (!links_->open()) {
+                links_->close();
+                links_.reset();
+                return false;
+            }
+        }
+        LinkMailboxes* linkMailboxes = links_ ? &links_->mailboxes() : nullptr;
+        for (int i = 0; i < config_.shardCount; i++) {
+            shards_.emplace_back(new Shard(i, config_, shards_, running_, directory_, nicknames_, epochs_, admission_, linkMailboxes));
+        }
+        for (size_t i = 0; i < shards_.size(); i++) {
+            if (!(handover != nullptr ? shards_[i]->adopt(handover->fds[i]) : shards_[i]->open())) {
+                abandonStart();
+                return false;
+            }
+        }
+        if (handover != nullptr && handover->adminPort != 0) {
+            // Kept if it is on the port asked for, so scrapes go on too.
+            int adminListener = handover->fds[shards_.size()];
+            if (handover->adminPort == config_.adminPort) {
+                adminSocket_ = adminListener;
+            } else {
+                ::close(adminListener);
+            }
+        }
+        if (config_.adminPort != 0 && adminSocket_ == -1 && !openAdminSocket()) {
+            abandonStart();
+            return false;
+        }
+        size_t clientsTaken = 0;
+        if (handover != nullptr) {
+            if (!takeOver(*handover, clientsTaken)) {
+                abandonStart();
+                return false;
+            }
+        }
+        // Past a takeover the old process is gone, so only a fresh start
+        // can still give up here.
+        if (!config_.upgradeSocket.empty() && !openUpgradeSocket() && handover == nullptr) {
+            abandonStart();
+            return false;
+        }
+
+        running_ = true;
+
+        if (config_.ioMode != IoMode::Threads) {
+            const char* mode = config_.ioMode == IoMode::Epoll ? "epoll" : config_.ioMode == IoMode::Uring ? "uring" : "coroutines";
+            std::cout << "Server started on port " << config_.port << " (" << mode << " mode, " << config_.shardCount << " shards)"
+                      << std::endl;
+        } else {
+            std::cout << "Server started on port " << config_.port << " (threads mode)" << std::endl;
+        }
+
+        if (handover != nullptr) {
+            std::cout << "Took over " << clientsTaken << " clients from the previous server process" << std::endl;
+        }
+
+        if (links_) {
+            std::cout << "Node " << links_->nodeId() << " linking";
+            if (config_.linkPort != 0) {
+                std::cout << " on port " << config_.linkPort;
+            }
+            for (const std::string& peer : config_.peers) {
+                std::cout << " to " << peer;
+            }
+            std::cout << std::endl;
+        }
+
+        for (auto& shard : shards_) {
+            shard->run();
+        }
+        if (links_) {
+            links_->run();
+        }
+        if (adminSocket_ != -1) {
+            std::cout << "Metrics available at http://127.0.0.1:" << config_.adminPort << "/metrics" << std::endl;
+            adminThread_ = std::thread(&Server::serveMetrics, this);
+        }
+        if (upgradeSocket_ != -1) {
+            std::cout << "A new server process can take over with --take-over " << config_.upgradeSocket << std::endl;
+            upgradeThread_ = std::thread(&Server::serveUpgrades, this);
+        }
+
+        return true;
+    }
+
+    // Hot upgrade, new side, before the Server exists: connects to the old
+    // process and receives its snapshot and sockets. The snapshot's header
+    // gives the port and shard count to start with.
+    static bool receiveHandover(const std::string& path, Handover& handover) {
+        sockaddr_un address;
+        if (!makeUnixAddress(path, address)) {
+            return false;
+        }
+        handover.connection = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (handover.connection == -1 || connect(handover.connection, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1 ||
+            !receiveSnapshot(handover.connection, handover.snapshot)) {
+            return false;
+        }
+
+        handover.state = SnapshotReader(handover.snapshot);
+        SnapshotReader& in = handover.state;
+        if (in.bytes() != HANDOVER_MAGIC || in.number() != HANDOVER_VERSION) {
+            return false;
+        }
+        handover.port = static_cast<int>(in.number());
+        handover.shardCount = static_cast<int>(in.number());
+        handover.adminPort = static_cast<int>(in.number());
+        uint64_t fdCount = in.number();
+        if (in.failed() || handover.shardCount < 1 || fdCount < static_cast<uint64_t>(handover.shardCount + (handover.adminPort != 0 ? 1 : 0))) {
+            return false;
+        }
+        return receiveDescriptors(handover.connection, fdCount, handover.fds);
+    }
+
+    void printStats() {
+        uint64_t droppedOldest = 0;
+        uint64_t droppedNewest = 0;
+        uint64_t disconnects = 0;
+        uint64_t connectionsRejected = 0;
+        uint64_t linesThrottled = 0;
+        uint64_t chatInvalidUtf8 = 0;
+        uint64_t chatTooLong = 0;
+        uint64_t chatBlocked = 0;
+        uint64_t pingsSent = 0;
+        uint64_t clientsTimedOut = 0;
+        for (auto& shard : shards_) {
+            const OverflowStats& stats = shard->overflowStats();
+            droppedOldest += stats.droppedOldest.load(std::memory_order_relaxed);
+            droppedNewest += stats.droppedNewest.load(std::memory_order_relaxed);
+            disconnects += stats.disconnects.load(std::memory_order_relaxed);
+            connectionsRejected += shard->metrics().connectionsRejected.load(std::memory_order_relaxed);
+            linesThrottled += shard->metrics().linesThrottled.load(std::memory_order_relaxed);
+            chatInvalidUtf8 += shard->metrics().chatInvalidUtf8.load(std::memory_order_relaxed);
+            chatTooLong += shard->metrics().chatTooLong.load(std::memory_order_relaxed);
+            chatBlocked += shard->metrics().chatBlocked.load(std::memory_order_relaxed);
+            pingsSent += shard->metrics().pingsSent.load(std::memory_order_relaxed);
+            clientsTimedOut += shard->metrics().clientsTimedOut.load(std::memory_order_relaxed);
+        }
+        std::cout << "Output queue overflows: " << droppedOldest << " oldest dropped, "
+                  << droppedNewest << " newest dropped, " << disconnects << " clients disconnected" << std::endl;
+        std::cout << "Rate limits: " << connectionsRejected << " connections rejected, " << linesThrottled << " lines dropped" << std::endl;
+        std::cout << "Chat filter: " << chatInvalidUtf8 << " invalid UTF-8, " << chatTooLong << " too long, "
+                  << chatBlocked << " blocked" << std::endl;
+        std::cout << "Timeouts: " << pingsSent << " pings sent, " << clientsTimedOut << " clients dropped" << std::endl;
+        if (links_) {
+            const LinkMetrics& metrics = links_->metrics();
+            std::cout << "Peer links: " << metrics.links.load(std::memory_order_relaxed) << " open, "
+                      << metrics.messagesOut.load(std::memory_order_relaxed) << " messages forwarded, "
+                      << metrics.messagesIn.load(std::memory_order_relaxed) << " relayed here, "
+                      << metrics.duplicates.load(std::memory_order_relaxed) << " duplicates dropped" << std::endl;
+        }
+        std::cout << "Heap allocations: " << heapAllocations.load(std::memory_order_relaxed) << std::endl;
+    }
+
+    // Blocks until every shard thread exits, i.e. until stop() is called.
+    void wait() {
+        for (auto& shard : shards_) {
+            shard->join();
+        }
+    }
+
+    void stop() {
+        if (!running_) {
+            return;
+        }
+
+        running_ = false;
+
+        // Waits for a handover in progress, which either ends the process
+        // or leaves it as it was.
+        if (upgradeSocket_ != -1) {
+            shutdown(upgradeSocket_, SHUT_RDWR);
+            upgradeThread_.join();
+            ::close(upgradeSocket_);
+            upgradeSocket_ = -1;
+            unlink(config_.upgradeSocket.c_str());
+        }
+
+        for (auto& shard : shards_) {
+            shard->wake();
+        }
+        if (links_) {
+            links_->wake();
+            links_->join();
+        }
+        wait();
+
+        for (auto& shard : shards_) {
+            shard->close();
+        }
+        if (links_) {
+            links_->close();
+        }
+
+        if (adminSocket_ != -1) {
+            shutdown(adminSocket_, SHUT_RDWR);
+            adminThread_.join();
+            ::close(adminSocket_);
+            adminSocket_ = -1;
+        }
+
+#ifdef _WIN32
+        WSACleanup();
+#endif
+    }
+
+private:
+    void abandonStart() {
+        shards_.clear();
+        if (links_) {
+            links_->close();
+            links_.reset();
+        }
+    }
+
+    static ServerConfig normalize(ServerConfig config) {
+        if (config.ioMode == IoMode::Threads || config.shardCount < 1) {
+            config.shardCount = 1;
+        }
+        return config;
+    }
+
+    // The admin port only listens on loopback.
+    bool openAdminSocket() {
+        adminSocket_ = socket(AF_INET, SOCK_STREAM, 0);
+        if (adminSocket_ == -1) {
+            std::cerr << "Failed to create admin socket" << std::endl;
+            return false;
+        }
+
+        int reuse = 1;
+        setsockopt(adminSocket_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(config_.adminPort);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(adminSocket_, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) == -1 ||
+            listen(adminSocket_, SOMAXCONN) == -1) {
+            std::cerr << "Failed to bind admin port " << config_.adminPort << std::endl;
+            ::close(adminSocket_);
+            adminSocket_ = -1;
+            return false;
+        }
+        return true;
+    }
+
+    // Only the user the server runs as may connect: whoever takes over gets
+    // every client's socket.
+    bool openUpgradeSocket() {
+        sockaddr_un address;
+        if (!makeUnixAddress(config_.upgradeSocket, address)) {
+            std::cerr << "Upgrade socket path is too long: " << config_.upgradeSocket << std::endl;
+            return false;
+        }
+        // A socket file left there is stale, or the one of the process just
+        // taken over from, which has let go of it.
+        unlink(config_.upgradeSocket.c_str());
+        upgradeSocket_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (upgradeSocket_ == -1 || bind(upgradeSocket_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1 ||
+            chmod(config_.upgradeSocket.c_str(), 0600) == -1 || listen(upgradeSocket_, 1) == -1) {
+            std::cerr << "Failed to listen on upgrade socket " << config_.upgradeSocket << std::endl;
+            if (upgradeSocket_ != -1) {
+                ::close(upgradeSocket_);
+                upgradeSocket_ = -1;
+            }
+            return false;
+        }
+        return true;
+    }
+
+    // One handover at a time, from a process of the same user.
+    void serveUpgrades() {
+        while (running_) {
+            int connection = accept4(upgradeSocket_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (connection == -1) {
+                if (running_ && errno != EINTR) {
+                    LOG_ERROR("Failed to accept upgrade connection");
+                }
+                continue;
+            }
+            ucred peer{};
+            socklen_t peerLength = sizeof(peer);
+            if (getsockopt(connection, SOL_SOCKET, SO_PEERCRED, &peer, &peerLength) == 0 && peer.uid == geteuid() && running_) {
+                handOver(connection);
+            } else {
+                LOG_WARNING("Refused an upgrade connection");
+            }
+            ::close(connection);
+        }
+    }
+
+    // Hot upgrade, old side: parks every shard, lets the requests in flight
+    // between them run, and sends the new process a snapshot of the clients
+    // and channels along with every socket. Exits as soon as the new
+    // process has taken over, without closing anything; if it does not,
+    // everything is put back and the shards carry on.
+    void handOver(int connection) {
+        LOG_INFO("Handing over to a new server process");
+        for (auto& shard : shards_) {
+            shard->pause();
+        }
+        bool busy = true;
+        while (busy) {
+            busy = false;
+            for (auto& shard : shards_) {
+                busy |= shard->settle();
+            }
+        }
+        for (auto& shard : shards_) {
+            shard->closeHistories();
+        }
+
+        std::vector<int> fds;
+        for (auto& shard : shards_) {
+            fds.push_back(shard->listener());
+        }
+        if (adminSocket_ != -1) {
+            fds.push_back(adminSocket_);
+        }
+        SnapshotWriter body;
+        std::vector<std::string> channelNames = directory_.namesById();
+        body.number(channelNames.size());
+        for (const std::string& name : channelNames) {
+            body.bytes(name);
+        }
+        std::unordered_map<ClientHandle, uint64_t> refs;
+        for (auto& shard : shards_) {
+            shard->exportClients(body, refs, fds);
+        }
+        for (auto& shard : shards_) {
+            shard->exportChannels(body, refs);
+        }
+
+        SnapshotWriter header;
+        header.bytes(HANDOVER_MAGIC);
+        header.number(HANDOVER_VERSION);
+        header.number(config_.port);
+        header.number(shards_.size());
+        header.number(adminSocket_ != -1 ? config_.adminPort : 0);
+        header.number(fds.size());
+        if (sendSnapshot(connection, header.data() + body.data()) && sendDescriptors(connection, fds) &&
+            expectByte(connection, HANDOVER_READY)) {
+            // The new process binds the path again once it has the go-ahead.
+            unlink(config_.upgradeSocket.c_str());
+            if (writeFully(connection, &HANDOVER_GO, 1)) {
+                std::cout << "Handed " << refs.size() << " clients over to the new server process" << std::endl;
+                LOG_INFO("Handed ", refs.size(), " clients over to the new server process");
+                Logger::instance().stop();
+                _exit(0);
+            }
+        }
+
+        LOG_ERROR("Hot upgrade failed, carrying on");
+        for (auto& shard : shards_) {
+            shard->reopenHistories();
+            shard->resume();
+        }
+    }
+
+    // Rebuilds the old process's clients and channels from the snapshot,
+    // then tells it so and waits for the go-ahead. Runs before any shard
+    // thread; a client's socket is the one at the same place in the
+    // snapshot and among the descriptors.
+    bool takeOver(Handover& handover, size_t& clientsTaken) {
+        SnapshotReader& in = handover.state;
+        // Slots are numbered as they are created, so creating them in the
+        // old process's order keeps every channel ID binary clients know.
+        uint64_t channelCount = in.number();
+        for (uint64_t i = 0; i < channelCount && !in.failed(); i++) {
+            directory_.find(std::string(in.bytes()));
+        }
+
+        std::vector<ClientHandle> handles;
+        size_t nextFd = shards_.size() + (handover.adminPort != 0 ? 1 : 0);
+        for (auto& shard : shards_) {
+            uint64_t count = in.number();
+            for (uint64_t i = 0; i < count && !in.failed(); i++) {
+                if (nextFd == handover.fds.size()) {
+                    std::cerr << "Handover snapshot has more clients than sockets" << std::endl;
+                    return false;
+                }
+                handles.push_back(shard->importClient(in, handover.fds[nextFd++]));
+            }
+        }
+        // Channels go to their home here, whichever shard had them before.
+        for (size_t shard = 0; shard < shards_.size() && !in.failed(); shard++) {
+            uint64_t channels = in.number();
+            for (uint64_t i = 0; i < channels && !in.failed(); i++) {
+                std::string name(in.bytes());
+                shards_[homeShardOf(name, shards_.size())]->importChannel(name, in, handles);
+            }
+            uint64_t admins = in.number();
+            for (uint64_t i = 0; i < admins && !in.failed(); i++) {
+                std::string name(in.bytes());
+                uint64_t ref = in.number();
+                shards_[homeShardOf(name, shards_.size())]->importAdmin(name, ref != 0 && ref <= handles.size() ? handles[ref - 1] : 0);
+            }
+        }
+        if (in.failed() || !in.done()) {
+            std::cerr << "Malformed handover snapshot" << std::endl;
+            return false;
+        }
+
+        if (!writeFully(handover.connection, &HANDOVER_READY, 1) || !expectByte(handover.connection, HANDOVER_GO)) {
+            std::cerr << "The previous server process did not let go of its sockets" << std::endl;
+            return false;
+        }
+        ::close(handover.connection);
+        handover.connection = -1;
+        for (auto& shard : shards_) {
+            shard->startSessions();
+        }
+        clientsTaken = static_cast<size_t>(std::count_if(handles.begin(), handles.end(), [](ClientHandle handle) { return handle != 0; }));
+        return true;
+    }
+
+    // Answers GET /metrics on the admin port in the Prometheus text format.
+    // Scrapes only read the shards' atomics, so they never hold up a shard
+    // and never take clientsMutex_.
+    void serveMetrics() {
+        while (running_) {
+            int connection = accept(adminSocket_, nullptr, nullptr);
+            if (connection == -1) {
+                if (running_ && errno != EINTR) {
+                    LOG_ERROR("Failed to accept admin connection");
+                }
+                continue;
+            }
+
+            timeval timeout{ 1, 0 };
+            setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            char request[ADMIN_REQUEST_SIZE];
+            ssize_t length = recv(connection, request, sizeof(request), 0);
+            std::string_view requestLine(request, length > 0 ? length : 0);
+
+            std::string response;
+            if (requestLine.substr(0, 13) == "GET /metrics " || requestLine.substr(0, 14) == "GET /metrics?") {
+                std::string body = renderMetrics();
+                response = "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                           std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+            } else {
+                response = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            }
+
+            size_t offset = 0;
+            while (offset < response.size()) {
+                ssize_t sent = send(connection, response.data() + offset, response.size() - offset, MSG_NOSIGNAL);
+                if (sent <= 0) {
+                    break;
+                }
+                offset += sent;
+            }
+            ::close(connection);
+        }
+    }
+
+    std::string renderMetrics() {
+        uint64_t accepts = 0;
+        uint64_t disconnects = 0;
+        uint64_t bytesIn = 0;
+        uint64_t bytesOut = 0;
+        uint64_t messagesBroadcast = 0;
+        uint64_t messagesQueued = 0;
+        uint64_t sendFailures = 0;
+        uint64_t connectionsRejected = 0;
+        uint64_t linesThrottled = 0;
+        uint64_t chatInvalidUtf8 = 0;
+        uint64_t chatTooLong = 0;
+        uint64_t chatBlocked = 0;
+        uint64_t pingsSent = 0;
+        uint64_t clientsTimedOut = 0;
+        uint64_t droppedOldest = 0;
+        uint64_t droppedNewest = 0;
+        uint64_t evictions = 0;
+        Histogram commandNanos;
+        Histogram fanoutNanos;
+        std::vector<std::tuple<std::string, uint64_t, uint64_t>> channels;
+        for (auto& shard : shards_) {
+            const ShardMetrics& metrics = shard->metrics();
+            accepts += metrics.accepts.load(std::memory_order_relaxed);
+            disconnects += metrics.disconnects.load(std::memory_order_relaxed);
+            bytesIn += metrics.bytesIn.load(std::memory_order_relaxed);
+            bytesOut += metrics.bytesOut.load(std::memory_order_relaxed);
+            messagesBroadcast += metrics.messagesBroadcast.load(std::memory_order_relaxed);
+            messagesQueued += metrics.messagesQueued.load(std::memory_order_relaxed);
+            sendFailures += metrics.sendFailures.load(std::memory_order_relaxed);
+            connectionsRejected += metrics.connectionsRejected.load(std::memory_order_relaxed);
+            linesThrottled += metrics.linesThrottled.load(std::memory_order_relaxed);
+            chatInvalidUtf8 += metrics.chatInvalidUtf8.load(std::memory_order_relaxed);
+            chatTooLong += metrics.chatTooLong.load(std::memory_order_relaxed);
+            chatBlocked += metrics.chatBlocked.load(std::memory_order_relaxed);
+            pingsSent += metrics.pingsSent.load(std::memory_order_relaxed);
+            clientsTimedOut += metrics.clientsTimedOut.load(std::memory_order_relaxed);
+            commandNanos.merge(metrics.commandNanos);
+            fanoutNanos.merge(metrics.fanoutNanos);
+
+            const OverflowStats& stats = shard->overflowStats();
+            droppedOldest += stats.droppedOldest.load(std::memory_order_relaxed);
+            droppedNewest += stats.droppedNewest.load(std::memory_order_relaxed);
+            evictions += stats.disconnects.load(std::memory_order_relaxed);
+
+        }
+        directory_.forEach([&](const std::string& name, const ChannelSlot& slot) {
+            channels.emplace_back(name, slot.gauges.members.load(std::memory_order_relaxed),
+                                  slot.gauges.messages.load(std::memory_order_relaxed));
+        });
+
+        std::ostringstream out;
+        writeMetric(out, "irc_accepts_total", "counter", "Client connections accepted.", accepts);
+        writeMetric(out, "irc_disconnects_total", "counter", "Client connections closed.", disconnects);
+        writeMetric(out, "irc_connected_clients", "gauge", "Client connections currently open.", accepts - disconnects);
+        writeMetric(out, "irc_received_bytes_total", "counter", "Bytes read from clients.", bytesIn);
+        writeMetric(out, "irc_sent_bytes_total", "counter", "Bytes written to clients.", bytesOut);
+        writeMetric(out, "irc_messages_broadcast_total", "counter", "Messages broadcast to a channel.", messagesBroadcast);
+        writeMetric(out, "irc_messages_queued_total", "counter", "Messages queued for a recipient.", messagesQueued);
+        writeMetric(out, "irc_send_failures_total", "counter", "Socket writes that failed.", sendFailures);
+        writeMetric(out, "irc_connections_rejected_total", "counter", "Connections refused for their source's limits.", connectionsRejected);
+        writeMetric(out, "irc_lines_throttled_total", "counter", "Lines dropped for a client over its rate limit.", linesThrottled);
+        writeMetric(out, "irc_chat_invalid_utf8_total", "counter", "Chat lines refused for not being valid UTF-8.", chatInvalidUtf8);
+        writeMetric(out, "irc_chat_too_long_total", "counter", "Chat lines refused for being over the length limit.", chatTooLong);
+        writeMetric(out, "irc_chat_blocked_total", "counter", "Chat lines refused for matching the blocklist.", chatBlocked);
+        writeMetric(out, "irc_pings_sent_total", "counter", "Keepalive PINGs sent to quiet clients.", pingsSent);
+        writeMetric(out, "irc_clients_timed_out_total", "counter", "Clients dropped by an idle, handshake or write timeout.", clientsTimedOut);
+        writeMetric(out, "irc_overflow_dropped_oldest_total", "counter", "Queued messages dropped by drop-oldest.", droppedOldest);
+        writeMetric(out, "irc_overflow_dropped_newest_total", "counter", "New messages dropped for a full queue.", droppedNewest);
+        writeMetric(out, "irc_overflow_disconnects_total", "counter", "Clients disconnected for a full queue.", evictions);
+        writeMetric(out, "irc_heap_allocations_total", "counter", "Global heap allocations.", heapAllocations.load(std::memory_order_relaxed));
+        writeSummary(out, "irc_command_duration_seconds", "Time to handle one line from a client.", commandNanos);
+        writeSummary(out, "irc_broadcast_fanout_duration_seconds", "Time to fan one message out on its home shard.", fanoutNanos);
+
+        // Prometheus derives rates from counters, but a gauge is handier for
+        // a quick look, so the rate since the previous scrape is exported too.
+        auto now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - previousScrape_).count();
+        out << "# HELP irc_channel_members Members of a channel.\n# TYPE irc_channel_members gauge\n";
+        for (const auto& channel : channels) {
+            out << "irc_channel_members{channel=\"" << escapeLabel(std::get<0>(channel)) << "\"} " << std::get<1>(channel) << "\n";
+        }
+        out << "# HELP irc_channel_messages_total Messages broadcast to a channel.\n# TYPE irc_channel_messages_total counter\n";
+        for (const auto& channel : channels) {
+            out << "irc_channel_messages_total{channel=\"" << escapeLabel(std::get<0>(channel)) << "\"} " << std::get<2>(channel) << "\n";
+        }
+        out << "# HELP irc_channel_message_rate Messages per second broadcast to a channel since the previous scrape.\n"
+            << "# TYPE irc_channel_message_rate gauge\n";
+        std::unordered_map<std::string, uint64_t> channelMessages;
+        for (const auto& channel : channels) {
+            auto previous = previousChannelMessages_.find(std::get<0>(channel));
+            double rate = 0;
+            if (previous != previousChannelMessages_.end() && elapsed > 0) {
+                rate = (std::get<2>(channel) - previous->second) / elapsed;
+            }
+            out << "irc_channel_message_rate{channel=\"" << escapeLabel(std::get<0>(channel)) << "\"} " << rate << "\n";
+            channelMessages[std::get<0>(channel)] = std::get<2>(channel);
+        }
+        previousChannelMessages_.swap(channelMessages);
+        previousScrape_ = now;
+
+        return out.str();
+    }
+
+    static void writeMetric(std::ostringstream& out, const char* name, const char* type, const char* help, uint64_t value) {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n" << name << " " << value << "\n";
+    }
+
+    // Histograms are recorded in nanoseconds and exported in seconds.
+    static void writeSummary(std::ostringstream& out, const char* name, const char* help, const Histogram& histogram) {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " summary\n";
+        for (const char* quantile : { "0.5", "0.99", "0.999" }) {
+            out << name << "{quantile=\"" << quantile << "\"} " << histogram.percentile(std::atof(quantile)) / 1e9 << "\n";
+        }
+        out << name << "_sum " << histogram.sum() / 1e9 << "\n" << name << "_count " << histogram.count() << "\n";
+    }
+
+    static std::string escapeLabel(const std::string& value) {
+        std::string escaped;
+        for (char c : value) {
+            if (c == '\\' || c == '"') {
+                escaped.push_back('\\');
+                escaped.push_back(c);
+            } else if (c == '\n') {
+                escaped.append("\\n");
+            } else {
+                escaped.push_back(c);
+            }
+        }
+        return escaped;
+    }
+
+    // start() and stop() run on the thread that owns the Server. Everything
+    // except running_ is set up before start() launches any other thread
+    // and only torn down after stop() has joined them all; in between,
+    // shards and the admin thread read it and the shards own their state.
+    ServerConfig config_;
+    std::atomic<bool> running_;
+    ChannelDirectory directory_;
+    NicknameRegistry nicknames_;
+    EpochReclaimer epochs_;
+    AdmissionTable admission_;
+    std::unique_ptr<PeerLinks> links_;           // federation; outlives the shards that post to its mailboxes
+    std::vector<std::unique_ptr<Shard>> shards_; // destroyed before the directory, registry, reclaimer and table they use
+    int adminSocket_ = -1;
+    std::thread adminThread_;
+    int upgradeSocket_ = -1; // hot upgrade: a new process connects here to take over
+    std::thread upgradeThread_;
+    std::unordered_map<std::string, uint64_t> previousChannelMessages_; // admin thread only
+    std::chrono::steady_clock::time_point previousScrape_;               // admin thread only
+};
+
+// "RATE" or "RATE:BURST", per second. The burst defaults to one second's
+// worth and is never below minBurst, the cost of the largest single take.
+RateLimit parseRateLimit(const char* value, uint64_t minBurst) {
+    char* end;
+    uint64_t rate = std::strtoull(value, &end, 10);
+    uint64_t burst = *end == ':' ? std::strtoull(end + 1, nullptr, 10) : rate;
+    return RateLimit(rate, std::max(burst, minBurst));
+}
+
+int main(int argc, char* argv[]) {
+#ifdef _WIN32
+    WSADATA wsData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsData) != 0) {
+        std::cerr << "Failed to initialize winsock" << std::endl;
+        return 1;
+    }
+#endif
+
+#ifdef _WIN32
+    SetConsoleCtrlHandler((PHANDLER_ROUTINE)CtrlHandler, TRUE);
+#else
+    signal(SIGINT, CtrlHandler);
+    // Socket writes pass MSG_NOSIGNAL, but sendfile() cannot: a history
+    // replay to a peer that has just hung up must fail with EPIPE instead.
+    signal(SIGPIPE, SIG_IGN);
+
+    // Every client is a descriptor; take whatever the hard limit allows.
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+#endif
+
+    ServerConfig config;
+    config.shardCount = std::max(1u, std::thread::hardware_concurrency());
+    std::string blocklistFile;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--port" && i + 1 < argc) {
+            config.port = std::atoi(argv[++i]);
+        } else if (arg == "--io" && i + 1 < argc) {
+            std::string mode = argv[++i];
+            if (mode == "threads") {
+                config.ioMode = IoMode::Threads;
+            } else if (mode == "epoll") {
+                config.ioMode = IoMode::Epoll;
+            } else if (mode == "uring") {
+                config.ioMode = IoMode::Uring;
+            } else if (mode == "coroutines") {
+#if SERVER_COROUTINES
+                config.ioMode = IoMode::Coroutines;
+#else
+                std::cerr << "Coroutines mode needs a C++20 build: make server20" << std::endl;
+                return 1;
+#endif
+            } else {
+                std::cerr << "Unknown I/O mode: " << mode << std::endl;
+                return 1;
+            }
+        } else if (arg == "--admin-port" && i + 1 < argc) {
+            config.adminPort = std::atoi(argv[++i]);
+        } else if (arg == "--log-file" && i + 1 < argc) {
+            config.logFile = argv[++i];
+        } else if (arg == "--no-chat-echo") {
+            config.chatEcho = false;
+        } else if (arg == "--history-dir" && i + 1 < argc) {
+            config.historyDir = argv[++i];
+        } else if (arg == "--history-segments" && i + 1 < argc) {
+            config.historySegments = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--replay-messages" && i + 1 < argc) {
+            config.replayMessages = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--replay-seconds" && i + 1 < argc) {
+            config.replaySeconds = std::atoll(argv[++i]);
+        } else if (arg == "--shards" && i + 1 < argc) {
+            config.shardCount = std::atoi(argv[++i]);
+        } else if (arg == "--max-queued-bytes" && i + 1 < argc) {
+            config.maxQueuedBytes = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--max-queued-messages" && i + 1 < argc) {
+            config.maxQueuedMessages = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--connect-limit" && i + 1 < argc) {
+            config.connectLimit = parseRateLimit(argv[++i], 1);
+        } else if (arg == "--max-connections-per-ip" && i + 1 < argc) {
+            config.maxConnectionsPerIp = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--command-limit" && i + 1 < argc) {
+            config.commandLimit = parseRateLimit(argv[++i], 1);
+        } else if (arg == "--byte-limit" && i + 1 < argc) {
+            config.byteLimit = parseRateLimit(argv[++i], MAX_MESSAGE_LENGTH + 1);
+        } else if (arg == "--link-port" && i + 1 < argc) {
+            config.linkPort = std::atoi(argv[++i]);
+        } else if (arg == "--peer" && i + 1 < argc) {
+            config.peers.push_back(argv[++i]);
+        } else if (arg == "--node-id" && i + 1 < argc) {
+            config.nodeId = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--ping-interval" && i + 1 < argc) {
+            config.pingInterval = std::atoi(argv[++i]);
+        } else if (arg == "--idle-timeout" && i + 1 < argc) {
+            config.idleTimeout = std::atoi(argv[++i]);
+        } else if (arg == "--handshake-timeout" && i + 1 < argc) {
+            config.handshakeTimeout = std::atoi(argv[++i]);
+        } else if (arg == "--write-timeout" && i + 1 < argc) {
+            config.writeTimeout = std::atoi(argv[++i]);
+        } else if (arg == "--upgrade-socket" && i + 1 < argc) {
+            config.upgradeSocket = argv[++i];
+        } else if (arg == "--take-over" && i + 1 < argc) {
+            config.takeOver = argv[++i];
+        } else if (arg == "--utf8-only") {
+            config.chatFilter.requireUtf8 = true;
+        } else if (arg == "--strip-controls") {
+            config.chatFilter.removeControls = true;
+        } else if (arg == "--max-chat-length" && i + 1 < argc) {
+            config.chatFilter.maxLength = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--blocklist" && i + 1 < argc) {
+            blocklistFile = argv[++i];
+        } else if (arg == "--overflow" && i + 1 < argc) {
+            std::string policy = argv[++i];
+            if (policy == "drop-oldest") {
+                config.overflowPolicy = OverflowPolicy::DropOldest;
+            } else if (policy == "drop-newest") {
+                config.overflowPolicy = OverflowPolicy::DropNewest;
+            } else if (policy == "disconnect") {
+                config.overflowPolicy = OverflowPolicy::Disconnect;
+            } else {
+                std::cerr << "Unknown overflow policy: " << policy << std::endl;
+                return 1;
+            }
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--port PORT] [--admin-port PORT] [--log-file PATH] [--no-chat-echo] [--io threads|epoll|coroutines|uring] [--shards N]"
+                      << " [--history-dir DIR] [--history-segments N] [--replay-messages N] [--replay-seconds T]"
+                      << " [--max-queued-bytes N] [--max-queued-messages N] [--overflow drop-oldest|drop-newest|disconnect]"
+                      << " [--connect-limit RATE[:BURST]] [--max-connections-per-ip N] [--command-limit RATE[:BURST]] [--byte-limit RATE[:BURST]]"
+                      << " [--link-port PORT] [--peer HOST:PORT]... [--node-id N]"
+                      << " [--ping-interval T] [--idle-timeout T] [--handshake-timeout T] [--write-timeout T]"
+                      << " [--upgrade-socket PATH] [--take-over PATH]"
+                      << " [--utf8-only] [--strip-controls] [--max-chat-length N] [--blocklist PATH]" << std::endl;
+            return 1;
+        }
+    }
+
+    // One pattern per line, matched anywhere in a chat line, ignoring case.
+    if (!blocklistFile.empty()) {
+        std::ifstream file(blocklistFile);
+        if (!file) {
+            std::cerr << "Failed to open blocklist " << blocklistFile << std::endl;
+            return 1;
+        }
+        std::vector<std::string> patterns;
+        std::string pattern;
+        while (std::getline(file, pattern)) {
+            if (!pattern.empty() && pattern.back() == '\r') {
+                pattern.pop_back();
+            }
+            patterns.push_back(pattern);
+        }
+        config.chatFilter.blocklist = Blocklist(patterns);
+    }
+
+    if (config.ioMode == IoMode::Uring && !Uring::supported()) {
+        std::cerr << "io_uring is not fully supported by this kernel, using epoll" << std::endl;
+        config.ioMode = IoMode::Epoll;
+    }
+
+    if (config.linkPort != 0 || !config.peers.empty()) {
+        if (config.ioMode == IoMode::Threads) {
+            std::cerr << "Peer links need an event loop I/O mode" << std::endl;
+            return 1;
+        }
+        while (config.nodeId == 0) {
+            config.nodeId = std::random_device{}();
+        }
+    }
+
+    // Only an epoll loop can be parked with nothing read but not yet parsed
+    // outside the parsers: io_uring keeps receiving into its buffers, and
+    // a coroutine session may be holding input.
+    if (!config.upgradeSocket.empty() || !config.takeOver.empty()) {
+        if (config.linkPort != 0 || !config.peers.empty()) {
+            std::cerr << "Hot upgrade does not carry peer links" << std::endl;
+            return 1;
+        }
+        if (!config.upgradeSocket.empty() && config.ioMode != IoMode::Epoll) {
+            std::cerr << "Only the epoll I/O mode can hand over to a new process (--upgrade-socket)" << std::endl;
+            return 1;
+        }
+        if (config.ioMode == IoMode::Threads) {
+            std::cerr << "Taking over needs an event loop I/O mode" << std::endl;
+            return 1;
+        }
+    }
+
+    // The port and shard count are the old process's.
+    Handover handover;
+    if (!config.takeOver.empty()) {
+        if (!Server::receiveHandover(config.takeOver, handover)) {
+            std::cerr << "Failed to take over from the server at " << config.takeOver << std::endl;
+            return 1;
+        }
+        config.port = handover.port;
+        config.shardCount = handover.shardCount;
+    }
+
+    if (config.port == 0) {
+        std::cout << "Enter server port: ";
+        std::cin >> config.port;
+    }
+
+    if (!config.historyDir.empty() && mkdir(config.historyDir.c_str(), 0755) == -1 && errno != EEXIST) {
+        std::cerr << "Failed to create history directory " << config.historyDir << std::endl;
+        return 1;
+    }
+
+    if (!Logger::instance().start(config.logFile)) {
+        std::cerr << "Failed to open log file " << config.logFile << std::endl;
+        return 1;
+    }
+
+    Server server(config);
+    if (!server.start(config.takeOver.empty() ? nullptr : &handover)) {
+        Logger::instance().stop();
+        return 1;
+    }
+
+    std::string input;
+    std::cout << "Type '/quit' to stop the server or '/stats' to show counters" << std::endl;
+    while (std::getline(std::cin, input)) {
+        if (input.find("/quit") != std::string::npos) {
+            server.stop();
+            Logger::instance().stop();
+            return 0;
+        }
+        if (input.find("/stats") != std::string::npos) {
+            server.printStats();
+        }
+    }
+
+    // stdin is closed (e.g. started from a script): keep serving until killed.
+    server.wait();
+
+    return 0;
+}
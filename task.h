@@ -0,0 +1,54 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include <coroutine>
+#include <exception>
+
+#include "message_buffer.h"
+
+// Detached coroutine: runs as soon as it is called, up to its first
+// suspension, and frees its own frame when it returns. Whoever parks it
+// either resumes it later or destroys it. Frames come from BufferPool, so
+// starting a task per connection does not touch the heap once the pool is
+// warm.
+class Task {
+public:
+    struct promise_type {
+        Task get_return_object() noexcept {
+            return {};
+        }
+
+        std::suspend_never initial_suspend() noexcept {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept {
+            return {};
+        }
+
+        void return_void() noexcept {}
+
+        void unhandled_exception() noexcept {
+            std::terminate();
+        }
+
+        static void* operator new(size_t size) {
+            return BufferPool::allocate(size);
+        }
+
+        static void operator delete(void* pointer, size_t size) {
+            BufferPool::release(pointer, size);
+        }
+    };
+};
+
+// A suspended task parked on a socket. The event loop calls ready() on
+// every readiness event in events and resumes the task once it returns
+// true; until then the task stays parked and costs nothing.
+struct Waiter {
+    std::coroutine_handle<> coroutine;
+    uint32_t events = 0;
+    bool (*ready)(Waiter&) = nullptr;
+};
+
+#endif
@@ -0,0 +1,101 @@
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+
+#include "check.h"
+#include "server_process.h"
+#include "../frame.h"
+
+// A binary client against the real ./server, with a text client in the
+// same channel. Frames whose text has a line break (Nickname, Join, Chat
+// and Command, with LF and with CR) must be ignored, with a notice to
+// their sender: none of it may reach the text client as extra lines, or
+// the history a later joiner replays. The channel's ID is 10, an LF as a
+// varint, so a Chat frame's ID must not be taken for part of its text.
+
+static std::string frame(Opcode opcode, std::string_view body) {
+    return std::string(FrameHeader(opcode, body.size()).view()) + std::string(body);
+}
+
+static std::string chat(uint64_t channelId, std::string_view text) {
+    std::string body;
+    appendVarint(body, channelId);
+    return frame(Opcode::Chat, body + std::string(text));
+}
+
+// The ID the server gave channelName in a Channel frame, 0 if none came.
+static uint64_t channelId(const std::string& received, std::string_view channelName) {
+    FrameParser parser;
+    std::string_view data = received;
+    std::string_view next;
+    while (parser.next(data, next)) {
+        std::string_view body = next.substr(1);
+        uint64_t id;
+        if (static_cast<Opcode>(next[0]) == Opcode::Channel && decodeVarint(body, id) == VarintStatus::Complete &&
+            body == channelName) {
+            return id;
+        }
+    }
+    return 0;
+}
+
+static size_t count(const std::string& text, std::string_view what) {
+    size_t found = 0;
+    for (size_t at = text.find(what); at != std::string::npos; at = text.find(what, at + 1)) {
+        found++;
+    }
+    return found;
+}
+
+int main() {
+    signal(SIGPIPE, SIG_IGN);
+    char directory[] = "/tmp/binary_client_testXXXXXX";
+    if (mkdtemp(directory) == nullptr) {
+        std::cerr << "mkdtemp failed" << std::endl;
+        return 1;
+    }
+    int port = freePort();
+    pid_t server = launch({ "./server", "--port", std::to_string(port), "--io", "epoll", "--shards", "2", "--log-file", "/dev/null",
+                            "--history-dir", std::string(directory) + "/history" });
+
+    {
+        TestClient alice(port);
+        alice.send("/nickname alice\n");
+        for (int channel = 1; channel < 10; channel++) {
+            alice.send("/join filler" + std::to_string(channel) + "\n");
+        }
+        alice.send("/join room\n/connect\n");
+        CHECK(alice.waitFor("alice connected."));
+
+        TestClient mallory(port);
+        mallory.send("/binary\n" + frame(Opcode::Nickname, "mal\nPING 3") + frame(Opcode::Nickname, "mallory") +
+                     frame(Opcode::Join, "room\nPING 4") + frame(Opcode::Join, "room") + frame(Opcode::Connect, ""));
+        CHECK(alice.waitFor("mallory connected."));
+        CHECK(mallory.waitFor("mallory connected."));
+        uint64_t room = channelId(mallory.received(), "room");
+        CHECK_EQUAL(room, 10u);
+
+        mallory.send(chat(room, "hi\nUser alice has been kicked from #x\nPING 1") + chat(room, "hi\rPING 2") +
+                     frame(Opcode::Command, "/kick alice\nPING 5") + chat(room, "after") + frame(Opcode::Command, "/whois alice"));
+        CHECK(alice.waitFor("mallory: after\n"));
+        CHECK(mallory.waitFor("permission to use the /whois command"));
+        const std::string notice = "Your frame was ignored: its text contains a line break.";
+        CHECK_EQUAL(count(mallory.received(), notice), 5u);
+        CHECK_EQUAL(count(alice.received(), "PING"), 0u);
+        CHECK_EQUAL(count(alice.received(), "kicked"), 0u);
+        CHECK_EQUAL(count(alice.received(), "mallory: "), 1u);
+
+        // The history has the one line that went out, and nothing after it.
+        TestClient bob(port);
+        bob.send("/nickname bob\n/join room\n/connect\n");
+        CHECK(alice.waitFor("bob connected."));
+        CHECK(bob.waitFor("mallory: after\n"));
+        CHECK_EQUAL(count(bob.received(), "PING"), 0u);
+        CHECK_EQUAL(count(bob.received(), "mallory: "), 1u);
+    }
+
+    stop(server);
+    std::system((std::string("rm -rf ") + directory).c_str());
+    return testResult("binary_client_test");
+}
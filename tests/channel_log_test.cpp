@@ -0,0 +1,212 @@
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "../channel_log.h"
+
+// ChannelLog against the messages that went in: what tail() hands out,
+// read back from the ranges, both from the log that wrote them and from
+// one reopened on the same directory. An append cut short by the file
+// size limit must leave no trace, whether it needed an index entry or not.
+// A segment that cannot get its index file must not be left half made.
+// With a segment limit, the oldest segments go, on disk too, while ranges
+// handed out before stay readable.
+
+static std::string makeDirectory() {
+    char directory[] = "/tmp/channel_log_testXXXXXX";
+    if (mkdtemp(directory) == nullptr) {
+        std::cerr << "mkdtemp failed" << std::endl;
+        std::exit(1);
+    }
+    return std::string(directory) + "/log";
+}
+
+static void removeDirectory(const std::string& directory) {
+    std::string parent = directory.substr(0, directory.rfind('/'));
+    std::system(("rm -rf " + parent).c_str());
+}
+
+static std::string message(uint64_t sequence) {
+    return "user" + std::to_string(sequence % 7) + ": message " + std::to_string(sequence) + "\n";
+}
+
+static std::string expectedTail(uint64_t first, uint64_t end) {
+    std::string out;
+    for (uint64_t sequence = first; sequence < end; sequence++) {
+        out += message(sequence);
+    }
+    return out;
+}
+
+static std::string read(const std::vector<LogRange>& ranges) {
+    std::string out;
+    for (const LogRange& range : ranges) {
+        std::string chunk(range.length, '\0');
+        ssize_t got = pread(range.file->fd(), &chunk[0], range.length, range.offset);
+        CHECK_EQUAL(got, static_cast<ssize_t>(range.length));
+        out += chunk;
+    }
+    return out;
+}
+
+static uint64_t fileSize(const std::string& path) {
+    struct stat status{};
+    stat(path.c_str(), &status);
+    return static_cast<uint64_t>(status.st_size);
+}
+
+static size_t countFiles(const std::string& directory) {
+    size_t files = 0;
+    DIR* dir = opendir(directory.c_str());
+    while (dirent* entry = readdir(dir)) {
+        files += entry->d_name[0] != '.';
+    }
+    closedir(dir);
+    return files;
+}
+
+static void setFileSizeLimit(rlim_t limit) {
+    struct rlimit bounds{};
+    getrlimit(RLIMIT_FSIZE, &bounds);
+    bounds.rlim_cur = limit;
+    setrlimit(RLIMIT_FSIZE, &bounds);
+}
+
+// Fails one append partway through its message (cut) and checks that the
+// log, and the log reopened after it, carry on as if it never happened.
+static void testTornAppend(uint64_t before, uint64_t cut) {
+    std::string directory = makeDirectory();
+    {
+        ChannelLog log(directory);
+        CHECK(log.open());
+        for (uint64_t sequence = 0; sequence < before; sequence++) {
+            CHECK(log.append(message(sequence), 1));
+        }
+        uint64_t logSize = fileSize(directory + "/0.log");
+        uint64_t indexSize = fileSize(directory + "/0.idx");
+
+        setFileSizeLimit(logSize + cut);
+        CHECK(!log.append(message(before), 1));
+        setFileSizeLimit(RLIM_INFINITY);
+        CHECK_EQUAL(fileSize(directory + "/0.log"), logSize);
+        CHECK_EQUAL(fileSize(directory + "/0.idx"), indexSize);
+        CHECK_EQUAL(log.messageCount(), before);
+
+        for (uint64_t sequence = before; sequence < before + 40; sequence++) {
+            CHECK(log.append(message(sequence), 1));
+        }
+        CHECK(read(log.tail(1000, 0)) == expectedTail(0, before + 40));
+        CHECK(read(log.tail(3, 0)) == expectedTail(before + 37, before + 40));
+    }
+    {
+        ChannelLog log(directory);
+        CHECK(log.open());
+        CHECK_EQUAL(log.messageCount(), before + 40);
+        CHECK(read(log.tail(1000, 0)) == expectedTail(0, before + 40));
+        for (uint64_t first = 0; first < before + 40; first += 5) {
+            CHECK(read(log.tail(before + 40 - first, 0)) == expectedTail(first, before + 40));
+        }
+    }
+    removeDirectory(directory);
+}
+
+// The next segment's index path is taken by a directory, so starting the
+// segment fails after its log file was created.
+static void testFailedRotation() {
+    const uint64_t segmentBytes = 300;
+    std::string directory = makeDirectory();
+    {
+        ChannelLog log(directory, 0, segmentBytes);
+        CHECK(log.open());
+        uint64_t sequence = 0;
+        while (fileSize(directory + "/0.log") < segmentBytes) {
+            CHECK(log.append(message(sequence++), 1));
+        }
+        std::string base = directory + "/" + std::to_string(sequence);
+        CHECK_EQUAL(mkdir((base + ".idx").c_str(), 0755), 0);
+        CHECK(!log.append(message(sequence), 1));
+        CHECK_EQUAL(access((base + ".log").c_str(), F_OK), -1);
+        CHECK_EQUAL(log.segmentCount(), 1u);
+        CHECK_EQUAL(log.messageCount(), sequence);
+        rmdir((base + ".idx").c_str());
+        CHECK(log.append(message(sequence++), 1));
+        CHECK_EQUAL(log.segmentCount(), 2u);
+        CHECK(read(log.tail(sequence, 0)) == expectedTail(0, sequence));
+    }
+    removeDirectory(directory);
+}
+
+static void testRetention() {
+    const uint64_t segmentBytes = 300;
+    const uint64_t count = 500;
+    std::string directory = makeDirectory();
+    {
+        ChannelLog log(directory, 3, segmentBytes);
+        CHECK(log.open());
+        std::vector<LogRange> early;
+        std::string earlyText;
+        for (uint64_t sequence = 0; sequence < count; sequence++) {
+            CHECK(log.append(message(sequence), 1));
+            CHECK(log.segmentCount() <= 3);
+            if (sequence == 20) {
+                early = log.tail(5, 0);
+                earlyText = expectedTail(16, 21);
+            }
+        }
+        CHECK_EQUAL(log.segmentCount(), 3u);
+        CHECK_EQUAL(countFiles(directory), 6u);
+        CHECK(log.firstSequence() > 20);
+        CHECK(read(early) == earlyText);
+        CHECK(read(log.tail(count, 0)) == expectedTail(log.firstSequence(), count));
+        CHECK(read(log.tail(4, 0)) == expectedTail(count - 4, count));
+        uint64_t first = 0;
+        log.tail(4, 0, &first);
+        CHECK_EQUAL(first, count - 4);
+        log.tail(count, 0, &first);
+        CHECK_EQUAL(first, log.firstSequence());
+        log.tail(0, 0, &first);
+        CHECK_EQUAL(first, count);
+    }
+    {
+        ChannelLog log(directory, 3, segmentBytes);
+        CHECK(log.open());
+        CHECK_EQUAL(log.segmentCount(), 3u);
+        CHECK_EQUAL(log.messageCount(), count);
+        CHECK(read(log.tail(count, 0)) == expectedTail(log.firstSequence(), count));
+    }
+    {
+        // A lower limit applies as the log is opened.
+        ChannelLog log(directory, 1, segmentBytes);
+        CHECK(log.open());
+        CHECK_EQUAL(log.segmentCount(), 1u);
+        CHECK_EQUAL(countFiles(directory), 2u);
+        CHECK_EQUAL(log.messageCount(), count);
+        CHECK(read(log.tail(count, 0)) == expectedTail(log.firstSequence(), count));
+        CHECK(log.append(message(count), 1));
+        CHECK(read(log.tail(count + 1, 0)) == expectedTail(log.firstSequence(), count + 1));
+    }
+    removeDirectory(directory);
+}
+
+int main() {
+    // Past the limit writes fail with EFBIG instead of killing the process.
+    signal(SIGXFSZ, SIG_IGN);
+    // An append that starts an index entry (32), and ones that don't.
+    const uint64_t counts[] = { 32, 33, 47 };
+    for (uint64_t before : counts) {
+        for (uint64_t cut : { 0, 1, 5 }) {
+            testTornAppend(before, cut);
+        }
+    }
+    testFailedRotation();
+    testRetention();
+    return testResult("channel_log_test");
+}
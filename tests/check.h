@@ -0,0 +1,42 @@
+#ifndef TESTS_CHECK_H
+#define TESTS_CHECK_H
+
+#include <iostream>
+
+// The few assertions the tests under tests/ need. A failed CHECK prints
+// where it failed and the test carries on, so one run shows every failure;
+// testResult() turns them into the exit status make test looks at.
+inline int& testFailures() {
+    static int failures = 0;
+    return failures;
+}
+
+#define CHECK(condition)                                                                         \
+    do {                                                                                         \
+        if (!(condition)) {                                                                      \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #condition ") failed" << std::endl; \
+            testFailures()++;                                                                    \
+        }                                                                                        \
+    } while (0)
+
+#define CHECK_EQUAL(actual, expected)                                                            \
+    do {                                                                                         \
+        auto&& checkActual = (actual);                                                           \
+        auto&& checkExpected = (expected);                                                       \
+        if (!(checkActual == checkExpected)) {                                                   \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": " #actual " is " << checkActual        \
+                      << ", expected " << checkExpected << std::endl;                            \
+            testFailures()++;                                                                    \
+        }                                                                                        \
+    } while (0)
+
+inline int testResult(const char* name) {
+    if (testFailures() == 0) {
+        std::cout << name << ": OK" << std::endl;
+        return 0;
+    }
+    std::cout << name << ": " << testFailures() << " failed" << std::endl;
+    return 1;
+}
+
+#endif
@@ -0,0 +1,205 @@
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "check.h"
+#include "../frame.h"
+
+// Varints at every length and cut short at every byte, and FrameParser on
+// a stream of frames cut into reads at every byte, a byte at a time and
+// handed from one parser to another with restore(), against the frames
+// that went in. Oversized frames must be skipped whole, and a length
+// prefix longer than any 64-bit value must stop the parser.
+
+constexpr size_t MAX_FRAME = 256;
+
+static std::string varint(uint64_t value) {
+    std::string out;
+    appendVarint(out, value);
+    return out;
+}
+
+static std::string frame(std::string_view content) {
+    return varint(content.size()) + std::string(content);
+}
+
+static void testVarints() {
+    const uint64_t values[] = { 0, 1, 127, 128, 16383, 16384, (1ull << 35) - 1, 1ull << 35, (1ull << 63) - 1, 1ull << 63, ~0ull };
+    for (uint64_t value : values) {
+        std::string bytes = varint(value);
+        std::string_view data = bytes;
+        uint64_t decoded = 0;
+        CHECK(decodeVarint(data, decoded) == VarintStatus::Complete);
+        CHECK_EQUAL(decoded, value);
+        CHECK(data.empty());
+        for (size_t cut = 0; cut < bytes.size(); cut++) {
+            std::string_view prefix(bytes.data(), cut);
+            CHECK(decodeVarint(prefix, decoded) == VarintStatus::Incomplete);
+            CHECK_EQUAL(prefix.size(), cut);
+        }
+    }
+    CHECK_EQUAL(varint(~0ull).size(), MAX_VARINT_LENGTH);
+
+    // Ten bytes: the last may only carry bit 63.
+    std::string tenBytes(9, '\x80');
+    std::string_view data;
+    uint64_t decoded;
+    data = tenBytes + '\x01';
+    CHECK(decodeVarint(data, decoded) == VarintStatus::Complete);
+    CHECK_EQUAL(decoded, 1ull << 63);
+    data = tenBytes + '\x02';
+    CHECK(decodeVarint(data, decoded) == VarintStatus::Malformed);
+    data = tenBytes + '\x7F';
+    CHECK(decodeVarint(data, decoded) == VarintStatus::Malformed);
+    // Eleven bytes, or ten that still ask for more.
+    std::string eleven = tenBytes + '\x80' + '\x00';
+    data = eleven;
+    CHECK(decodeVarint(data, decoded) == VarintStatus::Malformed);
+    data = std::string_view(eleven).substr(0, MAX_VARINT_LENGTH);
+    CHECK(decodeVarint(data, decoded) == VarintStatus::Malformed);
+    // Longer than needed but within ten bytes is still the same value.
+    data = std::string_view("\x81\x80\x00", 3);
+    CHECK(decodeVarint(data, decoded) == VarintStatus::Complete);
+    CHECK_EQUAL(decoded, 1u);
+}
+
+struct Parsed {
+    std::vector<std::string> frames;
+    size_t dropped = 0;
+    bool malformed = false;
+
+    bool operator==(const Parsed& other) const {
+        return frames == other.frames && dropped == other.dropped && malformed == other.malformed;
+    }
+};
+
+static void feed(FrameParser& parser, std::string_view data, Parsed& result) {
+    std::string_view frame;
+    while (parser.next(data, frame)) {
+        result.frames.emplace_back(frame);
+    }
+}
+
+static void finish(const FrameParser& parser, Parsed& result) {
+    result.dropped += parser.droppedFrames();
+    result.malformed = parser.malformed();
+}
+
+// Runs the stream through a parser whole, cut at every byte, byte by byte,
+// and restored into a second parser at every byte.
+static void checkEveryCut(const std::string& stream, const Parsed& reference) {
+    {
+        FrameParser parser(MAX_FRAME);
+        Parsed result;
+        feed(parser, stream, result);
+        finish(parser, result);
+        CHECK(result == reference);
+    }
+    {
+        FrameParser parser(MAX_FRAME);
+        Parsed result;
+        for (char c : stream) {
+            feed(parser, std::string_view(&c, 1), result);
+        }
+        finish(parser, result);
+        CHECK(result == reference);
+    }
+    int splitFailures = 0;
+    int restoreFailures = 0;
+    for (size_t cut = 0; cut <= stream.size(); cut++) {
+        FrameParser parser(MAX_FRAME);
+        Parsed result;
+        feed(parser, std::string_view(stream).substr(0, cut), result);
+        feed(parser, std::string_view(stream).substr(cut), result);
+        finish(parser, result);
+        splitFailures += !(result == reference);
+
+        // A malformed stream is not handed over; the connection is closed.
+        FrameParser before(MAX_FRAME);
+        Parsed restored;
+        feed(before, std::string_view(stream).substr(0, cut), restored);
+        if (before.malformed()) {
+            continue;
+        }
+        FrameParser after(MAX_FRAME);
+        after.restore(std::string(before.carried()), before.skipping());
+        feed(after, std::string_view(stream).substr(cut), restored);
+        restored.dropped = before.droppedFrames();
+        finish(after, restored);
+        restoreFailures += !(restored == reference);
+    }
+    CHECK_EQUAL(splitFailures, 0);
+    CHECK_EQUAL(restoreFailures, 0);
+}
+
+static void testFrames() {
+    std::string stream;
+    Parsed reference;
+    auto add = [&](const std::string& content) {
+        stream += frame(content);
+        if (content.size() > MAX_FRAME) {
+            reference.dropped++;
+        } else if (!content.empty()) {
+            reference.frames.push_back(content);
+        }
+    };
+    add("\x01" "alice");
+    add("");                              // empty: skipped
+    add("\x02" "#room");
+    add(std::string(MAX_FRAME, 'a'));     // exactly the limit; two byte length
+    add(std::string(MAX_FRAME + 1, 'b')); // one over: skipped whole
+    add("\x03");
+    add(std::string(MAX_FRAME * 20, 'c')); // far over
+    add(std::string(127, 'd'));            // the longest one byte length
+    add(std::string(128, 'e'));            // the shortest two byte one
+    add("\x04" "\x00" "last");
+    checkEveryCut(stream, reference);
+}
+
+static void testMalformedLength() {
+    std::string stream = frame("\x01" "first") + std::string(MAX_VARINT_LENGTH, '\xFF') + '\x01' + frame("\x01" "never");
+    Parsed reference;
+    reference.frames.push_back("\x01" "first");
+    reference.malformed = true;
+    checkEveryCut(stream, reference);
+}
+
+// A huge declared length is skipped as the bytes arrive, without being
+// buffered, and the stream carries on after it.
+static void testHugeFrame() {
+    const uint64_t huge = 1ull << 40;
+    FrameParser parser(MAX_FRAME);
+    Parsed result;
+    feed(parser, varint(huge) + std::string(1000, 'x'), result);
+    CHECK_EQUAL(parser.droppedFrames(), 1u);
+    CHECK_EQUAL(parser.skipping(), huge - 1000);
+    CHECK(parser.carried().empty());
+    CHECK(result.frames.empty());
+
+    FrameParser shortOne(MAX_FRAME);
+    std::string stream = varint(3000) + std::string(3000, 'x') + frame("\x01" "ok");
+    feed(shortOne, stream, result);
+    CHECK_EQUAL(shortOne.droppedFrames(), 1u);
+    CHECK(result.frames == std::vector<std::string>({ "\x01" "ok" }));
+}
+
+static void testHeader() {
+    FrameHeader header(Opcode::Chat, 200);
+    std::string stream = std::string(header.view()) + std::string(200, 'z');
+    FrameParser parser(MAX_FRAME);
+    Parsed result;
+    feed(parser, stream, result);
+    CHECK_EQUAL(result.frames.size(), 1u);
+    CHECK_EQUAL(result.frames.empty() ? 0 : result.frames[0].size(), 201u);
+    CHECK(!result.frames.empty() && static_cast<Opcode>(result.frames[0][0]) == Opcode::Chat);
+}
+
+int main() {
+    testVarints();
+    testFrames();
+    testMalformedLength();
+    testHugeFrame();
+    testHeader();
+    return testResult("frame_test");
+}
@@ -0,0 +1,339 @@
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "check.h"
+#include "server_process.h"
+#include "../handover.h"
+
+// Hot upgrade against the real ./server. The test sets up channels with an
+// admin, a muted and a kicked member, then plays the new process: it takes
+// the snapshot and hangs up before READY, so the old process must carry on
+// serving. The same happens after hanging up halfway through the snapshot.
+// A second server then really takes over, and its own snapshot must decode
+// to the same channels, members, mutes and kicks as the first. Finally the
+// test plays the old process and hands a new one the first snapshot cut at
+// every byte: it must refuse each one, exit with an error and never send
+// READY.
+
+static int connectUnix(const std::string& path) {
+    sockaddr_un address;
+    makeUnixAddress(path, address);
+    auto deadline = Clock::now() + std::chrono::milliseconds(WAIT_MILLIS);
+    do {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0) {
+            return fd;
+        }
+        close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    } while (Clock::now() < deadline);
+    return -1;
+}
+
+struct ClientState {
+    uint64_t flags = 0;
+    uint64_t failedAttempts = 0;
+    std::string channel;
+
+    bool operator==(const ClientState& other) const {
+        return flags == other.flags && failedAttempts == other.failedAttempts && channel == other.channel;
+    }
+};
+
+struct ChannelState {
+    std::string admin;
+    std::map<std::string, uint64_t> members; // nickname -> flags
+    std::set<std::string> muted;
+    std::set<std::string> kicked;
+
+    bool operator==(const ChannelState& other) const {
+        return admin == other.admin && members == other.members && muted == other.muted && kicked == other.kicked;
+    }
+};
+
+// A snapshot with the old process's client numbers replaced by nicknames,
+// so two processes' snapshots of the same state compare equal.
+struct Snapshot {
+    uint64_t port = 0;
+    uint64_t shardCount = 0;
+    uint64_t fdCount = 0;
+    std::vector<std::string> channelNames; // by ID
+    std::map<std::string, ClientState> clients;
+    std::map<std::string, ChannelState> channels;
+    std::map<std::string, std::string> admins; // channel -> the nickname it was first granted to
+};
+
+static std::set<std::string> readNames(SnapshotReader& in) {
+    std::set<std::string> names;
+    uint64_t count = in.number();
+    for (uint64_t i = 0; i < count && !in.failed(); i++) {
+        names.emplace(in.bytes());
+    }
+    return names;
+}
+
+// Decodes a snapshot the way Server::takeOver reads it.
+static bool decode(std::string_view data, Snapshot& snapshot) {
+    SnapshotReader in(data);
+    if (in.bytes() != HANDOVER_MAGIC || in.number() != HANDOVER_VERSION) {
+        return false;
+    }
+    snapshot.port = in.number();
+    snapshot.shardCount = in.number();
+    in.number(); // admin port
+    snapshot.fdCount = in.number();
+    uint64_t channelCount = in.number();
+    for (uint64_t i = 0; i < channelCount && !in.failed(); i++) {
+        snapshot.channelNames.emplace_back(in.bytes());
+    }
+
+    std::vector<std::string> nicknames; // by client number - 1
+    for (uint64_t shard = 0; shard < snapshot.shardCount && !in.failed(); shard++) {
+        uint64_t count = in.number();
+        for (uint64_t i = 0; i < count && !in.failed(); i++) {
+            ClientState client;
+            client.flags = in.number();
+            client.failedAttempts = in.number();
+            std::string nickname(in.bytes());
+            client.channel = in.bytes();
+            in.bytes(); // address
+            in.bytes(); // carried input
+            in.number();
+            uint64_t chunks = in.number();
+            for (uint64_t chunk = 0; chunk < chunks && !in.failed(); chunk++) {
+                in.bytes();
+            }
+            nicknames.push_back(nickname);
+            snapshot.clients[nickname] = client;
+        }
+    }
+    auto nicknameOf = [&](uint64_t ref) { return ref != 0 && ref <= nicknames.size() ? nicknames[ref - 1] : std::string("?"); };
+    for (uint64_t shard = 0; shard < snapshot.shardCount && !in.failed(); shard++) {
+        uint64_t channels = in.number();
+        for (uint64_t i = 0; i < channels && !in.failed(); i++) {
+            ChannelState& channel = snapshot.channels[std::string(in.bytes())];
+            channel.admin = in.bytes();
+            uint64_t members = in.number();
+            for (uint64_t member = 0; member < members && !in.failed(); member++) {
+                std::string nickname = nicknameOf(in.number());
+                CHECK(in.bytes() == nickname);
+                channel.members[nickname] = in.number();
+            }
+            channel.muted = readNames(in);
+            channel.kicked = readNames(in);
+        }
+        uint64_t admins = in.number();
+        for (uint64_t i = 0; i < admins && !in.failed(); i++) {
+            std::string name(in.bytes());
+            snapshot.admins[name] = nicknameOf(in.number());
+        }
+    }
+    return !in.failed() && in.done();
+}
+
+// Plays the new process up to READY and hangs up instead, or hangs up
+// halfway through the snapshot when half is set.
+static bool fetchSnapshot(const std::string& path, std::string& snapshot, bool half = false) {
+    int connection = connectUnix(path);
+    if (connection == -1) {
+        return false;
+    }
+    bool received;
+    if (half) {
+        uint64_t length = 0;
+        received = readFully(connection, reinterpret_cast<char*>(&length), sizeof(length));
+        snapshot.resize(length / 2);
+        received = received && readFully(connection, snapshot.data(), snapshot.size());
+    } else {
+        received = receiveSnapshot(connection, snapshot);
+        Snapshot header;
+        decode(snapshot, header);
+        std::vector<int> fds;
+        received = received && receiveDescriptors(connection, header.fdCount, fds);
+        for (int fd : fds) {
+            close(fd);
+        }
+    }
+    close(connection);
+    return received;
+}
+
+// Alice says something in the room; bob, muted but still a recipient,
+// must get it from whichever process is serving.
+static bool chatWorks(TestClient& alice, TestClient& bob, int round) {
+    std::string line = "still here " + std::to_string(round);
+    alice.send(line + "\n");
+    return bob.waitFor("alice: " + line);
+}
+
+static void checkExpectedState(const Snapshot& snapshot) {
+    CHECK_EQUAL(snapshot.clients.size(), 5u);
+    CHECK_EQUAL(snapshot.clients.count("alice") ? snapshot.clients.at("alice").flags : 0, HANDOVER_CONNECTED | HANDOVER_ADMIN);
+    CHECK_EQUAL(snapshot.clients.count("erin") ? snapshot.clients.at("erin").flags : 1, 0u);
+    CHECK_EQUAL(snapshot.fdCount, snapshot.shardCount + snapshot.clients.size());
+    CHECK_EQUAL(snapshot.channels.size(), 2u);
+    if (snapshot.channels.count("room") != 0) {
+        const ChannelState& room = snapshot.channels.at("room");
+        CHECK_EQUAL(room.admin, "alice");
+        CHECK_EQUAL(room.members.size(), 4u);
+        CHECK_EQUAL(room.members.count("bob") ? room.members.at("bob") : 0, HANDOVER_CONNECTED | HANDOVER_MUTED);
+        CHECK_EQUAL(room.members.count("carol") ? room.members.at("carol") : 0, HANDOVER_CONNECTED | HANDOVER_KICKED);
+        CHECK_EQUAL(room.members.count("erin") ? room.members.at("erin") : 1, 0u);
+        CHECK(room.muted == std::set<std::string>({ "bob" }));
+        CHECK(room.kicked == std::set<std::string>({ "carol" }));
+    } else {
+        CHECK(!"no room in the snapshot");
+    }
+    CHECK(snapshot.admins == (std::map<std::string, std::string>{ { "room", "alice" }, { "lobby", "dave" } }));
+}
+
+// Plays the old process for a new one taking over from path, handing it
+// the snapshot cut to length bytes, and listener and client sockets as
+// the header asks. The new process must exit with an error before READY.
+static bool refusesTruncated(const std::string& path, const std::string& snapshot, size_t length, int& failures) {
+    unlink(path.c_str());
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address;
+    makeUnixAddress(path, address);
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1 || listen(listener, 1) == -1) {
+        close(listener);
+        return false;
+    }
+    pid_t pid = launch({ "./server", "--take-over", path, "--log-file", "/dev/null" });
+    int connection = -1;
+    if (waitReadable(listener)) {
+        connection = accept(listener, nullptr, nullptr);
+    }
+    close(listener);
+    if (connection == -1) {
+        stop(pid);
+        return false;
+    }
+
+    std::string cut = snapshot.substr(0, length);
+    sendSnapshot(connection, cut);
+    Snapshot header;
+    decode(snapshot, header);
+    std::vector<int> fds;
+    for (uint64_t i = 0; i < header.fdCount; i++) {
+        if (i < header.shardCount) {
+            int tcp = socket(AF_INET, SOCK_STREAM, 0);
+            sockaddr_in any{};
+            any.sin_family = AF_INET;
+            any.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            bind(tcp, reinterpret_cast<sockaddr*>(&any), sizeof(any));
+            listen(tcp, 1);
+            fds.push_back(tcp);
+        } else {
+            int pair[2];
+            socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+            fds.push_back(pair[0]);
+            fds.push_back(pair[1]); // kept here, closed below
+        }
+    }
+    std::vector<int> sent;
+    for (uint64_t i = 0; i < header.fdCount; i++) {
+        sent.push_back(fds[i < header.shardCount ? i : header.shardCount + (i - header.shardCount) * 2]);
+    }
+    sendDescriptors(connection, sent); // fails if the new process already gave up
+
+    char byte = 0;
+    bool sawReady = readFully(connection, &byte, 1) && byte == HANDOVER_READY;
+    close(connection); // no GO, should it have sent READY
+    int status = waitExit(pid, WAIT_MILLIS);
+    if (status == -1) {
+        stop(pid);
+    }
+    for (int fd : fds) {
+        close(fd);
+    }
+    bool refused = !sawReady && status != 0 && status != -1;
+    if (!refused && failures++ < 5) {
+        std::cerr << "snapshot cut to " << length << " of " << snapshot.size() << " bytes: "
+                  << (sawReady ? "READY sent" : "no READY") << ", exit status " << status << std::endl;
+    }
+    return true;
+}
+
+int main() {
+    signal(SIGPIPE, SIG_IGN);
+    char directory[] = "/tmp/handover_testXXXXXX";
+    if (mkdtemp(directory) == nullptr) {
+        std::cerr << "mkdtemp failed" << std::endl;
+        return 1;
+    }
+    std::string oldSocket = std::string(directory) + "/old.sock";
+    std::string newSocket = std::string(directory) + "/new.sock";
+    int port = freePort();
+    pid_t old = launch({ "./server", "--port", std::to_string(port), "--io", "epoll", "--shards", "2", "--log-file", "/dev/null",
+                         "--upgrade-socket", oldSocket });
+
+    {
+        TestClient alice(port);
+        TestClient bob(port);
+        TestClient carol(port);
+        TestClient dave(port);
+        TestClient erin(port);
+        alice.send("/nickname alice\n/join room\n/connect\n");
+        CHECK(alice.waitFor("alice connected."));
+        bob.send("/nickname bob\n/join room\n/connect\n");
+        CHECK(alice.waitFor("bob connected."));
+        carol.send("/nickname carol\n/join room\n/connect\n");
+        CHECK(alice.waitFor("carol connected."));
+        dave.send("/nickname dave\n/join lobby\n/connect\n");
+        CHECK(dave.waitFor("dave connected."));
+        erin.send("/nickname erin\n/join room\n");
+        alice.send("/mute bob\n/kick carol\n");
+        CHECK(alice.waitFor("User carol has been kicked"));
+        std::this_thread::sleep_for(std::chrono::milliseconds(100)); // for erin's /join
+        CHECK(chatWorks(alice, bob, 1));
+
+        // Hanging up halfway through the snapshot, or before READY, leaves
+        // the old process serving.
+        std::string partial;
+        CHECK(fetchSnapshot(oldSocket, partial, true));
+        CHECK(chatWorks(alice, bob, 2));
+        std::string first;
+        CHECK(fetchSnapshot(oldSocket, first));
+        CHECK(chatWorks(alice, bob, 3));
+        CHECK_EQUAL(waitExit(old, 0), -1);
+
+        Snapshot before;
+        CHECK(decode(first, before));
+        checkExpectedState(before);
+
+        // A real take over: the old process exits once it has let go.
+        pid_t next = launch({ "./server", "--take-over", oldSocket, "--log-file", "/dev/null", "--upgrade-socket", newSocket });
+        CHECK_EQUAL(waitExit(old, WAIT_MILLIS), 0);
+        CHECK(chatWorks(alice, bob, 4));
+        std::string second;
+        CHECK(fetchSnapshot(newSocket, second));
+        CHECK(chatWorks(alice, bob, 5));
+
+        Snapshot after;
+        CHECK(decode(second, after));
+        CHECK(after.channelNames == before.channelNames);
+        CHECK(after.clients == before.clients);
+        CHECK(after.channels == before.channels);
+        CHECK(after.admins == before.admins);
+        CHECK_EQUAL(after.port, before.port);
+        CHECK_EQUAL(after.shardCount, before.shardCount);
+        stop(next);
+
+        int failures = 0;
+        int attempts = 0;
+        for (size_t length = 0; length < first.size(); length++) {
+            attempts += refusesTruncated(std::string(directory) + "/fake.sock", first, length, failures);
+        }
+        CHECK_EQUAL(failures, 0);
+        CHECK_EQUAL(attempts, static_cast<int>(first.size()));
+    }
+
+    std::system((std::string("rm -rf ") + directory).c_str());
+    return testResult("handover_test");
+}
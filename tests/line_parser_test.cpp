@@ -0,0 +1,216 @@
+#include <string>
+#include <string_view>
+#include <vector>
+#include <random>
+
+#include "check.h"
+#include "../line_parser.h"
+#include "../protocol.h"
+
+// LineParser against a reference model (split on LF, drop one CR before
+// it, drop lines over the limit), with the same stream cut into reads in
+// every way that matters: whole, at every byte, one byte at a time, in
+// random pieces, and handed from one parser to another with restore().
+// Also parseCommand on every command word.
+
+struct Parsed {
+    std::vector<std::string> lines;
+    size_t dropped = 0;
+};
+
+static Parsed expected(std::string_view stream) {
+    Parsed result;
+    size_t newline;
+    while ((newline = stream.find('\n')) != std::string_view::npos) {
+        std::string_view line = stream.substr(0, newline);
+        if (!line.empty() && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+        if (line.size() <= static_cast<size_t>(MAX_MESSAGE_LENGTH)) {
+            result.lines.emplace_back(line);
+        } else {
+            result.dropped++;
+        }
+        stream.remove_prefix(newline + 1);
+    }
+    return result;
+}
+
+static void feed(LineParser& parser, std::string_view data, Parsed& result) {
+    parser.feed(data.data(), data.size(), [&](std::string_view line) {
+        result.lines.emplace_back(line);
+        return true;
+    });
+}
+
+static bool same(const Parsed& a, const Parsed& b) {
+    return a.lines == b.lines && a.dropped == b.dropped;
+}
+
+// Chat lines, commands, empty lines, LF and CRLF, a CR inside a line, and
+// lines right at the limit, one byte over it with either terminator, and
+// far over it.
+static std::string makeStream() {
+    const std::string limit(MAX_MESSAGE_LENGTH, 'a');
+    std::string stream;
+    stream += "/nickname alice\n/join #room\r\n/connect\n";
+    stream += "\n\r\nhello\rworld\r\n";
+    stream += limit + "\n";
+    stream += limit + "\r\n";
+    stream += limit + "b\n";
+    stream += limit + "b\r\n";
+    stream += "after the long ones\n";
+    stream += std::string(MAX_MESSAGE_LENGTH * 3, 'c') + "\r\n";
+    stream += limit + "\r\r\n";
+    stream += "last\n";
+    stream += "unfinished";
+    return stream;
+}
+
+static void testWhole(const std::string& stream, const Parsed& reference) {
+    LineParser parser(MAX_MESSAGE_LENGTH);
+    Parsed result;
+    feed(parser, stream, result);
+    result.dropped = parser.droppedLines();
+    CHECK(same(result, reference));
+    CHECK_EQUAL(parser.pending(), std::string_view("unfinished").size());
+    CHECK(parser.carried() == "unfinished");
+}
+
+// Two reads, cut at every byte of the stream.
+static void testEverySplit(const std::string& stream, const Parsed& reference) {
+    int failures = 0;
+    for (size_t cut = 0; cut <= stream.size(); cut++) {
+        LineParser parser(MAX_MESSAGE_LENGTH);
+        Parsed result;
+        feed(parser, std::string_view(stream).substr(0, cut), result);
+        feed(parser, std::string_view(stream).substr(cut), result);
+        result.dropped = parser.droppedLines();
+        if (!same(result, reference) && failures++ == 0) {
+            std::cerr << "split at " << cut << " differs" << std::endl;
+        }
+    }
+    CHECK_EQUAL(failures, 0);
+}
+
+static void testByteAtATime(const std::string& stream, const Parsed& reference) {
+    LineParser parser(MAX_MESSAGE_LENGTH);
+    Parsed result;
+    for (char c : stream) {
+        feed(parser, std::string_view(&c, 1), result);
+    }
+    result.dropped = parser.droppedLines();
+    CHECK(same(result, reference));
+}
+
+static void testRandomReads(const std::string& stream, const Parsed& reference) {
+    std::mt19937 random(7);
+    for (int round = 0; round < 200; round++) {
+        LineParser parser(MAX_MESSAGE_LENGTH);
+        Parsed result;
+        for (size_t offset = 0; offset < stream.size();) {
+            size_t length = std::min<size_t>(stream.size() - offset, 1 + random() % (2 * MAX_MESSAGE_LENGTH));
+            feed(parser, std::string_view(stream).substr(offset, length), result);
+            offset += length;
+        }
+        result.dropped = parser.droppedLines();
+        CHECK(same(result, reference));
+    }
+}
+
+// A hot upgrade hands the unfinished line to a parser in another process:
+// cut at every byte, the second parser must go on as the first would have.
+static void testRestoreAtEverySplit(const std::string& stream, const Parsed& reference) {
+    int failures = 0;
+    for (size_t cut = 0; cut <= stream.size(); cut++) {
+        LineParser before(MAX_MESSAGE_LENGTH);
+        Parsed result;
+        feed(before, std::string_view(stream).substr(0, cut), result);
+        LineParser after(MAX_MESSAGE_LENGTH);
+        after.restore(std::string(before.carried()), before.discarding());
+        feed(after, std::string_view(stream).substr(cut), result);
+        result.dropped = before.droppedLines() + after.droppedLines();
+        if (!same(result, reference) && failures++ == 0) {
+            std::cerr << "restore at " << cut << " differs" << std::endl;
+        }
+    }
+    CHECK_EQUAL(failures, 0);
+}
+
+// A parser that stops midway leaves the rest of the read alone, and reset()
+// forgets a partial line.
+static void testStopAndReset() {
+    LineParser parser(MAX_MESSAGE_LENGTH);
+    std::string data = "one\ntwo\nthree\npart";
+    std::vector<std::string> lines;
+    bool finished = parser.feed(data.data(), data.size(), [&](std::string_view line) {
+        lines.emplace_back(line);
+        return lines.size() < 2;
+    });
+    CHECK(!finished);
+    CHECK(lines == std::vector<std::string>({ "one", "two" }));
+
+    parser.reset();
+    data = "tial\nnext\n";
+    lines.clear();
+    parser.feed(data.data(), data.size(), [&](std::string_view line) {
+        lines.emplace_back(line);
+        return true;
+    });
+    CHECK(lines == std::vector<std::string>({ "tial", "next" }));
+    CHECK_EQUAL(parser.pending(), 0u);
+}
+
+static void testParseCommand() {
+    struct Case {
+        std::string_view line;
+        Command command;
+        std::string_view argument;
+    };
+    const Case cases[] = {
+        { "", Command::None, "" },
+        { "hello there", Command::Chat, "" },
+        { " /join x", Command::Chat, "" },
+        { "/nickname alice", Command::Nickname, "alice" },
+        { "/connect", Command::Connect, "" },
+        { "/join #room", Command::Join, "#room" },
+        { "/ping", Command::Ping, "" },
+        { "/pong 42", Command::Pong, "42" },
+        { "/kick bob", Command::Kick, "bob" },
+        { "/mute bob", Command::Mute, "bob" },
+        { "/unmute bob", Command::Unmute, "bob" },
+        { "/whois bob", Command::Whois, "bob" },
+        { "/binary", Command::Binary, "" },
+        { "/join", Command::Join, "" },
+        { "/join ", Command::Join, "" },
+        { "/nickname two words", Command::Nickname, "two words" },
+        { "/JOIN x", Command::Unknown, "x" },
+        { "/joins x", Command::Unknown, "x" },
+        { "/", Command::Unknown, "" },
+        { "/quit", Command::Unknown, "" },
+    };
+    for (const Case& test : cases) {
+        std::string_view argument = "stale";
+        Command command = parseCommand(test.line, argument);
+        if (command != test.command || argument != test.argument) {
+            std::cerr << "parseCommand(\"" << test.line << "\") gave " << static_cast<int>(command) << " \"" << argument
+                      << "\"" << std::endl;
+            testFailures()++;
+        }
+    }
+}
+
+int main() {
+    const std::string stream = makeStream();
+    const Parsed reference = expected(stream);
+    CHECK_EQUAL(reference.dropped, 4u);
+
+    testWhole(stream, reference);
+    testEverySplit(stream, reference);
+    testByteAtATime(stream, reference);
+    testRandomReads(stream, reference);
+    testRestoreAtEverySplit(stream, reference);
+    testStopAndReset();
+    testParseCommand();
+    return testResult("line_parser_test");
+}
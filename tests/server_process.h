@@ -0,0 +1,144 @@
+#ifndef TESTS_SERVER_PROCESS_H
+#define TESTS_SERVER_PROCESS_H
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// For the tests that run the real ./server: starting and stopping it, and
+// talking to it as a client.
+
+using Clock = std::chrono::steady_clock;
+
+constexpr int WAIT_MILLIS = 5000;
+
+// Runs args[0] with stdin, stdout and stderr on /dev/null.
+inline pid_t launch(const std::vector<std::string>& args) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int devNull = open("/dev/null", O_RDWR);
+        dup2(devNull, 0);
+        dup2(devNull, 1);
+        dup2(devNull, 2);
+        std::vector<char*> argv;
+        for (const std::string& arg : args) {
+            argv.push_back(const_cast<char*>(arg.c_str()));
+        }
+        argv.push_back(nullptr);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+    return pid;
+}
+
+// The process's exit status, or -1 if it is still running after timeoutMillis.
+inline int waitExit(pid_t pid, int timeoutMillis) {
+    auto deadline = Clock::now() + std::chrono::milliseconds(timeoutMillis);
+    do {
+        int status;
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    } while (Clock::now() < deadline);
+    return -1;
+}
+
+inline void stop(pid_t pid) {
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+}
+
+inline int freePort() {
+    int probe = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(probe, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+    socklen_t length = sizeof(address);
+    getsockname(probe, reinterpret_cast<sockaddr*>(&address), &length);
+    close(probe);
+    return ntohs(address.sin_port);
+}
+
+// Connects, retrying while the server is still starting.
+inline int connectTcp(int port) {
+    auto deadline = Clock::now() + std::chrono::milliseconds(WAIT_MILLIS);
+    do {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(static_cast<uint16_t>(port));
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0) {
+            return fd;
+        }
+        close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    } while (Clock::now() < deadline);
+    return -1;
+}
+
+// A chat client over TCP. It sends raw bytes, lines or frames, and keeps
+// everything the server sent in received().
+class TestClient {
+public:
+    explicit TestClient(int port) : fd_(connectTcp(port)) {}
+
+    ~TestClient() {
+        close(fd_);
+    }
+
+    void send(std::string_view data) {
+        while (!data.empty()) {
+            ssize_t sent = ::send(fd_, data.data(), data.size(), MSG_NOSIGNAL);
+            if (sent <= 0) {
+                return;
+            }
+            data.remove_prefix(static_cast<size_t>(sent));
+        }
+    }
+
+    // Waits until text has come in, anywhere in what the client received.
+    bool waitFor(std::string_view text) {
+        auto deadline = Clock::now() + std::chrono::milliseconds(WAIT_MILLIS);
+        while (received_.find(text) == std::string::npos) {
+            int left = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count());
+            pollfd readable = { fd_, POLLIN, 0 };
+            if (left <= 0 || poll(&readable, 1, left) != 1) {
+                std::cerr << "timed out waiting for \"" << text << "\"" << std::endl;
+                return false;
+            }
+            char buffer[4096];
+            ssize_t got = recv(fd_, buffer, sizeof(buffer), 0);
+            if (got <= 0) {
+                std::cerr << "connection closed waiting for \"" << text << "\"" << std::endl;
+                return false;
+            }
+            received_.append(buffer, static_cast<size_t>(got));
+        }
+        return true;
+    }
+
+    const std::string& received() const {
+        return received_;
+    }
+
+private:
+    int fd_;
+    std::string received_;
+};
+
+#endif
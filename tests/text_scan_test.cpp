@@ -0,0 +1,340 @@
+#include <cstdint>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "check.h"
+#include "../message_filter.h"
+#include "../text_scan.h"
+
+// The vector UTF-8 and control character kernels against their scalar
+// versions (and the scalar UTF-8 check against the expected answer), with
+// every kind of invalid sequence placed at every offset around the 16 and
+// 32 byte blocks and valid sequences cut off at every block boundary. Then
+// the blocklist automaton on overlapping, nested and suffix patterns and
+// mixed case, against a naive search, and the filter's order of checks.
+
+struct Kernel {
+    const char* name;
+    bool (*validUtf8)(const char*, size_t);
+    size_t (*findControl)(const char*, size_t);
+};
+
+static std::vector<Kernel> kernels() {
+    std::vector<Kernel> result = { { "scalar", validUtf8Scalar, findControlScalar } };
+#if TEXT_SCAN_X86
+    if (__builtin_cpu_supports("ssse3")) {
+        result.push_back({ "sse", validUtf8Sse, findControlSse2 });
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        result.push_back({ "avx2", validUtf8Avx2, findControlAvx2 });
+    }
+#endif
+    return result;
+}
+
+static int utf8Failures = 0;
+
+// Every kernel, and the dispatching validUtf8(), must give the expected
+// answer.
+static void checkUtf8(const std::string& text, bool expected, const std::vector<Kernel>& all) {
+    for (const Kernel& kernel : all) {
+        if (kernel.validUtf8(text.data(), text.size()) != expected) {
+            if (utf8Failures++ < 10) {
+                std::cerr << kernel.name << " says " << !expected << " for";
+                for (unsigned char c : text) {
+                    std::cerr << ' ' << std::hex << static_cast<int>(c) << std::dec;
+                }
+                std::cerr << std::endl;
+            }
+        }
+    }
+    if (validUtf8(text) != expected) {
+        utf8Failures++;
+    }
+}
+
+struct Sequence {
+    std::string bytes;
+    bool valid;
+};
+
+static const std::vector<Sequence>& sequences() {
+    static const std::vector<Sequence> all = {
+        // Valid, at the edges of each length.
+        { "\x7F", true },
+        { "\xC2\x80", true },
+        { "\xDF\xBF", true },
+        { "\xE0\xA0\x80", true },
+        { "\xED\x9F\xBF", true },          // just below the surrogates
+        { "\xEE\x80\x80", true },          // just above them
+        { "\xEF\xBF\xBF", true },
+        { "\xF0\x90\x80\x80", true },
+        { "\xF4\x8F\xBF\xBF", true },      // U+10FFFF
+        // Overlong.
+        { "\xC0\x80", false },
+        { "\xC0\xAF", false },
+        { "\xC1\xBF", false },
+        { "\xE0\x80\x80", false },
+        { "\xE0\x9F\xBF", false },
+        { "\xF0\x80\x80\x80", false },
+        { "\xF0\x8F\xBF\xBF", false },
+        // Surrogates.
+        { "\xED\xA0\x80", false },
+        { "\xED\xAD\xBF", false },
+        { "\xED\xBF\xBF", false },
+        // Above U+10FFFF.
+        { "\xF4\x90\x80\x80", false },
+        { "\xF4\xBF\xBF\xBF", false },
+        { "\xF5\x80\x80\x80", false },
+        { "\xF7\xBF\xBF\xBF", false },
+        { "\xF8\x88\x80\x80\x80", false },
+        { "\xFF", false },
+        { "\xFE", false },
+        // Continuation bytes out of place, and leads without enough of them.
+        { "\x80", false },
+        { "\xBF", false },
+        { "\xC2\x80\x80", false },
+        { "\xC2\x41", false },
+        { "\xE1\x80\x41", false },
+        { "\xF1\x80\x80\x41", false },
+        { "\xC2\xC2\x80", false },
+        { "\xE1\x80\x80\x80", false },
+    };
+    return all;
+}
+
+// Each sequence at every offset in front of, across and past the block
+// boundaries, among ASCII and among two byte characters (so the ASCII
+// shortcut is taken on some blocks and not on others).
+static void testSequencesAtEveryOffset(const std::vector<Kernel>& all) {
+    const std::string fills[] = { "a", "\xC3\xA9" };
+    for (const Sequence& sequence : sequences()) {
+        for (const std::string& fill : fills) {
+            for (size_t offset = 0; offset < 72; offset++) {
+                std::string text;
+                while (text.size() < offset) {
+                    text += fill.size() == 1 || offset - text.size() >= fill.size() ? fill : "a";
+                }
+                text += sequence.bytes;
+                checkUtf8(text, sequence.valid, all);
+                std::string padded = text;
+                while (padded.size() < 100) {
+                    padded += fill;
+                }
+                checkUtf8(padded, sequence.valid, all);
+            }
+        }
+    }
+}
+
+// A valid sequence cut short at the end of the input is invalid wherever
+// the cut falls, in particular right at the end of a 16 or 32 byte block.
+static void testSequencesCutAtBoundaries(const std::vector<Kernel>& all) {
+    for (const Sequence& sequence : sequences()) {
+        if (!sequence.valid || sequence.bytes.size() < 2) {
+            continue;
+        }
+        for (size_t boundary = 16; boundary <= 128; boundary += 16) {
+            for (size_t kept = 1; kept < sequence.bytes.size(); kept++) {
+                std::string text(boundary - kept, 'a');
+                text += sequence.bytes.substr(0, kept);
+                checkUtf8(text, false, all);
+                // The same bytes not at the end, but followed by ASCII.
+                checkUtf8(text + "a", false, all);
+                checkUtf8(text + std::string(40, 'a'), false, all);
+            }
+            // Whole, ending right on the boundary or straddling it.
+            for (size_t before = 1; before < sequence.bytes.size(); before++) {
+                std::string text(boundary - before, 'a');
+                text += sequence.bytes;
+                checkUtf8(text, true, all);
+                checkUtf8(text + std::string(40, 'a'), true, all);
+            }
+        }
+    }
+}
+
+static void testEmptyAndAscii(const std::vector<Kernel>& all) {
+    for (size_t length = 0; length <= 100; length++) {
+        checkUtf8(std::string(length, 'x'), true, all);
+    }
+}
+
+// Random mixes of valid characters and random bytes: the kernels must
+// agree with the scalar check, which the cases above pin down.
+static void testRandom(const std::vector<Kernel>& all) {
+    std::mt19937_64 random(3);
+    for (int round = 0; round < 200000; round++) {
+        std::string text;
+        size_t length = random() % 100;
+        while (text.size() < length) {
+            if (random() % 8 == 0) {
+                text += static_cast<char>(random());
+            } else {
+                const Sequence& sequence = sequences()[random() % 9];
+                text += random() % 3 == 0 ? sequence.bytes : "abc";
+            }
+        }
+        checkUtf8(text, validUtf8Scalar(text.data(), text.size()), all);
+    }
+}
+
+static void testControls(const std::vector<Kernel>& all) {
+    int failures = 0;
+    const unsigned char controls[] = { 0x00, 0x01, 0x09, 0x0A, 0x0D, 0x1F, 0x7F };
+    const unsigned char others[] = { 0x20, 0x7E, 0x80, 0xC3, 0xFF };
+    for (size_t length = 0; length <= 100; length++) {
+        for (unsigned char other : others) {
+            std::string text(length, static_cast<char>(other));
+            for (const Kernel& kernel : all) {
+                failures += kernel.findControl(text.data(), text.size()) != length;
+            }
+            for (size_t position = 0; position < length; position++) {
+                for (unsigned char control : controls) {
+                    std::string marked = text;
+                    marked[position] = static_cast<char>(control);
+                    if (position + 1 < length) {
+                        marked[length - 1] = '\x01'; // a later one must not win
+                    }
+                    for (const Kernel& kernel : all) {
+                        failures += kernel.findControl(marked.data(), marked.size()) != position;
+                    }
+                    failures += findControl(marked) != position;
+                }
+            }
+        }
+    }
+    CHECK_EQUAL(failures, 0);
+
+    std::string out;
+    stripControls(std::string_view("\x01" "a\tb\r\nc\x7F" "\x1F", 9), out);
+    CHECK(out == "abc");
+    stripControls("no controls", out);
+    CHECK(out == "no controls");
+}
+
+static bool naiveMatch(const std::vector<std::string>& patterns, std::string_view text) {
+    auto fold = [](std::string s) {
+        for (char& c : s) {
+            if (c >= 'A' && c <= 'Z') {
+                c = static_cast<char>(c - 'A' + 'a');
+            }
+        }
+        return s;
+    };
+    std::string folded = fold(std::string(text));
+    for (const std::string& pattern : patterns) {
+        if (!pattern.empty() && folded.find(fold(pattern)) != std::string::npos) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void testBlocklist() {
+    // The textbook set: overlapping, nested and suffix patterns.
+    Blocklist classic({ "he", "she", "his", "hers" });
+    CHECK(classic.matches("ushers"));
+    CHECK(classic.matches("she"));
+    CHECK(classic.matches("ahishe"));
+    CHECK(classic.matches("xhx he"));
+    CHECK(!classic.matches("h e"));
+    CHECK(!classic.matches("hxe shx hi"));
+    CHECK(!classic.matches(""));
+
+    // Only reachable through failure links: the match is a suffix of a
+    // longer partial match.
+    Blocklist hers({ "hers" });
+    CHECK(!hers.matches("he"));
+    CHECK(!hers.matches("her"));
+    CHECK(hers.matches("hehers"));
+    CHECK(hers.matches("hherss"));
+    Blocklist suffix({ "abcd", "bc" });
+    CHECK(suffix.matches("abc"));
+    CHECK(suffix.matches("xbcx"));
+    CHECK(!suffix.matches("abd acd"));
+    Blocklist repeats({ "aab" });
+    CHECK(repeats.matches("aaab"));
+    CHECK(repeats.matches("aaaaaab"));
+    CHECK(!repeats.matches("abab aba"));
+
+    // ASCII case is ignored on both sides; other bytes match exactly.
+    Blocklist mixed({ "SpAm", "Caf\xC3\xA9" });
+    CHECK(mixed.matches("spam"));
+    CHECK(mixed.matches("SPAM"));
+    CHECK(mixed.matches("no sPaM here"));
+    CHECK(mixed.matches("CAF\xC3\xA9"));
+    CHECK(!mixed.matches("caf\xC3\x89"));
+    CHECK(!mixed.matches("spa m"));
+
+    Blocklist none;
+    CHECK(none.empty());
+    CHECK(!none.matches("anything"));
+    Blocklist emptyPatterns({ "", "" });
+    CHECK(emptyPatterns.empty());
+    CHECK(!emptyPatterns.matches("anything"));
+
+    // Random small sets against the naive search.
+    std::mt19937_64 random(5);
+    const char alphabet[] = "abcABC\x01\xFF";
+    int failures = 0;
+    for (int round = 0; round < 100000; round++) {
+        std::vector<std::string> patterns(random() % 6);
+        for (std::string& pattern : patterns) {
+            pattern.resize(random() % 5);
+            for (char& c : pattern) {
+                c = alphabet[random() % 8];
+            }
+        }
+        std::string text(random() % 30, 'a');
+        for (char& c : text) {
+            c = alphabet[random() % 8];
+        }
+        failures += Blocklist(patterns).matches(text) != naiveMatch(patterns, text);
+    }
+    CHECK_EQUAL(failures, 0);
+}
+
+static void testFilter() {
+    MessageFilter filter;
+    std::string scratch;
+    std::string_view text = "anything \xFF goes";
+    CHECK(!filter.enabled());
+    CHECK(filter.apply(text, scratch) == MessageFilter::Verdict::Pass);
+
+    filter.requireUtf8 = true;
+    filter.removeControls = true;
+    filter.maxLength = 8;
+    filter.blocklist = Blocklist({ "spam" });
+    CHECK(filter.enabled());
+    text = "bad \xC0\xAF";
+    CHECK(filter.apply(text, scratch) == MessageFilter::Verdict::InvalidUtf8);
+    // Controls go first, so they count against neither the length nor the
+    // blocklist.
+    text = "12\x01" "345678";
+    CHECK(filter.apply(text, scratch) == MessageFilter::Verdict::Pass);
+    CHECK(text == "12345678");
+    text = "123456789";
+    CHECK(filter.apply(text, scratch) == MessageFilter::Verdict::TooLong);
+    text = "sp\x7F" "am";
+    CHECK(filter.apply(text, scratch) == MessageFilter::Verdict::Blocked);
+    text = "fine";
+    CHECK(filter.apply(text, scratch) == MessageFilter::Verdict::Pass);
+    CHECK(text == "fine");
+}
+
+int main() {
+    std::vector<Kernel> all = kernels();
+    std::cout << "text_scan_test: " << all.size() << " kernels" << std::endl;
+    testSequencesAtEveryOffset(all);
+    testSequencesCutAtBoundaries(all);
+    testEmptyAndAscii(all);
+    testRandom(all);
+    CHECK_EQUAL(utf8Failures, 0);
+    testControls(all);
+    testBlocklist();
+    testFilter();
+    return testResult("text_scan_test");
+}
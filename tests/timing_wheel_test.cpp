@@ -0,0 +1,169 @@
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "check.h"
+#include "../timing_wheel.h"
+
+// Timers at and around every level boundary of the wheel (63/64, 4095/4096,
+// 262143/262144 ticks and MAX_DELAY), some cancelled and some rescheduled,
+// from clocks that start on and off those boundaries, advanced one tick at
+// a time and in jumps. Every timer still scheduled must fire exactly once,
+// on its own tick, and in deadline order.
+
+struct TestTimer {
+    TimerNode node; // first, so a TimerNode& is the TestTimer
+    uint64_t expected = 0; // tick it must fire on; 0: must not fire
+    int fired = 0;
+    uint64_t firedAt = 0;
+};
+
+static std::vector<uint64_t> boundaryDelays() {
+    std::vector<uint64_t> delays = { 0, 1, 2 };
+    for (int level = 1; level < TimingWheel::LEVELS; level++) {
+        uint64_t boundary = uint64_t(1) << (TimingWheel::SLOT_BITS * level);
+        delays.push_back(boundary - 1);
+        delays.push_back(boundary);
+        delays.push_back(boundary + 1);
+    }
+    delays.push_back(TimingWheel::MAX_DELAY - 1);
+    delays.push_back(TimingWheel::MAX_DELAY);
+    return delays;
+}
+
+// Schedules a timer per delay, plus one past MAX_DELAY (brought in to it);
+// cancels every third and reschedules every fifth, earlier or later.
+static void run(uint64_t start, uint64_t step) {
+    TimingWheel wheel(start);
+    std::vector<uint64_t> delays = boundaryDelays();
+    std::vector<std::unique_ptr<TestTimer>> timers;
+    auto add = [&](uint64_t delay) {
+        timers.emplace_back(new TestTimer);
+        TestTimer& timer = *timers.back();
+        wheel.schedule(timer.node, start + delay);
+        timer.expected = start + std::min(std::max<uint64_t>(delay, 1), TimingWheel::MAX_DELAY);
+    };
+    for (uint64_t delay : delays) {
+        add(delay);
+    }
+    add(TimingWheel::MAX_DELAY + 1000);
+    for (size_t i = 0; i < timers.size(); i++) {
+        TestTimer& timer = *timers[i];
+        if (i % 3 == 2) {
+            wheel.cancel(timer.node);
+            timer.expected = 0;
+        } else if (i % 5 == 4) {
+            uint64_t delay = delays[(i * 7) % delays.size()];
+            wheel.schedule(timer.node, start + delay);
+            timer.expected = start + std::min(std::max<uint64_t>(delay, 1), TimingWheel::MAX_DELAY);
+        }
+    }
+    size_t live = 0;
+    for (auto& timer : timers) {
+        live += timer->expected != 0;
+    }
+    CHECK_EQUAL(wheel.size(), live);
+
+    // A timer that reschedules itself from its callback, every 64 ticks.
+    TestTimer periodic;
+    const uint64_t period = TimingWheel::SLOTS;
+    wheel.schedule(periodic.node, start + period);
+    uint64_t periodicNext = start + period;
+    int periodicLate = 0;
+
+    uint64_t lastFired = start;
+    int outOfOrder = 0;
+    int wrongTick = 0;
+    const uint64_t end = start + TimingWheel::MAX_DELAY + 10;
+    for (uint64_t now = start; now < end;) {
+        now = std::min(now + step, end);
+        wheel.advance(now, [&](TimerNode& node) {
+            if (wheel.now() < lastFired) {
+                outOfOrder++;
+            }
+            lastFired = wheel.now();
+            if (&node == &periodic.node) {
+                periodicLate += wheel.now() != periodicNext;
+                periodic.fired++;
+                periodicNext = wheel.now() + period;
+                wheel.schedule(periodic.node, periodicNext);
+                return;
+            }
+            TestTimer& timer = reinterpret_cast<TestTimer&>(node);
+            timer.fired++;
+            timer.firedAt = wheel.now();
+            wrongTick += wheel.now() != timer.node.expires;
+        });
+    }
+
+    int failures = 0;
+    for (auto& timer : timers) {
+        bool right = timer->expected == 0 ? timer->fired == 0 : timer->fired == 1 && timer->firedAt == timer->expected;
+        if (!right && failures++ < 5) {
+            std::cerr << "start " << start << " step " << step << ": timer due at " << timer->expected << " fired "
+                      << timer->fired << " times, last at " << timer->firedAt << std::endl;
+        }
+        CHECK(!timer->node.scheduled());
+    }
+    CHECK_EQUAL(failures, 0);
+    CHECK_EQUAL(outOfOrder, 0);
+    CHECK_EQUAL(wrongTick, 0);
+    CHECK_EQUAL(periodicLate, 0);
+    CHECK_EQUAL(static_cast<uint64_t>(periodic.fired), (end - start) / period);
+    CHECK_EQUAL(wheel.size(), 1u);
+    CHECK_EQUAL(wheel.now(), end);
+}
+
+// Timers scheduled at random while time moves on, some cancelled from
+// inside another timer's callback.
+static void runRandom(uint64_t seed) {
+    std::mt19937_64 random(seed);
+    TimingWheel wheel(random() % (uint64_t(1) << 30));
+    std::vector<std::unique_ptr<TestTimer>> timers;
+    int failures = 0;
+    for (int round = 0; round < 2000; round++) {
+        for (int i = 0; i < 5; i++) {
+            timers.emplace_back(new TestTimer);
+            uint64_t delay = random() % 4 == 0 ? random() % (TimingWheel::MAX_DELAY + 1) : random() % 5000;
+            wheel.schedule(timers.back()->node, wheel.now() + delay);
+            timers.back()->expected = timers.back()->node.expires;
+        }
+        uint64_t target = wheel.now() + random() % 3000;
+        wheel.advance(target, [&](TimerNode& node) {
+            TestTimer& timer = reinterpret_cast<TestTimer&>(node);
+            timer.fired++;
+            failures += wheel.now() != timer.expected;
+            TestTimer& other = *timers[random() % timers.size()];
+            if (other.node.scheduled()) {
+                wheel.cancel(other.node);
+                other.expected = 0;
+            }
+        });
+    }
+    wheel.advance(wheel.now() + TimingWheel::MAX_DELAY + 1, [&](TimerNode& node) {
+        TestTimer& timer = reinterpret_cast<TestTimer&>(node);
+        timer.fired++;
+        failures += wheel.now() != timer.expected;
+    });
+    for (auto& timer : timers) {
+        failures += timer->fired != (timer->expected != 0 ? 1 : 0);
+    }
+    CHECK_EQUAL(failures, 0);
+    CHECK_EQUAL(wheel.size(), 0u);
+}
+
+int main() {
+    const uint64_t level1 = uint64_t(1) << TimingWheel::SLOT_BITS;
+    const uint64_t level3 = uint64_t(1) << (TimingWheel::SLOT_BITS * 3);
+    const uint64_t starts[] = { 0, 1, level1 - 1, level1, 4095, 4096, level3 - 1, level3 * 64 - 1, 123456789 };
+    for (uint64_t start : starts) {
+        run(start, 1);
+        run(start, 1000);
+    }
+    run(4095, TimingWheel::MAX_DELAY + 10);
+    for (uint64_t seed = 1; seed <= 3; seed++) {
+        runRandom(seed);
+    }
+    return testResult("timing_wheel_test");
+}
@@ -0,0 +1,332 @@
+#ifndef TEXT_SCAN_H
+#define TEXT_SCAN_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TEXT_SCAN_X86 1
+#include <immintrin.h>
+#define TEXT_SCAN_SSSE3 __attribute__((target("ssse3")))
+#define TEXT_SCAN_AVX2 __attribute__((target("avx2")))
+#endif
+
+// Byte scans on the chat path: UTF-8 validation and finding control
+// characters. Each has a scalar version, which is the reference and the
+// fallback, and on x86 an SSE and an AVX2 kernel; validUtf8() and
+// findControl() pick the widest one the CPU has, once. The binary is built
+// for baseline x86-64, so the kernels are compiled for their instruction
+// set one function at a time and only called after the CPU check.
+
+// One byte at a time, by the definition (RFC 3629): no overlong forms, no
+// surrogates, nothing above U+10FFFF.
+inline bool validUtf8Scalar(const char* data, size_t length) {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+    size_t i = 0;
+    while (i < length) {
+        unsigned char lead = bytes[i];
+        if (lead < 0x80) {
+            i++;
+            continue;
+        }
+        size_t continuations;
+        uint32_t codePoint;
+        uint32_t minimum;
+        if ((lead & 0xE0) == 0xC0) {
+            continuations = 1;
+            codePoint = lead & 0x1F;
+            minimum = 0x80;
+        } else if ((lead & 0xF0) == 0xE0) {
+            continuations = 2;
+            codePoint = lead & 0x0F;
+            minimum = 0x800;
+        } else if ((lead & 0xF8) == 0xF0) {
+            continuations = 3;
+            codePoint = lead & 0x07;
+            minimum = 0x10000;
+        } else {
+            return false;
+        }
+        if (length - i <= continuations) {
+            return false;
+        }
+        for (size_t k = 1; k <= continuations; k++) {
+            if ((bytes[i + k] & 0xC0) != 0x80) {
+                return false;
+            }
+            codePoint = codePoint << 6 | (bytes[i + k] & 0x3F);
+        }
+        if (codePoint < minimum || codePoint > 0x10FFFF || (codePoint >= 0xD800 && codePoint <= 0xDFFF)) {
+            return false;
+        }
+        i += continuations + 1;
+    }
+    return true;
+}
+
+// Control characters are C0 (below 0x20, tab and line ends included) and
+// DEL. Returns the position of the first one, length if there is none.
+inline size_t findControlScalar(const char* data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = static_cast<unsigned char>(data[i]);
+        if (c < 0x20 || c == 0x7F) {
+            return i;
+        }
+    }
+    return length;
+}
+
+#if TEXT_SCAN_X86
+// The vector UTF-8 check is the lookup algorithm of Keiser and Lemire
+// ("Validating UTF-8 in less than one instruction per byte", 2021). Every
+// error shows in a byte and the one before it: three table lookups, by the
+// high and low nibble of the previous byte and the high nibble of this
+// one, each give a set of error classes the pair may belong to, and the
+// pair is wrong when all three agree on one. Third and fourth bytes of a
+// sequence are told from misplaced continuations by looking two and three
+// bytes back. Blocks of plain ASCII skip all of that. The tables are shared
+// by both widths.
+constexpr uint8_t UTF8_TOO_SHORT = 1 << 0;  // 11______ 0_______, 11______ 11______
+constexpr uint8_t UTF8_TOO_LONG = 1 << 1;   // 0_______ 10______
+constexpr uint8_t UTF8_OVERLONG_3 = 1 << 2; // 11100000 100_____
+constexpr uint8_t UTF8_TOO_LARGE = 1 << 3;  // 11110100 1001____ and above
+constexpr uint8_t UTF8_SURROGATE = 1 << 4;  // 11101101 101_____
+constexpr uint8_t UTF8_OVERLONG_2 = 1 << 5; // 1100000_ 10______
+constexpr uint8_t UTF8_TOO_LARGE_1000 = 1 << 6; // 11110101 1000____ and above
+constexpr uint8_t UTF8_OVERLONG_4 = 1 << 6;     // 11110000 1000____
+constexpr uint8_t UTF8_TWO_CONTINUATIONS = 1 << 7; // 10______ 10______
+constexpr uint8_t UTF8_CARRY = UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTINUATIONS;
+
+alignas(32) constexpr uint8_t UTF8_BYTE_1_HIGH[16] = {
+    UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+    UTF8_TWO_CONTINUATIONS, UTF8_TWO_CONTINUATIONS, UTF8_TWO_CONTINUATIONS, UTF8_TWO_CONTINUATIONS,
+    UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+    UTF8_TOO_SHORT,
+    UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+    UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4
+};
+
+alignas(32) constexpr uint8_t UTF8_BYTE_1_LOW[16] = {
+    UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+    UTF8_CARRY | UTF8_OVERLONG_2,
+    UTF8_CARRY,
+    UTF8_CARRY,
+    UTF8_CARRY | UTF8_TOO_LARGE,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000
+};
+
+alignas(32) constexpr uint8_t UTF8_BYTE_2_HIGH[16] = {
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTINUATIONS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTINUATIONS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE,
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTINUATIONS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTINUATIONS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT
+};
+
+// A block that ends in these bytes or above ends inside a sequence: a lead
+// byte of four in the last three, of three in the last two, any in the last.
+alignas(32) constexpr uint8_t UTF8_INCOMPLETE[32] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xF0 - 1, 0xE0 - 1, 0xC0 - 1
+};
+
+struct Utf8StateSse {
+    __m128i error = _mm_setzero_si128();
+    __m128i previous = _mm_setzero_si128();   // the last block
+    __m128i incomplete = _mm_setzero_si128(); // the last block ended inside a sequence
+};
+
+TEXT_SCAN_SSSE3 inline __m128i utf8HighNibbleSse(__m128i bytes) {
+    return _mm_and_si128(_mm_srli_epi16(bytes, 4), _mm_set1_epi8(0x0F));
+}
+
+TEXT_SCAN_SSSE3 inline __m128i utf8LookupSse(const uint8_t* table, __m128i index) {
+    return _mm_shuffle_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(table)), index);
+}
+
+TEXT_SCAN_SSSE3 inline void utf8BlockSse(Utf8StateSse& state, __m128i input) {
+    if (_mm_movemask_epi8(input) == 0) {
+        state.error = _mm_or_si128(state.error, state.incomplete);
+        state.incomplete = _mm_setzero_si128();
+        state.previous = input;
+        return;
+    }
+    __m128i previous1 = _mm_alignr_epi8(input, state.previous, 15);
+    __m128i special = _mm_and_si128(_mm_and_si128(utf8LookupSse(UTF8_BYTE_1_HIGH, utf8HighNibbleSse(previous1)),
+                                                  utf8LookupSse(UTF8_BYTE_1_LOW, _mm_and_si128(previous1, _mm_set1_epi8(0x0F)))),
+                                    utf8LookupSse(UTF8_BYTE_2_HIGH, utf8HighNibbleSse(input)));
+    __m128i previous2 = _mm_alignr_epi8(input, state.previous, 14);
+    __m128i previous3 = _mm_alignr_epi8(input, state.previous, 13);
+    __m128i third = _mm_subs_epu8(previous2, _mm_set1_epi8(static_cast<char>(0xE0 - 0x80)));
+    __m128i fourth = _mm_subs_epu8(previous3, _mm_set1_epi8(static_cast<char>(0xF0 - 0x80)));
+    __m128i mustContinue = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8(static_cast<char>(0x80)));
+    state.error = _mm_or_si128(state.error, _mm_xor_si128(mustContinue, special));
+    state.incomplete = _mm_subs_epu8(input, _mm_loadu_si128(reinterpret_cast<const __m128i*>(UTF8_INCOMPLETE + 16)));
+    state.previous = input;
+}
+
+TEXT_SCAN_SSSE3 inline bool validUtf8Sse(const char* data, size_t length) {
+    Utf8StateSse state;
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        utf8BlockSse(state, _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i)));
+    }
+    if (i < length) {
+        alignas(16) char tail[16] = {};
+        std::memcpy(tail, data + i, length - i);
+        utf8BlockSse(state, _mm_load_si128(reinterpret_cast<const __m128i*>(tail)));
+    }
+    __m128i error = _mm_or_si128(state.error, state.incomplete);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) == 0xFFFF;
+}
+
+struct Utf8StateAvx2 {
+    __m256i error;
+    __m256i previous;
+    __m256i incomplete;
+};
+
+TEXT_SCAN_AVX2 inline __m256i utf8HighNibbleAvx2(__m256i bytes) {
+    return _mm256_and_si256(_mm256_srli_epi16(bytes, 4), _mm256_set1_epi8(0x0F));
+}
+
+TEXT_SCAN_AVX2 inline __m256i utf8LookupAvx2(const uint8_t* table, __m256i index) {
+    return _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(table))), index);
+}
+
+// The bytes before each byte of input, N back, reaching into the last
+// block: the in-lane alignr needs the lane before each lane next to it.
+template <int N>
+TEXT_SCAN_AVX2 inline __m256i utf8PreviousAvx2(__m256i input, __m256i previous) {
+    return _mm256_alignr_epi8(input, _mm256_permute2x128_si256(previous, input, 0x21), 16 - N);
+}
+
+TEXT_SCAN_AVX2 inline void utf8BlockAvx2(Utf8StateAvx2& state, __m256i input) {
+    if (_mm256_movemask_epi8(input) == 0) {
+        state.error = _mm256_or_si256(state.error, state.incomplete);
+        state.incomplete = _mm256_setzero_si256();
+        state.previous = input;
+        return;
+    }
+    __m256i previous1 = utf8PreviousAvx2<1>(input, state.previous);
+    __m256i special = _mm256_and_si256(_mm256_and_si256(utf8LookupAvx2(UTF8_BYTE_1_HIGH, utf8HighNibbleAvx2(previous1)),
+                                                        utf8LookupAvx2(UTF8_BYTE_1_LOW, _mm256_and_si256(previous1, _mm256_set1_epi8(0x0F)))),
+                                       utf8LookupAvx2(UTF8_BYTE_2_HIGH, utf8HighNibbleAvx2(input)));
+    __m256i third = _mm256_subs_epu8(utf8PreviousAvx2<2>(input, state.previous), _mm256_set1_epi8(static_cast<char>(0xE0 - 0x80)));
+    __m256i fourth = _mm256_subs_epu8(utf8PreviousAvx2<3>(input, state.previous), _mm256_set1_epi8(static_cast<char>(0xF0 - 0x80)));
+    __m256i mustContinue = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8(static_cast<char>(0x80)));
+    state.error = _mm256_or_si256(state.error, _mm256_xor_si256(mustContinue, special));
+    state.incomplete = _mm256_subs_epu8(input, _mm256_load_si256(reinterpret_cast<const __m256i*>(UTF8_INCOMPLETE)));
+    state.previous = input;
+}
+
+TEXT_SCAN_AVX2 inline bool validUtf8Avx2(const char* data, size_t length) {
+    Utf8StateAvx2 state{ _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256() };
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        utf8BlockAvx2(state, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i)));
+    }
+    if (i < length) {
+        alignas(32) char tail[32] = {};
+        std::memcpy(tail, data + i, length - i);
+        utf8BlockAvx2(state, _mm256_load_si256(reinterpret_cast<const __m256i*>(tail)));
+    }
+    __m256i error = _mm256_or_si256(state.error, state.incomplete);
+    return _mm256_testz_si256(error, error) != 0;
+}
+
+// A byte is a control character when min(byte, 0x1F) is the byte itself,
+// or when it is 0x7F. SSE2 is part of x86-64, so this one needs no check.
+inline size_t findControlSse2(const char* data, size_t length) {
+    const __m128i limit = _mm_set1_epi8(0x1F);
+    const __m128i del = _mm_set1_epi8(0x7F);
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i control = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(bytes, limit), bytes), _mm_cmpeq_epi8(bytes, del));
+        int mask = _mm_movemask_epi8(control);
+        if (mask != 0) {
+            return i + static_cast<size_t>(__builtin_ctz(static_cast<unsigned>(mask)));
+        }
+    }
+    return i + findControlScalar(data + i, length - i);
+}
+
+TEXT_SCAN_AVX2 inline size_t findControlAvx2(const char* data, size_t length) {
+    const __m256i limit = _mm256_set1_epi8(0x1F);
+    const __m256i del = _mm256_set1_epi8(0x7F);
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        __m256i control = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(bytes, limit), bytes), _mm256_cmpeq_epi8(bytes, del));
+        uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(control));
+        if (mask != 0) {
+            return i + static_cast<size_t>(__builtin_ctz(mask));
+        }
+    }
+    return i + findControlSse2(data + i, length - i);
+}
+#endif
+
+using Utf8Kernel = bool (*)(const char*, size_t);
+using ControlKernel = size_t (*)(const char*, size_t);
+
+inline Utf8Kernel bestUtf8Kernel() {
+#if TEXT_SCAN_X86
+    if (__builtin_cpu_supports("avx2")) {
+        return validUtf8Avx2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        return validUtf8Sse;
+    }
+#endif
+    return validUtf8Scalar;
+}
+
+inline ControlKernel bestControlKernel() {
+#if TEXT_SCAN_X86
+    if (__builtin_cpu_supports("avx2")) {
+        return findControlAvx2;
+    }
+    return findControlSse2;
+#else
+    return findControlScalar;
+#endif
+}
+
+inline bool validUtf8(std::string_view text) {
+    static const Utf8Kernel kernel = bestUtf8Kernel();
+    return kernel(text.data(), text.size());
+}
+
+inline size_t findControl(std::string_view text) {
+    static const ControlKernel kernel = bestControlKernel();
+    return kernel(text.data(), text.size());
+}
+
+// Copies text to out without its control characters.
+inline void stripControls(std::string_view text, std::string& out) {
+    out.clear();
+    size_t control;
+    while ((control = findControl(text)) != text.size()) {
+        out.append(text.data(), control);
+        text.remove_prefix(control + 1);
+    }
+    out.append(text.data(), text.size());
+}
+
+#endif
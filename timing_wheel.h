@@ -0,0 +1,152 @@
+#ifndef TIMING_WHEEL_H
+#define TIMING_WHEEL_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+// A timer, embedded in whatever it times, so scheduling never allocates.
+// Linked into a wheel slot while scheduled.
+struct TimerNode {
+    TimerNode* prev = nullptr;
+    TimerNode* next = nullptr;
+    uint64_t expires = 0; // tick
+
+    bool scheduled() const {
+        return next != nullptr;
+    }
+};
+
+// Hierarchical hashed timing wheel: LEVELS wheels of SLOTS slots each, the
+// slots of level L covering SLOTS^L ticks apiece. A timer goes into the
+// lowest level whose current rotation its deadline falls in; whenever a
+// level's rotation comes round, the slot now due is spread over the levels
+// below it. Scheduling and cancelling are O(1), each tick is O(1) plus the
+// timers it fires or moves down, and each timer moves at most LEVELS - 1
+// times. Deadlines further out than MAX_DELAY ticks are brought in to it.
+//
+// Times are in caller-defined ticks. Not thread safe.
+class TimingWheel {
+public:
+    static constexpr int LEVELS = 4;
+    static constexpr int SLOT_BITS = 6;
+    static constexpr size_t SLOTS = size_t(1) << SLOT_BITS;
+    static constexpr uint64_t MAX_DELAY = (uint64_t(1) << (SLOT_BITS * LEVELS)) - (uint64_t(1) << (SLOT_BITS * (LEVELS - 1))) - 1;
+
+    explicit TimingWheel(uint64_t now = 0) : now_(now) {
+        for (auto& level : slots_) {
+            for (TimerNode& slot : level) {
+                slot.prev = &slot;
+                slot.next = &slot;
+            }
+        }
+    }
+
+    TimingWheel(const TimingWheel&) = delete;
+    TimingWheel& operator=(const TimingWheel&) = delete;
+
+    uint64_t now() const {
+        return now_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    // (Re)schedules the timer; a deadline that is not in the future fires
+    // on the next tick.
+    void schedule(TimerNode& timer, uint64_t expires) {
+        cancel(timer);
+        timer.expires = std::min(std::max(expires, now_ + 1), now_ + MAX_DELAY);
+        insert(timer);
+        size_++;
+    }
+
+    void cancel(TimerNode& timer) {
+        if (timer.scheduled()) {
+            unlink(timer);
+            size_--;
+        }
+    }
+
+    // Moves time forward to now, calling onExpire(TimerNode&) for every
+    // timer that comes due, in deadline order. A fired timer is no longer
+    // scheduled; the callback may schedule or cancel any timer, itself
+    // included.
+    template <typename Callback>
+    void advance(uint64_t now, Callback&& onExpire) {
+        if (size_ == 0) {
+            now_ = std::max(now_, now);
+            return;
+        }
+        while (now_ < now && size_ > 0) {
+            now_++;
+            for (int level = LEVELS - 1; level > 0; level--) {
+                if ((now_ & ((uint64_t(1) << (SLOT_BITS * level)) - 1)) == 0) {
+                    cascade(level);
+                }
+            }
+
+            TimerNode due;
+            take(slots_[0][now_ & (SLOTS - 1)], due);
+            while (due.next != &due) {
+                TimerNode& timer = *due.next;
+                unlink(timer);
+                size_--;
+                onExpire(timer);
+            }
+        }
+        now_ = std::max(now_, now);
+    }
+
+private:
+    void insert(TimerNode& timer) {
+        int level = 0;
+        while (level < LEVELS - 1 && (timer.expires >> (SLOT_BITS * (level + 1))) != (now_ >> (SLOT_BITS * (level + 1)))) {
+            level++;
+        }
+        TimerNode& slot = slots_[level][(timer.expires >> (SLOT_BITS * level)) & (SLOTS - 1)];
+        timer.prev = slot.prev;
+        timer.next = &slot;
+        slot.prev->next = &timer;
+        slot.prev = &timer;
+    }
+
+    static void unlink(TimerNode& timer) {
+        timer.prev->next = timer.next;
+        timer.next->prev = timer.prev;
+        timer.prev = nullptr;
+        timer.next = nullptr;
+    }
+
+    // Moves a slot's whole list onto an empty list head.
+    static void take(TimerNode& slot, TimerNode& list) {
+        if (slot.next == &slot) {
+            list.prev = &list;
+            list.next = &list;
+            return;
+        }
+        list.next = slot.next;
+        list.prev = slot.prev;
+        list.next->prev = &list;
+        list.prev->next = &list;
+        slot.next = &slot;
+        slot.prev = &slot;
+    }
+
+    void cascade(int level) {
+        TimerNode moving;
+        take(slots_[level][(now_ >> (SLOT_BITS * level)) & (SLOTS - 1)], moving);
+        while (moving.next != &moving) {
+            TimerNode& timer = *moving.next;
+            unlink(timer);
+            insert(timer);
+        }
+    }
+
+    TimerNode slots_[LEVELS][SLOTS]; // list heads
+    uint64_t now_;
+    size_t size_ = 0;
+};
+
+#endif
@@ -0,0 +1,293 @@
+#ifndef URING_H
+#define URING_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+// A minimal io_uring driver on the raw system calls (liburing is not a
+// dependency): one submission and completion queue pair plus, optionally,
+// one group of provided receive buffers. Meant for a single thread; only
+// the kernel shares its memory.
+class Uring {
+public:
+    Uring() = default;
+
+    Uring(const Uring&) = delete;
+    Uring& operator=(const Uring&) = delete;
+
+    ~Uring() {
+        if (bufferRing_ != nullptr) {
+            munmap(bufferRing_, bufferRingBytes_);
+        }
+        if (sqes_ != nullptr) {
+            munmap(sqes_, sqEntries_ * sizeof(io_uring_sqe));
+        }
+        if (ring_ != nullptr) {
+            munmap(ring_, ringBytes_);
+        }
+        if (fd_ != -1) {
+            ::close(fd_);
+        }
+    }
+
+    // True if the kernel has everything the io_uring engine uses: multishot
+    // accept and recv, provided buffer rings and waits with a timeout.
+    static bool supported() {
+        utsname name{};
+        int major = 0;
+        int minor = 0;
+        if (uname(&name) == -1 || std::sscanf(name.release, "%d.%d", &major, &minor) != 2 || major < 6) {
+            return false;
+        }
+
+        Uring ring;
+        if (!ring.init(8) || !ring.registerBuffers(8, 64, 0)) {
+            return false;
+        }
+        size_t probeBytes = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+        std::unique_ptr<char[]> storage(new char[probeBytes]());
+        auto* probe = reinterpret_cast<io_uring_probe*>(storage.get());
+        if (syscall(__NR_io_uring_register, ring.fd_, IORING_REGISTER_PROBE, probe, 256) == -1) {
+            return false;
+        }
+        for (int op : { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_READ, IORING_OP_ASYNC_CANCEL }) {
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Sets up the queues with room for entries submissions and four times
+    // as many completions, since multishot requests complete repeatedly.
+    bool init(unsigned entries) {
+        io_uring_params params{};
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 4;
+        fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (fd_ == -1) {
+            return false;
+        }
+        unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+        if ((params.features & required) != required) {
+            return false;
+        }
+
+        size_t sqBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        size_t cqBytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        ringBytes_ = std::max(sqBytes, cqBytes);
+        void* ring = mmap(nullptr, ringBytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+        if (ring == MAP_FAILED) {
+            return false;
+        }
+        ring_ = static_cast<char*>(ring);
+        sqEntries_ = params.sq_entries;
+        void* sqes = mmap(nullptr, sqEntries_ * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_,
+                          IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            return false;
+        }
+        sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+        sqHead_ = reinterpret_cast<unsigned*>(ring_ + params.sq_off.head);
+        sqTail_ = reinterpret_cast<unsigned*>(ring_ + params.sq_off.tail);
+        sqMask_ = *reinterpret_cast<unsigned*>(ring_ + params.sq_off.ring_mask);
+        sqArray_ = reinterpret_cast<unsigned*>(ring_ + params.sq_off.array);
+        cqHead_ = reinterpret_cast<unsigned*>(ring_ + params.cq_off.head);
+        cqTail_ = reinterpret_cast<unsigned*>(ring_ + params.cq_off.tail);
+        cqMask_ = *reinterpret_cast<unsigned*>(ring_ + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(ring_ + params.cq_off.cqes);
+        sqLocalTail_ = *sqTail_;
+        return true;
+    }
+
+    // A zeroed submission slot, submitting what is queued first if the
+    // queue is full.
+    io_uring_sqe* nextSqe() {
+        if (sqLocalTail_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) >= sqEntries_) {
+            submit(0);
+        }
+        unsigned index = sqLocalTail_ & sqMask_;
+        sqArray_[index] = index;
+        sqLocalTail_++;
+        io_uring_sqe* sqe = &sqes_[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    // Submits everything queued and, if waitFor is not 0, waits until that
+    // many completions are there or timeoutNanos (if not negative) passed.
+    // Returns the io_uring_enter() result, -errno on failure.
+    int submit(unsigned waitFor, int64_t timeoutNanos = -1) {
+        __atomic_store_n(sqTail_, sqLocalTail_, __ATOMIC_RELEASE);
+        unsigned pending = sqLocalTail_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+
+        unsigned flags = waitFor != 0 ? IORING_ENTER_GETEVENTS : 0;
+        io_uring_getevents_arg arg{};
+        __kernel_timespec timeout{};
+        void* argument = nullptr;
+        size_t argumentSize = 0;
+        if (waitFor != 0 && timeoutNanos >= 0) {
+            timeout.tv_sec = timeoutNanos / 1000000000;
+            timeout.tv_nsec = timeoutNanos % 1000000000;
+            arg.ts = reinterpret_cast<uint64_t>(&timeout);
+            flags |= IORING_ENTER_EXT_ARG;
+            argument = &arg;
+            argumentSize = sizeof(arg);
+        }
+        long result = syscall(__NR_io_uring_enter, fd_, pending, waitFor, flags, argument, argumentSize);
+        return result == -1 ? -errno : static_cast<int>(result);
+    }
+
+    // Hands every available completion to onCompletion(const io_uring_cqe&),
+    // which may queue new submissions.
+    template <typename Callback>
+    void forEachCompletion(Callback&& onCompletion) {
+        unsigned head = *cqHead_;
+        while (head != __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE)) {
+            io_uring_cqe cqe = cqes_[head & cqMask_];
+            head++;
+            __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+            onCompletion(cqe);
+        }
+    }
+
+    // Registers count (a power of two) provided receive buffers of size
+    // bytes each as buffer group group. They go in a buffer ring if the
+    // kernel delivers from one (checked with a real receive, since some
+    // kernels accept the ring but never take buffers from it) and are
+    // handed over with IORING_OP_PROVIDE_BUFFERS otherwise. Call it before
+    // submitting anything else.
+    bool registerBuffers(unsigned count, unsigned size, uint16_t group) {
+        buffers_.reset(new char[static_cast<size_t>(count) * size]);
+        bufferCount_ = count;
+        bufferSize_ = size;
+        bufferGroup_ = group;
+
+        bufferRingBytes_ = count * sizeof(io_uring_buf);
+        void* ring = mmap(nullptr, bufferRingBytes_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring == MAP_FAILED) {
+            return false;
+        }
+        bufferRing_ = static_cast<io_uring_buf_ring*>(ring);
+        io_uring_buf_reg registration{};
+        registration.ring_addr = reinterpret_cast<uint64_t>(bufferRing_);
+        registration.ring_entries = count;
+        registration.bgid = group;
+        if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PBUF_RING, &registration, 1) == 0) {
+            for (unsigned id = 0; id < count; id++) {
+                recycleBuffer(static_cast<uint16_t>(id));
+            }
+            if (receivesIntoBuffers()) {
+                return true;
+            }
+            syscall(__NR_io_uring_register, fd_, IORING_UNREGISTER_PBUF_RING, &registration, 1);
+        }
+        munmap(bufferRing_, bufferRingBytes_);
+        bufferRing_ = nullptr;
+
+        io_uring_sqe* sqe = nextSqe();
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = static_cast<int>(count);
+        sqe->addr = reinterpret_cast<uint64_t>(buffers_.get());
+        sqe->len = size;
+        sqe->buf_group = group;
+        if (submit(1) < 0) {
+            return false;
+        }
+        int result = -1;
+        forEachCompletion([&](const io_uring_cqe& cqe) { result = cqe.res; });
+        return result >= 0 && receivesIntoBuffers();
+    }
+
+    const char* buffer(uint16_t id) const {
+        return buffers_.get() + static_cast<size_t>(id) * bufferSize_;
+    }
+
+    unsigned bufferSize() const {
+        return bufferSize_;
+    }
+
+    // Gives a provided buffer back to the kernel.
+    void recycleBuffer(uint16_t id) {
+        if (bufferRing_ == nullptr) {
+            io_uring_sqe* sqe = nextSqe();
+            sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+            sqe->fd = 1;
+            sqe->addr = reinterpret_cast<uint64_t>(buffer(id));
+            sqe->len = bufferSize_;
+            sqe->off = id;
+            sqe->buf_group = bufferGroup_;
+            return;
+        }
+        io_uring_buf& entry = bufferRing_->bufs[bufferTail_ & (bufferCount_ - 1)];
+        entry.addr = reinterpret_cast<uint64_t>(buffer(id));
+        entry.len = bufferSize_;
+        entry.bid = id;
+        bufferTail_++;
+        __atomic_store_n(&bufferRing_->tail, bufferTail_, __ATOMIC_RELEASE);
+    }
+
+private:
+    // Receives one byte over a socket pair with a provided buffer.
+    bool receivesIntoBuffers() {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1) {
+            return false;
+        }
+        bool received = false;
+        if (::write(pair[1], "", 1) == 1) {
+            io_uring_sqe* sqe = nextSqe();
+            sqe->opcode = IORING_OP_RECV;
+            sqe->fd = pair[0];
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = bufferGroup_;
+            if (submit(1) >= 0) {
+                forEachCompletion([&](const io_uring_cqe& cqe) {
+                    if (cqe.res == 1 && (cqe.flags & IORING_CQE_F_BUFFER)) {
+                        received = true;
+                        recycleBuffer(static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+                    }
+                });
+            }
+        }
+        ::close(pair[0]);
+        ::close(pair[1]);
+        return received;
+    }
+
+    int fd_ = -1;
+    char* ring_ = nullptr;
+    size_t ringBytes_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    unsigned sqEntries_ = 0;
+    unsigned* sqHead_ = nullptr;
+    unsigned* sqTail_ = nullptr;
+    unsigned sqMask_ = 0;
+    unsigned* sqArray_ = nullptr;
+    unsigned sqLocalTail_ = 0; // published to the kernel on submit()
+    unsigned* cqHead_ = nullptr;
+    unsigned* cqTail_ = nullptr;
+    unsigned cqMask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+    io_uring_buf_ring* bufferRing_ = nullptr;
+    size_t bufferRingBytes_ = 0;
+    std::unique_ptr<char[]> buffers_;
+    unsigned bufferCount_ = 0;
+    unsigned bufferSize_ = 0;
+    uint16_t bufferGroup_ = 0;
+    uint16_t bufferTail_ = 0;
+};
+
+#endif